@@ -0,0 +1,26 @@
+#ifndef BUILTIN_H_
+#define BUILTIN_H_
+
+// Tables compiled into the server, so that starting up reads no files and allocates nothing.
+//  builtin.c is generated by mkassets from the .bin images at build time - edit those
+//  (or mkassets.c), not it.
+
+#include "game.h"
+
+#include <stdint.h>
+
+// cursor size, in pixels
+#define CURSOR_WIDTH 17
+#define CURSOR_HEIGHT 22
+
+// BGR233 palette, in RFB's uint16 per channel: [0] red, [1] green, [2] blue
+extern const uint16_t bgr233_palette[3][256];
+
+// the cursor ("hand") as one BGR233 colour per pixel, and its RFB transparency bitmask
+extern const unsigned char cursor_pixels[CURSOR_WIDTH * CURSOR_HEIGHT];
+extern const unsigned char cursor_mask[(CURSOR_WIDTH + 7) / 8 * CURSOR_HEIGHT];
+
+// every sprite, with the reel strips already built
+extern const struct assets builtin_assets;
+
+#endif
@@ -0,0 +1,242 @@
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// distinct pixel formats with a cached cursor
+#define CURSOR_ENTRIES 8
+// encoded rectangles: a few pixel formats' worth of one frame's damage, plus keyframes - for each
+//  of the rooms running at once
+#define RECTANGLE_ENTRIES 256
+// most pixel formats a frame is encoded ahead in
+#define PREFETCH_FORMATS 4
+
+// a rectangle being encoded ahead, on an encoder thread
+struct prefetch {
+    struct encode_task task;
+    // held for the thread to read
+    struct snapshot * snapshot;
+    struct pixel_format format;
+    uint16_t encodings;
+    uint16_t x, y, w, h;
+    struct segment * seg;
+};
+
+struct cache_entry {
+    // what this is: a format, and for rectangles the encodings, source, version and area
+    struct pixel_format format;
+    uint16_t encodings;
+    const struct image * src;
+    unsigned int version;
+    uint16_t x, y, w, h;
+
+    unsigned int last_used;
+    struct segment * seg;
+    // or, until it's asked for, what's encoding it ahead
+    struct prefetch * pending;
+};
+
+static struct cache_entry cursors[CURSOR_ENTRIES];
+static struct cache_entry rectangles[RECTANGLE_ENTRIES];
+static unsigned int cache_clock;
+
+static struct {
+    unsigned long hits;
+    unsigned long misses;
+    // (rectangles) hits that were encoded ahead, and of those, how many had to be waited for
+    unsigned long prefetched;
+    unsigned long waited;
+} cursor_counters, rectangle_counters;
+
+static void prefetch_run(struct encode_task * t)
+{
+    struct prefetch * p = (struct prefetch *)t;
+    p->seg = encode_rectangle(&p->snapshot->image, &p->format, p->encodings, p->x, p->y, p->w, p->h);
+}
+
+// a prefetched entry, once the encoding is done (waiting for it if need be)
+static void settle(struct cache_entry * e)
+{
+    struct prefetch * p = e->pending;
+    if (encode_finish(&p->task)) rectangle_counters.waited ++;
+    e->seg = p->seg;
+    e->pending = NULL;
+    snapshot_unref(p->snapshot);
+    free(p);
+}
+
+// empty an entry - anybody still sending the old segment keeps their own reference to it
+static void clear(struct cache_entry * e)
+{
+    if (e->pending) settle(e);
+    segment_unref(e->seg);
+    e->seg = NULL;
+}
+
+// Two clients' pixel formats can differ in ways that don't matter: a paletted client ignores the
+//  colour fields, and an 8-bit one the byte order.  Squash those out so they share an entry.
+static void canonical_format(const struct pixel_format * f, struct pixel_format * out)
+{
+    memset(out, 0, sizeof(struct pixel_format));
+    out->bpp = f->bpp;
+    out->true_color_flag = f->true_color_flag;
+    if (f->bpp != 8) out->big_endian_flag = f->big_endian_flag;
+    if (f->true_color_flag) {
+        out->red_div = f->red_div;
+        out->green_div = f->green_div;
+        out->blue_div = f->blue_div;
+        out->red_shift = f->red_shift;
+        out->green_shift = f->green_shift;
+        out->blue_shift = f->blue_shift;
+    }
+}
+
+// find an entry matching the key - or, failing that, the least recently used one to replace
+static struct cache_entry * lookup(struct cache_entry * entries, int count, const struct cache_entry * key, int * hit)
+{
+    cache_clock ++;
+
+    struct cache_entry * oldest = &entries[0];
+    for (int i = 0; i < count; i ++) {
+        struct cache_entry * e = &entries[i];
+        int used = (e->seg != NULL || e->pending != NULL);
+        if (used && e->src == key->src && e->version != key->version) {
+            // versions only go up, so an older frame's rectangles will never be asked for again
+            clear(e);
+            used = 0;
+        }
+        if (used && memcmp(&e->format, &key->format, sizeof(struct pixel_format)) == 0 &&
+                e->encodings == key->encodings && e->src == key->src && e->version == key->version &&
+                e->x == key->x && e->y == key->y && e->w == key->w && e->h == key->h) {
+            e->last_used = cache_clock;
+            *hit = 1;
+            return e;
+        }
+        if ((oldest->seg != NULL || oldest->pending != NULL) && (! used || e->last_used < oldest->last_used)) oldest = e;
+    }
+
+    clear(oldest);
+    *oldest = *key;
+    oldest->seg = NULL;
+    oldest->pending = NULL;
+    oldest->last_used = cache_clock;
+    *hit = 0;
+    return oldest;
+}
+
+struct segment * cached_colour_map(void)
+{
+    // the palette never changes
+    static struct segment * colour_map;
+
+    if (colour_map == NULL) {
+        colour_map = segment_new(6 + 256 * 6);
+        colour_map->len = encode_colour_map(colour_map->data) - colour_map->data;
+    }
+
+    return colour_map;
+}
+
+struct segment * cached_cursor(const struct pixel_format * f)
+{
+    struct cache_entry key = { .encodings = 0, .src = NULL, .version = 0 };
+    canonical_format(f, &key.format);
+
+    int hit;
+    struct cache_entry * e = lookup(cursors, CURSOR_ENTRIES, &key, &hit);
+    if (hit) {
+        cursor_counters.hits ++;
+    } else {
+        cursor_counters.misses ++;
+        e->seg = segment_new(12 + 17 * 22 * 4 + 3 * 22);
+        e->seg->len = encode_cursor(e->seg->data, f) - e->seg->data;
+    }
+
+    return e->seg;
+}
+
+struct segment * cached_rectangle(struct snapshot * s, const struct pixel_format * f, uint16_t encodings,
+                                  uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+    // only the encodings the encoder can choose between make a difference to the output
+    struct cache_entry key = { .encodings = encodings & (RRE | HexTile), .src = s->source, .version = s->version,
+                               .x = x, .y = y, .w = w, .h = h };
+    canonical_format(f, &key.format);
+
+    int hit;
+    struct cache_entry * e = lookup(rectangles, RECTANGLE_ENTRIES, &key, &hit);
+    if (hit) {
+        rectangle_counters.hits ++;
+        if (e->pending) {
+            rectangle_counters.prefetched ++;
+            settle(e);
+        }
+    } else {
+        rectangle_counters.misses ++;
+        e->seg = encode_rectangle(&s->image, f, encodings, x, y, w, h);
+    }
+
+    return e->seg;
+}
+
+void cache_prefetch(struct snapshot * s)
+{
+    if (encode_threads() < 2) return;
+
+    // every format the machine's last frame went out in (before the lookups below forget them)
+    struct cache_entry formats[PREFETCH_FORMATS];
+    unsigned int format_count = 0;
+    for (int i = 0; i < RECTANGLE_ENTRIES && format_count < PREFETCH_FORMATS; i ++) {
+        const struct cache_entry * e = &rectangles[i];
+        if ((e->seg == NULL && e->pending == NULL) || e->src != s->source || e->version == s->version) continue;
+        unsigned int k = 0;
+        while (k < format_count && (formats[k].encodings != e->encodings ||
+                                    memcmp(&formats[k].format, &e->format, sizeof(struct pixel_format)) != 0))
+            k ++;
+        if (k == format_count) formats[format_count ++] = *e;
+    }
+
+    for (unsigned int k = 0; k < format_count; k ++) {
+        for (unsigned int i = 0; i < s->damage_count; i ++) {
+            const struct rect * d = &s->damage[i];
+            struct cache_entry key = { .format = formats[k].format, .encodings = formats[k].encodings,
+                                       .src = s->source, .version = s->version, .x = d->x, .y = d->y, .w = d->w, .h = d->h };
+            int hit;
+            struct cache_entry * e = lookup(rectangles, RECTANGLE_ENTRIES, &key, &hit);
+            if (hit) continue;
+
+            struct prefetch * p = malloc(sizeof(struct prefetch));
+            if (p == NULL) {
+                perror("malloc prefetch");
+                exit(EXIT_FAILURE);
+            }
+            p->task.run = prefetch_run;
+            p->snapshot = snapshot_ref(s);
+            // (the canonical format encodes just the same)
+            p->format = key.format;
+            p->encodings = key.encodings;
+            p->x = d->x;
+            p->y = d->y;
+            p->w = d->w;
+            p->h = d->h;
+            p->seg = NULL;
+            e->pending = p;
+            encode_submit(&p->task);
+        }
+    }
+}
+
+struct segment * encode_rectangle(const struct image * src, const struct pixel_format * f, uint16_t encodings,
+                                  uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+    struct segment * s = segment_new(encode_max_size(f, w, h));
+    s->len = encode(s->data, src, f, encodings, x, y, w, h) - s->data;
+    return segment_shrink(s);
+}
+
+void cache_dump(FILE * fp)
+{
+    fprintf(fp, "~ cache: cursor %lu hits, %lu misses; rectangle %lu hits (%lu encoded ahead, %lu waited for), %lu misses\n",
+            cursor_counters.hits, cursor_counters.misses, rectangle_counters.hits, rectangle_counters.prefetched,
+            rectangle_counters.waited, rectangle_counters.misses);
+}
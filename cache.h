@@ -0,0 +1,40 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+// cached copies of server messages that come out the same for every client with the same
+//  pixel format: the colour map, the cursor, and encoded rectangles of the framebuffer.
+//  A burst of new connections then costs about one encode per pixel format, and so does each
+//  frame's damage no matter how many are watching.
+//  Everything comes back as a shared segment, to be queued by reference (outq.h) - the returned
+//  pointer itself is only good until the next call.
+
+#include "encode.h"
+#include "outq.h"
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stddef.h>
+
+// the SetColourMapEntries message for the whole palette
+struct segment * cached_colour_map(void);
+
+// the Cursor pseudo-encoding rectangle, in pixel format f
+struct segment * cached_cursor(const struct pixel_format * f);
+
+// a rectangle (header included) of a machine's framebuffer, as it was in snapshot s
+struct segment * cached_rectangle(struct snapshot * s, const struct pixel_format * f, uint16_t encodings,
+                                  uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+// with encoder threads to do it, start encoding what's changed in s, in every pixel format the
+//  machine's last frame was asked for in - so those rectangles are (most likely) ready by the
+//  time anyone asks, and the caller can get on with something else meanwhile
+void cache_prefetch(struct snapshot * s);
+
+// the same, encoded fresh and not kept: for a framebuffer only one client is watching
+//  (the caller has the only reference)
+struct segment * encode_rectangle(const struct image * src, const struct pixel_format * f, uint16_t encodings,
+                                  uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+void cache_dump(FILE * fp);
+
+#endif
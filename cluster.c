@@ -0,0 +1,296 @@
+#include "cluster.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+// type, flags, count, length; then the view
+#define HEADER_SIZE 8
+#define VIEW_SIZE 24
+#define RECT_SIZE 8
+
+// a Unix socket, if it looks like a path
+static int unix_address(const char * where, struct sockaddr_un * addr)
+{
+    if (strchr(where, '/') == NULL) return 0;
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, where, sizeof(addr->sun_path) - 1);
+    return 1;
+}
+
+int cluster_listen(const char * where, int backlog)
+{
+    struct sockaddr_un addr;
+    if (unix_address(where, &addr)) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("socket");
+            return -1;
+        }
+        // whatever the last authority left behind
+        unlink(addr.sun_path);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, backlog)) {
+            perror("bind cluster");
+            close(fd);
+            return -1;
+        }
+        printf(" . Relays subscribe at %s, socket %d\n", where, fd);
+        return fd;
+    }
+
+    static const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_protocol = IPPROTO_TCP,
+        .ai_flags = AI_ADDRCONFIG | AI_PASSIVE
+    };
+    struct addrinfo * ai;
+    int rv = getaddrinfo(NULL, where, &hints, &ai);
+    if (rv != 0) {
+        fprintf(stderr, "getaddrinfo(%s): %s\n", where, gai_strerror(rv));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo * p = ai; p != NULL && fd < 0; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) continue;
+        static const int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+        if (bind(fd, p->ai_addr, p->ai_addrlen) || listen(fd, backlog)) {
+            perror("bind cluster");
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(ai);
+    if (fd >= 0) printf(" . Relays subscribe on port %s, socket %d\n", where, fd);
+    return fd;
+}
+
+int cluster_connect(const char * where)
+{
+    struct sockaddr_un addr;
+    if (unix_address(where, &addr)) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("socket");
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+            perror(where);
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // host:port - the last colon, so a bare IPv6 address works too
+    char host[256];
+    const char * colon = strrchr(where, ':');
+    if (colon == NULL || (size_t)(colon - where) >= sizeof(host)) {
+        fprintf(stderr, "%s: expected host:port, or a path\n", where);
+        return -1;
+    }
+    memcpy(host, where, colon - where);
+    host[colon - where] = '\0';
+
+    static const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_protocol = IPPROTO_TCP
+    };
+    struct addrinfo * ai;
+    int rv = getaddrinfo(host, colon + 1, &hints, &ai);
+    if (rv != 0) {
+        fprintf(stderr, "getaddrinfo(%s): %s\n", where, gai_strerror(rv));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo * p = ai; p != NULL && fd < 0; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(ai);
+    if (fd < 0) perror(where);
+    return fd;
+}
+
+static unsigned char * put16(unsigned char * p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
+}
+
+static unsigned char * put32(unsigned char * p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+static uint16_t get16(const unsigned char * p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const unsigned char * p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+struct segment * cluster_frame(const struct game * g, int flags, const struct rect * rects, unsigned int count)
+{
+    size_t len = HEADER_SIZE + VIEW_SIZE;
+    for (unsigned int i = 0; i < count; i ++)
+        len += RECT_SIZE + (size_t)rects[i].w * rects[i].h;
+
+    struct segment * s = segment_new(len);
+    unsigned char * p = s->data;
+    *p ++ = CLUSTER_FRAME;
+    *p ++ = flags;
+    p = put16(p, count);
+    p = put32(p, len);
+
+    *p ++ = g->state;
+    *p ++ = 0;
+    p = put16(p, g->coin_y);
+    p = put16(p, g->handle_y);
+    for (int i = 0; i < 3; i ++)
+        p = put16(p, g->reel_position[i]);
+    p = put32(p, g->plays);
+    p = put32(p, g->profit);
+    const struct image * fb = g->framebuffer;
+    p = put16(p, fb->width);
+    p = put16(p, fb->height);
+
+    for (unsigned int i = 0; i < count; i ++) {
+        const struct rect * r = &rects[i];
+        p = put16(p, r->x);
+        p = put16(p, r->y);
+        p = put16(p, r->w);
+        p = put16(p, r->h);
+        for (int y = r->y; y < r->y + r->h; y ++) {
+            memcpy(p, image_row(fb, y) + r->x, r->w);
+            p += r->w;
+        }
+    }
+
+    s->len = p - s->data;
+    return s;
+}
+
+void cluster_reader_init(struct cluster_reader * r)
+{
+    r->buf = NULL;
+    r->len = r->size = 0;
+}
+
+void cluster_reader_free(struct cluster_reader * r)
+{
+    free(r->buf);
+    cluster_reader_init(r);
+}
+
+// one complete frame: check it over, then draw it into the mirror
+static int apply_frame(const unsigned char * p, size_t len, struct game * g)
+{
+    const unsigned int count = get16(&p[2]);
+    const unsigned char * view = &p[HEADER_SIZE];
+    if (view[0] >= gamestate_count) return 0;
+    // only a keyframe can change the size of the screen
+    const unsigned int width = get16(&view[20]), height = get16(&view[22]);
+    const int resized = (width != g->framebuffer->width || height != g->framebuffer->height);
+    if (resized && ! (p[1] & CLUSTER_KEYFRAME)) return 0;
+
+    // the rectangles have to add up to the length, and fit on the screen
+    const unsigned char * q = view + VIEW_SIZE;
+    for (unsigned int i = 0; i < count; i ++) {
+        if ((size_t)(q + RECT_SIZE - p) > len) return 0;
+        const unsigned int x = get16(q), y = get16(q + 2), w = get16(q + 4), h = get16(q + 6);
+        if (x + w > width || y + h > height) return 0;
+        q += RECT_SIZE + (size_t)w * h;
+        if ((size_t)(q - p) > len) return 0;
+    }
+    if ((size_t)(q - p) != len) return 0;
+    if (resized && ! game_resize(g, width, height)) return 0;
+
+    g->state = view[0];
+    g->coin_y = (int16_t)get16(&view[2]);
+    g->handle_y = (int16_t)get16(&view[4]);
+    for (int i = 0; i < 3; i ++)
+        g->reel_position[i] = (int16_t)get16(&view[6 + 2 * i]);
+    g->plays = (int32_t)get32(&view[12]);
+    g->profit = (int32_t)get32(&view[16]);
+
+    struct image * fb = g->framebuffer;
+    q = view + VIEW_SIZE;
+    for (unsigned int i = 0; i < count; i ++) {
+        const unsigned int x = get16(q), y = get16(q + 2), w = get16(q + 4), h = get16(q + 6);
+        q += RECT_SIZE;
+        for (unsigned int row = y; row < y + h; row ++) {
+            memcpy(&fb->data[(size_t)row * fb->stride + x], q, w);
+            q += w;
+        }
+    }
+
+    g->version ++;
+    if (p[1] & CLUSTER_KEYFRAME) g->epoch ++;
+    return 1;
+}
+
+int cluster_read(struct cluster_reader * r, const unsigned char * data, size_t len, struct game * g)
+{
+    if (r->len + len > r->size) {
+        size_t size = (r->size ? r->size : 65536);
+        while (size < r->len + len) size *= 2;
+        unsigned char * buf = realloc(r->buf, size);
+        if (buf == NULL) {
+            perror("realloc cluster_reader");
+            exit(EXIT_FAILURE);
+        }
+        r->buf = buf;
+        r->size = size;
+    }
+    memcpy(&r->buf[r->len], data, len);
+    r->len += len;
+
+    int frames = 0;
+    size_t done = 0;
+    while (r->len - done >= HEADER_SIZE) {
+        const unsigned char * p = &r->buf[done];
+        const size_t length = get32(&p[4]);
+        if (p[0] != CLUSTER_FRAME || length < HEADER_SIZE + VIEW_SIZE) return -1;
+        if (r->len - done < HEADER_SIZE + VIEW_SIZE) break;
+        // a frame is at most the whole screen (as big as the frame says it is now), plus a
+        //  rectangle header for each damaged area
+        const unsigned int width = get16(&p[HEADER_SIZE + 20]), height = get16(&p[HEADER_SIZE + 22]);
+        if (width < MACHINE_WIDTH || height < MACHINE_HEIGHT || width > FRAMEBUFFER_MAX || height > FRAMEBUFFER_MAX)
+            return -1;
+        if (length > HEADER_SIZE + VIEW_SIZE + (size_t)width * height + RECT_SIZE * (GAME_DAMAGE_MAX + 1)) return -1;
+        if (r->len - done < length) break;
+
+        if (! apply_frame(p, length, g)) return -1;
+        frames ++;
+        done += length;
+    }
+
+    memmove(r->buf, &r->buf[done], r->len - done);
+    r->len -= done;
+    return frames;
+}
@@ -0,0 +1,53 @@
+#ifndef CLUSTER_H_
+#define CLUSTER_H_
+
+// Cluster mode: one authority process runs the machine, and any number of relays - edge servers
+//  with no game logic of their own - mirror it for their own viewers.  A relay subscribes over
+//  TCP or a Unix socket, and the authority streams it every new frame: the machine's state as
+//  far as a viewer can see it, and the pixels of whatever changed (BGR233 as drawn - each relay
+//  encodes them for its own clients).  The relay works out its clients' updates from that just
+//  as the authority does, and sends a byte back whenever one of them drops a coin in.
+//
+//  Authority to relay, all numbers big-endian:
+//   frame: 'F', flags (u8: 1 = keyframe, the whole screen), rectangle count (u16), length of the
+//    whole message (u32), state (u8), padding (u8), coin_y, handle_y, the three reel positions
+//    (s16 each), plays, profit (s32 each), the framebuffer's width and height (u16 each, which
+//    only a keyframe can change) - then for each rectangle x, y, w, h (u16 each) and its w * h
+//    pixels
+//  Relay to authority:
+//   pull: 'P'
+
+#include "game.h"
+#include "outq.h"
+
+#include <stddef.h>
+
+#define CLUSTER_FRAME 'F'
+#define CLUSTER_PULL 'P'
+
+#define CLUSTER_KEYFRAME 1
+
+// listen for relays on a port, or on a Unix socket if it's a path - returns the fd, or -1
+int cluster_listen(const char * where, int backlog);
+// connect to an authority at host:port, or a Unix socket path - returns the fd, or -1
+int cluster_connect(const char * where);
+
+// a frame message with these areas of the machine's framebuffer (the caller has the only reference)
+struct segment * cluster_frame(const struct game * g, int flags, const struct rect * rects, unsigned int count);
+
+// a relay's end of the stream: frames pieced together from whatever each read brings
+struct cluster_reader {
+    unsigned char * buf;
+    size_t len, size;
+};
+
+void cluster_reader_init(struct cluster_reader * r);
+void cluster_reader_free(struct cluster_reader * r);
+
+// take in some bytes from upstream, applying every frame they complete to the mirror g - which
+//  gets a new version for each, and a new epoch for a keyframe (resized first to the authority's
+//  framebuffer, if that's changed)
+//  returns how many frames were applied, or -1 if the stream makes no sense
+int cluster_read(struct cluster_reader * r, const unsigned char * data, size_t len, struct game * g);
+
+#endif
@@ -0,0 +1,1179 @@
+#include "encode.h"
+#include "builtin.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+
+unsigned char * encode_colour_map(unsigned char * p)
+{
+    // type + padding, first colour 0, 256 colours
+    p[1] = p[2] = p[3] = p[5] = 0;
+    p[0] = p[4] = 1;
+
+    p += 6;
+    for (int i = 0; i < 256; i ++) {
+        for (int c = 0; c < 3; c ++) {
+            *p = (bgr233_palette[c][i] >> 8) & 0xFF;
+            p ++;
+            *p = bgr233_palette[c][i] & 0xFF;
+            p ++;
+        }
+    }
+    return p;
+}
+
+static unsigned char * encode_pixel(unsigned char * p, const struct pixel_format * f, const uint8_t color)
+{
+    uint32_t pixel = ((bgr233_palette[0][color] / f->red_div) << f->red_shift) |
+                     ((bgr233_palette[1][color] / f->green_div) << f->green_shift) |
+                     ((bgr233_palette[2][color] / f->blue_div) << f->blue_shift);
+
+    if (f->bpp == 8) {
+        *p = (pixel & 0xFF);
+        p ++;
+    } else if (f->bpp == 16) {
+        if (f->big_endian_flag) {
+            *p = (pixel & 0xFF00) >> 8;
+            p ++;
+            *p = (pixel & 0xFF);
+            p ++;
+        } else {
+            *p = (pixel & 0xFF);
+            p ++;
+            *p = (pixel & 0xFF00) >> 8;
+            p ++;
+        }
+    } else {
+        if (f->big_endian_flag) {
+            *p = (pixel & 0xFF000000) >> 24;
+            p ++;
+            *p = (pixel & 0xFF0000) >> 16;
+            p ++;
+            *p = (pixel & 0xFF00) >> 8;
+            p ++;
+            *p = (pixel & 0xFF);
+            p ++;
+        } else {
+            *p = (pixel & 0xFF);
+            p ++;
+            *p = (pixel & 0xFF00) >> 8;
+            p ++;
+            *p = (pixel & 0xFF0000) >> 16;
+            p ++;
+            *p = (pixel & 0xFF000000) >> 24;
+            p ++;
+        }
+    }
+    return p;
+}
+
+static unsigned char * encode_hextile(unsigned char * p, const struct image * src, const struct pixel_format * f, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+    // some enums
+    enum {
+        H_None = 0,
+        H_Raw = 1,
+        H_BGSpec = 2,
+        H_FGSpec = 4,
+        H_AnySub = 8,
+        H_SubColor = 16
+    };
+
+    short background = -1;
+    short foreground = -1;
+
+    // we break the area into 16x16 tiles and analyze them
+    while (h > 0) {
+        int th = h > 16 ? 16 : h;
+        const unsigned char * row[16];
+        for (int j = 0; j < th; j ++)
+            row[j] = image_row(src, y + j);
+
+        int dx = x;
+        int w_left = w;
+        while (w_left > 0) {
+            int tw = w_left > 16 ? 16 : w_left;
+
+            // histogram of the colors
+            // for 8bpp we can use pigeonhole
+            unsigned short colors[256] = { 0 };
+            for (int j = 0; j < th; j ++)
+                for (int i = 0; i < tw; i ++)
+                    colors[row[j][dx + i]] ++;
+
+            short newbg = -1;
+            short newfg = -1;
+            unsigned short color_count = 0;
+            for (int i = 0; i < 256; i ++) {
+                if (colors[i] > 0) {
+                    color_count ++;
+                    if (newbg < 0 || colors[i] > colors[newbg]) {
+                        newfg = newbg;
+                        newbg = i;
+                    } else if (newfg < 0 || colors[i] > colors[newfg]) {
+                        newfg = i;
+                    }
+                }
+            }
+
+
+            // log this.  if we do the work and find this is more expensive than raw encoding the whole tile,
+            //  backtrack to this point and do raw.
+            unsigned char * tile_start = p;
+            int too_big = 0;
+
+            // ok!  we have determined a count of how many colors are in the tile,
+            // the most common (newbg) and the second-most-common (newfg)
+
+            if (color_count == 1) {
+                // solid colored tile
+                if (newbg == background) {
+                    // can carry over color from before
+                    *p = H_None;
+                    p ++;
+                } else {
+                    *p = H_BGSpec;
+                    p ++;
+                    p = encode_pixel(p, f, newbg);
+                    background = newbg;
+                }
+            } else {
+                if (color_count == 2) {
+                    // two-tone tile
+                    if (newbg == background && newfg == foreground) {
+                        *p = H_AnySub;
+                        p ++;
+                    } else if (newbg != background && newfg == foreground) {
+                        *p = H_AnySub | H_BGSpec;
+                        p ++;
+                        p = encode_pixel(p, f, newbg);
+                        background = newbg;
+                    } else if (newbg == background && newfg != foreground) {
+                        *p = H_AnySub | H_FGSpec;
+                        p ++;
+                        p = encode_pixel(p, f, newfg);
+                        foreground = newfg;
+                    } else {
+                        *p = H_AnySub | H_FGSpec | H_BGSpec;
+                        p ++;
+                        p = encode_pixel(p, f, newbg);
+                        background = newbg;
+                        p = encode_pixel(p, f, newfg);
+                        foreground = newfg;
+                    }
+                }  else {
+                    if (newbg == background) {
+                        // can carry over color from before
+                        *p = H_AnySub | H_SubColor;
+                        p ++;
+                    } else {
+                        *p = H_AnySub | H_SubColor | H_BGSpec;
+                        p ++;
+                        p = encode_pixel(p, f, newbg);
+                        background = newbg;
+                    }
+                    foreground = -1;
+                }
+
+                unsigned char * rect_count = p;
+                p ++;
+                *rect_count = 0;
+
+                // at last do RRE on the tile - until it's as big as the raw tile it will be sent as instead,
+                //  so a busy tile never takes more room than that
+                const int subrect_size = (color_count > 2 ? f->bpp / 8 : 0) + 2;
+                unsigned char coverage[16][16] = { 0 };
+                for (int j = 0; j < th && ! too_big; j ++) {
+                    for (int i = 0; i < tw; i ++) {
+                        // square already "covered", skip
+                        if (coverage[j][i]) continue;
+
+                        // mark it now
+                        coverage[j][i] = 1;
+
+                        // check for background-color
+                        unsigned char color = row[j][dx + i];
+
+                        if (color == background) continue;
+
+                        // an uncovered, new color.
+                        *rect_count += 1;
+
+                        //  try to expand our ending box as far right as we can
+                        int i2 = i + 1;
+                        while (i2 < tw && row[j][dx + i2] == color)
+                        {
+                            coverage[j][i2] = 1;
+                            i2 ++;
+                        }
+
+                        // and now a check to see how tall we can make the box
+                        int j2 = j + 1;
+                        while (j2 < th) {
+                            unsigned char full_row = 1;
+
+                            // check the row first
+                            for (int q = i; q < i2; q ++) {
+                                if (color != row[j2][dx + q]) {
+                                    full_row = 0;
+                                    break;
+                                }
+                            }
+                            if (! full_row) break;
+
+                            // mark the row now
+                            for (int q = i; q < i2; q ++)
+                                coverage[j2][q] = 1;
+                            j2 ++;
+                        }
+
+                        // ok we have everything we need!  send the rectangle
+                        if (p + subrect_size - tile_start > tw * th * f->bpp / 8) {
+                            too_big = 1;
+                            break;
+                        }
+                        if (color_count > 2) p = encode_pixel(p, f, color);
+                        *p = ((i & 0xF) << 4) | (j & 0xF);
+                        p ++;
+                        *p = (((i2 - i - 1) & 0xF) << 4) | ((j2 - j - 1) & 0xF);
+                        p ++;
+                    }
+                }
+            }
+
+            // RAW ENCODE THE TILE
+            if (too_big || p - tile_start > tw * th * f->bpp / 8) {
+                p = tile_start;
+                *p = 1;
+                p ++;
+                for (int j = 0; j < th; j ++)
+                    for (int i = 0; i < tw; i ++)
+                        p = encode_pixel(p, f, row[j][dx + i]);
+                background = foreground = -1;
+            }
+
+            //printf("%2x ", *tile_start);
+            dx += tw;
+            w_left -= tw;
+        }
+        //printf("\n");
+        y += th;
+        h -= th;
+    }
+
+    return p;
+}
+// histogram of an area's colours
+static void count_colours(const struct image * src, uint16_t x, uint16_t y, uint16_t w, uint16_t h, unsigned int colors[256])
+{
+    for (int src_y = y; src_y < y + h; src_y ++) {
+        const unsigned char * row = image_row(src, src_y);
+        for (int src_x = x; src_x < x + w; src_x ++)
+            colors[row[src_x]] ++;
+    }
+}
+
+// the RRE subrectangles for rows top to top + rows of the area x, y, w, h, against background bg
+//  - positions are relative to the whole area, and none reaches outside those rows
+//  gives up (returning NULL) rather than write past limit
+static unsigned char * rre_subrects(unsigned char * p, const unsigned char * limit, const struct image * src, const struct pixel_format * f,
+                                    uint16_t x, uint16_t y, uint16_t w, uint16_t top, uint16_t rows, unsigned char bg, unsigned int * subrects)
+{
+    // now we calloc a region and then walk it trying to build RRE blocks and send them
+    unsigned char * coverage = calloc(rows, w);
+    if (coverage == NULL) {
+        perror("calloc coverage");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int src_y = top; src_y < top + rows; src_y ++) {
+        const unsigned char * row = image_row(src, y + src_y) + x;
+        int j = (src_y - top) * w;
+        for (int src_x = 0; src_x < w; src_x ++) {
+            // square already "covered", skip
+            if (coverage[j + src_x]) continue;
+
+            // mark it now
+            coverage[j + src_x] = 1;
+
+            // check for background-color
+            unsigned char color = row[src_x];
+            if (color == bg) continue;
+
+            // an uncovered, new color.
+            (*subrects) ++;
+
+            //  try to expand our ending box as far right as we can
+            int src_x2 = src_x + 1;
+            while (src_x2 < w && row[src_x2] == color)
+            {
+                coverage[j + src_x2] = 1;
+                src_x2 ++;
+            }
+
+            // and now a check to see how tall we can make the box
+            int src_y2 = src_y + 1;
+            while (src_y2 < top + rows) {
+                const unsigned char * below = image_row(src, y + src_y2) + x;
+                unsigned char full_row = 1;
+                // check the row first
+                for (int l = src_x; l < src_x2; l ++) {
+                    if (color != below[l]) {
+                        full_row = 0;
+                        break;
+                    }
+                }
+                if (! full_row) break;
+                // mark the row now
+                int k = (src_y2 - top) * w;
+                for (int l = src_x; l < src_x2; l ++)
+                    coverage[k + l] = 1;
+                src_y2 ++;
+            }
+
+            // ok we have everything we need!  send the rectangle - if there's room
+            if (p + f->bpp / 8 + 8 > limit) {
+                free(coverage);
+                return NULL;
+            }
+            p = encode_pixel(p, f, color);
+            *p = src_x / 256;
+            p ++;
+            *p = src_x % 256;
+            p ++;
+            *p = src_y / 256;
+            p ++;
+            *p = src_y % 256;
+            p ++;
+            *p = (src_x2 - src_x) / 256;
+            p ++;
+            *p = (src_x2 - src_x) % 256;
+            p ++;
+            *p = (src_y2 - src_y) / 256;
+            p ++;
+            *p = (src_y2 - src_y) % 256;
+            p ++;
+        }
+    }
+
+    free(coverage);
+    return p;
+}
+
+static void put_subrect_count(unsigned char * p, unsigned int subrects)
+{
+    p[0] = (subrects & 0xFF000000) >> 24;
+    p[1] = (subrects & 0xFF0000) >> 16;
+    p[2] = (subrects & 0xFF00) >> 8;
+    p[3] = subrects & 0xFF;
+}
+
+// gives up (returning NULL) rather than write past limit
+static unsigned char * encode_rre(unsigned char * p, const unsigned char * limit, const struct image * src, const struct pixel_format * f, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+    // we need this to go update the subrectangle count later
+    unsigned char * start = p;
+    p += 4;
+
+    // find background color
+    //  this is a histogram across the region, tracking each pixel and its frequency
+    // for 8bpp we can use pigeonhole
+    unsigned int colors[256] = { 0 };
+    count_colours(src, x, y, w, h, colors);
+    unsigned char max_color = 0;
+    for (int i = 1; i < 256; i ++)
+        if (colors[i] > colors[max_color]) max_color = i;
+
+    p = encode_pixel(p, f, max_color);
+
+    unsigned int subrects = 0;
+    p = rre_subrects(p, limit, src, f, x, y, w, 0, h, max_color, &subrects);
+    if (p != NULL) put_subrect_count(start, subrects);
+    return p;
+}
+
+static unsigned char * encode_raw(unsigned char * p, const struct image * src, const struct pixel_format * f, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+    // if their format exactly matches ours, we can just send the pixels directly
+    if (f->bpp == 8 && (f->true_color_flag == 0 || (f->red_div == (65536 / 8) && f->red_shift == 0 && f->green_div == (65536 / 8) && f->green_shift == 3 && f->blue_div == (65536 / 4) && f->blue_shift == 6))) {
+
+        for (int row = y; row < y + h; row ++) {
+            memcpy(p, image_row(src, row) + x, w);
+            p += w;
+        }
+    } else {
+        // hmm ok A Conversion Is Needed
+
+        for (int src_y = y; src_y < y + h; src_y ++) {
+            const unsigned char * row = image_row(src, src_y);
+            for (int src_x = x; src_x < x + w; src_x ++)
+                p = encode_pixel(p, f, row[src_x]);
+        }
+    }
+    return p;
+}
+
+// /////////////////////////////////
+// Parallel bands
+//  A big area - a full refresh, or a new client's first frame - is cut into bands of whole
+//  16-row tiles, and the encoder threads work through those together, each band into a buffer
+//  of its own; then the bands are stitched back together in order.  A HexTile band starts with
+//  no background or foreground carried over from the one above (its first tile specifies them),
+//  and RRE finds the background over the whole area but gives each band its own subrectangles,
+//  so none of them crosses a band edge.  The selector above all this still runs on the caller.
+//  The same threads also take tasks to get on with in the background (encode_submit()): those
+//  encode a whole area each, on whichever thread picked them up, and never split it into bands.
+
+// areas smaller than this are quicker encoded than handed out
+#define BAND_MIN_PIXELS (128 * 128)
+// bands per thread, so one slow band doesn't leave the rest idle at the end
+#define BANDS_PER_THREAD 2
+#define MAX_BANDS (ENCODE_MAX_THREADS * BANDS_PER_THREAD)
+
+enum band_work {
+    band_hextile,
+    band_colours,
+    band_rre,
+    band_raw
+};
+
+struct band {
+    uint16_t top, rows;
+    unsigned char * buf;
+    size_t size;
+    // the end of its output, or NULL if it gave up
+    unsigned char * end;
+    unsigned int colors[256];
+    unsigned int subrects;
+};
+
+// the area being split up, and what to do with each band of it
+static struct {
+    enum band_work work;
+    const struct image * src;
+    const struct pixel_format * f;
+    uint16_t x, y, w;
+    unsigned char bg;
+    struct band bands[MAX_BANDS];
+    unsigned int count;
+} job;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake, finished;
+    pthread_t workers[ENCODE_MAX_THREADS];
+    // counting the caller, which works too
+    unsigned int threads;
+    // bumped for each job; its bands, the next one to take, and how many are still being worked on -
+    //  the count is copied from the job here, under the lock, as split_bands() rewrites the job without it
+    //  while a worker woken late for the last round may still be looking
+    unsigned long round;
+    unsigned int count, next, unfinished;
+    // background tasks not yet started, oldest first
+    struct encode_task * queue, ** queue_tail;
+    int quit;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, .threads = 1,
+           .queue_tail = &pool.queue };
+
+// set on the workers: only the caller's thread splits an area into bands
+static __thread int band_worker_thread;
+
+static void do_band(struct band * b)
+{
+    switch (job.work) {
+    case band_hextile:
+        b->end = encode_hextile(b->buf, job.src, job.f, job.x, job.y + b->top, job.w, b->rows);
+        break;
+    case band_colours:
+        memset(b->colors, 0, sizeof(b->colors));
+        count_colours(job.src, job.x, job.y + b->top, job.w, b->rows, b->colors);
+        break;
+    case band_rre:
+        // a band that comes out bigger than raw gives up, just as a whole area would
+        b->subrects = 0;
+        b->end = rre_subrects(b->buf, b->buf + (size_t)job.w * b->rows * (job.f->bpp / 8), job.src, job.f,
+                              job.x, job.y, job.w, b->top, b->rows, job.bg, &b->subrects);
+        break;
+    default:
+        b->end = encode_raw(b->buf, job.src, job.f, job.x, job.y + b->top, job.w, b->rows);
+    }
+}
+
+// take bands until there are none left - called with the lock held, which is let go for the work
+static void take_bands(void)
+{
+    while (pool.next < pool.count) {
+        struct band * b = &job.bands[pool.next ++];
+        pthread_mutex_unlock(&pool.lock);
+        do_band(b);
+        pthread_mutex_lock(&pool.lock);
+        if (-- pool.unfinished == 0) pthread_cond_signal(&pool.finished);
+    }
+}
+
+// run a background task - called with the lock held, which is let go for the work
+static void run_task(struct encode_task * t)
+{
+    t->state = encode_task_running;
+    pthread_mutex_unlock(&pool.lock);
+    t->run(t);
+    pthread_mutex_lock(&pool.lock);
+    t->state = encode_task_done;
+    pthread_cond_broadcast(&pool.finished);
+}
+
+static void * band_worker(void * arg)
+{
+    (void)arg;
+    band_worker_thread = 1;
+    pthread_mutex_lock(&pool.lock);
+    unsigned long seen = pool.round;
+    for (;;) {
+        while (! pool.quit && pool.round == seen && pool.queue == NULL)
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        if (pool.quit) break;
+        // bands first: the caller is waiting on those
+        if (pool.round != seen) {
+            seen = pool.round;
+            take_bands();
+        } else {
+            struct encode_task * t = pool.queue;
+            pool.queue = t->next;
+            if (pool.queue == NULL) pool.queue_tail = &pool.queue;
+            run_task(t);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+// do job.work to every band, and wait until it's all done
+static void run_bands(enum band_work work)
+{
+    pthread_mutex_lock(&pool.lock);
+    job.work = work;
+    pool.count = job.count;
+    pool.next = 0;
+    pool.unfinished = job.count;
+    pool.round ++;
+    pthread_cond_broadcast(&pool.wake);
+    take_bands();
+    while (pool.unfinished > 0)
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// set up the job for the area x, y, w, h - returns 0 if it isn't worth splitting
+static int split_bands(const struct image * src, const struct pixel_format * f, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+    if (pool.threads < 2 || band_worker_thread || (unsigned int)w * h < BAND_MIN_PIXELS) return 0;
+
+    const unsigned int tile_rows = (h + 15) / 16;
+    job.count = pool.threads * BANDS_PER_THREAD;
+    if (job.count > tile_rows) job.count = tile_rows;
+    job.src = src;
+    job.f = f;
+    job.x = x;
+    job.y = y;
+    job.w = w;
+
+    unsigned int top = 0;
+    for (unsigned int i = 0; i < job.count; i ++) {
+        struct band * b = &job.bands[i];
+        // the tile rows spread out as evenly as they go
+        unsigned int bottom = tile_rows * (i + 1) / job.count * 16;
+        if (bottom > h) bottom = h;
+        b->top = top;
+        b->rows = bottom - top;
+        top = bottom;
+
+        // room for the worst of them, as if the band were an area of its own
+        const size_t needed = encode_max_size(f, w, b->rows);
+        if (needed > b->size) {
+            free(b->buf);
+            b->buf = malloc(needed);
+            if (b->buf == NULL) {
+                perror("malloc band");
+                exit(EXIT_FAILURE);
+            }
+            b->size = needed;
+        }
+    }
+    return 1;
+}
+
+// the bands' output one after another at p - or NULL if any of them gave up, or it would all pass limit
+static unsigned char * stitch_bands(unsigned char * p, const unsigned char * limit)
+{
+    size_t total = 0;
+    for (unsigned int i = 0; i < job.count; i ++) {
+        if (job.bands[i].end == NULL) return NULL;
+        total += job.bands[i].end - job.bands[i].buf;
+    }
+    if (total > (size_t)(limit - p)) return NULL;
+
+    for (unsigned int i = 0; i < job.count; i ++) {
+        const size_t len = job.bands[i].end - job.bands[i].buf;
+        memcpy(p, job.bands[i].buf, len);
+        p += len;
+    }
+    return p;
+}
+
+// encode_rre, on the bands already split_bands()
+static unsigned char * encode_rre_bands(unsigned char * p, const unsigned char * limit)
+{
+    run_bands(band_colours);
+    unsigned int colors[256] = { 0 };
+    for (unsigned int i = 0; i < job.count; i ++)
+        for (int c = 0; c < 256; c ++)
+            colors[c] += job.bands[i].colors[c];
+    unsigned char max_color = 0;
+    for (int i = 1; i < 256; i ++)
+        if (colors[i] > colors[max_color]) max_color = i;
+
+    unsigned char * start = p;
+    p = encode_pixel(p + 4, job.f, max_color);
+    job.bg = max_color;
+    run_bands(band_rre);
+    p = stitch_bands(p, limit);
+    if (p == NULL) return NULL;
+
+    unsigned int subrects = 0;
+    for (unsigned int i = 0; i < job.count; i ++)
+        subrects += job.bands[i].subrects;
+    put_subrect_count(start, subrects);
+    return p;
+}
+
+void encode_submit(struct encode_task * t)
+{
+    t->next = NULL;
+    t->state = encode_task_queued;
+    // with nobody to hand it to, it might as well be done now
+    if (pool.threads < 2) {
+        t->run(t);
+        t->state = encode_task_done;
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    *pool.queue_tail = t;
+    pool.queue_tail = &t->next;
+    pthread_cond_signal(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+int encode_finish(struct encode_task * t)
+{
+    pthread_mutex_lock(&pool.lock);
+    const int waited = (t->state != encode_task_done);
+    if (t->state == encode_task_queued) {
+        // nobody has started it yet: take it out of the queue and do it here
+        struct encode_task ** link = &pool.queue;
+        while (*link != t) link = &(*link)->next;
+        *link = t->next;
+        if (pool.queue_tail == &t->next) pool.queue_tail = link;
+        run_task(t);
+    }
+    while (t->state != encode_task_done)
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    return waited;
+}
+
+unsigned int encode_threads(void)
+{
+    return pool.threads;
+}
+
+unsigned int encode_set_threads(unsigned int threads)
+{
+    if (threads < 1) threads = 1;
+    if (threads > ENCODE_MAX_THREADS) threads = ENCODE_MAX_THREADS;
+
+    // stop whichever are running (once they've cleared the queue), and start afresh
+    pthread_mutex_lock(&pool.lock);
+    while (pool.queue != NULL) {
+        struct encode_task * t = pool.queue;
+        pool.queue = t->next;
+        run_task(t);
+    }
+    pool.queue_tail = &pool.queue;
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (unsigned int i = 1; i < pool.threads; i ++)
+        pthread_join(pool.workers[i], NULL);
+    pool.quit = 0;
+    pool.threads = 1;
+
+    // signals are for the main loop: the workers start with them all blocked
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    while (pool.threads < threads) {
+        int rv = pthread_create(&pool.workers[pool.threads], NULL, band_worker, NULL);
+        if (rv != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rv));
+            break;
+        }
+        pool.threads ++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return pool.threads;
+}
+
+unsigned char * encode_cursor(unsigned char * p, const struct pixel_format * f)
+{
+    // rectangle header
+    p[0] = p[2] = p[4] = p[6] = 0;
+    // hotspot
+    p[1] = 5;
+    p[3] = 1;
+    // cursor size
+    p[5] = CURSOR_WIDTH;
+    p[7] = CURSOR_HEIGHT;
+    // encoding
+    p[8] = p[9] = p[10] = 0xFF;
+    p[11] = 0x11;
+
+    p += 12;
+
+    for (int i = 0; i < CURSOR_WIDTH * CURSOR_HEIGHT; i ++)
+        p = encode_pixel(p, f, cursor_pixels[i]);
+
+    // the transparency map
+    memcpy(p, cursor_mask, sizeof(cursor_mask));
+    p += sizeof(cursor_mask);
+
+    return p;
+}
+
+unsigned char * encode_desktop_size(unsigned char * p, uint16_t encodings, enum desktop_size_reason reason,
+                                    enum desktop_size_status status, uint16_t w, uint16_t h)
+{
+    const int extended = (encodings & ExtendedDesktopSize) != 0;
+    // rectangle header: x and y are the reason and status (or nothing)
+    p[0] = p[2] = 0;
+    p[1] = (extended ? reason : 0);
+    p[3] = (extended ? status : 0);
+    p[4] = w / 256;
+    p[5] = w % 256;
+    p[6] = h / 256;
+    p[7] = h % 256;
+    // encoding: -308 or -223
+    p[8] = p[9] = 0xFF;
+    p[10] = (extended ? 0xFE : 0xFF);
+    p[11] = (extended ? 0xCC : 0x21);
+    p += 12;
+    if (! extended) return p;
+
+    // one screen, the whole framebuffer: number of screens + padding, then id, x, y, w, h, flags
+    memset(p, 0, 20);
+    p[0] = 1;
+    p[12] = w / 256;
+    p[13] = w % 256;
+    p[14] = h / 256;
+    p[15] = h % 256;
+    return p + 20;
+}
+
+
+// /////////////////////////////////
+// Encoding selector
+//  The same few regions (reels, handle, digits) get encoded over and over, so rather than
+//  encoding each one every way and throwing away the losers, keep running statistics per region
+//  and pixel size of how big each encoding comes out (relative to a model built from cheap
+//  features of the pixels) and how long it takes, and only run the predicted winner.
+//  Every so often all of them are tried again, to keep the statistics honest.
+
+enum {
+    sel_hextile,
+    sel_rre,
+    sel_raw,
+    sel_count
+};
+
+static const char * const sel_names[sel_count] = { "HexTile", "RRE", "Raw" };
+static const uint8_t sel_type[sel_count] = { 5, 2, 0 };
+static const enum metric_encoding sel_metric[sel_count] = { metric_hextile, metric_rre, metric_raw };
+
+// regions remembered (least recently used is replaced)
+#define SELECTOR_REGIONS 64
+// re-try all encodings of a region this often
+#define PROBE_INTERVAL 64
+// what a microsecond of encoding is worth in bytes on the wire - and when CPU time is short
+#define BYTES_PER_USEC 8
+#define THRIFTY_BYTES_PER_USEC 256
+
+struct region_stats {
+    uint16_t x, y, w, h;
+    uint8_t bpp;
+    unsigned int encodes;
+    unsigned int last_used;
+
+    // running averages of actual size / modelled size, and of encoding time per pixel
+    float size_ratio[sel_count];
+    float ns_per_pixel[sel_count];
+    unsigned int samples[sel_count];
+
+    unsigned int chosen[sel_count];
+    unsigned int probes;
+    unsigned int mispredictions;
+};
+
+// everything from here to the counters is shared by every thread encoding, under the lock
+static pthread_mutex_t selector_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct region_stats regions[SELECTOR_REGIONS];
+static unsigned int region_count;
+static unsigned int selector_clock;
+static float bytes_per_usec = BYTES_PER_USEC;
+static int thrifty;
+
+static struct {
+    unsigned long chosen[sel_count];
+    unsigned long probes;
+    unsigned long mispredictions;
+    unsigned long fallbacks;
+} counters;
+
+// cheap features of an area: how many colours, and how many horizontal runs of the same colour
+struct features {
+    unsigned int colours;
+    unsigned int runs;
+    unsigned int tiles;
+};
+
+static void measure(const struct image * src, uint16_t x, uint16_t y, uint16_t w, uint16_t h, struct features * ft)
+{
+    unsigned char seen[256] = { 0 };
+    ft->colours = 0;
+    ft->runs = 0;
+    for (int j = y; j < y + h; j ++) {
+        const unsigned char * row = image_row(src, j);
+        int previous = -1;
+        for (int i = x; i < x + w; i ++) {
+            if (! seen[row[i]]) {
+                seen[row[i]] = 1;
+                ft->colours ++;
+            }
+            if (row[i] != previous) {
+                ft->runs ++;
+                previous = row[i];
+            }
+        }
+    }
+    ft->tiles = ((w + 15) / 16) * ((h + 15) / 16);
+}
+
+// a rough size for each encoding, before the learned correction
+static float model_size(int sel, const struct features * ft, unsigned int bytes_pp, uint16_t w, uint16_t h)
+{
+    switch (sel) {
+    case sel_hextile:
+        // a header per tile, a background per tile, and a subrect per run
+        return ft->tiles * (1 + bytes_pp) + (ft->colours > 1 ? ft->runs * (2 + (ft->colours > 2 ? bytes_pp : 0)) : 0);
+    case sel_rre:
+        // background and count, then a coloured subrect per run
+        return 4 + bytes_pp + (ft->colours > 1 ? ft->runs * (bytes_pp + 8) : 0);
+    default:
+        return (float)w * h * bytes_pp;
+    }
+}
+
+static struct region_stats * find_region(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t bpp)
+{
+    selector_clock ++;
+
+    struct region_stats * oldest = &regions[0];
+    for (unsigned int i = 0; i < region_count; i ++) {
+        struct region_stats * r = &regions[i];
+        if (r->x == x && r->y == y && r->w == w && r->h == h && r->bpp == bpp) {
+            r->last_used = selector_clock;
+            return r;
+        }
+        if (r->last_used < oldest->last_used) oldest = r;
+    }
+
+    struct region_stats * r = (region_count < SELECTOR_REGIONS ? &regions[region_count ++] : oldest);
+    memset(r, 0, sizeof(struct region_stats));
+    r->x = x;
+    r->y = y;
+    r->w = w;
+    r->h = h;
+    r->bpp = bpp;
+    r->last_used = selector_clock;
+    for (int i = 0; i < sel_count; i ++) r->size_ratio[i] = 1;
+    // until measured, guess that the smarter encodings cost more
+    r->ns_per_pixel[sel_hextile] = 20;
+    r->ns_per_pixel[sel_rre] = 15;
+    r->ns_per_pixel[sel_raw] = 3;
+    return r;
+}
+
+static void learn(struct region_stats * r, int sel, float model, size_t size, long ns)
+{
+    float ratio = size / (model > 1 ? model : 1);
+    float ns_pp = (float)ns / (r->w * r->h);
+    if (r->samples[sel] == 0) {
+        r->size_ratio[sel] = ratio;
+        r->ns_per_pixel[sel] = ns_pp;
+    } else {
+        r->size_ratio[sel] += (ratio - r->size_ratio[sel]) / 8;
+        r->ns_per_pixel[sel] += (ns_pp - r->ns_per_pixel[sel]) / 8;
+    }
+    r->samples[sel] ++;
+}
+
+static long ns_between(const struct timespec * start, const struct timespec * end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+// run one encoder: returns the end of its output, or NULL if it came out bigger than raw
+static unsigned char * run_encoder(int sel, unsigned char * p, const struct image * src, const struct pixel_format * f,
+                                   uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+    const size_t raw_size = (size_t)w * h * (f->bpp / 8);
+    unsigned char * end;
+
+    if (split_bands(src, f, x, y, w, h)) {
+        switch (sel) {
+        case sel_hextile:
+            run_bands(band_hextile);
+            return stitch_bands(p, p + raw_size);
+        case sel_rre:
+            return encode_rre_bands(p, p + raw_size);
+        default:
+            run_bands(band_raw);
+            return stitch_bands(p, p + raw_size);
+        }
+    }
+
+    switch (sel) {
+    case sel_hextile:
+        end = encode_hextile(p, src, f, x, y, w, h);
+        return ((size_t)(end - p) <= raw_size ? end : NULL);
+    case sel_rre:
+        return encode_rre(p, p + raw_size, src, f, x, y, w, h);
+    default:
+        return encode_raw(p, src, f, x, y, w, h);
+    }
+}
+
+size_t encode_max_size(const struct pixel_format * f, uint16_t w, uint16_t h)
+{
+    // Raw, plus a subencoding byte for every HexTile tile (none comes out bigger than its raw tile) -
+    //  and room past that for the header of a tile about to turn out worse than raw, or RRE's
+    return 12 + (size_t)w * h * (f->bpp / 8) + (size_t)((w + 15) / 16) * ((h + 15) / 16) + 16;
+}
+
+unsigned char * encode(unsigned char * p, const struct image * src, const struct pixel_format * f, uint16_t encodings,
+                       uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+    const uint64_t trace_start = trace_begin();
+
+    // pack an update
+    // x
+    p[0] = (x / 256);
+    p[1] = (x % 256);
+    p[2] = (y / 256);
+    p[3] = (y % 256);
+    p[4] = (w / 256);
+    p[5] = (w % 256);
+    p[6] = (h / 256);
+    p[7] = (h % 256);
+    // encoding
+    p[8] = p[9] = p[10] = 0;
+    p += 11;
+
+    // the candidates this client can take - Raw always
+    unsigned char allowed[sel_count] = { (encodings & HexTile) != 0, (encodings & RRE) != 0, 1 };
+
+    const unsigned int bytes_pp = f->bpp / 8;
+    struct features ft;
+    measure(src, x, y, w, h, &ft);
+
+    // predict: the smallest output, counting time spent as bytes too
+    //  (r is only good while the lock is held - another thread could replace it after)
+    pthread_mutex_lock(&selector_lock);
+    struct region_stats * r = find_region(x, y, w, h, f->bpp);
+    float model[sel_count], score[sel_count];
+    int predicted = sel_raw, probe = (! thrifty && r->encodes % PROBE_INTERVAL == 0);
+    for (int i = sel_count - 1; i >= 0; i --) {
+        if (! allowed[i]) continue;
+        model[i] = model_size(i, &ft, bytes_pp, w, h);
+        score[i] = model[i] * r->size_ratio[i] + r->ns_per_pixel[i] * w * h / 1000 * bytes_per_usec;
+        if (score[i] < score[predicted]) predicted = i;
+        // never measured: have a look at everything
+        if (r->samples[i] == 0) probe = 1;
+    }
+    r->encodes ++;
+    const float cost_per_usec = bytes_per_usec;
+    pthread_mutex_unlock(&selector_lock);
+
+    struct timespec t0, t1;
+    if (probe) {
+        // encode every candidate into scratch space, and keep the one that really was best
+        static __thread unsigned char * scratch[sel_count];
+        static __thread size_t scratch_size;
+        size_t needed = encode_max_size(f, w, h);
+        if (needed > scratch_size) {
+            for (int i = 0; i < sel_count; i ++) {
+                free(scratch[i]);
+                scratch[i] = malloc(needed);
+                if (scratch[i] == NULL) {
+                    perror("malloc selector scratch");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            scratch_size = needed;
+        }
+
+        unsigned char * end[sel_count];
+        size_t size[sel_count];
+        long ns[sel_count];
+        float actual[sel_count];
+        int best = sel_raw;
+        for (int i = 0; i < sel_count; i ++) {
+            if (! allowed[i]) continue;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            end[i] = run_encoder(i, scratch[i], src, f, x, y, w, h);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns[i] = ns_between(&t0, &t1);
+            metric_encode_time(sel_metric[i], x, y, w, h, ns[i]);
+
+            // an encoding that lost to raw is recorded as raw-sized
+            size[i] = (end[i] ? (size_t)(end[i] - scratch[i]) : (size_t)w * h * bytes_pp);
+            actual[i] = size[i] + (float)ns[i] / 1000 * cost_per_usec;
+            if (end[i] != NULL && actual[i] < actual[best]) best = i;
+        }
+
+        pthread_mutex_lock(&selector_lock);
+        r = find_region(x, y, w, h, f->bpp);
+        for (int i = 0; i < sel_count; i ++)
+            if (allowed[i]) learn(r, i, model[i], size[i], ns[i]);
+        r->probes ++;
+        counters.probes ++;
+        if (best != predicted) {
+            r->mispredictions ++;
+            counters.mispredictions ++;
+        }
+        r->chosen[best] ++;
+        counters.chosen[best] ++;
+        pthread_mutex_unlock(&selector_lock);
+
+        *p = sel_type[best];
+        memcpy(p + 1, scratch[best], end[best] - scratch[best]);
+        TRACE_END(trace_encode, trace_start, sel_names[best], x, y, w, h, 12 + (end[best] - scratch[best]), 1);
+        return p + 1 + (end[best] - scratch[best]);
+    }
+
+    // just run the predicted winner
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    unsigned char * end = run_encoder(predicted, p + 1, src, f, x, y, w, h);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long ns = ns_between(&t0, &t1);
+    metric_encode_time(sel_metric[predicted], x, y, w, h, ns);
+    const int fell_back = (end == NULL);
+    if (fell_back) {
+        // it seems that made it worse than Raw, so toss that encoding attempt
+        end = run_encoder(sel_raw, p + 1, src, f, x, y, w, h);
+    }
+
+    pthread_mutex_lock(&selector_lock);
+    r = find_region(x, y, w, h, f->bpp);
+    learn(r, predicted, model[predicted], fell_back ? (size_t)w * h * bytes_pp : (size_t)(end - p - 1), ns);
+    if (fell_back) {
+        r->mispredictions ++;
+        counters.mispredictions ++;
+        counters.fallbacks ++;
+        predicted = sel_raw;
+    }
+    r->chosen[predicted] ++;
+    counters.chosen[predicted] ++;
+    pthread_mutex_unlock(&selector_lock);
+
+    *p = sel_type[predicted];
+    TRACE_END(trace_encode, trace_start, sel_names[predicted], x, y, w, h, 11 + (end - p), 0);
+    return end;
+}
+
+void selector_set_thrifty(int on)
+{
+    pthread_mutex_lock(&selector_lock);
+    thrifty = on;
+    bytes_per_usec = (on ? THRIFTY_BYTES_PER_USEC : BYTES_PER_USEC);
+    pthread_mutex_unlock(&selector_lock);
+}
+
+void selector_dump(FILE * fp)
+{
+    pthread_mutex_lock(&selector_lock);
+    fprintf(fp, "~ selector: %lu HexTile, %lu RRE, %lu Raw chosen; %lu probes, %lu mispredictions, %lu fallbacks to Raw\n",
+            counters.chosen[sel_hextile], counters.chosen[sel_rre], counters.chosen[sel_raw],
+            counters.probes, counters.mispredictions, counters.fallbacks);
+    fprintf(fp, "~ region           bpp  encodes  mispredict  chosen (size ratio, ns/pixel) per encoding\n");
+    for (unsigned int i = 0; i < region_count; i ++) {
+        const struct region_stats * r = &regions[i];
+        fprintf(fp, "~ %3u,%3u %3ux%-3u  %3u  %7u  %10u", r->x, r->y, r->w, r->h, r->bpp, r->encodes, r->mispredictions);
+        for (int k = 0; k < sel_count; k ++)
+            fprintf(fp, "  %s %u (%.2f, %.1f)", sel_names[k], r->chosen[k], r->size_ratio[k], r->ns_per_pixel[k]);
+        fputc('\n', fp);
+    }
+    pthread_mutex_unlock(&selector_lock);
+}
+
+// /////////////////////////////////
+// Benchmark: each encoder on the whole of src, with one thread and then more
+
+void encode_benchmark(FILE * fp, const struct image * src, unsigned int max_threads)
+{
+    // a typical viewer's format: 32-bit true colour, 8 bits a channel
+    static const struct pixel_format format = { 32, 0, 1, 256, 256, 256, 16, 8, 0 };
+    const uint16_t w = src->width, h = src->height;
+    const unsigned int previous = pool.threads;
+
+    unsigned char * out = malloc((size_t)w * h * 4 + ((w + 15) / 16) * ((h + 15) / 16) + 16);
+    if (out == NULL) {
+        perror("malloc benchmark");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(fp, "Encoding the whole %ux%u frame at %ubpp\n", w, h, format.bpp);
+    // (ns/pixel stays put as the frame grows, if the encoders scale with the area)
+    fprintf(fp, "%-8s %8s %10s %10s %9s %8s\n", "encoding", "threads", "bytes", "ms/frame", "ns/pixel", "speedup");
+    for (int sel = 0; sel < sel_count; sel ++) {
+        double single = 0;
+        for (unsigned int threads = 1; threads <= max_threads; threads ++) {
+            if (encode_set_threads(threads) != threads) break;
+
+            // as many times as fit in a quarter of a second
+            struct timespec t0, t1;
+            unsigned int runs = 0;
+            unsigned char * end;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            do {
+                end = run_encoder(sel, out, src, &format, 0, 0, w, h);
+                runs ++;
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+            } while (ns_between(&t0, &t1) < 250000000L);
+
+            const double ms = ns_between(&t0, &t1) / 1000000.0 / runs;
+            const double ns_per_pixel = ms * 1000000.0 / ((double)w * h);
+            if (threads == 1) single = ms;
+            if (end != NULL)
+                fprintf(fp, "%-8s %8u %10zu %10.3f %9.2f %7.2fx\n", sel_names[sel], threads, (size_t)(end - out), ms, ns_per_pixel, single / ms);
+            else
+                fprintf(fp, "%-8s %8u %10s %10.3f %9.2f %7.2fx\n", sel_names[sel], threads, "(> raw)", ms, ns_per_pixel, single / ms);
+        }
+    }
+
+    free(out);
+    encode_set_threads(previous);
+}
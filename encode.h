@@ -0,0 +1,109 @@
+#ifndef ENCODE_H_
+#define ENCODE_H_
+
+// RFB encoders: turn areas of a BGR233 image into rectangles in the client's pixel format
+
+#include "image.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+// bit field of the encodings (and pseudo-encodings) a client supports
+enum encoding {
+    Raw = 0,
+    CopyRect = 1,
+    RRE = 2,
+    HexTile = 4,
+    TRLE = 8,
+    ZRLE = 16,
+    Cursor = 32,
+    ContinuousUpdates = 64,
+    Fence = 128,
+    LastRect = 256,
+    DesktopSize = 512,
+    ExtendedDesktopSize = 1024
+};
+
+// ExtendedDesktopSize: why the size changed, and what came of a client's request to change it
+enum desktop_size_reason {
+    desktop_size_server = 0,
+    desktop_size_client = 1,
+    desktop_size_other_client = 2
+};
+enum desktop_size_status {
+    desktop_size_ok = 0,
+    desktop_size_prohibited = 1,
+    desktop_size_no_resources = 2,
+    desktop_size_invalid = 3
+};
+// the longest rectangle encode_desktop_size() makes
+#define DESKTOP_SIZE_MAX 32
+
+// a slightly cooked pixel format, where the _max is converted to a _div
+struct pixel_format {
+    uint8_t bpp;
+//    uint8_t depth;
+    uint8_t big_endian_flag;
+    uint8_t true_color_flag;
+    uint16_t red_div;
+    uint16_t green_div;
+    uint16_t blue_div;
+    uint8_t red_shift;
+    uint8_t green_shift;
+    uint8_t blue_shift;
+};
+
+// SetColourMapEntries message with the whole palette, for paletted clients
+unsigned char * encode_colour_map(unsigned char * p);
+
+// a complete rectangle (header included) of the area x, y, w, h of src,
+//  in whichever of the client's encodings is expected to come out smallest
+unsigned char * encode(unsigned char * p, const struct image * src, const struct pixel_format * f, uint16_t encodings,
+                       uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+// the most room encode() can need for an area w x h, header included
+size_t encode_max_size(const struct pixel_format * f, uint16_t w, uint16_t h);
+
+// the Cursor pseudo-encoding rectangle
+unsigned char * encode_cursor(unsigned char * p, const struct pixel_format * f);
+
+// a rectangle telling the client the framebuffer is w x h: ExtendedDesktopSize (a single screen
+//  covering all of it) if it's in encodings, otherwise DesktopSize - which has no reason or status
+unsigned char * encode_desktop_size(unsigned char * p, uint16_t encodings, enum desktop_size_reason reason,
+                                    enum desktop_size_status status, uint16_t w, uint16_t h);
+
+// when the server is overloaded: count encoding time as many more bytes than usual, so the
+//  selector leans to whatever is quickest, and skip the periodic try-everything probes
+void selector_set_thrifty(int on);
+
+// print the encoding selector's decisions and statistics
+void selector_dump(FILE * fp);
+
+// the most encoder threads there can be
+#define ENCODE_MAX_THREADS 32
+
+// encode big areas in bands, on this many threads (the caller's included) - returns how many it got
+unsigned int encode_set_threads(unsigned int threads);
+unsigned int encode_threads(void);
+
+// something for the encoder threads to do in the background: run is called on one of them,
+//  once, with the task - which can be embedded in something bigger
+struct encode_task {
+    void (*run)(struct encode_task * t);
+    struct encode_task * next;
+    enum {
+        encode_task_queued,
+        encode_task_running,
+        encode_task_done
+    } state;
+};
+
+// hand a task over (or, with no threads to take it, run it now)
+void encode_submit(struct encode_task * t);
+// wait until a task is done - doing it here and now, if no thread has started on it yet
+//  returns 0 if it was done already
+int encode_finish(struct encode_task * t);
+
+// time each encoder on the whole of src with one thread, then two, up to max_threads, and print the table
+void encode_benchmark(FILE * fp, const struct image * src, unsigned int max_threads);
+
+#endif
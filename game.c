@@ -0,0 +1,496 @@
+#include "game.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// the V-12-70 reel strips of the Jennings "Chief"
+static const uint8_t reels[3][20] = {
+    { orange, bar, plum, cherry, plum, orange, bell, plum, orange, cherry, orange, bar, orange, plum, orange, plum, cherry, bar, orange, plum },
+    { bell, cherry, bell, cherry, bell, cherry, bell, orange, bell, cherry, bell, cherry, bell, bar, bell, cherry, bell, cherry, bell, plum },
+    { orange, cherry, orange, plum, orange, bar, orange, plum, orange, bell, orange, cherry, orange, plum, orange, plum, orange, cherry, orange, plum }
+};
+
+/*
+static const char * en2s(int fruit)
+{
+    if (fruit == bar) return "BAR";
+    if (fruit == bell) return "BELL";
+    if (fruit == plum) return "PLUM";
+    if (fruit == orange) return "ORANGE";
+    if (fruit == cherry) return "CHERRY";
+    return "UNKNOWN";
+}
+*/
+
+const char * gamestate_name(enum gamestate s)
+{
+    static const char * names[gamestate_count] = { "waiting", "coin", "handle_down", "handle_up", "spin", "payout" };
+    if (s < gamestate_count) return names[s];
+    return "unknown";
+}
+
+// special draw functions
+static void draw_number(struct image * dst, const struct image * src, int number, unsigned short dst_x, unsigned short dst_y)
+{
+    static char num[12] = "";
+    sprintf(num, "%8d", number);
+    for (int i = 0; i < 8; i ++) {
+        if (num[i] >= '0' && num[i] <= '9') {
+            blit_special(src, 0, 11 * (num[i] - '0'), dst, dst_x, dst_y, src->width, 11, 0, (number < 0 ? 7 : 0));
+        } else if (num[i] == '-') {
+            blit_special(src, 0, 110, dst, dst_x, dst_y, src->width, 11, 0, (number < 0 ? 7 : 0));
+        } else {
+            // white square
+            fill(dst, dst_x, dst_y, 6, 11, 0xFF);
+        }
+        dst_x += 8;
+    }
+}
+
+static void darken_row(struct image * dst, unsigned short x, unsigned short y, unsigned short w, unsigned char amount)
+{
+    unsigned char *p = &dst->data[(size_t)y * dst->stride + x];
+    while (w > 0) {
+        short b = ((*p & 0xC0) >> 6) - (amount >> 1);
+        if (b < 0) b = 0;
+        short g = ((*p & 0x38) >> 3) - amount;
+        if (g < 0) g = 0;
+        short r = (*p & 0x07) - amount;
+        if (r < 0) r = 0;
+        *p = (b << 6) | (g << 3) | r;
+        p ++;
+        w --;
+    }
+}
+
+static void draw_reel(struct image * dst, const struct image * src, short reel_position, unsigned short dst_x, unsigned short dst_y)
+{
+    // reel is 114 pixels high
+    short dst_h = 114;
+    if (reel_position + dst_h > src->height) {
+        // reel won't fit
+        int h = src->height - reel_position;
+        blit_simple(src, 0, reel_position, dst, dst_x, dst_y, src->width, h);
+        blit_simple(src, 0, 0, dst, dst_x, dst_y + h, src->width, dst_h - h);
+    } else {
+        blit_simple(src, 0, reel_position, dst, dst_x, dst_y, src->width, dst_h);
+    }
+
+    // darken top and bottom
+    for (int y = 0; y < 14; y ++) {
+        darken_row(dst, dst_x, dst_y + y, 32, (14 - y) >> 1);
+        darken_row(dst, dst_x, dst_y + dst_h - y - 1, 32, (14 - y) >> 1);
+    }
+}
+
+static void draw_handle(struct image * dst, const struct image * img_background, const struct image * img_handle, const struct image * img_ball, int scale)
+{
+    blit_simple(img_background, 447, 73, dst, 447, 73, 40, img_ball->height + img_handle->height);
+    blit_special(img_ball, 0, 0, dst, 451, 73 + scale, img_ball->height, img_ball->width, 0xFF, 0);
+    blit_scaled(img_handle, 0, 0, img_handle->height, dst, 447, img_ball->height + 73 + scale, img_handle->height - scale, img_handle->width, 0xFF);
+}
+
+static void draw_coin(struct image * dst, const struct assets * a, short coin_y)
+{
+    blit_simple(a->background, 388, 186, dst, 388, 186, 29, 36);
+    blit_special(a->coin, 0, 0, dst, 388, 185 + coin_y, 29, (coin_y < 8 ? 29 : 36 - coin_y), 0xC7, 0);
+    blit_special(a->coinslot, 0, 0, dst, 388, 213, 29, 8, 0xFF, 0);
+}
+
+void game_machine(const struct game * g, struct rect * r)
+{
+    r->x = (g->framebuffer->width - MACHINE_WIDTH) / 2;
+    r->y = (g->framebuffer->height - MACHINE_HEIGHT) / 2;
+    r->w = MACHINE_WIDTH;
+    r->h = MACHINE_HEIGHT;
+}
+
+// the machine's part of a framebuffer, to draw on in the machine's own coordinates
+static void machine_window(const struct game * g, struct image * win)
+{
+    struct rect r;
+    game_machine(g, &r);
+    image_window(win, g->framebuffer, r.x, r.y, r.w, r.h);
+}
+
+// draw the whole machine as it stands - and black all round it, if the framebuffer is bigger
+static void draw_all(struct game * g)
+{
+    const struct assets * a = g->assets;
+    struct image * fb = g->framebuffer, machine;
+    machine_window(g, &machine);
+    if (fb->width > MACHINE_WIDTH || fb->height > MACHINE_HEIGHT)
+        fill(fb, 0, 0, fb->width, fb->height, 0);
+
+    blit_simple(a->background, 0, 0, &machine, 0, 0, a->background->width, a->background->height);
+    draw_handle(&machine, a->background, a->handle, a->ball, g->handle_y);
+    if (g->state == coin) draw_coin(&machine, a, g->coin_y);
+    draw_number(&machine, a->digits, g->plays, 19, 293);
+    draw_number(&machine, a->digits, g->profit, 19, 323);
+    draw_number(&machine, a->digits, g->profit - g->plays, 19, 353);
+
+    for (int i = 0; i < 3; i ++)
+        draw_reel(&machine, a->reels[i], g->reel_position[i], 222 + 50 * i, 67);
+}
+
+// returns a random value in 0 .. 63999
+static int game_random(struct game * g)
+{
+    int rand_result;
+
+    if (g->rng == 0) {
+        //  do this by picking random values from /dev/urandom...
+        FILE * rng = fopen("/dev/urandom", "rb");
+        if (! rng) {
+            perror("Failed to open /dev/urandom");
+            exit(EXIT_FAILURE);
+        }
+        do {
+            unsigned char rngbuf[2];
+            if (fread(rngbuf, 1, 2, rng) != 2) {
+                perror("Failed to read /dev/urandom");
+                exit(EXIT_FAILURE);
+            }
+            rand_result = (rngbuf[0] << 8) | rngbuf[1];
+        } while (rand_result >= 64000);
+        fclose(rng);
+    } else {
+        // ... or from a seeded xorshift64, so a run can be repeated exactly
+        do {
+            g->rng ^= g->rng << 13;
+            g->rng ^= g->rng >> 7;
+            g->rng ^= g->rng << 17;
+            rand_result = g->rng >> 48;
+        } while (rand_result >= 64000);
+    }
+
+    return rand_result;
+}
+
+int load_assets(struct assets * a)
+{
+    // images
+    a->background = read_image("background.bin");
+    a->digits = read_image("digits.bin");
+    a->ball = read_image("ball.bin");
+    a->handle = read_image("handle.bin");
+    a->coin = read_image("coin.bin");
+    a->coinslot = read_image("coinslot.bin");
+    struct image * img_fruit = read_image("fruit.bin");
+
+    if (a->background == NULL || a->digits == NULL || a->ball == NULL || a->handle == NULL ||
+            a->coin == NULL || a->coinslot == NULL || img_fruit == NULL)
+        return 0;
+
+    // build three large reel images
+    for (int i = 0; i < 3; i ++) {
+        struct image * reel = make_image(32, 48 * 20);
+        if (reel == NULL) return 0;
+        for (int k = 0; k < 20; k ++) {
+            blit_simple(img_fruit, 0, 32 * reels[i][k], reel, 0, 48 * k, 32, 32);
+            fill(reel, 0, 48 * k + 32, 32, 16, 0xFF);
+        }
+        a->reels[i] = reel;
+    }
+    free_image(img_fruit);
+
+    return 1;
+}
+
+int game_init(struct game * g, const struct assets * a, int plays, int profit, uint64_t seed,
+              unsigned short width, unsigned short height)
+{
+    g->state = waiting;
+    g->plays = plays;
+    g->profit = profit;
+    g->rng = seed;
+    g->assets = a;
+
+    // reel positions
+    //  the center position is 57 pixels down but then we also have to remove 16px for the top half of the fruit
+    g->reel_stop[0] = g->reel_stop[1] = g->reel_stop[2] = 0;
+    g->reel_position[0] = g->reel_position[1] = g->reel_position[2] = 960 - 57 + 16;
+    g->coin_y = g->handle_y = 0;
+    g->reel_left[0] = g->reel_left[1] = g->reel_left[2] = 0;
+    g->payout_left = 0;
+    g->version = 0;
+    g->epoch = 0;
+
+    // BUILD FRAMEBUFFER
+    g->framebuffer = make_image(width, height);
+    if (g->framebuffer == NULL) return 0;
+
+    // blit
+    draw_all(g);
+
+    return 1;
+}
+
+int game_resize(struct game * g, unsigned short width, unsigned short height)
+{
+    struct image * framebuffer = make_image(width, height);
+    if (framebuffer == NULL) return 0;
+    free_image(g->framebuffer);
+    g->framebuffer = framebuffer;
+    draw_all(g);
+    g->version ++;
+    g->epoch ++;
+    return 1;
+}
+
+void game_set_assets(struct game * g, const struct assets * a)
+{
+    g->assets = a;
+    draw_all(g);
+    g->version ++;
+    g->epoch ++;
+}
+
+void game_redraw(struct game * g)
+{
+    draw_all(g);
+}
+
+void game_rebase(struct game * g, const struct game * base, struct image * framebuffer)
+{
+    const struct assets * a = base->assets;
+    g->assets = a;
+    g->framebuffer = framebuffer;
+    struct image machine;
+    machine_window(g, &machine);
+
+    if (g->handle_y != base->handle_y)
+        draw_handle(&machine, a->background, a->handle, a->ball, g->handle_y);
+    if (g->state == coin)
+        draw_coin(&machine, a, g->coin_y);
+    else if (base->state == coin)
+        blit_simple(a->background, 388, 186, &machine, 388, 186, 29, 36);
+    if (g->plays != base->plays)
+        draw_number(&machine, a->digits, g->plays, 19, 293);
+    if (g->profit != base->profit)
+        draw_number(&machine, a->digits, g->profit, 19, 323);
+    if (g->profit - g->plays != base->profit - base->plays)
+        draw_number(&machine, a->digits, g->profit - g->plays, 19, 353);
+    for (int i = 0; i < 3; i ++) {
+        if (g->reel_position[i] != base->reel_position[i])
+            draw_reel(&machine, a->reels[i], g->reel_position[i], 222 + 50 * i, 67);
+    }
+
+    g->version ++;
+    g->epoch ++;
+}
+
+void game_view(const struct game * g, struct game_view * v)
+{
+    v->state = g->state;
+    v->coin_y = g->coin_y;
+    v->handle_y = g->handle_y;
+    for (int i = 0; i < 3; i ++)
+        v->reel_position[i] = g->reel_position[i];
+    v->plays = g->plays;
+    v->profit = g->profit;
+}
+
+// the parts of the machine game_damage() might find changed
+enum part { part_coin, part_handle, part_reel, part_scoreboard = part_reel + 3 };
+
+// the damaged areas, and (if parts isn't NULL) which part of the machine each one is for
+static unsigned int damage(const struct game * g, const struct game_view * seen, struct rect * out, enum part * parts)
+{
+    unsigned int n = 0;
+    struct rect m;
+    game_machine(g, &m);
+#define DAMAGE(part, rx, ry, rw, rh) { \
+        if (parts != NULL) parts[n] = (part); \
+        out[n ++] = (struct rect) { m.x + (rx), m.y + (ry), rw, rh }; \
+    }
+
+    // coin drop
+    if (seen->coin_y != g->coin_y)
+        DAMAGE(part_coin, 388, 185, 29, 37)
+
+    // handle
+    if (seen->handle_y != g->handle_y) {
+        int skip = (seen->handle_y < g->handle_y ? seen->handle_y : g->handle_y);
+        DAMAGE(part_handle, 447, 73 + skip, 40, 248 - skip)
+    }
+
+    // reels
+    for (int i = 0; i < 3; i ++) {
+        if (seen->reel_position[i] != g->reel_position[i])
+            DAMAGE(part_reel + i, 222 + 50 * i, 67, 32, 114)
+    }
+
+    // scoreboard
+    if (seen->profit - seen->plays != g->profit - g->plays)
+        DAMAGE(part_scoreboard, 19, 353, 63, 11)
+    if (seen->plays != g->plays)
+        DAMAGE(part_scoreboard, 19, 293, 63, 11)
+    if (seen->profit != g->profit)
+        DAMAGE(part_scoreboard, 19, 323, 63, 11)
+
+#undef DAMAGE
+    return n;
+}
+
+unsigned int game_damage(const struct game * g, const struct game_view * seen, struct rect * out)
+{
+    return damage(g, seen, out, NULL);
+}
+
+void game_view_region(const struct game * g, const struct rect * region, struct game_view * seen)
+{
+    struct rect d[GAME_DAMAGE_MAX];
+    enum part parts[GAME_DAMAGE_MAX];
+    const unsigned int n = damage(g, seen, d, parts);
+
+    // the three numbers on the scoreboard are all worked out from plays and profit, so they go
+    //  together: all of them shown, or none
+    int scoreboard = 1;
+    for (unsigned int i = 0; i < n; i ++) {
+        const int inside = (d[i].x >= region->x && d[i].y >= region->y &&
+                            d[i].x + d[i].w <= region->x + region->w && d[i].y + d[i].h <= region->y + region->h);
+        switch (parts[i]) {
+        case part_coin:
+            if (inside) seen->coin_y = g->coin_y;
+            break;
+        case part_handle:
+            if (inside) seen->handle_y = g->handle_y;
+            break;
+        case part_scoreboard:
+            if (! inside) scoreboard = 0;
+            break;
+        default:
+            if (inside) seen->reel_position[parts[i] - part_reel] = g->reel_position[parts[i] - part_reel];
+        }
+    }
+    if (scoreboard) {
+        seen->plays = g->plays;
+        seen->profit = g->profit;
+    }
+    seen->state = g->state;
+}
+
+int game_pull(struct game * g)
+{
+    if (g->state != waiting) return 0;
+
+    g->state = coin;
+    g->coin_y = 0;
+    return 1;
+}
+
+int game_tick(struct game * g)
+{
+    const struct assets * a = g->assets;
+    // (everything is drawn in the machine's own part of the framebuffer)
+    struct image machine;
+    machine_window(g, &machine);
+    struct image * framebuffer = &machine;
+
+    // printf("State %d -> ", g->state);
+    // do game updates now
+    switch(g->state) {
+    case coin:
+        g->coin_y += 2;
+        draw_coin(framebuffer, a, g->coin_y);
+        if (g->coin_y >= 36) {
+            g->plays ++;
+
+            draw_number(framebuffer, a->digits, g->plays, 19, 293);
+            draw_number(framebuffer, a->digits, g->profit - g->plays, 19, 353);
+            g->handle_y = 0;
+            g->state = handle_down;
+        }
+        break;
+    case handle_down:
+        g->handle_y += 10;
+        draw_handle(framebuffer, a->background, a->handle, a->ball, g->handle_y);
+        if (g->handle_y >= 100)
+        {
+            g->handle_y = 100;
+            g->state = handle_up;
+        }
+        break;
+    case handle_up:
+        g->handle_y -= 20;
+        draw_handle(framebuffer, a->background, a->handle, a->ball, g->handle_y);
+        if (g->handle_y <= 0)
+        {
+            g->handle_y = 0;
+
+            // determine three Amounts To Spin - i.e. find the three new Reel Stops
+            //  do this by picking three random values
+            int rand_result = game_random(g);
+
+            // 960 is a full rotation: spin at least once and each subsequent spin must be longer than the previous
+            unsigned short new_rp = rand_result % 20;
+            rand_result /= 20;
+            g->reel_left[0] = (g->reel_stop[0] - new_rp) * 48;
+            while (g->reel_left[0] < 960) g->reel_left[0] += 960;
+            g->reel_stop[0] = new_rp;
+            new_rp = rand_result % 20;
+            rand_result /= 20;
+            g->reel_left[1] = (g->reel_stop[1] - new_rp) * 48;
+            while (g->reel_left[1] <= g->reel_left[0]) g->reel_left[1] += 960;
+            g->reel_stop[1] = new_rp;
+            new_rp = rand_result % 20; // rand_result /= 20;
+            g->reel_left[2] = (g->reel_stop[2] - new_rp) * 48;
+            while (g->reel_left[2] <= g->reel_left[1]) g->reel_left[2] += 960;
+            g->reel_stop[2] = new_rp;
+            g->state = spin;
+        }
+        break;
+    case spin:
+        for (int i = 0; i < 3; i ++) {
+            int amt = (g->reel_left[i] > 21 ? 21 : g->reel_left[i]);
+            if (amt > 0) {
+                g->reel_position[i] -= amt;
+                g->reel_left[i] -= amt;
+                if (g->reel_position[i] < 0) g->reel_position[i] += a->reels[i]->height;
+                const uint64_t trace_start = trace_begin();
+                draw_reel(framebuffer, a->reels[i], g->reel_position[i], 222 + 50 * i, 67);
+                TRACE_END(trace_draw_reel, trace_start, NULL, i, g->reel_position[i]);
+            }
+        }
+
+        if (g->reel_left[0] == 0 && g->reel_left[1] == 0 && g->reel_left[2] == 0)
+        {
+            // determine the payout amounts
+            int r0 = reels[0][g->reel_stop[0]];
+            int r1 = reels[1][g->reel_stop[1]];
+            int r2 = reels[2][g->reel_stop[2]];
+            if (r0 == bar && r1 == bar && r2 == bar) g->payout_left = 100;
+            else if (r0 == bell && r1 == bell && (r2 == bell || r2 == bar)) g->payout_left = 18;
+            else if (r0 == plum && r1 == plum && (r2 == plum || r2 == bar)) g->payout_left = 13;
+            else if (r0 == orange && r1 == orange && (r2 == orange || r2 == bar)) g->payout_left = 11;
+            else if (r0 == cherry && r1 == cherry && r2 == cherry) g->payout_left = 11;
+            else if (r0 == cherry && r1 == cherry) g->payout_left = 5;
+            else if (r0 == cherry) g->payout_left = 3;
+            else g->payout_left = 0;
+
+            //printf("SPIN: %s - %s - %s => %d\n", en2s(r0), en2s(r1), en2s(r2), g->payout_left);
+
+            g->state = payout;
+        }
+
+        break;
+    case payout:
+        if (g->payout_left <= 0) {
+            g->state = waiting;
+            return 1;
+        } else {
+            g->payout_left --;
+            g->profit ++;
+            draw_number(framebuffer, a->digits, g->profit, 19, 323);
+            draw_number(framebuffer, a->digits, g->profit - g->plays, 19, 353);
+        }
+        break;
+    default:
+        return 0;
+    }
+
+    g->version ++;
+    return 0;
+}
@@ -0,0 +1,138 @@
+#ifndef GAME_H_
+#define GAME_H_
+
+// the slot machine itself: game state, economy, and the rendering of the framebuffer
+
+#include "image.h"
+
+#include <stdint.h>
+
+enum fruit {
+    cherry,
+    orange,
+    plum,
+    bell,
+    bar
+};
+
+// gamestate - what the slot machine is currently doing
+enum gamestate {
+    waiting,
+    coin,
+    handle_down,
+    handle_up,
+    spin,
+    payout,
+
+    gamestate_count
+};
+
+// all the sprites needed to draw the machine
+struct assets {
+    const struct image * background;
+    const struct image * digits;
+    const struct image * ball;
+    const struct image * handle;
+    const struct image * coin;
+    const struct image * coinslot;
+    // three large reel strips, assembled from the fruit sprites
+    const struct image * reels[3];
+};
+
+struct game {
+    enum gamestate state;
+
+    // economy
+    int plays;
+    int profit;
+    // which of the 20 stops is each reel on
+    unsigned char reel_stop[3];
+
+    //  actual Y position on the reel
+    short reel_position[3];
+    // temporary usage for screen drawing
+    short coin_y;
+    short handle_y;
+    short reel_left[3];
+    short payout_left;
+
+    // random source: 0 reads /dev/urandom, anything else is the state of a xorshift generator
+    uint64_t rng;
+
+    const struct assets * assets;
+    struct image * framebuffer;
+    // bumped whenever the framebuffer is drawn on
+    unsigned int version;
+    // bumped when all of it is redrawn (new assets), so every client needs a full refresh
+    unsigned int epoch;
+};
+
+// what a viewer has seen of the machine: enough to work out which areas have changed since
+struct game_view {
+    enum gamestate state;
+    short coin_y;
+    short handle_y;
+    short reel_position[3];
+    int plays, profit;
+};
+
+struct rect {
+    uint16_t x, y, w, h;
+};
+
+// the machine's own size (the background's): a bigger framebuffer has it in the middle, on black
+#define MACHINE_WIDTH 512
+#define MACHINE_HEIGHT 384
+// and the biggest framebuffer there can be, either way
+#define FRAMEBUFFER_MAX 8192
+
+// most areas game_damage() comes up with
+#define GAME_DAMAGE_MAX 8
+
+// read all the .bin sprites from disk and build the reel strips (mkassets does this at build time)
+int load_assets(struct assets * a);
+
+// set up a machine and draw its initial framebuffer, width x height (at least the machine's size)
+int game_init(struct game * g, const struct assets * a, int plays, int profit, uint64_t seed,
+              unsigned short width, unsigned short height);
+
+// move a machine onto a new framebuffer of a different size, redrawing everything
+//  returns 0 (leaving it as it was) if there's no memory for it
+int game_resize(struct game * g, unsigned short width, unsigned short height);
+
+// where in its framebuffer the machine is drawn
+void game_machine(const struct game * g, struct rect * r);
+
+// switch to a new set of sprites (of the same sizes), redrawing everything
+void game_set_assets(struct game * g, const struct assets * a);
+
+// draw the whole framebuffer again from the machine's state (filled in from elsewhere, say),
+//  keeping its version
+void game_redraw(struct game * g);
+
+// move a machine onto a framebuffer that already shows base (a copy of one, say), drawing over
+//  just what's different - and onto base's sprites, if they've changed
+//  the old framebuffer is the caller's to get rid of
+void game_rebase(struct game * g, const struct game * base, struct image * framebuffer);
+
+// drop a coin in: starts a pull if the machine is waiting, returns 1 if it did
+int game_pull(struct game * g);
+
+// advance the machine by one animation frame and render it
+//  returns 1 when a pull has just finished (so the stats can be saved)
+int game_tick(struct game * g);
+
+// what a viewer sees of the machine now
+void game_view(const struct game * g, struct game_view * v);
+
+// the areas of the framebuffer that have changed between what a viewer saw and now
+//  returns how many went into out
+unsigned int game_damage(const struct game * g, const struct game_view * seen, struct rect * out);
+
+// what a viewer has seen once it's been shown only region of the framebuffer now: the parts of
+//  the machine whose damage lies wholly inside it are up to date, and the rest stay damaged
+void game_view_region(const struct game * g, const struct rect * region, struct game_view * seen);
+
+const char * gamestate_name(enum gamestate s);
+
+#endif
@@ -0,0 +1,53 @@
+#include "governor.h"
+
+// step up a stage after this many ticks in a row using more than GOVERNOR_HIGH of the budget,
+//  and back down after this many under GOVERNOR_LOW (in thousandths)
+//  - slow to relax, so it doesn't flap between two stages
+#define GOVERNOR_HIGH 900
+#define GOVERNOR_LOW 500
+#define GOVERNOR_ESCALATE 10
+#define GOVERNOR_RECOVER 75
+
+void governor_init(struct governor * g)
+{
+    g->stage = governor_normal;
+    g->load = 0;
+    g->over = g->under = 0;
+    g->changes = 0;
+}
+
+int governor_tick(struct governor * g, long busy_us, long budget_us)
+{
+    if (busy_us < 0) busy_us = 0;
+    unsigned long sample = (unsigned long)busy_us * 1000 / budget_us;
+    if (sample > 4000) sample = 4000;
+    g->load = (7 * g->load + sample) / 8;
+
+    if (g->load > GOVERNOR_HIGH) {
+        g->under = 0;
+        if (++ g->over >= GOVERNOR_ESCALATE && g->stage + 1 < governor_stage_count) {
+            g->stage ++;
+            g->over = 0;
+            g->changes ++;
+            return 1;
+        }
+    } else if (g->load < GOVERNOR_LOW) {
+        g->over = 0;
+        if (++ g->under >= GOVERNOR_RECOVER && g->stage > governor_normal) {
+            g->stage --;
+            g->under = 0;
+            g->changes ++;
+            return 1;
+        }
+    } else {
+        // in between: hold steady
+        g->over = g->under = 0;
+    }
+    return 0;
+}
+
+const char * governor_stage_name(enum governor_stage stage)
+{
+    static const char * const names[governor_stage_count] = { "normal", "cheap encodings", "slow spectators", "refusing connections" };
+    return (stage < governor_stage_count ? names[stage] : "?");
+}
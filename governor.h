@@ -0,0 +1,40 @@
+#ifndef GOVERNOR_H_
+#define GOVERNOR_H_
+
+// Overload governor: watches how much of each tick's budget goes on rendering, encoding and
+//  sending, and when that's too much for too long, sheds load in stages - each one on top of
+//  the last - until things are back under control.  Once the load has stayed low for a while,
+//  it steps back down a stage at a time.
+
+enum governor_stage {
+    // everything as normal
+    governor_normal,
+    // the encoding selector counts CPU time dearly, and stops trying every encoder
+    governor_cheap_encodings,
+    // everyone but the player gets a frame only every few ticks
+    governor_slow_spectators,
+    // new connections are closed as soon as they're accepted
+    governor_refuse,
+
+    governor_stage_count
+};
+
+struct governor {
+    enum governor_stage stage;
+    // smoothed share of the tick budget in use, in thousandths
+    unsigned int load;
+    // ticks in a row spent above the limit, or below the recovery mark
+    unsigned int over, under;
+    // how many times the stage has changed
+    unsigned long changes;
+};
+
+void governor_init(struct governor * g);
+
+// account for a tick that took busy_us (from when it was due to when it was done) out of
+//  budget_us: returns 1 if that changed the stage
+int governor_tick(struct governor * g, long busy_us, long budget_us);
+
+const char * governor_stage_name(enum governor_stage stage);
+
+#endif
@@ -0,0 +1,343 @@
+#include "handoff.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// descriptors per message (the kernel takes at most 253)
+#define HANDOFF_BATCH 250
+
+static const char magic[4] = "VNCH";
+
+void handoff_init(struct handoff * h)
+{
+    h->data = NULL;
+    h->len = h->size = h->pos = 0;
+    h->fds = NULL;
+    h->fd_count = h->fd_size = 0;
+    h->bad = 0;
+}
+
+void handoff_free(struct handoff * h)
+{
+    free(h->data);
+    free(h->fds);
+    handoff_init(h);
+}
+
+void handoff_put(struct handoff * h, const void * data, size_t len)
+{
+    if (h->len + len > h->size) {
+        size_t size = (h->size ? h->size : 4096);
+        while (size < h->len + len) size *= 2;
+        unsigned char * p = realloc(h->data, size);
+        if (p == NULL) {
+            perror("realloc handoff");
+            exit(EXIT_FAILURE);
+        }
+        h->data = p;
+        h->size = size;
+    }
+    memcpy(&h->data[h->len], data, len);
+    h->len += len;
+}
+
+void handoff_put8(struct handoff * h, uint8_t v)
+{
+    handoff_put(h, &v, 1);
+}
+
+void handoff_put16(struct handoff * h, uint16_t v)
+{
+    const unsigned char p[2] = { v >> 8, v };
+    handoff_put(h, p, 2);
+}
+
+void handoff_put32(struct handoff * h, uint32_t v)
+{
+    const unsigned char p[4] = { v >> 24, v >> 16, v >> 8, v };
+    handoff_put(h, p, 4);
+}
+
+void handoff_put64(struct handoff * h, uint64_t v)
+{
+    handoff_put32(h, v >> 32);
+    handoff_put32(h, v);
+}
+
+void handoff_put_fd(struct handoff * h, int fd)
+{
+    if (fd < 0) {
+        handoff_put32(h, UINT32_MAX);
+        return;
+    }
+    if (h->fd_count == h->fd_size) {
+        unsigned int size = (h->fd_size ? h->fd_size * 2 : 64);
+        int * fds = realloc(h->fds, size * sizeof(int));
+        if (fds == NULL) {
+            perror("realloc handoff fds");
+            exit(EXIT_FAILURE);
+        }
+        h->fds = fds;
+        h->fd_size = size;
+    }
+    handoff_put32(h, h->fd_count);
+    h->fds[h->fd_count ++] = fd;
+}
+
+void handoff_get(struct handoff * h, void * data, size_t len)
+{
+    if (h->len - h->pos < len) {
+        memset(data, 0, len);
+        h->pos = h->len;
+        h->bad = 1;
+        return;
+    }
+    memcpy(data, &h->data[h->pos], len);
+    h->pos += len;
+}
+
+uint8_t handoff_get8(struct handoff * h)
+{
+    uint8_t v;
+    handoff_get(h, &v, 1);
+    return v;
+}
+
+uint16_t handoff_get16(struct handoff * h)
+{
+    unsigned char p[2];
+    handoff_get(h, p, 2);
+    return (p[0] << 8) | p[1];
+}
+
+uint32_t handoff_get32(struct handoff * h)
+{
+    unsigned char p[4];
+    handoff_get(h, p, 4);
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+uint64_t handoff_get64(struct handoff * h)
+{
+    uint64_t high = handoff_get32(h);
+    return (high << 32) | handoff_get32(h);
+}
+
+int handoff_get_fd(struct handoff * h)
+{
+    uint32_t index = handoff_get32(h);
+    if (index == UINT32_MAX) return -1;
+    if (index >= h->fd_count) {
+        h->bad = 1;
+        return -1;
+    }
+    return h->fds[index];
+}
+
+static int unix_address(const char * path, struct sockaddr_un * addr)
+{
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "%s: too long for a Unix socket\n", path);
+        return 0;
+    }
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 1;
+}
+
+int handoff_listen(const char * path)
+{
+    struct sockaddr_un addr;
+    if (! unix_address(path, &addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    // whatever the last server left behind - which may be the one just taken over from
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 1)) {
+        perror("bind handoff");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_connect(const char * path)
+{
+    struct sockaddr_un addr;
+    if (! unix_address(path, &addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int write_all(int fd, const void * data, size_t len)
+{
+    const unsigned char * p = data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("handoff send");
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static int read_all(int fd, void * data, size_t len)
+{
+    unsigned char * p = data;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n < 0) perror("handoff recv");
+            else fputs("handoff: the other side hung up\n", stderr);
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+int handoff_send(int fd, const struct handoff * h)
+{
+    struct handoff header;
+    handoff_init(&header);
+    handoff_put(&header, magic, 4);
+    handoff_put32(&header, HANDOFF_VERSION);
+    handoff_put32(&header, h->len);
+    handoff_put32(&header, h->fd_count);
+    int ok = write_all(fd, header.data, header.len);
+    handoff_free(&header);
+
+    for (unsigned int i = 0; ok && i < h->fd_count; i += HANDOFF_BATCH) {
+        const unsigned int count = (h->fd_count - i < HANDOFF_BATCH ? h->fd_count - i : HANDOFF_BATCH);
+        const unsigned char n[4] = { count >> 24, count >> 16, count >> 8, count };
+        struct iovec iov = { (void *)n, 4 };
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))];
+        } control;
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = CMSG_SPACE(count * sizeof(int))
+        };
+        struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &h->fds[i], count * sizeof(int));
+        // (the count is so small it always goes in one piece)
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 4) {
+            perror("handoff sendmsg");
+            ok = 0;
+        }
+    }
+
+    return ok && write_all(fd, h->data, h->len);
+}
+
+int handoff_recv(int fd, struct handoff * h)
+{
+    handoff_init(h);
+
+    unsigned char p[16];
+    if (! read_all(fd, p, 16)) return 0;
+    struct handoff header = { .data = p, .len = 16 };
+    char m[4];
+    handoff_get(&header, m, 4);
+    const uint32_t version = handoff_get32(&header), len = handoff_get32(&header), fd_count = handoff_get32(&header);
+    if (memcmp(m, magic, 4) != 0 || version != HANDOFF_VERSION) {
+        fprintf(stderr, "handoff: expected format %d, got %u\n", HANDOFF_VERSION, (unsigned int)version);
+        return 0;
+    }
+
+    h->fds = malloc((fd_count ? fd_count : 1) * sizeof(int));
+    h->data = malloc(len ? len : 1);
+    if (h->fds == NULL || h->data == NULL) {
+        perror("malloc handoff");
+        exit(EXIT_FAILURE);
+    }
+    h->fd_size = fd_count;
+    h->size = len;
+
+    int ok = 1;
+    while (ok && h->fd_count < fd_count) {
+        unsigned char n[4];
+        struct iovec iov = { n, 4 };
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))];
+        } control;
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf)
+        };
+        ssize_t got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+        if (got != 4) {
+            if (got < 0) perror("handoff recvmsg");
+            else fputs("handoff: short read\n", stderr);
+            ok = 0;
+            break;
+        }
+        const unsigned int count = ((unsigned int)n[0] << 24) | (n[1] << 16) | (n[2] << 8) | n[3];
+        const struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            fputs("handoff: descriptors missing\n", stderr);
+            ok = 0;
+            break;
+        }
+        // whatever else went wrong, the descriptors that did come are ours now: as many as there's
+        //  room for are kept (and closed with the rest if this fails), and any beyond that closed
+        const unsigned int arrived = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const unsigned int room = fd_count - h->fd_count;
+        const unsigned int kept = (arrived < room ? arrived : room);
+        memcpy(&h->fds[h->fd_count], CMSG_DATA(cmsg), kept * sizeof(int));
+        h->fd_count += kept;
+        for (unsigned int i = kept; i < arrived; i ++) {
+            int extra;
+            memcpy(&extra, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            close(extra);
+        }
+        if (arrived != count || count > room || (msg.msg_flags & MSG_CTRUNC)) {
+            fputs("handoff: descriptors missing\n", stderr);
+            ok = 0;
+        }
+    }
+
+    if (ok && read_all(fd, h->data, len)) {
+        h->len = len;
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < h->fd_count; i ++)
+        close(h->fds[i]);
+    handoff_free(h);
+    return 0;
+}
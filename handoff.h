@@ -0,0 +1,65 @@
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+// Zero-downtime upgrades: a running server hands everything it has - its listening sockets,
+//  its clients' sockets, and all it knows about the machines and the clients - to a freshly
+//  started one over a Unix socket, then gets out of the way.  The sockets go across as
+//  SCM_RIGHTS, so no connection ever notices.
+//
+//  The state travels as a flat run of big-endian fields, with the descriptors alongside it
+//  (the fields refer to them by index).  On the wire:
+//   header: "VNCH", format version, length of the state, number of descriptors (u32 each)
+//   descriptors: in batches of up to HANDOFF_BATCH, each a u32 count carrying that many
+//   state: the fields
+//  The new process answers with a single 'K' once it has taken over; until then the old one
+//  can still carry on as it was.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// bumped whenever the fields change, so mismatched versions refuse rather than misread
+#define HANDOFF_VERSION 4
+
+#define HANDOFF_OK 'K'
+
+struct handoff {
+    unsigned char * data;
+    size_t len, size;
+    // where the next get reads from
+    size_t pos;
+    int * fds;
+    unsigned int fd_count, fd_size;
+    // read past the end, or a descriptor that isn't there
+    int bad;
+};
+
+void handoff_init(struct handoff * h);
+// free the buffers (closing none of the descriptors)
+void handoff_free(struct handoff * h);
+
+void handoff_put8(struct handoff * h, uint8_t v);
+void handoff_put16(struct handoff * h, uint16_t v);
+void handoff_put32(struct handoff * h, uint32_t v);
+void handoff_put64(struct handoff * h, uint64_t v);
+void handoff_put(struct handoff * h, const void * data, size_t len);
+// a descriptor, or -1 for none
+void handoff_put_fd(struct handoff * h, int fd);
+
+// reads past the end come back as zeros, and set bad
+uint8_t handoff_get8(struct handoff * h);
+uint16_t handoff_get16(struct handoff * h);
+uint32_t handoff_get32(struct handoff * h);
+uint64_t handoff_get64(struct handoff * h);
+void handoff_get(struct handoff * h, void * data, size_t len);
+int handoff_get_fd(struct handoff * h);
+
+// the old process waits for its successor on a Unix socket at path - returns the fd, or -1
+int handoff_listen(const char * path);
+// the new process connects to it - returns the fd, or -1
+int handoff_connect(const char * path);
+
+// send / receive the lot - return 0 on failure (when any descriptors received are closed again)
+int handoff_send(int fd, const struct handoff * h);
+int handoff_recv(int fd, struct handoff * h);
+
+#endif
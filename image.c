@@ -1,9 +1,22 @@
+#define _GNU_SOURCE
 #include "image.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct image_share {
+    unsigned short width;
+    unsigned short height;
+    // a memfd holding the pixels, and its length (whole pages)
+    int fd;
+    size_t len;
+    // or, without one, the pixels to copy
+    struct image * copy;
+};
 
 struct image * make_image(unsigned short w, unsigned short h)
 {
@@ -15,8 +28,10 @@ struct image * make_image(unsigned short w, unsigned short h)
 
     img->width = w;
     img->height = h;
+    img->stride = w;
+    img->rows = NULL;
 
-    size_t size = w * h;
+    size_t size = (size_t)w * h;
 
     img->data = malloc(size);
     if (img->data == NULL) {
@@ -34,6 +49,94 @@ void free_image(struct image * img)
     free(img);
 }
 
+void image_window(struct image * win, struct image * img, unsigned short x, unsigned short y, unsigned short w, unsigned short h)
+{
+    win->width = w;
+    win->height = h;
+    win->stride = img->stride;
+    win->data = &img->data[(size_t)y * img->stride + x];
+    win->rows = NULL;
+}
+
+struct image_share * share_image(const struct image * src)
+{
+    struct image_share * s = malloc(sizeof(struct image_share));
+    if (s == NULL) {
+        perror("malloc image_share");
+        return NULL;
+    }
+    s->width = src->width;
+    s->height = src->height;
+    s->fd = -1;
+    s->copy = NULL;
+
+    const size_t size = (size_t)src->width * src->height;
+    const size_t page = sysconf(_SC_PAGESIZE);
+    s->len = (size + page - 1) / page * page;
+#ifdef MFD_CLOEXEC
+    s->fd = memfd_create("framebuffer", MFD_CLOEXEC);
+    if (s->fd >= 0 && (ftruncate(s->fd, s->len) != 0 || pwrite(s->fd, src->data, size, 0) != (ssize_t)size)) {
+        perror("framebuffer memfd");
+        close(s->fd);
+        s->fd = -1;
+    }
+#endif
+    if (s->fd < 0) {
+        s->copy = make_image(src->width, src->height);
+        if (s->copy == NULL) {
+            free(s);
+            return NULL;
+        }
+        memcpy(s->copy->data, src->data, size);
+    }
+    return s;
+}
+
+void unshare_image(struct image_share * s)
+{
+    // anything still mapped keeps its pages
+    if (s->fd >= 0) close(s->fd);
+    if (s->copy) free_image(s->copy);
+    free(s);
+}
+
+struct image * map_image(const struct image_share * s)
+{
+    if (s->copy) {
+        struct image * img = make_image(s->width, s->height);
+        if (img != NULL) memcpy(img->data, s->copy->data, (size_t)s->width * s->height);
+        return img;
+    }
+
+    struct image * img = malloc(sizeof(struct image));
+    if (img == NULL) {
+        perror("malloc image");
+        return NULL;
+    }
+    img->width = s->width;
+    img->height = s->height;
+    img->stride = s->width;
+    img->rows = NULL;
+    // MAP_PRIVATE: reads come from the shared pages, until a write gives this mapping its own copy
+    img->data = mmap(NULL, s->len, PROT_READ | PROT_WRITE, MAP_PRIVATE, s->fd, 0);
+    if (img->data == MAP_FAILED) {
+        perror("mmap image");
+        free(img);
+        return NULL;
+    }
+    return img;
+}
+
+void unmap_image(const struct image_share * s, struct image * img)
+{
+    if (s->copy) {
+        free_image(img);
+        return;
+    }
+    munmap(img->data, s->len);
+    free(img);
+}
+
 struct image * read_image(const char * filename)
 {
     // READ IMAGES FROM DISK
@@ -48,11 +151,13 @@ struct image * read_image(const char * filename)
 
     if (fread(buffer, 1, 2, fp) != 2) {
         fprintf(stderr, "fread(%s) width: %d: %s\n", filename, errno, strerror(errno));
+        fclose(fp);
         return NULL;
     }
     unsigned short width = (buffer[0] << 8) | buffer[1];
     if (fread(buffer, 1, 2, fp) != 2) {
         fprintf(stderr, "fread(%s) height: %d: %s\n", filename, errno, strerror(errno));
+        fclose(fp);
         return NULL;
     }
     unsigned short height = (buffer[0] << 8) | buffer[1];
@@ -60,11 +165,14 @@ struct image * read_image(const char * filename)
     struct image * img = make_image(width, height);
     if (img == NULL) {
         fprintf(stderr, "Failed to allocate image reading %s\n", filename);
+        fclose(fp);
         return NULL;
     }
 
     if (fread(img->data, img->width, img->height, fp) != img->height) {
         fprintf(stderr, "fread(%s) data: %d: %s\n", filename, errno, strerror(errno));
+        free_image(img);
+        fclose(fp);
         return NULL;
     }
     fclose(fp);
@@ -76,19 +184,19 @@ struct image * read_image(const char * filename)
 void fill(struct image * dst, unsigned short x, unsigned short y, unsigned short w, unsigned short h, unsigned char color)
 {
     for (int dy = y; dy < y + h; dy ++)
-        memset(&dst->data[dy * dst->width + x], color, w);
+        memset(&dst->data[(size_t)dy * dst->stride + x], color, w);
 }
 
 void blit_simple(const struct image * src, unsigned short src_x, unsigned short src_y,
                  struct image * dst, unsigned short dst_x, unsigned short dst_y,
                  unsigned short w, unsigned short h)
 {
-    int doff = dst_y * dst->width + dst_x;
-    int soff = src_y * src->width + src_x;
+    size_t doff = (size_t)dst_y * dst->stride + dst_x;
+    size_t soff = (size_t)src_y * src->stride + src_x;
     for (int y = 0; y < h; y ++) {
         memcpy(&dst->data[doff], &src->data[soff], w);
-        doff += dst->width;
-        soff += src->width;
+        doff += dst->stride;
+        soff += src->stride;
     }
 }
 
@@ -97,16 +205,16 @@ void blit_special(const struct image * src, unsigned short src_x, unsigned short
                   struct image * dst, unsigned short dst_x, unsigned short dst_y,
                   unsigned short w, unsigned short h, unsigned char transparency, unsigned char tint)
 {
-    int doff = dst_y * dst->width + dst_x;
-    int soff = src_y * src->width + src_x;
+    size_t doff = (size_t)dst_y * dst->stride + dst_x;
+    size_t soff = (size_t)src_y * src->stride + src_x;
     for (int y = 0; y < h; y ++) {
         for (int x = 0; x < w; x ++) {
             if ( ! (transparency && src->data[soff] == transparency)) dst->data[doff] = src->data[soff] | tint;
             doff ++;
             soff ++;
         }
-        doff += (dst->width - w);
-        soff += (src->width - w);
+        doff += (dst->stride - w);
+        soff += (src->stride - w);
     }
 }
 
@@ -118,15 +226,35 @@ void blit_scaled(const struct image * src, unsigned short src_x, unsigned short
 {
     const float row_skip = (float)src_h / dst_h;
 
-    int doff = dst_y * dst->width + dst_x;
+    size_t doff = (size_t)dst_y * dst->stride + dst_x;
     for (int y = 0; y < dst_h; y ++) {
-        int soff = ((int)(y * row_skip + .5) + src_y) * src->width + src_x;
+        size_t soff = (size_t)((int)(y * row_skip + .5) + src_y) * src->stride + src_x;
         for (int x = 0; x < w; x ++) {
             if (src->data[soff] != transparency) dst->data[doff] = src->data[soff];
             doff ++;
             soff ++;
         }
-        doff += (dst->width - w);
+        doff += (dst->stride - w);
     }
 }
 
+void blit_downscale(const struct image * src, struct image * dst, unsigned short factor,
+                    unsigned short x, unsigned short y, unsigned short w, unsigned short h)
+{
+    const unsigned int n = factor * factor;
+    for (int dy = y; dy < y + h; dy ++) {
+        unsigned char * d = &dst->data[(size_t)dy * dst->stride + x];
+        for (int dx = x; dx < x + w; dx ++) {
+            unsigned int r = 0, g = 0, b = 0;
+            for (int j = 0; j < factor; j ++) {
+                const unsigned char * s = image_row(src, dy * factor + j) + dx * factor;
+                for (int i = 0; i < factor; i ++) {
+                    r += s[i] & 0x07;
+                    g += (s[i] >> 3) & 0x07;
+                    b += s[i] >> 6;
+                }
+            }
+            *d ++ = ((r + n / 2) / n) | (((g + n / 2) / n) << 3) | (((b + n / 2) / n) << 6);
+        }
+    }
+}
@@ -3,17 +3,48 @@
 
 // some functions for working with Images
 
+#include <stddef.h>
+
 struct image {
     unsigned short width;
     unsigned short height;
+    // pixels from the start of one row to the next: the width, unless this is a window onto
+    //  a bigger image (see image_window())
+    unsigned short stride;
     unsigned char * data;
+    // where each row starts, for an image whose rows aren't all in one piece (a snapshot - see
+    //  snapshot.h); or NULL, when row y is at data + y * width
+    const unsigned char * const * rows;
 };
 
+// the start of row y - all that anything reading a snapshot may use
+static inline const unsigned char * image_row(const struct image * img, unsigned int y)
+{
+    return img->rows ? img->rows[y] : &img->data[(size_t)y * img->stride];
+}
+
 struct image * make_image(unsigned short w, unsigned short h);
 void free_image(struct image * img);
 
+// point win at the area x, y, w, h of img: drawing on one draws on the other
+//  (win owns nothing - it's just good while img is)
+void image_window(struct image * win, struct image * img, unsigned short x, unsigned short y, unsigned short w, unsigned short h);
+
 struct image * read_image(const char * filename);
 
+// Copy-on-write images: an image's pixels put where any number of copies can map them privately.
+//  A copy costs next to nothing until it's drawn on, and then only the pages it touches (tiles of
+//  eight rows, at 512 wide) get copied - the rest stay shared with everyone else's.
+//  (Without memfd, each copy is a plain copy.)
+struct image_share;
+
+struct image_share * share_image(const struct image * src);
+void unshare_image(struct image_share * s);
+
+// a copy of the shared image, and how to get rid of it (NULL if it can't be mapped)
+struct image * map_image(const struct image_share * s);
+void unmap_image(const struct image_share * s, struct image * img);
+
 void fill(struct image * dst, unsigned short x, unsigned short y, unsigned short w, unsigned short h, unsigned char color);
 
 void blit_simple(const struct image * src, unsigned short src_x, unsigned short src_y,
@@ -30,4 +61,9 @@ void blit_scaled(const struct image * src, unsigned short src_x, unsigned short
                  struct image * dst, unsigned short dst_x, unsigned short dst_y, unsigned short dst_h,
                  unsigned short w, unsigned char transparency);
 
+// shrink src by factor into the area x, y, w, h of dst (in dst's pixels): each pixel is the
+//  average of the factor x factor block of src it stands for, channel by channel (BGR233)
+void blit_downscale(const struct image * src, struct image * dst, unsigned short factor,
+                    unsigned short x, unsigned short y, unsigned short w, unsigned short h);
+
 #endif
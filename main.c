@@ -3,93 +3,193 @@
 */
 
 #include "image.h"
+#include "game.h"
+#include "record.h"
+#include "encode.h"
+#include "cache.h"
+#include "snapshot.h"
+#include "shadow.h"
+#include "outq.h"
+#include "net.h"
+#include "pack.h"
+#include "builtin.h"
+#include "metrics.h"
+#include "trace.h"
+#include "governor.h"
+#include "timer.h"
+#include "cluster.h"
+#include "handoff.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/time.h>
+#include <time.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
 
-#define PORT "5900"   // port we're listening on
+#define PORT "5900"   // port we're listening on, unless told otherwise
 
 #define INTERVAL (1000000 / 25)
 
+// (relay mode) ms between attempts to reach the authority
+#define RECONNECT_INTERVAL 1000
+
+// ms a handoff waits for every client's output to drain before dropping those still behind,
+//  and then for the new process to say it has taken over
+#define HANDOFF_DRAIN 3000
+#define HANDOFF_ANSWER 10000
+
+// most network events handled per wait
+#define MAX_EVENTS 64
+
+// most listen sockets (one per address family, in practice)
+#define MAX_LISTENERS 8
+// connections the kernel holds for us before it starts dropping SYNs (it caps this at somaxconn)
+#define DEFAULT_BACKLOG 1024
+
 // /////////////////////////////////
 // types
-enum fruit {
-    cherry,
-    orange,
-    plum,
-    bell,
-    bar
+// Fence message flags
+enum fence_flags {
+    fence_BlockBefore = 1,
+    fence_BlockAfter = 2,
+    fence_SyncNext = 4,
+    fence_Request = 0x80000000
 };
 
-enum encoding {
-    Raw = 0,
-    CopyRect = 1,
-    RRE = 2,
-    HexTile = 4,
-    TRLE = 8,
-    ZRLE = 16,
-    Cursor = 32
-};
+// while a continuous-updates client has more than this in flight (or a couple of round-trips' worth
+//  at its measured bandwidth, if that's larger), it skips ticks rather than piling up a backlog
+#define FLIGHT_WINDOW 65536
+
+// frame pacing: a client with more than this still on its way only gets a frame if its link will
+//  have drained enough to take it by the next tick (see pace_open)
+#define PACE_FLOOR 32768
+
+// a client that hasn't finished the handshake this long (ms) after connecting is dropped
+#define HANDSHAKE_TIMEOUT 10000
+// after this long without a word from a client, check it's still there - and drop it if that
+//  gets no answer within KEEPALIVE_GRACE
+#define IDLE_TIMEOUT 60000
+#define KEEPALIVE_GRACE 15000
+
+// while the governor has spectators slowed, they get one frame in this many ticks
+#define SPECTATOR_TICKS 3
+
+// with --zerocopy, sends at least this big go out with MSG_ZEROCOPY
+//  (below it, pinning the pages costs more than the copy it saves)
+#define ZEROCOPY_MIN 65536
+
+// a send that takes longer than this (the socket buffer was full) counts as a stall
+#define STALL_NS 1000000
 
 // GLOBALS
-// gamestate - what the slot machine is currently doing
-enum {
-    waiting,
-    coin,
-    handle_down,
-    handle_up,
-    spin,
-    payout
-} gamestate;
-
-// economy
-int plays;
-int profit;
-// which of the 20 stops is each reel on
-unsigned char reel_stop[3];
-
-// GRAPHICS -
-static struct image * framebuffer;
-static uint16_t * palette[3];
-//  actual Y position on the reel
-short reel_position[3];
-// temporary usage for screen drawing
-short coin_y;
-short handle_y;
-short reel_left[3];
-short payout_left;
-
-// a slightly cooked pixel format, where the _max is converted to a _div
-struct pixel_format {
-    uint8_t bpp;
-//    uint8_t depth;
-    uint8_t big_endian_flag;
-    uint8_t true_color_flag;
-    uint16_t red_div;
-    uint16_t green_div;
-    uint16_t blue_div;
-    uint8_t red_shift;
-    uint8_t green_shift;
-    uint8_t blue_shift;
+// a slot machine, and who's at it: they all share the same sprites, but each has its own
+//  state and framebuffer
+struct room {
+    struct game game;
+    // what the encoders read: the framebuffer as of the last frame anyone was sent (see snapshot.h)
+    struct snapshot * snapshot;
+    // the framebuffer shrunk for scaled sessions, by each factor one has asked for (see shadow.h)
+    struct shadow * shadows[SHADOW_SCALE_MAX + 1];
+    // its number, or -1 for a client's private machine
+    int id;
+    // clients placed here
+    unsigned int clients;
+    // whoever started the current pull - everyone else is a spectator
+    const struct client * player;
+    // while it's mid-pull, it's on the running list: the pointer to it there, and the next one
+    struct room ** running_link;
+    struct room * next_running;
 };
 
-// LINKED LISTS for network sockets
-struct listener {
-    int fd;
-    struct listener * next;
+// the shared machines
+static struct room * rooms;
+static unsigned int room_count;
+// every machine in the middle of a pull (shared or private), all ticked together
+static struct room * running;
+static unsigned int rooms_running;
+
+// with --private, each client gets a machine of its own: a copy of this one, whose framebuffer
+//  they all share copy-on-write
+static int private_rooms;
+static struct game private_base;
+static struct snapshot * private_snapshot;
+static struct image_share * private_share;
+static unsigned int private_count;
+//  the next one's seed (or 0 for /dev/urandom), and the takings of those that have closed
+static uint64_t private_seed;
+static long private_plays, private_profit;
+
+// set by SIGUSR1: print the per-client link statistics and encoder counters
+static volatile sig_atomic_t dump_requested;
+// set by SIGUSR2: start recording a trace, or write it out
+static volatile sig_atomic_t trace_requested;
+
+// the event loop, and when the next animation frame is due
+static struct net net;
+static struct timeval tv_next;
+
+// sheds load when ticks run over budget
+static struct governor governor;
+
+// per-client deadlines
+static struct timer_wheel timers;
+enum {
+    timer_deadline,
+    timer_pace,
+    // (relay mode) time to try the authority again
+    timer_reconnect
 };
 
+// the sockets we listen on, besides the clients': viewers (one per address family), metrics
+//  scrapes, and the new process taking over
+static int listen_fds[MAX_LISTENERS];
+static unsigned int listeners;
+static int metrics_fd = -1;
+static int handoff_fd = -1;
+//  while handing off, the new process, and when it turned up
+static int successor_fd = -1;
+static uint64_t handoff_started;
+
+// cluster mode (see cluster.h): as the authority, where relays subscribe; as a relay, the
+//  authority this mirrors, its stream, and what's on its way there
+static int cluster_fd = -1;
+static const char * upstream_address;
+static int upstream_fd = -1;
+static struct cluster_reader upstream;
+static struct outq upstream_out;
+static struct timer reconnect;
+//  the context of the upstream connection in the event loop
+static char upstream_conn;
+
+// LINKED LIST of clients
 struct client {
     int fd;
     struct client * next;
+    // the machine it's watching (and maybe playing)
+    struct room * room;
+    // the pointer to this client (the list head, or the previous one's next), so it can be
+    //  unlinked without a walk - and the next one dropped, until they're swept up
+    struct client ** link;
+    struct client * next_dropped;
+
+    // handshake, idle and keepalive deadlines (depending on the state), and when a client
+    //  held back by its link can next take a frame
+    struct timer deadline;
+    struct timer pace;
+    // when we last heard from it (ms), and whether it's been asked if it's still there
+    uint64_t last_input;
+    uint8_t probing;
 
     enum {
         none = 0,
@@ -108,20 +208,41 @@ struct client {
         client_message_keyevent,
         client_message_pointerevent,
         client_message_clientcuttext_0,
-        client_message_clientcuttext_n
+        client_message_clientcuttext_n,
+        client_message_enablecontinuousupdates,
+        client_message_fence_0,
+        client_message_fence_n,
+        client_message_setdesktopsize_0,
+        client_message_setdesktopsize_n,
+
+        // not a viewer at all, but a relay, taking the frame stream (and sending pulls back)
+        relay_feed
     } state;
 
     // data read from the TCP socket
+    //  (big enough for a Fence with its largest payload)
     unsigned int read, needed, extra;
-    unsigned char buffer[20];
+    unsigned char buffer[76];
+    // what's waiting to go out, as references to shared segments
+    struct outq out;
+    // MSG_ZEROCOPY threshold for this socket, or 0 if it's not using it
+    size_t zerocopy_min;
     // statistics
     unsigned int bytes_sent;
+    // session capture, if --record is on
+    struct recorder * rec;
+    // the room's epoch as of the last update: if it's moved on, everything needs redrawing
+    unsigned int epoch;
 
     // client state
     struct pixel_format format;
+    // the framebuffer size it knows of: from the ServerInit, or the last DesktopSize it was sent
+    uint16_t width, height;
+    // a scaled session sees the framebuffer shrunk by this much (1 for the real thing)
+    uint8_t scale;
 
     // bit field of encodings supported
-    uint8_t encodings;
+    uint16_t encodings;
 
     // key-down status
     uint8_t key_down;
@@ -130,856 +251,2594 @@ struct client {
 
     // ready for update?
     uint8_t ready;
+    //  ...of this area: the incremental requests outstanding, all in one (changes anywhere else
+    //  wait until they're asked for)
+    struct rect requested;
+
+    // ContinuousUpdates: push an update of this area every tick, without waiting for a request
+    uint8_t continuous;
+    uint8_t sent_end_of_cu;
+    uint16_t cu_x, cu_y, cu_w, cu_h;
+
+    // Fence round-trips, for flow control and the link estimates
+    uint8_t fence_pending;
+    uint32_t fence_id;
+    struct timeval fence_sent, fence_acked;
+    //  bytes_sent when the outstanding fence was sent, and when the last one came back
+    unsigned int fence_bytes, acked_bytes;
+    // smoothed round-trip time in usec, and delivery rate in bytes/sec
+    unsigned int rtt;
+    unsigned int bandwidth;
+
+    // frame pacing: bytes delivered (sent, less what's still on its way) and the backlog at the
+    //  last sample, and when that was
+    unsigned int delivered;
+    size_t backlog;
+    struct timeval pace_sampled;
+    //  smoothed rate the backlog drains at, in bytes/sec
+    unsigned int drain_rate;
+    // the game version as of the last update, when the last frame went out, the smoothed time
+    //  between frames in usec, and how many ticks it had to sit out
+    unsigned int version;
+    struct timeval last_frame;
+    unsigned int frame_interval;
+    unsigned long frame_skips;
 
     // some indicators of Last Time Things Happened, which tells us when they need a Rectangle update
     unsigned char sent_cursor;
     unsigned char sent_palette;
-    short coin_y;
-    short handle_y;
-    short reel_position[3];
-    int plays, profit;
+    struct game_view seen;
+};
+
+// for the trace: client->state as a string
+static const char * const client_state_names[] = {
+    "none", "protocolversion", "security", "securityresult", "init",
+    "message", "setpixelformat", "setencodings", "setencodings", "framebufferupdaterequest", "keyevent",
+    "pointerevent", "clientcuttext", "clientcuttext", "enablecontinuousupdates", "fence", "fence",
+    "setdesktopsize", "setdesktopsize", "relay"
 };
 
 // /////////////////////////////////
 // Helper functions
 
-static unsigned char * encode_pixel(unsigned char * p, const struct pixel_format * f, const uint8_t color)
-{
-    uint32_t pixel = ((palette[0][color] / f->red_div) << f->red_shift) |
-                     ((palette[1][color] / f->green_div) << f->green_shift) |
-                     ((palette[2][color] / f->blue_div) << f->blue_shift);
-
-    if (f->bpp == 8) {
-        *p = (pixel & 0xFF);
-        p ++;
-    } else if (f->bpp == 16) {
-        if (f->big_endian_flag) {
-            *p = (pixel & 0xFF00) >> 8;
-            p ++;
-            *p = (pixel & 0xFF);
-            p ++;
-        } else {
-            *p = (pixel & 0xFF);
-            p ++;
-            *p = (pixel & 0xFF00) >> 8;
-            p ++;
-        }
-    } else {
-        if (f->big_endian_flag) {
-            *p = (pixel & 0xFF000000) >> 24;
-            p ++;
-            *p = (pixel & 0xFF0000) >> 16;
-            p ++;
-            *p = (pixel & 0xFF00) >> 8;
-            p ++;
-            *p = (pixel & 0xFF);
-            p ++;
-        } else {
-            *p = (pixel & 0xFF);
-            p ++;
-            *p = (pixel & 0xFF00) >> 8;
-            p ++;
-            *p = (pixel & 0xFF0000) >> 16;
-            p ++;
-            *p = (pixel & 0xFF000000) >> 24;
-            p ++;
-        }
-    }
-    return p;
+// Bytes have left for a client: keep the statistics and session capture up to date.
+static void client_sent(void * ctx, const unsigned char * data, size_t len)
+{
+    struct client * c = ctx;
+    c->bytes_sent += len;
+    if (c->rec) record_out(c->rec, data, len);
 }
 
-static unsigned char * encode_hextile(unsigned char * p, struct pixel_format * f, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+// Send everything queued for a client (or, with io_uring, have it go out with the next wait).
+//  flags are passed on to sendmsg() - e.g. MSG_MORE when another part of the message follows right away
+static int client_flush(struct client * c, int flags)
 {
-    // some enums
-    enum {
-        H_None = 0,
-        H_Raw = 1,
-        H_BGSpec = 2,
-        H_FGSpec = 4,
-        H_AnySub = 8,
-        H_SubColor = 16
-    };
+    const uint64_t trace_start = trace_begin();
+    const size_t queued = c->out.bytes;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int ok = net_send(&net, c->fd, &c->out, flags, c->zerocopy_min, client_sent, c);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    TRACE_END(trace_send, trace_start, NULL, c->fd, queued - c->out.bytes);
+
+    // it blocked, or couldn't all go
+    if (c->out.count || (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec) > STALL_NS)
+        METRIC_ADD(metrics_local()->send_stalls, 1);
+    return ok;
+}
 
-    short background = -1;
-    short foreground = -1;
-
-    // we break the area into 16x16 tiles and analyze them
-    while (h > 0) {
-        int th = h > 16 ? 16 : h;
-
-        int dx = x;
-        int w_left = w;
-        while (w_left > 0) {
-            int tw = w_left > 16 ? 16 : w_left;
-
-            // histogram of the colors
-            // for 8bpp we can use pigeonhole
-            unsigned short colors[256] = { 0 };
-            for (int j = 0; j < th; j ++)
-                for (int i = 0; i < tw; i ++)
-                    colors[framebuffer->data[(y + j) * 512 + dx + i]] ++;
-
-            short newbg = -1;
-            short newfg = -1;
-            unsigned short color_count = 0;
-            for (int i = 0; i < 256; i ++) {
-                if (colors[i] > 0) {
-                    color_count ++;
-                    if (newbg < 0 || colors[i] > colors[newbg]) {
-                        newfg = newbg;
-                        newbg = i;
-                    } else if (newfg < 0 || colors[i] > colors[newfg]) {
-                        newfg = i;
-                    }
-                }
-            }
+// Send some bytes of our own to a client.
+static int client_send(struct client * c, const void * buf, size_t len)
+{
+    outq_push_copy(&c->out, buf, len);
+    return client_flush(c, 0);
+}
 
+// Queue some bytes of our own, to go with whatever comes next - at the latest, once the client's
+//  input has all been handled (client_input).
+static void client_queue(struct client * c, const void * buf, size_t len)
+{
+    outq_push_copy(&c->out, buf, len);
+}
 
-            // log this.  if we do the work and find this is more expensive than raw encoding the whole tile,
-            //  backtrack to this point and do raw.
-            unsigned char * tile_start = p;
-
-            // ok!  we have determined a count of how many colors are in the tile,
-            // the most common (newbg) and the second-most-common (newfg)
-
-            if (color_count == 1) {
-                // solid colored tile
-                if (newbg == background) {
-                    // can carry over color from before
-                    *p = H_None;
-                    p ++;
-                } else {
-                    *p = H_BGSpec;
-                    p ++;
-                    p = encode_pixel(p, f, newbg);
-                    background = newbg;
-                }
-            } else {
-                if (color_count == 2) {
-                    // two-tone tile
-                    if (newbg == background && newfg == foreground) {
-                        *p = H_AnySub;
-                        p ++;
-                    } else if (newbg != background && newfg == foreground) {
-                        *p = H_AnySub | H_BGSpec;
-                        p ++;
-                        p = encode_pixel(p, f, newbg);
-                        background = newbg;
-                    } else if (newbg == background && newfg != foreground) {
-                        *p = H_AnySub | H_FGSpec;
-                        p ++;
-                        p = encode_pixel(p, f, newfg);
-                        foreground = newfg;
-                    } else {
-                        *p = H_AnySub | H_FGSpec | H_BGSpec;
-                        p ++;
-                        p = encode_pixel(p, f, newbg);
-                        background = newbg;
-                        p = encode_pixel(p, f, newfg);
-                        foreground = newfg;
-                    }
-                }  else {
-                    if (newbg == background) {
-                        // can carry over color from before
-                        *p = H_AnySub | H_SubColor;
-                        p ++;
-                    } else {
-                        *p = H_AnySub | H_SubColor | H_BGSpec;
-                        p ++;
-                        p = encode_pixel(p, f, newbg);
-                        background = newbg;
-                    }
-                    foreground = -1;
-                }
+static long usec_between(const struct timeval * start, const struct timeval * end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_usec - start->tv_usec);
+}
 
-                unsigned char * rect_count = p;
-                p ++;
-                *rect_count = 0;
-
-                // at last do RRE on the tile
-                unsigned char coverage[16][16] = { 0 };
-                for (int j = 0; j < th; j ++) {
-                    for (int i = 0; i < tw; i ++) {
-                        // square already "covered", skip
-                        if (coverage[j][i]) continue;
-
-                        // mark it now
-                        coverage[j][i] = 1;
-
-                        // check for background-color
-                        unsigned char color = framebuffer->data[(y + j) * 512 + dx + i];
-
-                        if (color == background) continue;
-
-                        // an uncovered, new color.
-                        *rect_count += 1;
-
-                        //  try to expand our ending box as far right as we can
-                        int i2 = i + 1;
-                        while (i2 < tw && framebuffer->data[(y + j) * 512 + dx + i2] == color)
-                        {
-                            coverage[j][i2] = 1;
-                            i2 ++;
-                        }
-
-                        // and now a check to see how tall we can make the box
-                        int j2 = j + 1;
-                        while (j2 < th) {
-                            unsigned char full_row = 1;
-
-                            // check the row first
-                            for (int q = i; q < i2; q ++) {
-                                if (color != framebuffer->data[(y + j2) * 512 + dx + q]) {
-                                    full_row = 0;
-                                    break;
-                                }
-                            }
-                            if (! full_row) break;
-
-                            // mark the row now
-                            for (int q = i; q < i2; q ++)
-                                coverage[j2][q] = 1;
-                            j2 ++;
-                        }
-
-                        // ok we have everything we need!  send the rectangle
-                        if (color_count > 2) p = encode_pixel(p, f, color);
-                        *p = ((i & 0xF) << 4) | (j & 0xF);
-                        p ++;
-                        *p = (((i2 - i - 1) & 0xF) << 4) | ((j2 - j - 1) & 0xF);
-                        p ++;
-                    }
-                }
-            }
+// Fence message: either our own request, or the reply to one of theirs
+static int send_fence(struct client * c, uint32_t flags, const unsigned char * payload, uint8_t length)
+{
+    unsigned char msg[9 + 64];
+    msg[0] = 248;
+    msg[1] = msg[2] = msg[3] = 0;
+    *(uint32_t *)(&msg[4]) = htonl(flags);
+    msg[8] = length;
+    memcpy(&msg[9], payload, length);
+    return client_send(c, msg, 9 + length);
+}
 
-            // RAW ENCODE THE TILE
-            if (p - tile_start > tw * th * f->bpp / 8) {
-                p = tile_start;
-                *p = 1;
-                p ++;
-                for (int j = 0; j < th; j ++)
-                    for (int i = 0; i < tw; i ++)
-                        p = encode_pixel(p, f, framebuffer->data[(y + j) * 512 + dx + i]);
-                background = foreground = -1;
-            }
+// Start a round-trip measurement, once the previous one has come back.
+static int request_fence(struct client * c)
+{
+    if (! (c->encodings & Fence) || c->fence_pending) return 1;
+
+    c->fence_id ++;
+    uint32_t id = htonl(c->fence_id);
+    gettimeofday(&c->fence_sent, NULL);
+    c->fence_bytes = c->bytes_sent;
+    c->fence_pending = 1;
+    // BlockBefore: the client answers only once it has handled everything we sent before
+    return send_fence(c, fence_Request | fence_BlockBefore, (const unsigned char *)&id, 4);
+}
 
-            //printf("%2x ", *tile_start);
-            dx += tw;
-            w_left -= tw;
-        }
-        //printf("\n");
-        y += th;
-        h -= th;
+// The client answered our fence: everything sent before it has been delivered.
+static void fence_reply(struct client * c, const unsigned char * payload, uint8_t length)
+{
+    uint32_t id;
+    if (! c->fence_pending || length != 4) return;
+    memcpy(&id, payload, 4);
+    if (ntohl(id) != c->fence_id) return;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    long sample = usec_between(&c->fence_sent, &now);
+    c->rtt = (c->rtt ? (7 * c->rtt + sample) / 8 : sample);
+
+    // delivery rate since the previous reply
+    long interval = usec_between(&c->fence_acked, &now);
+    if (c->acked_bytes && interval > 0) {
+        unsigned int rate = (unsigned long long)(c->fence_bytes - c->acked_bytes) * 1000000 / interval;
+        c->bandwidth = (c->bandwidth ? (7ULL * c->bandwidth + rate) / 8 : rate);
     }
 
-    return p;
+    c->acked_bytes = c->fence_bytes;
+    c->fence_acked = now;
+    c->fence_pending = 0;
 }
-static unsigned char * encode_rre(unsigned char * p, struct pixel_format * f, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
-{
-    // we need this to go update the subrectangle count later
-    unsigned char * start = p;
-    p += 4;
 
-    unsigned int subrects = 0;
-
-    // find background color
-    //  this is a histogram across the region, tracking each pixel and its frequency
-    // for 8bpp we can use pigeonhole
+// Is there room on the link for a pushed update?
+static int flight_window_open(const struct client * c)
+{
+    unsigned int window = FLIGHT_WINDOW;
+    unsigned long long bdp = (unsigned long long)c->bandwidth * c->rtt * 2 / 1000000;
+    if (bdp > window) window = bdp;
 
-    unsigned char max_color = 0;
-    unsigned int colors[256] = { 0 };
-    for (int src_y = y; src_y < y + h; src_y ++) {
-        int i = src_y * 512;
-        for (int src_x = x; src_x < x + w; src_x ++) {
+    // without fences there's no way to tell how much is in flight
+    if (! (c->encodings & Fence)) return 1;
+    return c->bytes_sent - c->acked_bytes <= window;
+}
 
-            unsigned char color = framebuffer->data[i + src_x];
-            colors[color] ++;
-            if (colors[color] > colors[max_color])
-                max_color = color;
-        }
-    }
+// Round-trip time in usec: from the fences if there are any, or else what TCP makes of it.
+static unsigned int link_rtt(const struct client * c)
+{
+    if (c->rtt) return c->rtt;
+#ifdef TCP_INFO
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(c->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) return info.tcpi_rtt;
+#endif
+    return 0;
+}
 
-    p = encode_pixel(p, f, max_color);
+// The most a client's backlog can be and still take a frame: what its link drains by the next tick.
+static size_t pace_budget(const struct client * c)
+{
+    const unsigned long long budget = (unsigned long long)c->drain_rate * (link_rtt(c) + INTERVAL) / 1000000;
+    return (budget > PACE_FLOOR ? budget : PACE_FLOOR);
+}
 
-    // now we calloc a region and then walk it trying to build RRE blocks and send them
-    unsigned char * coverage = calloc(h, w);
-    if (coverage == NULL) {
-        perror("calloc coverage");
-        exit(EXIT_FAILURE);
+// Measure how fast a client's backlog drains, and say whether it can take a frame this tick:
+//  only if what's already on its way will be gone by the next tick (give or take a round trip).
+//  A client that can't sits the tick out, and its next update is diffed against the last state
+//  it saw - so it catches up with the latest frame in one go, rather than a queue of stale ones.
+static int pace_open(struct client * c, const struct timeval * now)
+{
+    const size_t in_transit = net_backlog(&net, c->fd);
+    const size_t backlog = c->out.bytes + in_transit;
+    const unsigned int delivered = c->bytes_sent - in_transit;
+
+    long interval = usec_between(&c->pace_sampled, now);
+    if (timerisset(&c->pace_sampled) && interval > 0 && c->backlog > 0) {
+        unsigned int rate = (unsigned long long)(delivered - c->delivered) * 1000000 / interval;
+        // the link was busy all along only if there's still a backlog - if it ran dry, the rate
+        //  it managed is just a lower bound
+        if (backlog > 0 || rate > c->drain_rate)
+            c->drain_rate = (c->drain_rate ? (7ULL * c->drain_rate + rate) / 8 : rate);
     }
+    c->delivered = delivered;
+    c->backlog = backlog;
+    c->pace_sampled = *now;
 
-    for (int src_y = 0; src_y < h; src_y ++) {
-        int i = (y + src_y) * 512;
-        int j = src_y * w;
-        for (int src_x = 0; src_x < w; src_x ++) {
-            // square already "covered", skip
-            if (coverage[j + src_x]) continue;
-
-            // mark it now
-            coverage[j + src_x] = 1;
+    return backlog <= pace_budget(c);
+}
 
-            // check for background-color
-            unsigned char color = framebuffer->data[i + x + src_x];
-            if (color == max_color) continue;
+// A client pace_open() held back: have its pace timer go off about when the link will have
+//  drained enough, so it gets the frame then instead of waiting for a tick that may never come.
+static void pace_arm(struct client * c)
+{
+    const size_t budget = pace_budget(c);
+    unsigned long long ms = INTERVAL / 1000;
+    if (c->drain_rate && c->backlog > budget)
+        ms = (unsigned long long)(c->backlog - budget) * 1000 / c->drain_rate;
+    if (ms < 1) ms = 1;
+    if (ms > INTERVAL / 1000) ms = INTERVAL / 1000;
+    timer_set(&timers, &c->pace, timer_now() + ms);
+}
 
-            // an uncovered, new color.
-            subrects ++;
+// A frame went out: keep the frame rate up to date.
+static void count_frame(struct client * c)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (timerisset(&c->last_frame)) {
+        long sample = usec_between(&c->last_frame, &now);
+        c->frame_interval = (c->frame_interval ? (7 * c->frame_interval + sample) / 8 : sample);
+    }
+    c->last_frame = now;
+}
 
-            //  try to expand our ending box as far right as we can
-            int src_x2 = src_x + 1;
-            while (src_x2 < w && framebuffer->data[i + x + src_x2] == color)
-            {
-                coverage[j + src_x2] = 1;
-                src_x2 ++;
-            }
+// Frames per second a client is actually getting - falling away once they stop coming.
+static double client_fps(const struct client * c, const struct timeval * now)
+{
+    if (! timerisset(&c->last_frame)) return 0;
+    long interval = usec_between(&c->last_frame, now);
+    if (interval < (long)c->frame_interval) interval = c->frame_interval;
+    return (interval > 0 ? 1e6 / interval : 0);
+}
 
-            // and now a check to see how tall we can make the box
-            int src_y2 = src_y + 1;
-            while (src_y2 < h) {
-                int k = (y + src_y2) * 512;
-                unsigned char full_row = 1;
-                // check the row first
-                for (int l = src_x; l < src_x2; l ++) {
-                    if (color != framebuffer->data[l + x + k]) {
-                        full_row = 0;
-                        break;
-                    }
-                }
-                if (! full_row) break;
-                // mark the row now
-                k = src_y2 * w;
-                for (int l = src_x; l < src_x2; l ++)
-                    coverage[k + l] = 1;
-                src_y2 ++;
-            }
+// The room for a new client: whichever has the fewest in it (the first of them, on a tie).
+static struct room * room_place(void)
+{
+    struct room * best = &rooms[0];
+    for (unsigned int i = 1; i < room_count; i ++)
+        if (rooms[i].clients < best->clients) best = &rooms[i];
+    return best;
+}
 
-            // ok we have everything we need!  send the rectangle
-            p = encode_pixel(p, f, color);
-            *p = src_x / 256;
-            p ++;
-            *p = src_x % 256;
-            p ++;
-            *p = src_y / 256;
-            p ++;
-            *p = src_y % 256;
-            p ++;
-            *p = (src_x2 - src_x) / 256;
-            p ++;
-            *p = (src_x2 - src_x) % 256;
-            p ++;
-            *p = (src_y2 - src_y) / 256;
-            p ++;
-            *p = (src_y2 - src_y) % 256;
-            p ++;
-        }
+// A private machine for a new client, starting out as a fresh copy of private_base.
+static struct room * room_private(void)
+{
+    struct room * r = malloc(sizeof(struct room));
+    if (r == NULL) {
+        perror("malloc room");
+        return NULL;
     }
-    *start = (subrects & 0xFF000000) >> 24;
-    start ++;
-    *start = (subrects & 0xFF0000) >> 16;
-    start ++;
-    *start = (subrects & 0xFF00) >> 8;
-    start ++;
-    *start = subrects & 0xFF;
+    r->game = private_base;
+    r->game.framebuffer = map_image(private_share);
+    if (r->game.framebuffer == NULL) {
+        free(r);
+        return NULL;
+    }
+    if (private_seed) r->game.rng = private_seed ++;
+    r->snapshot = NULL;
+    for (int i = 0; i <= SHADOW_SCALE_MAX; i ++)
+        r->shadows[i] = NULL;
+    r->id = -1;
+    r->clients = 0;
+    r->player = NULL;
+    r->running_link = NULL;
+    r->next_running = NULL;
+    private_count ++;
+    return r;
+}
 
-    free(coverage);
+// A machine's pull is over (or it's going away): take it off the running list.
+static void room_stop(struct room * r)
+{
+    *r->running_link = r->next_running;
+    if (r->next_running) r->next_running->running_link = r->running_link;
+    r->running_link = NULL;
+    rooms_running --;
+}
 
-    return p;
+// A client is leaving its room - and if that was its own private machine, the machine goes too.
+static void room_leave(struct room * r)
+{
+    r->clients --;
+    if (r->id >= 0 || r->clients > 0) return;
+
+    if (r->running_link) room_stop(r);
+    private_plays += r->game.plays;
+    private_profit += r->game.profit;
+    unmap_image(private_share, r->game.framebuffer);
+    for (int i = 0; i <= SHADOW_SCALE_MAX; i ++)
+        shadow_free(r->shadows[i]);
+    private_count --;
+    free(r);
+}
 
+// (relay mode) Subscribe to the authority - or, if it isn't there, try again in a while.
+static void upstream_connect(void)
+{
+    upstream_fd = cluster_connect(upstream_address);
+    if (upstream_fd >= 0 && net_attach(&net, upstream_fd, &upstream_conn)) {
+        printf("* Relaying for %s on socket %d\n", upstream_address, upstream_fd);
+        return;
+    }
+    if (upstream_fd >= 0) close(upstream_fd);
+    upstream_fd = -1;
+    timer_set(&timers, &reconnect, timer_now() + RECONNECT_INTERVAL);
 }
 
-static unsigned char * encode_raw(unsigned char * p, const struct pixel_format * f, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+// (relay mode) The authority has gone: the mirror stays as it was, with nobody able to play,
+//  until it comes back - and sends a keyframe to pick up from.
+static void upstream_lost(void)
 {
-    // if their format exactly matches ours, we can just send the pixels directly
-    if (f->bpp == 8 && (f->true_color_flag == 0 || (f->red_div == (65536 / 8) && f->red_shift == 0 && f->green_div == (65536 / 8) && f->green_shift == 3 && f->blue_div == (65536 / 4) && f->blue_shift == 6))) {
+    printf("- Lost the authority on socket %d\n", upstream_fd);
+    net_detach(&net, upstream_fd);
+    upstream_fd = -1;
+    outq_free(&upstream_out);
+    outq_init(&upstream_out);
+    cluster_reader_free(&upstream);
+    timer_set(&timers, &reconnect, timer_now() + RECONNECT_INTERVAL);
+}
 
-        for (int row = y; row < y + h; row ++) {
-            memcpy(p, & framebuffer->data[512 * row + x], w);
-            p += w;
-        }
-    } else {
-        // hmm ok A Conversion Is Needed
+// A machine has started a pull: put it on the running list.
+static void room_run(struct room * r)
+{
+    r->next_running = running;
+    if (running) running->running_link = &r->next_running;
+    r->running_link = &running;
+    running = r;
+    // the first machine to start off gets a tick right away - any others wait for the next one,
+    //  so the ticks keep to their rhythm however many pulls come in
+    if (rooms_running ++ == 0) gettimeofday(&tv_next, NULL);
+}
 
-        for (int src_y = y; src_y < y + h; src_y ++) {
-            int i = src_y * 512;
-            for (int src_x = x; src_x < x + w; src_x ++)
-                p = encode_pixel(p, f, framebuffer->data[i + src_x]);
-        }
-    }
-    return p;
-}
-
-static unsigned char * encode_cursor(unsigned char * p, const struct pixel_format * f)
-{
-    // the cursor shape - Windows "hand"
-    static const unsigned char cursor_colormap[47] = { 0x00, 0x00, 0x03, 0x00, 0x01, 0x80, 0x00, 0xc0, 0x00, 0x60, 0x00, 0x30, 0x00, 0x1b, 0x00, 0x0d, 0xb0, 0x06, 0xda, 0x03, 0x6d, 0x99, 0xfe, 0xce, 0xff, 0xe3, 0x7f, 0xf0, 0xbf, 0xf8, 0x7f, 0xfc, 0x1f, 0xfe, 0x0f, 0xfe, 0x03, 0xff, 0x01, 0xff, 0x80, 0x7f, 0x80, 0x3f, 0xc0, 0x00, 0x00 };
-    static const unsigned char cursor_tmap[66] = { 0x06, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x0f, 0xc0, 0x00, 0x0f, 0xf8, 0x00, 0x0f, 0xfe, 0x00, 0x0f, 0xff, 0x00, 0xef, 0xff, 0x80, 0xff, 0xff, 0x80, 0xff, 0xff, 0x80, 0x7f, 0xff, 0x80, 0x3f, 0xff, 0x80, 0x3f, 0xff, 0x80, 0x1f, 0xff, 0x80, 0x1f, 0xff, 0x00, 0x0f, 0xff, 0x00, 0x0f, 0xff, 0x00, 0x07, 0xfe, 0x00, 0x07, 0xfe, 0x00, 0x07, 0xfe, 0x00 };
-
-    // rectangle header
-    p[0] = p[2] = p[4] = p[6] = 0;
-    // hotspot
-    p[1] = 5;
-    p[3] = 1;
-    // cursor size
-    p[5] = 17;
-    p[7] = 22;
-    // encoding
-    p[8] = p[9] = p[10] = 0xFF;
-    p[11] = 0x11;
-
-    p += 12;
-
-    // decode the cursor colormap
-    char bit = 7;
-    int byte = 0;
-    for (int i = 0; i < 17 * 22; i ++) {
-        p = encode_pixel(p, f, cursor_colormap[byte] & (1 << bit) ? 0xFF : 0);
-        bit --;
-        if (bit < 0) {
-            byte ++;
-            bit = 7;
+// A client dropped a coin in its machine: if that starts a pull, it's the player.
+static void client_pull(struct client * c)
+{
+    struct room * r = c->room;
+    if (upstream_address) {
+        // a relay has no game of its own: the coin goes to the authority, which knows better
+        //  than the mirror whether the machine is free
+        static const unsigned char pull = CLUSTER_PULL;
+        if (upstream_fd >= 0) {
+            outq_push_copy(&upstream_out, &pull, 1);
+            if (! net_send(&net, upstream_fd, &upstream_out, 0, 0, NULL, NULL)) upstream_lost();
         }
+        return;
     }
+    if (! game_pull(&r->game)) return;
+    r->player = c;
+    room_run(r);
+}
 
-    // dump the transparency map
-    memcpy(p, cursor_tmap, 66);
-    p += 66;
-
-    return p;
+// Where a room's plays and profit are kept: stats.ini for the first, as ever, and
+//  stats-N.ini for the rest.
+static void room_stats_file(char * name, size_t len, unsigned int room)
+{
+    if (room == 0) snprintf(name, len, "stats.ini");
+    else snprintf(name, len, "stats-%u.ini", room);
 }
 
-// Sends a consolidated Update packet to the client.
-static unsigned char * encode(unsigned char * p, struct client * c, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+static void room_save_stats(unsigned int room)
 {
-    // pack an update
-    // x
-    p[0] = (x / 256);
-    p[1] = (x % 256);
-    p[2] = (y / 256);
-    p[3] = (y % 256);
-    p[4] = (w / 256);
-    p[5] = (w % 256);
-    p[6] = (h / 256);
-    p[7] = (h % 256);
-    // encoding
-    p[8] = p[9] = p[10] = 0;
-    p += 11;
+    char name[32];
+    room_stats_file(name, sizeof(name), room);
+    FILE * stats = fopen(name, "w");
+    if (stats != NULL) {
+        fprintf(stats, "%d %d\n", rooms[room].game.plays, rooms[room].game.profit);
+        fclose(stats);
+    } else perror("stats fopen");
+}
 
-    if (c->encodings & HexTile) {
-        *p = 5;
-        unsigned char * hextile = encode_hextile(p + 1, & c->format, x, y, w, h);
-        if (hextile - p <= w * h * (c->format.bpp / 8)) return hextile;
+static void dump_signal(int sig)
+{
+    if (sig == SIGUSR2) trace_requested = 1;
+    else dump_requested = 1;
+}
 
-        // it seems HexTile made it worse than Raw so toss that encoding attempt
+// one line per connected client: traffic so far, and what the fences have measured of its link
+static void dump_clients(const struct client * clients)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    printf("= governor: %s, load %u%% of the tick budget (%lu changes)\n",
+           governor_stage_name(governor.stage), governor.load / 10, governor.changes);
+    printf("= rooms: %u shared, %u private, %u running\n", room_count, private_count, rooms_running);
+    puts("= fd    room  bytes sent   in flight   rtt (us)  bytes/sec    backlog  drain/sec    fps  skipped  continuous  zerocopy (copied)");
+    for (const struct client * c = clients; c != NULL; c = c->next) {
+        char room[12] = "own";
+        if (c->room->id >= 0) snprintf(room, sizeof(room), "%d", c->room->id);
+        printf("= %-5d %4s  %10u  %10u  %9u  %9u  %9zu  %9u  %5.1f  %7lu  %-10s  %lu (%lu)\n", c->fd,
+               room, c->bytes_sent, (c->encodings & Fence) ? c->bytes_sent - c->acked_bytes : 0,
+               c->rtt, c->bandwidth, c->backlog, c->drain_rate, client_fps(c, &now), c->frame_skips,
+               c->continuous ? "yes" : "no", c->out.zerocopy_sends, c->out.zerocopy_copied);
     }
+    fflush(stdout);
+}
 
-    if (c->encodings & RRE) {
-        *p = 2;
-        unsigned char * rre = encode_rre(p + 1, & c->format, x, y, w, h);
-        if (rre - p <= w * h * (c->format.bpp / 8)) return rre;
+// Count a rectangle going out, by the encoding in its header.
+static void count_rectangle(const struct segment * r)
+{
+    struct metrics * m = metrics_local();
+    uint32_t type = ((uint32_t)r->data[8] << 24) | (r->data[9] << 16) | (r->data[10] << 8) | r->data[11];
+    enum metric_encoding e = metric_encoding_of((int32_t)type);
+    METRIC_ADD(m->rect_bytes[e], r->len);
+    METRIC_ADD(m->rects[e], 1);
+}
 
-        // it seems RRE made it worse than Raw so toss that encoding attempt
+// A rectangle of a client's machine, for an update - from the cache, if anyone else could be
+//  watching the same thing.  A private machine that hasn't been played yet still looks just like
+//  private_base, so it shares that one's rectangles; once it has, they're its own, and get
+//  encoded fresh rather than crowding everybody else's out of the cache.
+//  returns a reference for the caller to drop
+static struct segment * client_rectangle(const struct client * c, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+{
+    const struct game * g = &c->room->game;
+    // a scaled session's screen is its own room's shadow, kept up to date by update()
+    if (c->scale > 1)
+        return encode_rectangle(c->room->shadows[c->scale]->image, &c->format, c->encodings, x, y, w, h);
+    struct snapshot * s;
+    if (c->room->id < 0) {
+        if (g->version != private_base.version)
+            return encode_rectangle(g->framebuffer, &c->format, c->encodings, x, y, w, h);
+        s = snapshot_take(&private_snapshot, &private_base);
+    } else {
+        s = snapshot_take(&c->room->snapshot, g);
     }
+    return segment_ref(cached_rectangle(s, &c->format, c->encodings, x, y, w, h));
+}
+
+// The framebuffer size a client knows of, as a DesktopSize or ExtendedDesktopSize rectangle
+//  returns a reference for the caller to drop
+static struct segment * desktop_size_rectangle(const struct client * c, enum desktop_size_reason reason, enum desktop_size_status status)
+{
+    struct segment * s = segment_new(DESKTOP_SIZE_MAX);
+    s->len = encode_desktop_size(s->data, c->encodings, reason, status, c->width, c->height) - s->data;
+    return s;
+}
 
-    // RAW encoding
-    *p = 0;
-    return encode_raw(p + 1, & c->format, x, y, w, h);
+// Grow a to take in b as well - an empty rectangle takes in nothing.
+static void rect_union(struct rect * a, const struct rect * b)
+{
+    if (b->w == 0 || b->h == 0) return;
+    if (a->w == 0 || a->h == 0) {
+        *a = *b;
+        return;
+    }
+    const unsigned int right = (a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w);
+    const unsigned int bottom = (a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h);
+    if (b->x < a->x) a->x = b->x;
+    if (b->y < a->y) a->y = b->y;
+    a->w = (right - a->x > UINT16_MAX ? UINT16_MAX : right - a->x);
+    a->h = (bottom - a->y > UINT16_MAX ? UINT16_MAX : bottom - a->y);
 }
 
 // Sends a consolidated Update packet to the client.
+//  an incremental one has just what's changed inside the area, and anything that's changed
+//  outside it stays pending for when it's asked for
 static int update(struct client * c, uint16_t x, uint16_t y, uint16_t w, uint16_t h, unsigned char incremental)
 {
-    // cap the region to just our screen limits
-    if (x > 511) x = 511;
-    if (y > 383) y = 383;
-    if (x + w > 512) w = 512 - x;
-    if (y + h > 384) h = 384 - y;
-
-    // this is a staging area for building the complete packet we'll send
-    //  the largest possible packet is a full screen 32-bit refresh, plus maybe a cursor
-    static unsigned char * packet = NULL, *p;
-    if (packet == NULL) {
-        packet = malloc(4 +
-                        12 + 512 * 384 * 4 +
-                        12 + 17 * 22 * 4 + 3 * 22);
-        if (packet == NULL) {
-            perror("packet malloc");
-            exit(EXIT_FAILURE);
-        }
+    const uint64_t trace_start = trace_begin();
+    const unsigned int bytes_before = c->bytes_sent;
+    const struct game * g = &c->room->game;
+    // what it's shown: the framebuffer, or a scaled session's shadow of it
+    const unsigned int scale = c->scale;
+    const struct image * fb = (scale > 1 ? shadow_update(&c->room->shadows[scale], g, scale) : g->framebuffer);
+
+    // the framebuffer isn't the size this client knows of any more: if it can take a new size,
+    //  it's told, and gets all of the screen again - if not, it goes on seeing what still fits
+    const unsigned char resized = (c->width != fb->width || c->height != fb->height) &&
+                                  (c->encodings & (DesktopSize | ExtendedDesktopSize));
+    if (resized) {
+        c->width = fb->width;
+        c->height = fb->height;
+    }
 
+    // the whole screen has changed since this client last saw it
+    const unsigned char everything = (c->epoch != g->epoch || resized);
+    if (everything) {
+        incremental = 0;
+        x = y = 0;
+        w = fb->width;
+        h = fb->height;
     }
 
+    // cap the region to just our screen limits (or the client's, if those are smaller)
+    const unsigned int width = (c->width < fb->width ? c->width : fb->width);
+    const unsigned int height = (c->height < fb->height ? c->height : fb->height);
+    if (x > width - 1) x = width - 1;
+    if (y > height - 1) y = height - 1;
+    if (x + w > width) w = width - x;
+    if (y + h > height) h = height - y;
+
     // paletted modes should get a copy of the palette on first update
     if (! c->format.true_color_flag && ! c->sent_palette) {
-        // type + padding
-        packet[1] = packet[2] = packet[3] = packet[5] = 0;
-        packet[0] = packet[4] = 1;
-
-        p = &packet[6];
-        for (int i = 0; i < 256; i ++) {
-            for (int c = 0; c < 3; c ++) {
-                *p = (palette[c][i] >> 8) & 0xFF;
-                p ++;
-                *p = palette[c][i] & 0xFF;
-                p ++;
-            }
-        }
-
-        c->bytes_sent += (p - packet);
-        //printf("Sending %d bytes\n", p - packet);
-        if ( send(c->fd, packet, p - packet, 0) == -1) {
-            perror("send");
-            return 0;
-        }
-
+        struct segment * colour_map = cached_colour_map();
+        outq_push(&c->out, colour_map, 0, colour_map->len);
         c->sent_palette = 1;
     }
 
     // framebuffer update
-    // type + padding
-    packet[0] = packet[1] = 0;
-    p = &packet[4];
+    //  everything but this header and the trailer is shared with any other client
+    //  using the same pixel format, and goes out straight from the cache
+    // type + padding + rectangle count (filled in at the end)
+    struct segment * header = segment_new(4);
+    header->data[0] = header->data[1] = 0;
 
     unsigned short rectangle_count = 0;
+    unsigned char ding = 0;
+
+    // LastRect clients don't need the rectangle count up front, so each rectangle can go out
+    //  as soon as it's encoded (the header with the first one) instead of waiting for the whole update
+    const unsigned char streaming = (c->encodings & LastRect) != 0;
+    if (streaming) header->data[2] = header->data[3] = 0xFF;
+
+#define RECTANGLE(s) { \
+        struct segment * r = (s); \
+        if (rectangle_count == 0) outq_push(&c->out, header, 0, 4); \
+        outq_push(&c->out, r, 0, r->len); \
+        count_rectangle(r); \
+        segment_unref(r); \
+        rectangle_count ++; \
+        if (streaming && ! client_flush(c, MSG_MORE)) { segment_unref(header); return 0; } \
+    }
+#define DAMAGE(x, y, w, h) RECTANGLE(client_rectangle(c, x, y, w, h))
+
+    // a new size goes first, so the rest is drawn at that size - and a client that knows about
+    //  ExtendedDesktopSize is told the size with every full update it asks for, so it always has
+    //  a way of finding out
+    if (resized || (! incremental && (c->encodings & ExtendedDesktopSize)))
+        RECTANGLE(desktop_size_rectangle(c, desktop_size_server, desktop_size_ok))
 
     // Incremental update can take just the changes in the area
     if (incremental)
     {
-        // coin drop
-        if (c->coin_y != coin_y) {
-            rectangle_count ++;
-            p = encode(p, c, 388, 185, 29, 37);
+        struct rect damage[GAME_DAMAGE_MAX];
+        const unsigned int damage_count = game_damage(g, &c->seen, damage);
+        for (unsigned int i = 0; i < damage_count; i ++) {
+            // (every block of the shadow the damage touches, for a scaled session)
+            const struct rect * d = &damage[i];
+            const unsigned int d_left = d->x / scale, d_top = d->y / scale;
+            const unsigned int d_right = (d->x + d->w + scale - 1) / scale, d_bottom = (d->y + d->h + scale - 1) / scale;
+            const unsigned int left = (d_left > x ? d_left : x), top = (d_top > y ? d_top : y);
+            const unsigned int right = (d_right < x + w ? d_right : x + w);
+            const unsigned int bottom = (d_bottom < y + h ? d_bottom : y + h);
+            if (left < right && top < bottom)
+                DAMAGE(left, top, right - left, bottom - top)
+        }
+
+// nothing to do!  don't send anything (but the palette, if that was new).
+        if (rectangle_count == 0) {
+            segment_unref(header);
+            c->version = g->version;
+            int ok = client_flush(c, 0);
+            TRACE_END(trace_update, trace_start, NULL, c->fd, incremental, 0, c->bytes_sent - bytes_before);
+            return ok;
         }
+    } else {
+// encode the entire region - if it's the whole screen, someone else with this pixel format may well have asked for it already
+        DAMAGE(x, y, w, h)
+    }
+
+    if ((c->encodings & Cursor) && ! c->sent_cursor)
+        RECTANGLE(segment_ref(cached_cursor(&c->format)))
+
+#undef DAMAGE
+#undef RECTANGLE
+
+    // what it's seen now: the lot, or whatever's changed inside the area it was sent
+    struct game_view seen = c->seen;
+    if (everything) game_view(g, &seen);
+    else game_view_region(g, &(struct rect) { x * scale, y * scale, w * scale, h * scale }, &seen);
+
+// ding!  (after the update is complete)
+    if (incremental && seen.profit != c->seen.profit)
+        ding = 1;
+
+    unsigned char trailer[13];
+    size_t trailer_len = 0;
+    if (streaming) {
+        // the LastRect marker ends the update
+        memset(trailer, 0, 8);
+        trailer[8] = trailer[9] = trailer[10] = 0xFF;
+        trailer[11] = 0x20;
+        trailer_len = 12;
+    } else {
+        header->data[2] = rectangle_count / 256;
+        header->data[3] = rectangle_count % 256;
+    }
+    segment_unref(header);
+
+    if (ding)
+        trailer[trailer_len ++] = 0x02;
+
+// All done!  Send the (rest of the) update.
+    if (trailer_len) outq_push_copy(&c->out, trailer, trailer_len);
+    if (! client_flush(c, 0)) return 0;
+
+    c->sent_cursor = 1;
+    c->seen = seen;
+    c->epoch = g->epoch;
+    c->version = g->version;
+    c->ready = 0;
+    count_frame(c);
+
+    TRACE_END(trace_update, trace_start, NULL, c->fd, incremental, rectangle_count, c->bytes_sent - bytes_before);
+    return 1;
+}
+
+
+// Send a relay what's changed since the last frame it got - or the whole screen, if it's new
+//  or everything has been redrawn.
+static int relay_update(struct client * c)
+{
+    const struct game * g = &c->room->game;
+    // (the end of a pull changes the state, but not a pixel)
+    if (c->version == g->version && c->epoch == g->epoch && c->seen.state == g->state) return 1;
+
+    struct rect damage[GAME_DAMAGE_MAX];
+    unsigned int count;
+    int flags = 0;
+    if (c->epoch != g->epoch) {
+        damage[0] = (struct rect) { 0, 0, g->framebuffer->width, g->framebuffer->height };
+        count = 1;
+        flags = CLUSTER_KEYFRAME;
+    } else {
+        count = game_damage(g, &c->seen, damage);
+    }
+    struct segment * frame = cluster_frame(g, flags, damage, count);
+    outq_push(&c->out, frame, 0, frame->len);
+    segment_unref(frame);
+    if (! client_flush(c, 0)) return 0;
+
+    game_view(g, &c->seen);
+    c->version = g->version;
+    c->epoch = g->epoch;
+    count_frame(c);
+    return 1;
+}
+
+// Bring a client up to date with the latest frame.
+static int client_update(struct client * c)
+{
+    if (c->state == relay_feed) return relay_update(c);
+    // whatever's been asked for - ContinuousUpdates' area, and any request still waiting
+    struct rect area = { 0, 0, 0, 0 };
+    if (c->ready) area = c->requested;
+    if (c->continuous) rect_union(&area, &(struct rect) { c->cu_x, c->cu_y, c->cu_w, c->cu_h });
+    return update(c, area.x, area.y, area.w, area.h, 1);
+}
+
+// A client asked for a different framebuffer size (the SetDesktopSize in its buffer, with the
+//  last of its screens): the framebuffer shrunk by a whole factor - one screen of half the size,
+//  say - it can have, as a scaled session seeing the room's shadow.  The answer goes in an update
+//  of its own, with the size it has now; a new size means everything is sent again, at once if
+//  it's waiting.
+static int set_desktop_size(struct client * c)
+{
+    const unsigned int width = ntohs(*(uint16_t*)(&c->buffer[2]));
+    const unsigned int height = ntohs(*(uint16_t*)(&c->buffer[4]));
+    const struct image * fb = c->room->game.framebuffer;
+    unsigned int scale = 1;
+    while (scale <= SHADOW_SCALE_MAX && (fb->width / scale != width || fb->height / scale != height))
+        scale ++;
+
+    enum desktop_size_status status = desktop_size_ok;
+    if (c->buffer[6] != 1 || scale > SHADOW_SCALE_MAX) {
+        status = desktop_size_invalid;
+    } else if (scale != c->scale || width != c->width || height != c->height) {
+        c->scale = scale;
+        c->width = width;
+        c->height = height;
+        c->epoch = c->room->game.epoch - 1;
+    }
 
-        // handle
-        if (c->handle_y != handle_y) {
-            rectangle_count ++;
-            int skip = (c->handle_y < handle_y ? c->handle_y : handle_y);
-            p = encode(p, c, 447, 73 + skip, 40, 248 - skip);
+    unsigned char msg[4 + DESKTOP_SIZE_MAX] = { 0, 0, 0, 1 };
+    const unsigned char * end = encode_desktop_size(&msg[4], ExtendedDesktopSize, desktop_size_client, status,
+                                                    c->width, c->height);
+    if (! client_send(c, msg, end - msg)) return 0;
+    if (c->ready && c->epoch != c->room->game.epoch)
+        return client_update(c) && request_fence(c);
+    return 1;
+}
 
+// Act on a complete message from a client - or the next step of the handshake.
+//  returns 0 if the client should be dropped
+static int client_process(struct client * c)
+{
+    switch (c->state) {
+    case handshake_protocolversion:
+        // 7.1.1 ProtocolVersion Handshake
+        //  The client is replying to our protocolversion with theirs - an ASCII string
+        /*
+                                    c->buffer[12] = '\0';
+                                    printf(". Client %d sent protocol version %s", c->fd, c->buffer);
+        */
+
+        // Basically ignore whatever they sent - the Security Types went with our version already
+        c->state = handshake_security;
+        c->read = 0;
+        c->needed = 1;
+        break;
+    case handshake_security:
+        // 7.1.2 Security Handshake
+        /*
+                                    printf("Client %d requested security type %u...\n", c->fd, c->buffer[0]);
+        */
+
+        // send Security Result - always OK (no auth)
+        //  queued: a client that sent its ClientInit along with this gets the ServerInit in the same write
+        ;
+        static const unsigned char security_result[] = { 0x00, 0x00, 0x00, 0x00 };
+        client_queue(c, security_result, 4);
+        c->state = init_client;
+        c->read = 0;
+        c->needed = 1;
+        break;
+    case init_client:
+        // 7.3.1 ClientInit
+        /*
+                                    printf("Client %d sent client_init flag %u...\n", c->fd, c->buffer[0]);
+        */
+        // ignore the flag :P
+        // we send the parameters of the window
+
+        // width x height (filled in below)
+        ;
+        unsigned char server_init[] = { 0x00, 0x00, 0x00, 0x00,
+                                         // bpp   depth big-e tcol  red-max     green-max   blue-max    r - g - b shift      padding
+                                         0x08, 0x08, 0x01, 0x01, 0x00, 0x07, 0x00, 0x07, 0x00, 0x03, 0x00, 0x03, 0x06, 0x00, 0x00, 0x00,
+                                         // window title, 8 chars: "VNCSlots"
+                                         0x00, 0x00, 0x00, 0x08, 0x56, 0x4e, 0x43, 0x53, 0x6c, 0x6f, 0x74, 0x73
+                                       };
+        c->width = c->room->game.framebuffer->width;
+        c->height = c->room->game.framebuffer->height;
+        server_init[0] = c->width / 256;
+        server_init[1] = c->width % 256;
+        server_init[2] = c->height / 256;
+        server_init[3] = c->height % 256;
+        client_queue(c, server_init, 32);
+        c->state = client_message;
+        // from here on, only a client that goes quiet has a deadline
+        timer_set(&timers, &c->deadline, c->last_input + IDLE_TIMEOUT);
+        c->read = 0;
+        c->needed = 1;
+        break;
+    case client_message:
+        // 7.5 Client Message
+        //  We read only one byte - the message-type - and then switch to a new state to handle each specific message
+        /*
+                                    printf("Client %d sent message %u... ", c->fd, c->buffer[0]);
+        */
+        // the bytes-needed are dependent on the message
+        switch(c->buffer[0]) {
+        case 0:
+            //printf("SetPixelFormat\n");
+            c->state = client_message_setpixelformat;
+            c->needed = 20;
+            break;
+        case 2:
+            //printf("SetEncodings\n");
+            c->state = client_message_setencodings_0;
+            c->needed = 4;
+            break;
+        case 3:
+            //printf("FramebufferUpdateRequest\n");
+            c->state = client_message_framebufferupdaterequest;
+            c->needed = 10;
+            break;
+        case 4:
+            //printf("KeyEvent\n");
+            c->state = client_message_keyevent;
+            c->needed = 8;
+            break;
+        case 5:
+            //printf("PointerEvent\n");
+            c->state = client_message_pointerevent;
+            c->needed = 6;
+            break;
+        case 6:
+            //printf("ClientCutText\n");
+            c->state = client_message_clientcuttext_0;
+            c->needed = 8;
+            break;
+        case 150:
+            //printf("EnableContinuousUpdates\n");
+            c->state = client_message_enablecontinuousupdates;
+            c->needed = 10;
+            break;
+        case 248:
+            //printf("Fence\n");
+            c->state = client_message_fence_0;
+            c->needed = 9;
+            break;
+        case 251:
+            //printf("SetDesktopSize\n");
+            c->state = client_message_setdesktopsize_0;
+            c->needed = 8;
+            break;
+        default:
+            // Got an unknown message-type from the client!  This is bad.
+            fprintf(stderr, "Got unknown message-type %d from client %d!\n", c->buffer[0], c->fd);
+            return 0;
+        }
+        break;
+    case client_message_setpixelformat:
+        // 7.5.1 SetPixelFormat
+        //printf("Client %d requested new pixel format...\n", c->fd);
+        // the encoders write 1, 2 or 4 bytes a pixel, and nothing else
+        if (c->buffer[4] != 8 && c->buffer[4] != 16 && c->buffer[4] != 32) {
+            fprintf(stderr, "Client %d asked for %d bits per pixel!\n", c->fd, c->buffer[4]);
+            return 0;
+        }
+        c->format.bpp = c->buffer[4];
+        //c->format.depth = c->buffer[5];
+        c->format.big_endian_flag = c->buffer[6];
+        c->format.true_color_flag = c->buffer[7];
+        c->format.red_div = 65536 / ( 1 + ntohs(*(uint16_t*)(&c->buffer[8])));
+        c->format.green_div = 65536 / (1 + ntohs(*(uint16_t*)(&c->buffer[10])));
+        c->format.blue_div = 65536 / (1 + ntohs(*(uint16_t*)(&c->buffer[12])) );
+        c->format.red_shift = c->buffer[14];
+        c->format.green_shift = c->buffer[15];
+        c->format.blue_shift = c->buffer[16];
+
+        /*
+                                    printf("bpp=%d depth=%d be=%d tc=%d rmax=%08x gmax=%08x bmax=%08x rshft=%d gshft=%d bshft=%d\n",
+                                           c->format.bpp,
+                                           c->buffer[5], //c->format.depth,
+                                           c->format.big_endian_flag,
+                                           c->format.true_color_flag,
+                                           c->format.red_div,
+                                           c->format.green_div,
+                                           c->format.blue_div,
+                                           c->format.red_shift,
+                                           c->format.green_shift,
+                                           c->format.blue_shift
+                                          );
+        */
+
+        c->state = client_message;
+        c->read = 0;
+        c->needed = 1;
+        break;
+    case client_message_setencodings_0:
+        // 7.5.2 SetEncodings
+        //  this is a "multi-part" message: the first part (this) tells a number of encodings,
+        //  we set ->extra to this, and then the _n part is reading the array entry-by-entry
+        c->extra = ntohs(*(uint16_t*)(&(c->buffer[2])));
+
+        // blank the encodings bitfield
+        c->encodings = 0;
+        // determine next-state based on ->extra
+        goto foo;
+    case client_message_setencodings_n:
+        // 7.5.2 SetEncodings - interpret the encoding type and set flags if appropriate
+        switch ((int)ntohl(*(uint32_t*)(c->buffer))) {
+        case 0:
+            // RAW encoding - but we always support this
+            break;
+        case 1:
+            // CopyRect encoding
+            c->encodings |= CopyRect;
+            break;
+        case 2:
+            // RRE
+            c->encodings |= RRE;
+            break;
+        case 5:
+            // HexTile
+            c->encodings |= HexTile;
+            break;
+        case 15:
+            // TRLE
+            c->encodings |= TRLE;
+            break;
+        case 16:
+            // ZRLE
+            c->encodings |= ZRLE;
+            break;
+        case -239:
+            // Cursor
+            c->encodings |= Cursor;
+            break;
+        case -223:
+            // DesktopSize
+            c->encodings |= DesktopSize;
+            break;
+        case -308:
+            // ExtendedDesktopSize
+            c->encodings |= ExtendedDesktopSize;
+            break;
+        case -312:
+            // Fence
+            c->encodings |= Fence;
+            break;
+        case -313:
+            // ContinuousUpdates
+            c->encodings |= ContinuousUpdates;
+            break;
+        case -224:
+            // LastRect
+            c->encodings |= LastRect;
+            break;
+        default:
+            // Other, unknown, unused
+            break;
+        }
+        c->extra --;
+foo:
+        c->read = 0;
+        if (c->extra == 0) {
+            // read all the encodings!  back to the regular loop
+            c->state = client_message;
+            c->needed = 1;
+
+            // a client announcing ContinuousUpdates learns we support it from an EndOfContinuousUpdates
+            if ((c->encodings & ContinuousUpdates) && ! c->sent_end_of_cu) {
+                static const unsigned char end_of_cu[] = { 150 };
+                if (! client_send(c, end_of_cu, 1))
+                    return 0;
+                c->sent_end_of_cu = 1;
+            }
+        } else {
+            c->state = client_message_setencodings_n;
+            c->needed = 4;
+        }
+        break;
+    case client_message_framebufferupdaterequest:
+        if (c->buffer[1]) {
+            // incremental request - and so client can just wait, for changes in the area it
+            //  asked about (or in any of them, if it's asked more than once)
+            const struct rect area = {
+                ntohs(*(uint16_t*)(&c->buffer[2])),
+                ntohs(*(uint16_t*)(&c->buffer[4])),
+                ntohs(*(uint16_t*)(&c->buffer[6])),
+                ntohs(*(uint16_t*)(&c->buffer[8]))
+            };
+            if (! c->ready) c->requested = (struct rect) { 0, 0, 0, 0 };
+            rect_union(&c->requested, &area);
+            c->ready = 1;
+
+            // changes held back from the last update (outside what was asked for then) needn't
+            //  wait for the machine to move again - a client that's merely behind waits its turn
+            const struct game * g = &c->room->game;
+            struct rect damage[GAME_DAMAGE_MAX];
+            if (c->version == g->version && c->epoch == g->epoch && game_damage(g, &c->seen, damage) > 0) {
+                if (! client_update(c) || ! request_fence(c))
+                    return 0;
+            }
+        } else {
+            // they want a whole the entire full complete edition rectangle
+            if (! update(c,
+                         ntohs(*(uint16_t*)(&c->buffer[2])),
+                         ntohs(*(uint16_t*)(&c->buffer[4])),
+                         ntohs(*(uint16_t*)(&c->buffer[6])),
+                         ntohs(*(uint16_t*)(&c->buffer[8])), 0))
+                return 0;
+            if (! request_fence(c))
+                return 0;
+
+            c->ready = 0;
+        }
+        c->state = client_message;
+        c->read = 0;
+        c->needed = 1;
+        break;
+    case client_message_keyevent:
+    {
+        int key = ntohl(*(uint32_t*)(&c->buffer[4]));
+        // space, return, enter, down-arrow
+        if (key == 32 || key == 65421 || key == 65293 || key == 65364) {
+            if (c->buffer[1] && ! c->key_down) {
+                c->key_down = 1;
+                client_pull(c);
+            } else if (! c->buffer[1]) c->key_down = 0;
         }
+    }
+
+    c->state = client_message;
+    c->read = 0;
+    c->needed = 1;
+    break;
+    case client_message_pointerevent:
+    {
+        // the hotspots are in the machine's own coordinates, wherever it is on the screen
+        struct rect m;
+        game_machine(&c->room->game, &m);
+        //  (and a scaled session points at the middle of the block it sees as one pixel)
+        const int x = ntohs(*(uint16_t*)(&c->buffer[2])) * c->scale + c->scale / 2 - m.x;
+        const int y = ntohs(*(uint16_t*)(&c->buffer[4])) * c->scale + c->scale / 2 - m.y;
+
+        // we only really care about the places button 1 state changes
+        if (c->mouse_down != 0 && (c->buffer[1] & 1) == 0) {
+            // button release
+            if (x >= 451 && x <= 487 && y >= 73 && y <= 109 && c->mouse_down == 1) {
+                // clicked on handle
+                client_pull(c);
+            } else if (x >= 472 && x <= 490 && y >= 365 && y <= 383 && c->mouse_down == 2) {
+                // clicked COPY button - set cuttext to our github URL
+                static const unsigned char url_msg[] = { 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 40,
+                                                         0x68, 0x74, 0x74, 0x70, 0x73, 0x3A, 0x2F, 0x2F, 0x67, 0x69, 0x74, 0x68, 0x75, 0x62, 0x2E, 0x63, 0x6F, 0x6D, 0x2F, 0x67, 0x72, 0x65, 0x67, 0x2D, 0x6B, 0x65, 0x6E, 0x6E, 0x65, 0x64, 0x79, 0x2F, 0x56, 0x4E, 0x43, 0x53, 0x6C, 0x6F, 0x74, 0x73
+                                                       };
+                if (! client_send(c, url_msg, 48))
+                    return 0;
 
-        // reels
-        for (int i = 0; i < 3; i ++) {
-            if (c->reel_position[i] != reel_position[i]) {
-                rectangle_count ++;
-                p = encode(p, c, 222 + 50 * i, 67, 32, 114);
+            }
+            c->mouse_down = 0;
+        }
+        else if (c->mouse_down == 0 && (c->buffer[1] & 1) == 1)
+        {
+            // check hotspots
+            if (x >= 451 && x <= 487 && y >= 73 && y <= 109) {
+                // clicked on handle
+                c->mouse_down = 1;
+            } else if (x >= 472 && x <= 490 && y >= 365 && y <= 383) {
+                // clicked COPY button - set cuttext to our github URL
+                c->mouse_down = 2;
             }
         }
+    }
+
+    c->state = client_message;
+    c->read = 0;
+    c->needed = 1;
+    break;
+    case client_message_clientcuttext_0:
+        c->extra = ntohl(*(uint32_t*)(&c->buffer[4]));
+    // printf("Client %d plans to send us %u cut-text\n", c->fd, c->extra);
 
-        // scoreboard
-        if (c->profit - c->plays != profit - plays) {
-            rectangle_count ++;
-            p = encode(p, c, 19, 353, 63, 11);
+    // We don't actually care about the cut-text and just plan to read and discard it,
+    // 20 bytes at a time.
+
+    // fallthrough
+
+    case client_message_clientcuttext_n:
+        c->read = 0;
+        if (c->extra == 0) {
+            c->needed = 1;
+            c->state = client_message;
+        } else {
+            c->needed = (c->extra < 20 ? c->extra : 20);
+            c->extra -= c->needed;
+            c->state = client_message_clientcuttext_n;
+        }
+        break;
+    case client_message_enablecontinuousupdates:
+        // EnableContinuousUpdates
+        if (c->buffer[1]) {
+            c->continuous = 1;
+            c->cu_x = ntohs(*(uint16_t*)(&c->buffer[2]));
+            c->cu_y = ntohs(*(uint16_t*)(&c->buffer[4]));
+            c->cu_w = ntohs(*(uint16_t*)(&c->buffer[6]));
+            c->cu_h = ntohs(*(uint16_t*)(&c->buffer[8]));
+        } else {
+            // turning it off must be confirmed, even if it was never on
+            static const unsigned char end_of_cu[] = { 150 };
+            c->continuous = 0;
+            if (! client_send(c, end_of_cu, 1))
+                return 0;
+        }
+        c->state = client_message;
+        c->read = 0;
+        c->needed = 1;
+        break;
+    case client_message_fence_0:
+        // Fence - the header says how long the payload is
+        if (c->buffer[8] > 64) {
+            fprintf(stderr, "Client %d sent a Fence with a %d byte payload!\n", c->fd, c->buffer[8]);
+            return 0;
         }
+        if (c->buffer[8] > 0) {
+            c->state = client_message_fence_n;
+            c->needed = 9 + c->buffer[8];
+            break;
+        }
+    // fallthrough
+    case client_message_fence_n:
+    {
+        uint32_t flags = ntohl(*(uint32_t*)(&c->buffer[4]));
+        if (flags & fence_Request) {
+            // we handle every message in order as it arrives, so all the blocking
+            //  requests are already satisfied: just echo it back with the flags we know
+            if (! send_fence(c, flags & (fence_BlockBefore | fence_BlockAfter | fence_SyncNext), &c->buffer[9], c->buffer[8]))
+                return 0;
+        } else {
+            fence_reply(c, &c->buffer[9], c->buffer[8]);
+        }
+    }
 
-        if (c->plays != plays) {
-            rectangle_count ++;
-            p = encode(p, c, 19, 293, 63, 11);
+    c->state = client_message;
+    c->read = 0;
+    c->needed = 1;
+    break;
+    case client_message_setdesktopsize_0:
+        // SetDesktopSize - the layout follows, 16 bytes for each screen (each read in after the
+        //  header, which stays put)
+        c->extra = c->buffer[6];
+    // fallthrough
+    case client_message_setdesktopsize_n:
+        if (c->extra > 0) {
+            c->extra --;
+            c->read = 8;
+            c->needed = 24;
+            c->state = client_message_setdesktopsize_n;
+            break;
+        }
+        if (! set_desktop_size(c))
+            return 0;
+        c->state = client_message;
+        c->read = 0;
+        c->needed = 1;
+        break;
+    case relay_feed:
+        // the only thing a relay sends is a pull from one of its viewers
+        if (c->buffer[0] != CLUSTER_PULL) {
+            fprintf(stderr, "Relay %d sent %u, not a pull\n", c->fd, c->buffer[0]);
+            return 0;
         }
+        client_pull(c);
+        c->read = 0;
+        break;
+    default:
+        fprintf(stderr, "Ended up in unhandled state %d for client %d!\n", c->state, c->fd);
+        return 0;
 
-        if (c->profit != profit) {
-            rectangle_count ++;
-            p = encode(p, c, 19, 323, 63, 11);
+    }
 
-// ding!
-            *p = 0x02;
-            p ++;
-        }
+    return 1;
+}
 
-// nothing to do!  don't send anything.
-        if (rectangle_count == 0) return 1;
-    } else {
-// encode the entire region
-        rectangle_count ++;
-        p = encode(p, c, x, y, w, h);
+// Feed some input from a client through the protocol, a message at a time.
+//  returns 0 if the client should be dropped
+static int client_input(struct client * c, const unsigned char * data, size_t len)
+{
+    if (c->rec) record_in(c->rec, data, len);
+    // (the idle deadline catches up with this when it goes off)
+    c->last_input = timer_now();
+    c->probing = 0;
+
+    const uint64_t trace_start = trace_begin();
+    const size_t total = len;
+    while (len > 0) {
+        unsigned int n = c->needed - c->read;
+        if (n > len) n = len;
+        memcpy(&c->buffer[c->read], data, n);
+        c->read += n;
+        data += n;
+        len -= n;
+
+        // we have a full packet and can process it depending on the current client state
+        if (c->needed == c->read) {
+            const unsigned int from = c->state;
+            if (! client_process(c)) return 0;
+            if (c->state != from)
+                TRACE_INSTANT(trace_state, client_state_names[c->state], c->fd, from, c->state);
+        }
     }
+    TRACE_END(trace_input, trace_start, NULL, c->fd, total);
 
-    if ((c->encodings & Cursor) && ! c->sent_cursor)
-    {
-        rectangle_count ++;
-        p = encode_cursor(p, &c->format);
+    // whatever the handshake queued up, in one go
+    if (c->out.count && ! client_flush(c, 0)) return 0;
+    return 1;
+}
+
+// get sockaddr, IPv4 or IPv6:
+static const void *get_in_addr(const struct sockaddr *sa)
+{
+    if (sa->sa_family == AF_INET) {
+        return &(((struct sockaddr_in *)sa)->sin_addr);
     }
+    return &(((struct sockaddr_in6 *)sa)->sin6_addr);
+}
 
-    packet[2] = rectangle_count / 256;
-    packet[3] = rectangle_count % 256;
+// Bind a listen socket on port for each local address family.
+//  returns how many there are, with their fds in fds
+static unsigned int bind_listeners(int * fds, unsigned int max, int backlog, const char * port)
+{
+    unsigned int listeners = 0;
+
+    printf("Binding listen sockets (port %s)...\n", port);
 
-// All done!  Send the packet.
+    // get us a socket and bind it - any family, TCP / stream
+    static const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_protocol = IPPROTO_TCP,
+        .ai_flags = AI_ADDRCONFIG | AI_PASSIVE
+    };
 
-    c->bytes_sent += (p - packet);
-    //printf("Sending %d bytes\n", p - packet);
-    if ( send(c->fd, packet, p - packet, 0) == -1) {
-        perror("send");
+    struct addrinfo *ai;
+    int rv = getaddrinfo(NULL, port, &hints, &ai);
+    if (rv != 0) {
+        fputs("getaddrinfo: ", stderr);
+        fputs(gai_strerror(rv), stderr);
         return 0;
     }
 
-    c->sent_cursor = 1;
-    c->coin_y = coin_y;
-    c->handle_y = handle_y;
-    for (int i = 0; i < 3; i ++)
-        c->reel_position[i] = reel_position[i];
-    c->plays = plays;
-    c->profit = profit;
+    for(struct addrinfo * p = ai; p != NULL && listeners < max; p = p->ai_next) {
+        int fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) {
+            perror("socket");
+            continue;
+        }
+
+        // lose the pesky "address already in use" error message
+        static const int yes=1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
+        if (bind(fd, p->ai_addr, p->ai_addrlen)) {
+            perror("bind");
+            close(fd);
+            continue;
+        }
+
+        if (listen(fd, backlog)) {
+            perror("listen");
+            close(fd);
+            continue;
+        }
+
+        // looks good!  print some info
+        char ip[INET6_ADDRSTRLEN];
+        inet_ntop(p->ai_addr->sa_family,
+                  get_in_addr(p->ai_addr),
+                  ip, INET6_ADDRSTRLEN);
+        printf(" . Bound to %s on socket %d\n", ip, fd);
+
+        fds[listeners ++] = fd;
+    }
+
+    freeaddrinfo(ai); // all done with this
+    return listeners;
+}
+
+// Set up a freshly accepted connection, and send it the protocol version - or, for a relay
+//  subscribing to the frame stream, nothing yet.
+//  returns NULL (with the socket closed) if that doesn't work out
+static struct client * client_new(int fd, unsigned int id, const char * record_dir, int zerocopy, int subscriber)
+{
+    // Connection success!
+    struct sockaddr_storage remoteaddr; // client address
+    socklen_t addrlen = sizeof remoteaddr;
+    char ip[INET6_ADDRSTRLEN] = "?";
+    if (getpeername(fd, (struct sockaddr *)&remoteaddr, &addrlen) == 0)
+        inet_ntop(remoteaddr.ss_family, get_in_addr((struct sockaddr*)&remoteaddr), ip, INET6_ADDRSTRLEN);
+    printf("+ Received new %s from %s on socket %d\n", subscriber ? "relay" : "connection", ip, fd);
+
+    struct client * c = malloc(sizeof(struct client));
+    if (c == NULL) {
+        perror("malloc client");
+        close(fd);
+        return NULL;
+    }
+
+    // initialize all client state
+    c->fd = fd;
+    c->next = NULL;
+    c->link = NULL;
+    c->next_dropped = NULL;
+    timer_init(&c->deadline, c, timer_deadline);
+    timer_init(&c->pace, c, timer_pace);
+    c->last_input = timer_now();
+    c->probing = 0;
+
+    c->state = (subscriber ? relay_feed : handshake_protocolversion);
+    TRACE_INSTANT(trace_state, client_state_names[c->state], fd, none, c->state);
+    static const struct pixel_format format = { 8, 1, 1, 65536 / 8, 65536 / 8, 65536 / 4, 5, 2, 0 };
+    c->format = format;
+    c->width = c->height = 0;
+    c->scale = 1;
+    outq_init(&c->out);
+    c->zerocopy_min = 0;
+#ifdef SO_ZEROCOPY
+    // (io_uring has nowhere to deliver the completions)
+    static const int one = 1;
+    if (zerocopy && net.backend == &net_select_backend) {
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(int)) == 0)
+            c->zerocopy_min = ZEROCOPY_MIN;
+        else
+            perror("setsockopt SO_ZEROCOPY");
+    }
+#else
+    (void)zerocopy;
+#endif
+    c->bytes_sent = 0;
+    c->rec = NULL;
+    if (record_dir != NULL) {
+        c->rec = record_open(record_dir, id);
+        if (c->rec != NULL) printf(". Recording client %d as session %u\n", fd, id);
+    }
+    c->read = 0;
+    c->needed = (subscriber ? 1 : 12);
+    c->extra = 0;
+    c->encodings = 0;
+    c->key_down = 0;
+    c->mouse_down = 0;
     c->ready = 0;
+    c->requested = (struct rect) { 0, 0, 0, 0 };
+    c->continuous = 0;
+    c->sent_end_of_cu = 0;
+    c->fence_pending = 0;
+    c->fence_id = 0;
+    c->fence_bytes = c->acked_bytes = 0;
+    timerclear(&c->fence_sent);
+    timerclear(&c->fence_acked);
+    c->rtt = c->bandwidth = 0;
+    c->delivered = 0;
+    c->backlog = 0;
+    timerclear(&c->pace_sampled);
+    c->drain_rate = 0;
+    timerclear(&c->last_frame);
+    c->frame_interval = 0;
+    c->frame_skips = 0;
+    c->sent_cursor = 0;
+    c->sent_palette = 0;
+
+    if (! net_attach(&net, fd, c)) {
+        outq_free(&c->out);
+        if (c->rec) record_close(c->rec);
+        close(fd);
+        free(c);
+        return NULL;
+    }
 
-    return 1;
+    // send protocol-version message before anything else - if this fails, we can skip the rest
+    //  We only speak 3.8, whatever the client answers, so the Security Types (only one, "no auth")
+    //  go right along with it: a client can have its whole side of the handshake on its way
+    //  after one round trip
+    // "RFB 003.008\n"
+    static const unsigned char greeting[] = { 0x52, 0x46, 0x42, 0x20, 0x30, 0x30, 0x33, 0x2e, 0x30, 0x30, 0x38, 0x0a, 0x01, 0x01 };
+    if (! subscriber && ! client_send(c, greeting, 14)) {
+        outq_free(&c->out);
+        if (c->rec) record_close(c->rec);
+        net_detach(&net, fd);
+        free(c);
+        return NULL;
+    }
+
+    // a machine of its own, or a place at the emptiest shared one - relays mirror the first
+    c->room = (subscriber ? &rooms[0] : private_rooms ? room_private() : room_place());
+    if (c->room == NULL) {
+        outq_free(&c->out);
+        if (c->rec) record_close(c->rec);
+        net_detach(&net, fd);
+        free(c);
+        return NULL;
+    }
+    c->room->clients ++;
+    c->version = c->room->game.version;
+    c->epoch = c->room->game.epoch;
+    game_view(&c->room->game, &c->seen);
+
+    if (subscriber) {
+        // it wants every frame - starting with a keyframe
+        c->continuous = 1;
+        c->epoch = c->room->game.epoch - 1;
+        timer_set(&timers, &c->deadline, c->last_input + IDLE_TIMEOUT);
+        return c;
+    }
+
+    // all of the handshake has to be done by then
+    timer_set(&timers, &c->deadline, c->last_input + HANDSHAKE_TIMEOUT);
+    return c;
 }
 
+// clients dropped since the last client_sweep()
+static struct client * dropped;
 
-// special draw functions
-static void draw_number(struct image * dst, const struct image * src, int number, unsigned short dst_x, unsigned short dst_y)
+// Put a new client at the head of the list.
+static void client_link(struct client ** clients, struct client * c)
 {
-    static char num[12] = "";
-    sprintf(num, "%8d", number);
-    for (int i = 0; i < 8; i ++) {
-        if (num[i] >= '0' && num[i] <= '9') {
-            blit_special(src, 0, 11 * (num[i] - '0'), dst, dst_x, dst_y, src->width, 11, 0, (number < 0 ? 7 : 0));
-        } else if (num[i] == '-') {
-            blit_special(src, 0, 110, dst, dst_x, dst_y, src->width, 11, 0, (number < 0 ? 7 : 0));
-        } else {
-            // white square
-            fill(dst, dst_x, dst_y, 6, 11, 0xFF);
+    c->next = *clients;
+    if (c->next) c->next->link = &c->next;
+    c->link = clients;
+    *clients = c;
+}
+
+// Close a client's connection.  It stays on the list, marked as gone, until client_sweep().
+static void client_drop(struct client * c)
+{
+    if (c->state == none) return;
+    printf("- Client %d took %u bytes (rtt %u us, %u bytes/sec)\n", c->fd, c->bytes_sent, c->rtt, c->bandwidth);
+    outq_free(&c->out);
+    if (c->rec) record_close(c->rec);
+    net_detach(&net, c->fd);
+    TRACE_INSTANT(trace_state, client_state_names[none], c->fd, c->state, none);
+    c->state = none;
+    if (c->room->player == c) c->room->player = NULL;
+    room_leave(c->room);
+    timer_cancel(&timers, &c->deadline);
+    timer_cancel(&timers, &c->pace);
+    c->next_dropped = dropped;
+    dropped = c;
+}
+
+// Unlink and free the dropped clients - just those, however long the list is.
+static void client_sweep(void)
+{
+    while (dropped != NULL) {
+        struct client * c = dropped;
+        dropped = c->next_dropped;
+        *c->link = c->next;
+        if (c->next) c->next->link = c->link;
+        free(c);
+    }
+}
+
+// New sprites: redraw the private machines' starting point, share that, and move every private
+//  machine over to a copy of it - drawing in only what its game has changed since it started.
+//  So they stay copy-on-write, instead of every one ending up with a whole framebuffer of its own.
+static void rebase_private(struct client * clients, const struct assets * a)
+{
+    game_set_assets(&private_base, a);
+    struct image_share * share = share_image(private_base.framebuffer);
+    if (share == NULL) {
+        // stay on the old one, and redraw everything there
+        for (struct client * c = clients; c != NULL; c = c->next)
+            if (c->state != none && c->room->id < 0) game_set_assets(&c->room->game, a);
+        return;
+    }
+
+    for (struct client * c = clients; c != NULL; c = c->next) {
+        if (c->state == none || c->room->id >= 0) continue;
+        struct image * framebuffer = map_image(share);
+        if (framebuffer == NULL) {
+            client_drop(c);
+            continue;
         }
-        dst_x += 8;
+        struct image * old = c->room->game.framebuffer;
+        game_rebase(&c->room->game, &private_base, framebuffer);
+        unmap_image(private_share, old);
     }
+    unshare_image(private_share);
+    private_share = share;
 }
 
-static void darken_row(struct image * dst, unsigned short x, unsigned short y, unsigned short w, unsigned char amount)
+
+// Send the latest frame to every client waiting for one, and whose link can take it.
+//  continuous-updates clients get pushed a frame whenever there's room on their link
+//  returns how many were held back while still behind, and need another tick even if the game stops
+//  (those held back by pacing have their own timers)
+static unsigned int push_updates(struct client * clients)
 {
-    unsigned char *p = &dst->data[y * dst->width + x];
-    while (w > 0) {
-        short b = ((*p & 0xC0) >> 6) - (amount >> 1);
-        if (b < 0) b = 0;
-        short g = ((*p & 0x38) >> 3) - amount;
-        if (g < 0) g = 0;
-        short r = (*p & 0x07) - amount;
-        if (r < 0) r = 0;
-        *p = (b << 6) | (g << 3) | r;
-        p ++;
-        w --;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    // an overloaded server only has frames for spectators every few ticks
+    static unsigned int ticks;
+    const int spectator_tick = (governor.stage < governor_slow_spectators || ++ ticks % SPECTATOR_TICKS == 0);
+
+    unsigned int held = 0;
+    for (struct client * c = clients; c != NULL; c = c->next) {
+        if (c->state < client_message) continue;
+        const int paced = pace_open(c, &now);
+        const int governed = (! spectator_tick && c != c->room->player && c->state != relay_feed);
+        if (paced && ! governed && (c->ready || (c->continuous && flight_window_open(c)))) {
+            if (! client_update(c)) {
+                client_drop(c);
+                continue;
+            }
+        } else if (c->ready || c->continuous) {
+            const int behind = (c->version != c->room->game.version || c->epoch != c->room->game.epoch);
+            if (! paced) {
+                // its pace timer brings the frame once the link has room
+                METRIC_ADD(metrics_local()->pace_skips, 1);
+                c->frame_skips ++;
+                if (behind) pace_arm(c);
+            } else if (governed) {
+                METRIC_ADD(metrics_local()->spectator_skips, 1);
+                if (behind) held ++;
+            } else {
+                METRIC_ADD(metrics_local()->window_skips, 1);
+                if (behind) held ++;
+            }
+        }
+        // fence off anything new, so we hear when it has arrived
+        if (c->bytes_sent != c->fence_bytes && ! request_fence(c)) client_drop(c);
     }
+    return held;
 }
 
-static void draw_reel(struct image * dst, const struct image * src, short reel_position, unsigned short dst_x, unsigned short dst_y)
+// A client's deadline has come: a handshake that never finished, or a client that's gone quiet.
+//  A quiet one is asked if it's still there - with a fence, or an empty update if it's waiting
+//  for one, either of which it has to answer - and dropped if it doesn't within the grace period.
+static void deadline_expired(struct client * c, uint64_t now)
 {
-    // reel is 114 pixels high
-    short dst_h = 114;
-    if (reel_position + dst_h > src->height) {
-        // reel won't fit
-        int h = src->height - reel_position;
-        blit_simple(src, 0, reel_position, dst, dst_x, dst_y, src->width, h);
-        blit_simple(src, 0, 0, dst, dst_x, dst_y + h, src->width, dst_h - h);
-    } else {
-        blit_simple(src, 0, reel_position, dst, dst_x, dst_y, src->width, dst_h);
+    if (c->state < client_message) {
+        printf("- Client %d timed out in the handshake\n", c->fd);
+        METRIC_ADD(metrics_local()->handshake_timeouts, 1);
+        client_drop(c);
+        return;
+    }
+
+    if (now < c->last_input + IDLE_TIMEOUT) {
+        // heard from it since the deadline was set
+        timer_set(&timers, &c->deadline, c->last_input + IDLE_TIMEOUT);
+        return;
+    }
+    if (c->probing) {
+        printf("- Client %d stopped answering\n", c->fd);
+        METRIC_ADD(metrics_local()->idle_timeouts, 1);
+        client_drop(c);
+        return;
     }
 
-    // darken top and bottom
-    for (int y = 0; y < 14; y ++) {
-        darken_row(dst, dst_x, dst_y + y, 32, (14 - y) >> 1);
-        darken_row(dst, dst_x, dst_y + dst_h - y - 1, 32, (14 - y) >> 1);
+    if (c->encodings & Fence) {
+        // an outstanding fence is as good as a new one
+        if (! request_fence(c)) {
+            client_drop(c);
+            return;
+        }
+    } else if (c->ready) {
+        // FramebufferUpdate with no rectangles: it'll ask for another
+        static const unsigned char empty_update[] = { 0x00, 0x00, 0x00, 0x00 };
+        if (! client_send(c, empty_update, 4)) {
+            client_drop(c);
+            return;
+        }
+        c->ready = 0;
+    } else {
+        // it isn't waiting on us for anything, so there's nothing it would have to answer:
+        //  leave it to TCP keepalives to find out if it's gone
+        static const int on = 1, idle = IDLE_TIMEOUT / 1000, interval = KEEPALIVE_GRACE / 1000, probes = 4;
+        setsockopt(c->fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(int));
+#ifdef TCP_KEEPIDLE
+        setsockopt(c->fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(int));
+        setsockopt(c->fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(int));
+        setsockopt(c->fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(int));
+#else
+        (void)idle; (void)interval; (void)probes;
+#endif
+        timer_set(&timers, &c->deadline, now + IDLE_TIMEOUT);
+        return;
     }
+    c->probing = 1;
+    timer_set(&timers, &c->deadline, now + KEEPALIVE_GRACE);
 }
 
-static void draw_handle(struct image * dst, const struct image * img_background, const struct image * img_handle, const struct image * img_ball, int scale)
+// A client held back by pacing may have room for its frame now.
+static void pace_expired(struct client * c)
 {
-    blit_simple(img_background, 447, 73, dst, 447, 73, 40, img_ball->height + img_handle->height);
-    blit_special(img_ball, 0, 0, dst, 451, 73 + scale, img_ball->height, img_ball->width, 0xFF, 0);
-    blit_scaled(img_handle, 0, 0, img_handle->height, dst, 447, img_ball->height + 73 + scale, img_handle->height - scale, img_handle->width, 0xFF);
+    if (c->state < client_message || ! (c->ready || c->continuous)) return;
+    if (c->version == c->room->game.version && c->epoch == c->room->game.epoch) return;
+    // an overloaded server's spectators wait for their tick (a relay's viewers get theirs from it)
+    if (governor.stage >= governor_slow_spectators && c != c->room->player && c->state != relay_feed) return;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (! pace_open(c, &now) || (! c->ready && ! flight_window_open(c))) {
+        pace_arm(c);
+        return;
+    }
+    if (! client_update(c) || (c->bytes_sent != c->fence_bytes && ! request_fence(c)))
+        client_drop(c);
 }
 
-// get sockaddr, IPv4 or IPv6:
-static const void *get_in_addr(const struct sockaddr *sa)
+// Move the timers on to now, and act on whatever has expired.
+static void run_timers(void)
 {
-    if (sa->sa_family == AF_INET) {
-        return &(((struct sockaddr_in *)sa)->sin_addr);
+    const uint64_t now = timer_now();
+    struct timer * next;
+    for (struct timer * t = timer_advance(&timers, now); t != NULL; t = next) {
+        // (acting on one may re-arm it)
+        next = t->next;
+        if (t->kind == timer_reconnect) {
+            upstream_connect();
+            continue;
+        }
+        struct client * c = t->ctx;
+        if (c->state == none) continue;
+        if (t->kind == timer_deadline) deadline_expired(c, now);
+        else pace_expired(c);
     }
-    return &(((struct sockaddr_in6 *)sa)->sin6_addr);
 }
 
-/*
-static const char * en2s(int fruit)
+// /////////////////////////////////
+// Metrics endpoint: just enough HTTP for Prometheus to scrape
+
+// the context of metrics connections in the event loop
+static char metrics_conn;
+
+// Listen for scrapes on PORT - on the loopback address only.
+static int metrics_listen(const char * port)
 {
-    if (fruit == bar) return "BAR";
-    if (fruit == bell) return "BELL";
-    if (fruit == plum) return "PLUM";
-    if (fruit == orange) return "ORANGE";
-    if (fruit == cherry) return "CHERRY";
-    return "UNKNOWN";
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(strtol(port, NULL, 10));
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    static const int yes=1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 4)) {
+        perror("bind metrics");
+        close(fd);
+        return -1;
+    }
+    printf(" . Metrics on 127.0.0.1:%s, socket %d\n", port, fd);
+    return fd;
 }
-*/
 
-// /////////////////////////////////
-int main(void)
+// the gauges: who's connected and in what state, what's queued for them, and the machine's totals
+static void metrics_write_clients(FILE * fp, const struct client * clients, unsigned int connections)
 {
-    puts("VNCSlots - starting up!");
+    unsigned int handshake = 0, init = 0, active = 0, continuous = 0;
+    unsigned long queued = 0;
+    long plays = private_plays, profit = private_profit;
+    for (unsigned int i = 0; i < room_count; i ++) {
+        plays += rooms[i].game.plays;
+        profit += rooms[i].game.profit;
+    }
+    for (const struct client * c = clients; c != NULL; c = c->next) {
+        if (c->state == none) continue;
+        if (c->room->id < 0) {
+            plays += c->room->game.plays;
+            profit += c->room->game.profit;
+        }
+        if (c->state < init_client) handshake ++;
+        else if (c->state == init_client) init ++;
+        else active ++;
+        if (c->continuous) continuous ++;
+        queued += c->out.bytes;
+    }
 
-    // local constants
-    static const uint8_t reels[3][20] = {
-        { orange, bar, plum, cherry, plum, orange, bell, plum, orange, cherry, orange, bar, orange, plum, orange, plum, cherry, bar, orange, plum },
-        { bell, cherry, bell, cherry, bell, cherry, bell, orange, bell, cherry, bell, cherry, bell, bar, bell, cherry, bell, cherry, bell, plum },
-        { orange, cherry, orange, plum, orange, bar, orange, plum, orange, bell, orange, cherry, orange, plum, orange, plum, orange, cherry, orange, plum }
+    fprintf(fp, "# HELP vncslots_clients Connected clients, by handshake state.\n"
+            "# TYPE vncslots_clients gauge\n"
+            "vncslots_clients{state=\"handshake\"} %u\n"
+            "vncslots_clients{state=\"init\"} %u\n"
+            "vncslots_clients{state=\"active\"} %u\n"
+            "# HELP vncslots_continuous_clients Clients on ContinuousUpdates.\n"
+            "# TYPE vncslots_continuous_clients gauge\n"
+            "vncslots_continuous_clients %u\n"
+            "# HELP vncslots_connections_total Connections accepted.\n"
+            "# TYPE vncslots_connections_total counter\n"
+            "vncslots_connections_total %u\n"
+            "# HELP vncslots_queued_bytes Bytes waiting in client send queues.\n"
+            "# TYPE vncslots_queued_bytes gauge\n"
+            "vncslots_queued_bytes %lu\n"
+            "# HELP vncslots_spins_total Pulls of the handle.\n"
+            "# TYPE vncslots_spins_total counter\n"
+            "vncslots_spins_total %ld\n"
+            "# HELP vncslots_payout_coins_total Coins paid out.\n"
+            "# TYPE vncslots_payout_coins_total counter\n"
+            "vncslots_payout_coins_total %ld\n"
+            "# HELP vncslots_rooms Slot machines, and how many are in the middle of a pull.\n"
+            "# TYPE vncslots_rooms gauge\n"
+            "vncslots_rooms{state=\"shared\"} %u\n"
+            "vncslots_rooms{state=\"private\"} %u\n"
+            "vncslots_rooms{state=\"running\"} %u\n"
+            "# HELP vncslots_governor_stage Load-shedding stage: 0 normal, 1 cheap encodings, 2 slow spectators, 3 refusing connections.\n"
+            "# TYPE vncslots_governor_stage gauge\n"
+            "vncslots_governor_stage %d\n"
+            "# HELP vncslots_governor_load Smoothed share of the tick budget in use.\n"
+            "# TYPE vncslots_governor_load gauge\n"
+            "vncslots_governor_load %.3f\n",
+            handshake, init, active, continuous, connections, queued, plays, profit, room_count, private_count, rooms_running,
+            governor.stage, governor.load / 1000.0);
+
+    static const char * const client_metrics[] = {
+        "# HELP vncslots_client_sent_bytes_total Bytes sent, per client.\n"
+        "# TYPE vncslots_client_sent_bytes_total counter\n",
+        "# HELP vncslots_client_queued_bytes Bytes waiting in the send queue, per client.\n"
+        "# TYPE vncslots_client_queued_bytes gauge\n",
+        "# HELP vncslots_client_unacked_bytes Bytes sent but not yet fenced back, per client.\n"
+        "# TYPE vncslots_client_unacked_bytes gauge\n",
+        "# HELP vncslots_client_rtt_seconds Smoothed fence round-trip time, per client.\n"
+        "# TYPE vncslots_client_rtt_seconds gauge\n",
+        "# HELP vncslots_client_delivery_bytes_per_second Measured delivery rate, per client.\n"
+        "# TYPE vncslots_client_delivery_bytes_per_second gauge\n",
+        "# HELP vncslots_client_backlog_bytes Bytes queued or in transit at the last tick, per client.\n"
+        "# TYPE vncslots_client_backlog_bytes gauge\n",
+        "# HELP vncslots_client_drain_bytes_per_second Rate the send backlog drains at, per client.\n"
+        "# TYPE vncslots_client_drain_bytes_per_second gauge\n",
+        "# HELP vncslots_client_fps Frames per second actually sent, per client.\n"
+        "# TYPE vncslots_client_fps gauge\n",
+        "# HELP vncslots_client_frame_skips_total Ticks a client sat out to let its link drain.\n"
+        "# TYPE vncslots_client_frame_skips_total counter\n"
     };
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    for (int k = 0; k < 9; k ++) {
+        fputs(client_metrics[k], fp);
+        for (const struct client * c = clients; c != NULL; c = c->next) {
+            if (c->state == none) continue;
+            switch (k) {
+            case 0:
+                fprintf(fp, "vncslots_client_sent_bytes_total{fd=\"%d\"} %u\n", c->fd, c->bytes_sent);
+                break;
+            case 1:
+                fprintf(fp, "vncslots_client_queued_bytes{fd=\"%d\"} %zu\n", c->fd, c->out.bytes);
+                break;
+            case 2:
+                fprintf(fp, "vncslots_client_unacked_bytes{fd=\"%d\"} %u\n", c->fd,
+                        (c->encodings & Fence) ? c->bytes_sent - c->acked_bytes : 0);
+                break;
+            case 3:
+                fprintf(fp, "vncslots_client_rtt_seconds{fd=\"%d\"} %.6f\n", c->fd, c->rtt / 1e6);
+                break;
+            case 4:
+                fprintf(fp, "vncslots_client_delivery_bytes_per_second{fd=\"%d\"} %u\n", c->fd, c->bandwidth);
+                break;
+            case 5:
+                fprintf(fp, "vncslots_client_backlog_bytes{fd=\"%d\"} %zu\n", c->fd, c->backlog);
+                break;
+            case 6:
+                fprintf(fp, "vncslots_client_drain_bytes_per_second{fd=\"%d\"} %u\n", c->fd, c->drain_rate);
+                break;
+            case 7:
+                fprintf(fp, "vncslots_client_fps{fd=\"%d\"} %.2f\n", c->fd, client_fps(c, &now));
+                break;
+            default:
+                fprintf(fp, "vncslots_client_frame_skips_total{fd=\"%d\"} %lu\n", c->fd, c->frame_skips);
+                break;
+            }
+        }
+    }
+}
 
-    // important variables
-    plays = 0;
-    profit = 0;
-    FILE * stats = fopen("stats.ini", "r");
-    if (stats != NULL) {
-        fscanf(stats, "%d %d\n", &plays, &profit);
-        fclose(stats);
+// Answer a request on a metrics connection.  The scraper hangs up once it has the answer.
+static void metrics_serve(int fd, const unsigned char * data, size_t len, const struct client * clients, unsigned int connections)
+{
+    char * body = NULL;
+    size_t body_len = 0;
+    FILE * fp = open_memstream(&body, &body_len);
+    if (fp == NULL) {
+        perror("open_memstream");
+        net_detach(&net, fd);
+        return;
+    }
+    const int found = (len >= 13 && memcmp(data, "GET /metrics", 12) == 0 && (data[12] == ' ' || data[12] == '?'));
+    if (found) {
+        metrics_write_clients(fp, clients, connections);
+        metrics_write(fp);
     }
+    fclose(fp);
+
+    char header[160];
+    int header_len = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\nConnection: close\r\n\r\n", found ? "200 OK" : "404 Not Found", body_len);
+
+    // the reply is small and local: let it go out in one blocking send, rather than keep it around
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0) fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    struct outq q;
+    outq_init(&q);
+    outq_push_copy(&q, header, header_len);
+    outq_push_copy(&q, body, body_len);
+    if (! net_send(&net, fd, &q, MSG_NOSIGNAL, 0, NULL, NULL)) net_detach(&net, fd);
+    outq_free(&q);
+    free(body);
+}
 
-    // reel positions
-    reel_stop[0] = reel_stop[1] = reel_stop[2] = 0;
-    reel_position[0] = reel_position[1] = reel_position[2] = 960 - 57 + 16;
+// FNV-1a over the framebuffer, to compare frames between runs
+static uint64_t hash_image(const struct image * img)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < img->width * img->height; i ++) {
+        hash ^= img->data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
 
-    //  linked lists of listeners and clients
-    struct listener * listeners = NULL;
-    struct client * clients = NULL;
-    // nEtwork socketstuff
-    int listener_fd_max = 0;    // maximum file descriptor number
-    fd_set master;    // master file descriptor list
-    FD_ZERO(&master);    // clear the master set
-
-    // images
-    puts("Loading images...");
-    const struct image * img_background = read_image("background.bin");
-    const struct image * img_digits = read_image("digits.bin");
-    const struct image * img_ball = read_image("ball.bin");
-    const struct image * img_handle = read_image("handle.bin");
-    const struct image * img_coin = read_image("coin.bin");
-    const struct image * img_coinslot = read_image("coinslot.bin");
-    struct image * img_fruit = read_image("fruit.bin");
-
-    // build three large reel images
-    struct image * img_reels[3];
-    for (int i = 0; i < 3; i ++) {
-        img_reels[i] = make_image(32, 48 * 20);
-        for (int k = 0; k < 20; k ++) {
-            blit_simple(img_fruit, 0, 32 * reels[i][k], img_reels[i], 0, 48 * k, 32, 32);
-            fill(img_reels[i], 0, 48 * k + 32, 32, 16, 0xFF);
+static double elapsed(const struct timespec * start, const struct timespec * end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+// Headless mode: run a number of full pulls as fast as possible, with no sockets or clock waits,
+//  and report how long the rendering took in each state
+static int simulate(struct game * g, unsigned int pulls, int print_hash)
+{
+    unsigned int frames = 0;
+    unsigned int state_frames[gamestate_count] = { 0 };
+    double state_time[gamestate_count] = { 0 };
+
+    struct timespec start, end, t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (unsigned int pull = 0; pull < pulls; pull ++) {
+        game_pull(g);
+        while (g->state != waiting) {
+            enum gamestate s = g->state;
+
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            game_tick(g);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+
+            state_frames[s] ++;
+            state_time[s] += elapsed(&t0, &t1);
+
+            if (print_hash)
+                printf("frame %u pull %u %s %016llx\n", frames, pull, gamestate_name(s), (unsigned long long)hash_image(g->framebuffer));
+            frames ++;
         }
     }
-    free_image(img_fruit);
 
-    // build BGR233 palette
-    //  the format of a RFB palette is uint16
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double total = elapsed(&start, &end);
+
+    printf("Simulated %u pulls: %u frames in %.3f s (%.0f frames/sec)\n", pulls, frames, total, total > 0 ? frames / total : 0);
+    printf("plays = %d, profit = %d, net = %d, final frame %016llx\n", g->plays, g->profit, g->profit - g->plays, (unsigned long long)hash_image(g->framebuffer));
+    printf("%-12s %10s %12s %10s\n", "state", "frames", "render ms", "us/frame");
+    for (int s = 0; s < gamestate_count; s ++) {
+        if (state_frames[s] == 0) continue;
+        printf("%-12s %10u %12.3f %10.3f\n", gamestate_name(s), state_frames[s], state_time[s] * 1000, state_time[s] * 1000000 / state_frames[s]);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// /////////////////////////////////
+// Handing off to a new process (see handoff.h): every socket, and everything about the machines
+//  and the clients that a fresh process couldn't work out for itself
+
+static void put_timeval(struct handoff * h, const struct timeval * tv)
+{
+    handoff_put64(h, tv->tv_sec);
+    handoff_put32(h, tv->tv_usec);
+}
+
+static void get_timeval(struct handoff * h, struct timeval * tv)
+{
+    tv->tv_sec = handoff_get64(h);
+    tv->tv_usec = handoff_get32(h);
+}
+
+// a machine's state - the framebuffer is drawn again from that, and its hash checks it came out the same
+static void save_game(struct handoff * h, const struct game * g)
+{
+    handoff_put8(h, g->state);
+    handoff_put32(h, g->plays);
+    handoff_put32(h, g->profit);
+    for (int i = 0; i < 3; i ++) {
+        handoff_put8(h, g->reel_stop[i]);
+        handoff_put16(h, g->reel_position[i]);
+        handoff_put16(h, g->reel_left[i]);
+    }
+    handoff_put16(h, g->coin_y);
+    handoff_put16(h, g->handle_y);
+    handoff_put16(h, g->payout_left);
+    handoff_put64(h, g->rng);
+    handoff_put32(h, g->version);
+    handoff_put32(h, g->epoch);
+    handoff_put64(h, hash_image(g->framebuffer));
+}
+
+// (into a machine that already has its assets and framebuffer) returns the old framebuffer's hash
+static uint64_t load_game(struct handoff * h, struct game * g)
+{
+    g->state = handoff_get8(h);
+    if (g->state >= gamestate_count) {
+        h->bad = 1;
+        g->state = waiting;
+    }
+    g->plays = handoff_get32(h);
+    g->profit = handoff_get32(h);
+    for (int i = 0; i < 3; i ++) {
+        g->reel_stop[i] = handoff_get8(h);
+        g->reel_position[i] = handoff_get16(h);
+        g->reel_left[i] = handoff_get16(h);
+    }
+    g->coin_y = handoff_get16(h);
+    g->handle_y = handoff_get16(h);
+    g->payout_left = handoff_get16(h);
+    g->rng = handoff_get64(h);
+    g->version = handoff_get32(h);
+    g->epoch = handoff_get32(h);
+    return handoff_get64(h);
+}
+
+// the new process's sprites don't draw the same picture: everyone needs the whole screen again
+static void check_game(struct game * g, uint64_t hash)
+{
+    if (hash_image(g->framebuffer) == hash) return;
+    g->version ++;
+    g->epoch ++;
+}
+
+static void save_client(struct handoff * h, struct client * c)
+{
+    handoff_put_fd(h, c->fd);
+    handoff_put8(h, c->state);
+    handoff_put32(h, c->read);
+    handoff_put32(h, c->needed);
+    handoff_put32(h, c->extra);
+    handoff_put(h, c->buffer, sizeof(c->buffer));
+    handoff_put64(h, c->zerocopy_min);
+    handoff_put32(h, c->out.zerocopy_next);
+    handoff_put32(h, c->bytes_sent);
+
+    handoff_put8(h, c->format.bpp);
+    handoff_put8(h, c->format.big_endian_flag);
+    handoff_put8(h, c->format.true_color_flag);
+    handoff_put16(h, c->format.red_div);
+    handoff_put16(h, c->format.green_div);
+    handoff_put16(h, c->format.blue_div);
+    handoff_put8(h, c->format.red_shift);
+    handoff_put8(h, c->format.green_shift);
+    handoff_put8(h, c->format.blue_shift);
+    handoff_put16(h, c->encodings);
+    handoff_put16(h, c->width);
+    handoff_put16(h, c->height);
+    handoff_put8(h, c->scale);
+    handoff_put8(h, c->key_down);
+    handoff_put8(h, c->mouse_down);
+
+    handoff_put8(h, c->ready);
+    handoff_put16(h, c->requested.x);
+    handoff_put16(h, c->requested.y);
+    handoff_put16(h, c->requested.w);
+    handoff_put16(h, c->requested.h);
+    handoff_put8(h, c->continuous);
+    handoff_put8(h, c->sent_end_of_cu);
+    handoff_put16(h, c->cu_x);
+    handoff_put16(h, c->cu_y);
+    handoff_put16(h, c->cu_w);
+    handoff_put16(h, c->cu_h);
+    handoff_put8(h, c->fence_pending);
+    handoff_put32(h, c->fence_id);
+    put_timeval(h, &c->fence_sent);
+    put_timeval(h, &c->fence_acked);
+    handoff_put32(h, c->fence_bytes);
+    handoff_put32(h, c->acked_bytes);
+    handoff_put32(h, c->rtt);
+    handoff_put32(h, c->bandwidth);
+    handoff_put32(h, c->delivered);
+    handoff_put64(h, c->backlog);
+    put_timeval(h, &c->pace_sampled);
+    handoff_put32(h, c->drain_rate);
+    put_timeval(h, &c->last_frame);
+    handoff_put32(h, c->frame_interval);
+    handoff_put64(h, c->frame_skips);
+    handoff_put64(h, c->last_input);
+    handoff_put8(h, c->probing);
+
+    // what it has been sent
+    handoff_put32(h, c->version);
+    handoff_put32(h, c->epoch);
+    handoff_put8(h, c->sent_cursor);
+    handoff_put8(h, c->sent_palette);
+    handoff_put8(h, c->seen.state);
+    handoff_put16(h, c->seen.coin_y);
+    handoff_put16(h, c->seen.handle_y);
     for (int i = 0; i < 3; i ++)
-    {
-        palette[i] = malloc(256 * sizeof(uint16_t));
-        if (palette[i] == NULL) {
-            perror("malloc palette");
-            return EXIT_FAILURE;
-        }
+        handoff_put16(h, c->seen.reel_position[i]);
+    handoff_put32(h, c->seen.plays);
+    handoff_put32(h, c->seen.profit);
+
+    // its machine: a shared one by number, or its own, in full
+    handoff_put32(h, c->room->id >= 0 ? (uint32_t)c->room->id : UINT32_MAX);
+    if (c->room->id < 0) {
+        save_game(h, &c->room->game);
+        handoff_put8(h, c->room->running_link != NULL);
+    }
+    handoff_put8(h, c->room->player == c);
+
+    // a recording carries on into the same files
+    handoff_put8(h, c->rec != NULL);
+    if (c->rec) {
+        fflush(c->rec->in);
+        fflush(c->rec->out);
+        handoff_put_fd(h, fileno(c->rec->in));
+        handoff_put_fd(h, fileno(c->rec->out));
+        put_timeval(h, &c->rec->start);
     }
+}
 
-    int i = 0;
-    for (int b = 0; b < 4; b ++)
-    {
-        for (int g = 0; g < 8; g ++)
-        {
-            for (int r = 0; r < 8; r ++)
-            {
-                palette[0][i] = (r << 13) | (r << 10) | (r << 7) | (r << 4) | (r << 1) | (r >> 2);
-                palette[1][i] = (g << 13) | (g << 10) | (g << 7) | (g << 4) | (g << 1) | (g >> 2);
-                palette[2][i] = (b << 14) | (b << 12) | (b << 10) | (b << 8) | (b << 6) | (b << 4) | (b << 2) | b;
-                i ++;
-            }
+// a client as the old process left it - returns NULL if that doesn't work out (with its socket closed)
+static struct client * load_client(struct handoff * h)
+{
+    struct client * c = calloc(1, sizeof(struct client));
+    if (c == NULL) {
+        perror("malloc client");
+        exit(EXIT_FAILURE);
+    }
+    outq_init(&c->out);
+    timer_init(&c->deadline, c, timer_deadline);
+    timer_init(&c->pace, c, timer_pace);
+
+    c->fd = handoff_get_fd(h);
+    c->state = handoff_get8(h);
+    if (c->state == none || c->state > relay_feed) h->bad = 1;
+    c->read = handoff_get32(h);
+    c->needed = handoff_get32(h);
+    c->extra = handoff_get32(h);
+    if (c->read > sizeof(c->buffer) || c->needed > sizeof(c->buffer)) h->bad = 1;
+    handoff_get(h, c->buffer, sizeof(c->buffer));
+    c->zerocopy_min = handoff_get64(h);
+    c->out.zerocopy_next = handoff_get32(h);
+    c->bytes_sent = handoff_get32(h);
+
+    c->format.bpp = handoff_get8(h);
+    c->format.big_endian_flag = handoff_get8(h);
+    c->format.true_color_flag = handoff_get8(h);
+    c->format.red_div = handoff_get16(h);
+    c->format.green_div = handoff_get16(h);
+    c->format.blue_div = handoff_get16(h);
+    c->format.red_shift = handoff_get8(h);
+    c->format.green_shift = handoff_get8(h);
+    c->format.blue_shift = handoff_get8(h);
+    c->encodings = handoff_get16(h);
+    c->width = handoff_get16(h);
+    c->height = handoff_get16(h);
+    c->scale = handoff_get8(h);
+    if (c->scale < 1 || c->scale > SHADOW_SCALE_MAX) h->bad = 1;
+    c->key_down = handoff_get8(h);
+    c->mouse_down = handoff_get8(h);
+
+    c->ready = handoff_get8(h);
+    c->requested.x = handoff_get16(h);
+    c->requested.y = handoff_get16(h);
+    c->requested.w = handoff_get16(h);
+    c->requested.h = handoff_get16(h);
+    c->continuous = handoff_get8(h);
+    c->sent_end_of_cu = handoff_get8(h);
+    c->cu_x = handoff_get16(h);
+    c->cu_y = handoff_get16(h);
+    c->cu_w = handoff_get16(h);
+    c->cu_h = handoff_get16(h);
+    c->fence_pending = handoff_get8(h);
+    c->fence_id = handoff_get32(h);
+    get_timeval(h, &c->fence_sent);
+    get_timeval(h, &c->fence_acked);
+    c->fence_bytes = handoff_get32(h);
+    c->acked_bytes = handoff_get32(h);
+    c->rtt = handoff_get32(h);
+    c->bandwidth = handoff_get32(h);
+    c->delivered = handoff_get32(h);
+    c->backlog = handoff_get64(h);
+    get_timeval(h, &c->pace_sampled);
+    c->drain_rate = handoff_get32(h);
+    get_timeval(h, &c->last_frame);
+    c->frame_interval = handoff_get32(h);
+    c->frame_skips = handoff_get64(h);
+    c->last_input = handoff_get64(h);
+    c->probing = handoff_get8(h);
+
+    c->version = handoff_get32(h);
+    c->epoch = handoff_get32(h);
+    c->sent_cursor = handoff_get8(h);
+    c->sent_palette = handoff_get8(h);
+    c->seen.state = handoff_get8(h);
+    if (c->seen.state >= gamestate_count) h->bad = 1;
+    c->seen.coin_y = handoff_get16(h);
+    c->seen.handle_y = handoff_get16(h);
+    for (int i = 0; i < 3; i ++)
+        c->seen.reel_position[i] = handoff_get16(h);
+    c->seen.plays = handoff_get32(h);
+    c->seen.profit = handoff_get32(h);
+
+    const uint32_t room = handoff_get32(h);
+    if (room == UINT32_MAX) {
+        c->room = (private_rooms ? room_private() : NULL);
+        if (c->room != NULL) {
+            // drawn over the shared starting frame, as if it had been played that far
+            struct game * g = &c->room->game;
+            const uint64_t hash = load_game(h, g);
+            const unsigned int version = g->version, epoch = g->epoch;
+            game_rebase(g, &private_base, g->framebuffer);
+            g->version = version;
+            g->epoch = epoch;
+            check_game(g, hash);
+            if (handoff_get8(h)) room_run(c->room);
         }
+    } else if (room < room_count) {
+        c->room = &rooms[room];
+    }
+    if (c->room == NULL) h->bad = 1;
+    else {
+        c->room->clients ++;
+        if (handoff_get8(h)) c->room->player = c;
     }
 
-    // BUILD FRAMEBUFFER
-    framebuffer = make_image(512, 384);
+    if (handoff_get8(h)) {
+        int in = handoff_get_fd(h), out = handoff_get_fd(h);
+        struct timeval start;
+        get_timeval(h, &start);
+        if (in >= 0 && out >= 0) c->rec = record_adopt(in, out, &start);
+    }
 
-    // blit
-    blit_simple(img_background, 0, 0, framebuffer, 0, 0, img_background->width, img_background->height);
-    draw_handle(framebuffer, img_background, img_handle, img_ball, 0);
-    draw_number(framebuffer, img_digits, plays, 19, 293);
-    draw_number(framebuffer, img_digits, profit, 19, 323);
-    draw_number(framebuffer, img_digits, profit - plays, 19, 353);
+    if (h->bad || c->fd < 0 || ! net_attach(&net, c->fd, c)) {
+        fputs("Couldn't take over a client\n", stderr);
+        if (c->room) room_leave(c->room);
+        if (c->rec) record_close(c->rec);
+        if (c->fd >= 0) close(c->fd);
+        free(c);
+        return NULL;
+    }
 
-    // visuals - the center position is 57 pixels down but then we also have to remove 16px for the top half of the fruit
+    // deadlines start over, as they would after any other input
+    const uint64_t now = timer_now();
+    if (c->state < client_message) timer_set(&timers, &c->deadline, now + HANDSHAKE_TIMEOUT);
+    else timer_set(&timers, &c->deadline, (c->probing ? now + KEEPALIVE_GRACE : c->last_input + IDLE_TIMEOUT));
+    return c;
+}
 
-    draw_reel(framebuffer, img_reels[0], reel_position[0], 222, 67);
-    draw_reel(framebuffer, img_reels[1], reel_position[1], 272, 67);
-    draw_reel(framebuffer, img_reels[2], reel_position[2], 322, 67);
+// (old process) Everything the new one needs.
+static void handoff_save(struct handoff * h, const struct client * clients, unsigned int connections)
+{
+    handoff_put32(h, connections);
+    handoff_put8(h, private_rooms);
+
+    handoff_put32(h, listeners);
+    for (unsigned int i = 0; i < listeners; i ++)
+        handoff_put_fd(h, listen_fds[i]);
+    handoff_put_fd(h, metrics_fd);
+    handoff_put_fd(h, cluster_fd);
+
+    handoff_put32(h, room_count);
+    for (unsigned int i = 0; i < room_count; i ++) {
+        save_game(h, &rooms[i].game);
+        handoff_put8(h, rooms[i].running_link != NULL);
+    }
+    handoff_put64(h, private_seed);
+    handoff_put64(h, private_plays);
+    handoff_put64(h, private_profit);
+
+    unsigned int count = 0;
+    for (const struct client * c = clients; c != NULL; c = c->next) count ++;
+    handoff_put32(h, count);
+    for (const struct client * c = clients; c != NULL; c = c->next)
+        save_client(h, (struct client *)c);
+}
 
-    // BIND LISTENERS
-    puts("Binding listen sockets (port " PORT ")...");
-    {
-        // get us a socket and bind it - any family, TCP / stream
-        static const struct addrinfo hints = {
-            .ai_family = AF_UNSPEC,
-            .ai_socktype = SOCK_STREAM,
-            .ai_protocol = IPPROTO_TCP,
-            .ai_flags = AI_ADDRCONFIG | AI_PASSIVE
-        };
-
-        struct addrinfo *ai;
-        int rv = getaddrinfo(NULL, PORT, &hints, &ai);
-        if (rv != 0) {
-            fputs("getaddrinfo: ", stderr);
-            fputs(gai_strerror(rv), stderr);
-            return EXIT_FAILURE;
+// (old process) Stop taking input and connections, and say whether everything has gone quiet
+//  enough to hand over - with any client whose output hasn't drained by the deadline dropped.
+static int handoff_drained(struct client * clients)
+{
+    int ready = 1;
+    for (unsigned int i = 0; i < listeners; i ++)
+        ready &= net_release(&net, listen_fds[i]);
+    if (metrics_fd >= 0) ready &= net_release(&net, metrics_fd);
+    if (cluster_fd >= 0) ready &= net_release(&net, cluster_fd);
+
+    const int late = (timer_now() >= handoff_started + HANDOFF_DRAIN);
+    for (struct client * c = clients; c != NULL; c = c->next) {
+        if (c->state == none) continue;
+        if (c->zerocopy_min) outq_zerocopy_complete(&c->out, c->fd);
+        if (net_release(&net, c->fd) && c->out.count == 0 && c->out.zerocopy_count == 0) continue;
+        if (late) {
+            printf("- Client %d is still behind: dropping it for the handoff\n", c->fd);
+            client_drop(c);
+        } else {
+            ready = 0;
         }
+    }
+    client_sweep();
+    return ready;
+}
 
-        for(struct addrinfo * p = ai; p != NULL; p = p->ai_next) {
-            int fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-            if (fd < 0) {
-                perror("socket");
-                continue;
-            }
+// (old process) The new one never took over: carry on as before.
+static void handoff_abort(struct client * clients)
+{
+    fputs("Handoff failed - carrying on\n", stderr);
+    close(successor_fd);
+    successor_fd = -1;
+    for (unsigned int i = 0; i < listeners; i ++)
+        net_listen(&net, listen_fds[i]);
+    if (metrics_fd >= 0) net_listen(&net, metrics_fd);
+    if (cluster_fd >= 0) net_listen(&net, cluster_fd);
+    for (struct client * c = clients; c != NULL; c = c->next) {
+        if (! net_attach(&net, c->fd, c)) client_drop(c);
+    }
+    client_sweep();
+}
 
-            // lose the pesky "address already in use" error message
-            static const int yes=1;
-            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+// (old process) Once everyone is quiet, send it all over - and if the new process takes it, that's
+//  the end of this one.
+static void handoff_step(struct client * clients, unsigned int connections)
+{
+    if (! handoff_drained(clients)) return;
+
+    struct handoff h;
+    handoff_init(&h);
+    handoff_save(&h, clients, connections);
+    int ok = handoff_send(successor_fd, &h);
+    handoff_free(&h);
+
+    unsigned char answer = 0;
+    if (ok) {
+        const struct timeval wait = { HANDOFF_ANSWER / 1000, HANDOFF_ANSWER % 1000 * 1000 };
+        setsockopt(successor_fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+        ok = (recv(successor_fd, &answer, 1, 0) == 1 && answer == HANDOFF_OK);
+    }
+    if (! ok) {
+        handoff_abort(clients);
+        return;
+    }
 
-            if (bind(fd, p->ai_addr, p->ai_addrlen)) {
-                perror("bind");
-                close(fd);
-                continue;
-            }
+    // (the sockets stay open in the new process: closing ours as we go doesn't touch them)
+    //  - but let any encoding still going on in the background finish first
+    encode_set_threads(1);
+    printf("* Handed off to the new process after %lu ms\n", (unsigned long)(timer_now() - handoff_started));
+    fflush(stdout);
+    exit(EXIT_SUCCESS);
+}
 
-            if (listen(fd, 1)) {
-                perror("listen");
-                close(fd);
-                continue;
+// (new process) The sockets, from what the old one sent - listen_fds, metrics_fd and cluster_fd
+//  - and how many rooms it had.
+static unsigned int takeover_sockets(struct handoff * h, unsigned int * connections)
+{
+    *connections = handoff_get32(h);
+    const int was_private = handoff_get8(h);
+    if (was_private != private_rooms) {
+        fputs("Taking over needs the same --private setting\n", stderr);
+        h->bad = 1;
+    }
+
+    listeners = handoff_get32(h);
+    if (listeners > MAX_LISTENERS) {
+        h->bad = 1;
+        listeners = 0;
+    }
+    for (unsigned int i = 0; i < listeners; i ++)
+        listen_fds[i] = handoff_get_fd(h);
+    metrics_fd = handoff_get_fd(h);
+    cluster_fd = handoff_get_fd(h);
+    return handoff_get32(h);
+}
+
+// (new process) The machines, picking up exactly where they were - and where the private ones
+//  had got to.
+static void takeover_rooms(struct handoff * h)
+{
+    for (unsigned int i = 0; i < room_count; i ++) {
+        struct game * g = &rooms[i].game;
+        const uint64_t hash = load_game(h, g);
+        game_redraw(g);
+        check_game(g, hash);
+        if (handoff_get8(h)) room_run(&rooms[i]);
+    }
+    private_seed = handoff_get64(h);
+    private_plays = handoff_get64(h);
+    private_profit = handoff_get64(h);
+}
+
+// (new process) And everyone watching them.
+static void takeover_clients(struct handoff * h, struct client ** clients)
+{
+    const unsigned int count = handoff_get32(h);
+    unsigned int adopted = 0;
+    for (unsigned int i = 0; i < count && ! h->bad; i ++) {
+        struct client * c = load_client(h);
+        if (c == NULL) continue;
+        client_link(clients, c);
+        adopted ++;
+    }
+    printf("* Took over %u of %u clients\n", adopted, count);
+}
+
+static void usage(const char * name)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "  --seed N          seed the reel RNG (default: /dev/urandom, or 1 when simulating)\n"
+            "  --simulate N      run N pulls headless as fast as possible and report render costs\n"
+            "  --hash            with --simulate, print a hash of the framebuffer for every frame\n"
+            "  --threads N       encode big areas (full refreshes) in bands on N threads (default 1)\n"
+            "  --bench-encode N  time each encoder on a whole frame with 1 to N threads, and exit\n"
+            "  --geometry WxH    make the framebuffer W x H, with the machine in the middle (default %ux%u)\n"
+            "  --record DIR      capture every session into DIR as <n>-in.fbs / <n>-out.fbs\n"
+            "  --zerocopy        send large updates with MSG_ZEROCOPY\n"
+            "  --uring           use io_uring for the network, if the kernel has it\n"
+            "  --pack FILE       write the built-in images (and reels) to an asset pack, and exit\n"
+            "  --assets FILE     run from an asset pack, reloading it whenever it's replaced\n"
+            "  --metrics PORT    serve Prometheus metrics on 127.0.0.1:PORT\n"
+            "  --backlog N       connections waiting to be accepted before the kernel drops more (default %d)\n"
+            "  --rooms N         run N independent machines, each new client joining the emptiest (default 1)\n"
+            "  --private         give every client a machine of its own instead\n"
+            "  --port PORT       listen for viewers on PORT (default " PORT ")\n"
+            "  --authority WHERE run the machine for relays subscribing at WHERE - a port, or a Unix socket path\n"
+            "  --relay WHERE     mirror the authority at WHERE - host:port, or a Unix socket path - for viewers here\n"
+            "  --handoff PATH    wait at Unix socket PATH for a new process to take over everything, then exit\n"
+            "  --takeover PATH   start by taking over from the process waiting at PATH\n",
+            name, MACHINE_WIDTH, MACHINE_HEIGHT, DEFAULT_BACKLOG);
+}
+
+// /////////////////////////////////
+int main(int argc, char * argv[])
+{
+    // command-line options
+    static const struct option long_options[] = {
+        { "seed", required_argument, NULL, 's' },
+        { "simulate", required_argument, NULL, 'S' },
+        { "hash", no_argument, NULL, 'H' },
+        { "threads", required_argument, NULL, 't' },
+        { "bench-encode", required_argument, NULL, 'E' },
+        { "geometry", required_argument, NULL, 'g' },
+        { "record", required_argument, NULL, 'r' },
+        { "zerocopy", no_argument, NULL, 'z' },
+        { "uring", no_argument, NULL, 'u' },
+        { "pack", required_argument, NULL, 'p' },
+        { "assets", required_argument, NULL, 'a' },
+        { "metrics", required_argument, NULL, 'm' },
+        { "backlog", required_argument, NULL, 'b' },
+        { "rooms", required_argument, NULL, 'R' },
+        { "private", no_argument, NULL, 'P' },
+        { "port", required_argument, NULL, 'o' },
+        { "authority", required_argument, NULL, 'A' },
+        { "relay", required_argument, NULL, 'L' },
+        { "handoff", required_argument, NULL, 'F' },
+        { "takeover", required_argument, NULL, 'T' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    uint64_t seed = 0;
+    long simulate_pulls = -1;
+    int print_hash = 0;
+    long threads = 1;
+    long bench_threads = 0;
+    unsigned int width = MACHINE_WIDTH, height = MACHINE_HEIGHT;
+    const char * record_dir = NULL;
+    int zerocopy = 0;
+    int use_uring = 0;
+    const char * pack_out = NULL;
+    const char * assets_file = NULL;
+    const char * metrics_port = NULL;
+    int backlog = DEFAULT_BACKLOG;
+    long room_option = 1;
+    const char * port = PORT;
+    const char * authority = NULL;
+    const char * handoff_path = NULL;
+    const char * takeover_path = NULL;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'S':
+            simulate_pulls = strtol(optarg, NULL, 0);
+            break;
+        case 'H':
+            print_hash = 1;
+            break;
+        case 't':
+            threads = strtol(optarg, NULL, 0);
+            break;
+        case 'E':
+            bench_threads = strtol(optarg, NULL, 0);
+            break;
+        case 'g':
+            if (sscanf(optarg, "%ux%u", &width, &height) != 2 || width < MACHINE_WIDTH || height < MACHINE_HEIGHT ||
+                    width > FRAMEBUFFER_MAX || height > FRAMEBUFFER_MAX) {
+                fprintf(stderr, "--geometry takes WxH, from %ux%u up to %ux%u\n", MACHINE_WIDTH, MACHINE_HEIGHT, FRAMEBUFFER_MAX, FRAMEBUFFER_MAX);
+                return EXIT_FAILURE;
             }
+            break;
+        case 'r':
+            record_dir = optarg;
+            break;
+        case 'z':
+            zerocopy = 1;
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'p':
+            pack_out = optarg;
+            break;
+        case 'a':
+            assets_file = optarg;
+            break;
+        case 'm':
+            metrics_port = optarg;
+            break;
+        case 'b':
+            backlog = strtol(optarg, NULL, 0);
+            break;
+        case 'R':
+            room_option = strtol(optarg, NULL, 0);
+            if (room_option < 1) {
+                fputs("--rooms needs at least one\n", stderr);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            private_rooms = 1;
+            break;
+        case 'o':
+            port = optarg;
+            break;
+        case 'A':
+            authority = optarg;
+            break;
+        case 'L':
+            upstream_address = optarg;
+            break;
+        case 'F':
+            handoff_path = optarg;
+            break;
+        case 'T':
+            takeover_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
 
-            // looks good!  print some info and put this into the master set
-            char ip[INET6_ADDRSTRLEN];
-            inet_ntop(p->ai_addr->sa_family,
-                      get_in_addr(p->ai_addr),
-                      ip, INET6_ADDRSTRLEN);
-            printf(" . Bound to %s on socket %d\n", ip, fd);
+    if ((authority || upstream_address) && (room_option > 1 || private_rooms || (authority && upstream_address))) {
+        // a cluster shares the one machine
+        fputs("--authority and --relay each take a single shared machine\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    puts("VNCSlots - starting up!");
+    // simulating or benchmarking needs no sockets
+    const int headless = (simulate_pulls >= 0 || bench_threads > 0);
 
-            // add the listener to the master set
-            FD_SET(fd, &master);
+    if (pack_out != NULL) {
+        if (! pack_write(pack_out, &builtin_assets)) return EXIT_FAILURE;
+        printf("Wrote %s\n", pack_out);
+        return EXIT_SUCCESS;
+    }
 
-            // keep track of the biggest file descriptor
-            if (fd > listener_fd_max) listener_fd_max = fd;
+    // BIND LISTENERS
+    //  before anything else: everything the server needs to get going is compiled in, so a
+    //  restart is taking connections again without touching the disk or the heap
+    //  - or, taking over, all the sockets the old process had
+    struct handoff inherited;
+    handoff_init(&inherited);
+    int predecessor_fd = -1;
+    // count of all connections ever accepted, used to name session captures
+    unsigned int connections = 0;
+    if (takeover_path != NULL) {
+        printf("Taking over from %s...\n", takeover_path);
+        predecessor_fd = handoff_connect(takeover_path);
+        if (predecessor_fd < 0 || ! handoff_recv(predecessor_fd, &inherited)) return EXIT_FAILURE;
+        room_option = takeover_sockets(&inherited, &connections);
+        if (inherited.bad || room_option < 1) {
+            fputs("Couldn't make sense of the handoff\n", stderr);
+            return EXIT_FAILURE;
+        }
+    } else if (! headless) {
+        listeners = bind_listeners(listen_fds, MAX_LISTENERS, backlog, port);
+        // if we got here, it means we didn't get bound
+        if (listeners == 0) {
+            fputs("selectserver: failed to bind to any sockets\n", stderr);
+            return EXIT_FAILURE;
+        }
+    }
+    if (metrics_port != NULL && ! headless && metrics_fd < 0) {
+        metrics_fd = metrics_listen(metrics_port);
+        if (metrics_fd < 0) return EXIT_FAILURE;
+    }
+    if (authority != NULL && ! headless && cluster_fd < 0) {
+        cluster_fd = cluster_listen(authority, backlog);
+        if (cluster_fd < 0) return EXIT_FAILURE;
+    }
 
-            struct listener * l = malloc(sizeof(struct listener));
-            l->fd = fd;
-            l->next = listeners;
-            listeners = l;
+    // images - built in, or mapped from a pack
+    struct pack * pack = NULL;
+    const struct assets * a = &builtin_assets;
+    if (assets_file != NULL) {
+        puts("Mapping asset pack...");
+        pack = pack_open(assets_file);
+        if (pack == NULL) return EXIT_FAILURE;
+        a = pack_assets(pack);
+    }
 
+    if (headless) {
+        // a simulation always starts from a fresh machine, and is repeatable unless asked otherwise
+        static struct game game;
+        if (! game_init(&game, a, 0, 0, seed ? seed : 1, width, height)) return EXIT_FAILURE;
+        if (bench_threads > 0) {
+            encode_benchmark(stdout, game.framebuffer, bench_threads);
+            return EXIT_SUCCESS;
         }
+        return simulate(&game, simulate_pulls, print_hash);
+    }
+
+    // ENCODER THREADS
+    if (threads > 1) printf(" . Encoding big areas on %u threads\n", encode_set_threads(threads));
 
-        freeaddrinfo(ai); // all done with this
+    // BUILD FRAMEBUFFERS
+    //  one per room, each picking up where its stats file left off (and with a seed of its own)
+    //  - except a relay's, which only ever shows what the authority sends it
+    room_count = room_option;
+    rooms = calloc(room_count, sizeof(struct room));
+    if (rooms == NULL) {
+        perror("malloc rooms");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int i = 0; i < room_count; i ++) {
+        int plays = 0, profit = 0;
+        char name[32];
+        room_stats_file(name, sizeof(name), i);
+        FILE * stats = (upstream_address ? NULL : fopen(name, "r"));
+        if (stats != NULL) {
+            if (fscanf(stats, "%d %d\n", &plays, &profit) != 2) plays = profit = 0;
+            fclose(stats);
+        }
+        if (! game_init(&rooms[i].game, a, plays, profit, seed ? seed + i : 0, width, height)) return EXIT_FAILURE;
+    }
+    if (width != MACHINE_WIDTH || height != MACHINE_HEIGHT) printf(" . Framebuffer is %ux%u\n", width, height);
+    if (room_count > 1) printf("Running %u rooms\n", room_count);
+    if (private_rooms) {
+        // every private machine starts out the same: fresh, and looking like this
+        if (! game_init(&private_base, a, 0, 0, 0, width, height)) return EXIT_FAILURE;
+        private_share = share_image(private_base.framebuffer);
+        if (private_share == NULL) return EXIT_FAILURE;
+        if (takeover_path == NULL) private_seed = seed;
+        puts("Every client gets a machine of its own");
     }
 
-    // if we got here, it means we didn't get bound
-    if (listeners == NULL) {
-        fputs("selectserver: failed to bind to any sockets\n", stderr);
-        return EXIT_FAILURE;
+    if (takeover_path != NULL) takeover_rooms(&inherited);
+
+    //  linked list of clients
+    struct client * clients = NULL;
+    // nEtwork socketstuff
+    if (! net_init(&net, use_uring)) return EXIT_FAILURE;
+    printf("Using %s for the network\n", net.backend->name);
+
+    // put the listeners into the event loop
+    for (unsigned int i = 0; i < listeners; i ++) {
+        if (! net_listen(&net, listen_fds[i])) {
+            fputs("Failed to start listening\n", stderr);
+            return EXIT_FAILURE;
+        }
+    }
+    if (metrics_fd >= 0 && ! net_listen(&net, metrics_fd)) return EXIT_FAILURE;
+    if (cluster_fd >= 0 && ! net_listen(&net, cluster_fd)) return EXIT_FAILURE;
+
+    // a replaced asset pack gets swapped in between ticks
+    int watch_fd = -1, reload_pending = 0;
+    // clients that sat out the last tick to let their links drain, and are still behind
+    unsigned int held = 0;
+    governor_init(&governor);
+    timer_wheel_init(&timers, timer_now());
+    if (upstream_address != NULL) {
+        cluster_reader_init(&upstream);
+        outq_init(&upstream_out);
+        timer_init(&reconnect, NULL, timer_reconnect);
+        upstream_connect();
+    }
+    if (pack != NULL) {
+        watch_fd = pack_watch(assets_file);
+        if (watch_fd >= 0 && ! net_watch(&net, watch_fd, NULL)) {
+            close(watch_fd);
+            watch_fd = -1;
+        }
+        if (watch_fd >= 0) printf(" . Watching %s for changes\n", assets_file);
     }
 
-    puts("Ready to accept new connections!");
+    if (takeover_path != NULL) {
+        // everyone the old process had - then it can go
+        takeover_clients(&inherited, &clients);
+        if (inherited.bad) {
+            fputs("Couldn't make sense of the handoff\n", stderr);
+            return EXIT_FAILURE;
+        }
+        static const unsigned char ok = HANDOFF_OK;
+        if (send(predecessor_fd, &ok, 1, MSG_NOSIGNAL) != 1) {
+            perror("handoff answer");
+            return EXIT_FAILURE;
+        }
+        close(predecessor_fd);
+        handoff_free(&inherited);
+        // whatever came out different here (other sprites, another size) goes out straight away,
+        //  as after a reload
+        held = push_updates(clients);
+        client_sweep();
+    }
+    if (handoff_path != NULL) {
+        // and be ready to hand over in turn
+        handoff_fd = handoff_listen(handoff_path);
+        if (handoff_fd < 0 || ! net_listen(&net, handoff_fd)) return EXIT_FAILURE;
+        printf(" . Handing off to whoever turns up at %s\n", handoff_path);
+    }
 
-    // state info about the game display
-    gamestate = waiting;
+    puts("Ready to accept new connections!");
 
-    struct timeval tv_now, tv_next;
+    // a machine taken over mid-pull (or a client held back) has its tick due now, and the first
+    //  wait works out how long until then from tv_now
+    struct timeval tv_now;
+    gettimeofday(&tv_now, NULL);
+    if (timercmp(&tv_next, &tv_now, <)) tv_next = tv_now;
 
     /*
     	gettimeofday(&tv_now, NULL);
@@ -993,17 +2852,34 @@ int main(void)
     	}
     */
 
+    // SIGUSR1 dumps the client statistics - and must interrupt select() to do it
+    struct sigaction sa = { .sa_handler = dump_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+
     // main loop
-    int fd_max = listener_fd_max;
     for(;;) {
-        // temp file descriptor list for select()
-        fd_set read_fds = master;
+        if (dump_requested) {
+            dump_requested = 0;
+            dump_clients(clients);
+            selector_dump(stdout);
+            cache_dump(stdout);
+            fflush(stdout);
+        }
+        if (trace_requested) {
+            trace_requested = 0;
+            const char * written = trace_toggle();
+            if (trace_on) puts("* Tracing...");
+            else if (written) printf("* Trace written to %s\n", written);
+            fflush(stdout);
+        }
 
-        int ready_fds;
-        if (gamestate != waiting) {
+        // wait for input, or the next tick - which slow clients still catching up need too, and
+        //  the governor, to see the load has gone
+        struct timeval tv, * timeout = NULL;
+        if (rooms_running || held || governor.stage != governor_normal) {
             // set timer for remaining duration between now and next tick
-            struct timeval tv;
-
             if (tv_now.tv_usec > tv_next.tv_usec) {
                 tv.tv_sec = tv_next.tv_sec - tv_now.tv_sec - 1;
                 tv.tv_usec = tv_next.tv_usec + 1000000 - tv_now.tv_usec;
@@ -1011,418 +2887,176 @@ int main(void)
                 tv.tv_sec = tv_next.tv_sec - tv_now.tv_sec;
                 tv.tv_usec = tv_next.tv_usec - tv_now.tv_usec;
             }
-            ready_fds = select(fd_max+1, &read_fds, NULL, NULL, &tv);
-        } else {
-            ready_fds = select(fd_max+1, &read_fds, NULL, NULL, NULL);
+            timeout = &tv;
+        }
+        //  or the next client deadline, if that's sooner
+        const long timer_ms = timer_next(&timers, timer_now());
+        if (timer_ms >= 0 && (timeout == NULL || timer_ms * 1000 < tv.tv_sec * 1000000L + tv.tv_usec)) {
+            tv.tv_sec = timer_ms / 1000;
+            tv.tv_usec = timer_ms % 1000 * 1000;
+            timeout = &tv;
+        }
+        //  - handing off, nothing moves on but the output, and that's checked on often
+        if (successor_fd >= 0) {
+            tv.tv_sec = 0;
+            tv.tv_usec = 5000;
+            timeout = &tv;
         }
 
-        if (ready_fds < 0) {
-            perror("select");
+        struct net_event events[MAX_EVENTS];
+        int event_count = net_wait(&net, timeout, events, MAX_EVENTS);
+        if (event_count < 0) {
+            perror("net_wait");
             return EXIT_FAILURE;
-        } else if (ready_fds > 0) {
-            // run through the existing connections looking for data to read
-            fd_max = listener_fd_max;
-
-            //  check the accept sockets first
-            for (struct listener * l = listeners; l != NULL; l = l->next) {
-                // keep the max fd updated
-                if (FD_ISSET(l->fd, &read_fds)) {
-                    // handle new connections
-                    struct sockaddr_storage remoteaddr; // client address
-                    socklen_t addrlen = sizeof remoteaddr;
-                    int fd = accept(l->fd, (struct sockaddr *)&remoteaddr, &addrlen);
-                    if (fd == -1) {
-                        // an error occurred trying to accept the new connection - maybe they disconnected in the meantime or something
-                        perror("accept");
-                        continue;
-                    }
-                    // Connection success!
-                    char ip[INET6_ADDRSTRLEN];
-                    inet_ntop(remoteaddr.ss_family, get_in_addr((struct sockaddr*)&remoteaddr), ip, INET6_ADDRSTRLEN);
-                    printf("+ Received new connection from %s on socket %d\n", ip, fd);
-
-                    // send protocol-version message before anything else - if this fails, we can skip allocation etc
-                    // "RFB 003.008\n"
-                    static const unsigned char protocol_version[] = { 0x52, 0x46, 0x42, 0x20, 0x30, 0x30, 0x33, 0x2e, 0x30, 0x30, 0x38, 0x0a };
-                    if (send(fd, protocol_version, 12, 0) == -1) {
-                        perror("send");
-                        continue;
-                    }
-                    FD_SET(fd, &master); // add to master set
-                    if (fd > fd_max) fd_max = fd;
-
-                    struct client * c = malloc(sizeof(struct client));
-
-                    // initialize all client state
-                    c->fd = fd;
-
-                    c->state = handshake_protocolversion;
-                    static const struct pixel_format format = { 8, 1, 1, 65536 / 8, 65536 / 8, 65536 / 4, 5, 2, 0 };
-                    c->format = format;
-                    c->bytes_sent = 0;
-                    c->read = 0;
-                    c->needed = 12;
-                    c->extra = 0;
-                    c->encodings = 0;
-                    c->key_down = 0;
-                    c->mouse_down = 0;
-                    c->ready = 0;
-                    c->sent_cursor = 0;
-                    c->sent_palette = 0;
-
-                    // insert the client into the list
-                    c->next = clients;
-                    clients = c;
-
-                } // END got new incoming connection
-            } // END looping through listener file descriptors
-
-// a helper macro to drop a client from the list
-#define DROP_CLIENT { printf("- Client %d took %u bytes\n", c->fd, c->bytes_sent); close(c->fd); FD_CLR(c->fd, &master); if (c == clients) { clients = c->next; free(c); c = clients; } else { p->next = c->next; free(c); c = p->next; } continue; }
-
-            struct client *c = clients, *p = NULL;
-            while (c != NULL) {
-                if (FD_ISSET(c->fd, &read_fds)) {
-                    // handle data from a client
-                    int nbytes = recv(c->fd, &c->buffer[c->read], c->needed - c->read, 0);
-                    if (nbytes <= 0) {
-                        // got error or connection closed by client
-                        if (nbytes == 0) {
-                            // connection closed
-                            printf("- Socket %d hung up\n", c->fd);
-                        } else {
-                            perror("recv");
-                        }
-                        DROP_CLIENT
+        }
 
-                    }
-                    // we got some data from a client
-                    c->read += nbytes;
-                    if (c->needed == c->read) {
-                        // we have a full packet and can process it depending on the current client state
-                        switch (c->state) {
-                        case handshake_protocolversion:
-                            // 7.1.1 ProtocolVersion Handshake
-                            //  The client is replying to our protocolversion with theirs - an ASCII string
-                            /*
-                                                        c->buffer[12] = '\0';
-                                                        printf(". Client %d sent protocol version %s", c->fd, c->buffer);
-                            */
-
-                            // Basically ignore whatever they sent, and
-                            // send Security Types - only one, "no auth"
-                            ;
-                            static const unsigned char security_handshake[] = { 0x01, 0x01 };
-                            if (send(c->fd, security_handshake, 2, 0) == -1) {
-                                perror("send");
-                                DROP_CLIENT
-                            }
-                            c->state = handshake_security;
-                            c->read = 0;
-                            c->needed = 1;
-                            break;
-                        case handshake_security:
-                            // 7.1.2 Security Handshake
-                            /*
-                                                        printf("Client %d requested security type %u...\n", c->fd, c->buffer[0]);
-                            */
-
-                            // send Security Result - always OK (no auth)
-                            ;
-                            static const unsigned char security_result[] = { 0x00, 0x00, 0x00, 0x00 };
-                            if (send(c->fd, security_result, 4, 0) == -1) {
-                                perror("send");
-                                DROP_CLIENT
-                            }
-                            c->state = init_client;
-                            c->read = 0;
-                            c->needed = 1;
-                            break;
-                        case init_client:
-                            // 7.3.1 ClientInit
-                            /*
-                                                        printf("Client %d sent client_init flag %u...\n", c->fd, c->buffer[0]);
-                            */
-                            // ignore the flag :P
-                            // we send the parameters of the window
-
-                            // 512 x 384
-                            ;
-                            static const unsigned char server_init[] = { 0x02, 0x00, 0x01, 0x80,
-                                                                         // bpp   depth big-e tcol  red-max     green-max   blue-max    r - g - b shift      padding
-                                                                         0x08, 0x08, 0x01, 0x01, 0x00, 0x07, 0x00, 0x07, 0x00, 0x03, 0x00, 0x03, 0x06, 0x00, 0x00, 0x00,
-                                                                         // window title, 8 chars: "VNCSlots"
-                                                                         0x00, 0x00, 0x00, 0x08, 0x56, 0x4e, 0x43, 0x53, 0x6c, 0x6f, 0x74, 0x73
-                                                                       };
-                            if (send(c->fd, server_init, 32, 0) == -1) {
-                                perror("send");
-                                DROP_CLIENT
-                            }
-                            c->state = client_message;
-                            c->read = 0;
-                            c->needed = 1;
-                            break;
-                        case client_message:
-                            // 7.5 Client Message
-                            //  We read only one byte - the message-type - and then switch to a new state to handle each specific message
-                            /*
-                                                        printf("Client %d sent message %u... ", c->fd, c->buffer[0]);
-                            */
-                            // the bytes-needed are dependent on the message
-                            switch(c->buffer[0]) {
-                            case 0:
-                                //printf("SetPixelFormat\n");
-                                c->state = client_message_setpixelformat;
-                                c->needed = 20;
-                                break;
-                            case 2:
-                                //printf("SetEncodings\n");
-                                c->state = client_message_setencodings_0;
-                                c->needed = 4;
-                                break;
-                            case 3:
-                                //printf("FramebufferUpdateRequest\n");
-                                c->state = client_message_framebufferupdaterequest;
-                                c->needed = 10;
-                                break;
-                            case 4:
-                                //printf("KeyEvent\n");
-                                c->state = client_message_keyevent;
-                                c->needed = 8;
-                                break;
-                            case 5:
-                                //printf("PointerEvent\n");
-                                c->state = client_message_pointerevent;
-                                c->needed = 6;
-                                break;
-                            case 6:
-                                //printf("ClientCutText\n");
-                                c->state = client_message_clientcuttext_0;
-                                c->needed = 8;
-                                break;
-                            default:
-                                // Got an unknown message-type from the client!  This is bad.
-                                fprintf(stderr, "Got unknown message-type %d from client %d!\n", c->buffer[0], c->fd);
-                                DROP_CLIENT
-                            }
-                            break;
-                        case client_message_setpixelformat:
-                            // 7.5.1 SetPixelFormat
-                            //printf("Client %d requested new pixel format...\n", c->fd);
-                            c->format.bpp = c->buffer[4];
-                            //c->format.depth = c->buffer[5];
-                            c->format.big_endian_flag = c->buffer[6];
-                            c->format.true_color_flag = c->buffer[7];
-                            c->format.red_div = 65536 / ( 1 + ntohs(*(uint16_t*)(&c->buffer[8])));
-                            c->format.green_div = 65536 / (1 + ntohs(*(uint16_t*)(&c->buffer[10])));
-                            c->format.blue_div = 65536 / (1 + ntohs(*(uint16_t*)(&c->buffer[12])) );
-                            c->format.red_shift = c->buffer[14];
-                            c->format.green_shift = c->buffer[15];
-                            c->format.blue_shift = c->buffer[16];
-
-                            /*
-                                                        printf("bpp=%d depth=%d be=%d tc=%d rmax=%08x gmax=%08x bmax=%08x rshft=%d gshft=%d bshft=%d\n",
-                                                               c->format.bpp,
-                                                               c->buffer[5], //c->format.depth,
-                                                               c->format.big_endian_flag,
-                                                               c->format.true_color_flag,
-                                                               c->format.red_div,
-                                                               c->format.green_div,
-                                                               c->format.blue_div,
-                                                               c->format.red_shift,
-                                                               c->format.green_shift,
-                                                               c->format.blue_shift
-                                                              );
-                            */
-
-                            c->state = client_message;
-                            c->read = 0;
-                            c->needed = 1;
-                            break;
-                        case client_message_setencodings_0:
-                            // 7.5.2 SetEncodings
-                            //  this is a "multi-part" message: the first part (this) tells a number of encodings,
-                            //  we set ->extra to this, and then the _n part is reading the array entry-by-entry
-                            c->extra = ntohs(*(uint16_t*)(&(c->buffer[2])));
-
-                            // blank the encodings bitfield
-                            c->encodings = 0;
-                            // determine next-state based on ->extra
-                            goto foo;
-                        case client_message_setencodings_n:
-                            // 7.5.2 SetEncodings - interpret the encoding type and set flags if appropriate
-                            switch ((int)ntohl(*(uint32_t*)(c->buffer))) {
-                            case 0:
-                                // RAW encoding - but we always support this
-                                break;
-                            case 1:
-                                // CopyRect encoding
-                                c->encodings |= CopyRect;
-                                break;
-                            case 2:
-                                // RRE
-                                c->encodings |= RRE;
-                                break;
-                            case 5:
-                                // HexTile
-                                c->encodings |= HexTile;
-                                break;
-                            case 15:
-                                // TRLE
-                                c->encodings |= TRLE;
-                                break;
-                            case 16:
-                                // ZRLE
-                                c->encodings |= ZRLE;
-                                break;
-                            case -239:
-                                // Cursor
-                                c->encodings |= Cursor;
-                                break;
-                            case -223:
-                                // DesktopSize
-                                break;
-                            default:
-                                // Other, unknown, unused
-                                break;
-                            }
-                            c->extra --;
-foo:
-                            c->read = 0;
-                            if (c->extra == 0) {
-                                // read all the encodings!  back to the regular loop
-                                c->state = client_message;
-                                c->needed = 1;
-                            } else {
-                                c->state = client_message_setencodings_n;
-                                c->needed = 4;
-                            }
-                            break;
-                        case client_message_framebufferupdaterequest:
-                            if (c->buffer[1]) {
-                                // incremental request - and so client can just wait
-                                c->ready = 1;
-                            } else {
-                                // they want a whole the entire full complete edition rectangle
-                                if (! update(c,
-                                             ntohs(*(uint16_t*)(&c->buffer[2])),
-                                             ntohs(*(uint16_t*)(&c->buffer[4])),
-                                             ntohs(*(uint16_t*)(&c->buffer[6])),
-                                             ntohs(*(uint16_t*)(&c->buffer[8])), 0))
-                                    DROP_CLIENT
-
-                                    c->ready = 0;
-                            }
-                            c->state = client_message;
-                            c->read = 0;
-                            c->needed = 1;
-                            break;
-                        case client_message_keyevent:
-                        {
-                            int key = ntohl(*(uint32_t*)(&c->buffer[4]));
-                            // space, return, enter, down-arrow
-                            if (key == 32 || key == 65421 || key == 65293 || key == 65364) {
-                                if (c->buffer[1] && ! c->key_down) {
-                                    c->key_down = 1;
-                                    if (gamestate == waiting) {
-                                        gettimeofday(&tv_next, NULL);
-                                        gamestate = coin;
-                                        coin_y = 0;
-                                    }
-                                } else if (! c->buffer[1]) c->key_down = 0;
-                            }
-                        }
-
-                        c->state = client_message;
-                        c->read = 0;
-                        c->needed = 1;
-                        break;
-                        case client_message_pointerevent:
-                            // we only really care about the places button 1 state changes
-                            if (c->mouse_down != 0 && (c->buffer[1] & 1) == 0) {
-                                // button release
-                                uint16_t x = ntohs(*(uint16_t*)(&c->buffer[2]));
-                                uint16_t y = ntohs(*(uint16_t*)(&c->buffer[4]));
-                                if (x >= 451 && x <= 487 && y >= 73 && y <= 109 && c->mouse_down == 1) {
-                                    // clicked on handle
-                                    if (gamestate == waiting) {
-                                        gettimeofday(&tv_next, NULL);
-                                        gamestate = coin;
-
-                                        coin_y = 0;
-                                    }
-                                } else if (x >= 472 && x <= 490 && y >= 365 && y <= 383 && c->mouse_down == 2) {
-                                    // clicked COPY button - set cuttext to our github URL
-                                    static const unsigned char url_msg[] = { 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 40,
-                                                                             0x68, 0x74, 0x74, 0x70, 0x73, 0x3A, 0x2F, 0x2F, 0x67, 0x69, 0x74, 0x68, 0x75, 0x62, 0x2E, 0x63, 0x6F, 0x6D, 0x2F, 0x67, 0x72, 0x65, 0x67, 0x2D, 0x6B, 0x65, 0x6E, 0x6E, 0x65, 0x64, 0x79, 0x2F, 0x56, 0x4E, 0x43, 0x53, 0x6C, 0x6F, 0x74, 0x73
-                                                                           };
-                                    if (send(c->fd, url_msg, 48, 0) == -1) {
-                                        perror("send");
-                                        DROP_CLIENT
-                                    }
-
-                                }
-                                c->mouse_down = 0;
-                            }
-                            else if (c->mouse_down == 0 && (c->buffer[1] & 1) == 1)
-                            {
-                                // check hotspots
-                                uint16_t x = ntohs(*(uint16_t*)(&c->buffer[2]));
-                                uint16_t y = ntohs(*(uint16_t*)(&c->buffer[4]));
-                                if (x >= 451 && x <= 487 && y >= 73 && y <= 109) {
-                                    // clicked on handle
-                                    c->mouse_down = 1;
-                                } else if (x >= 472 && x <= 490 && y >= 365 && y <= 383) {
-                                    // clicked COPY button - set cuttext to our github URL
-                                    c->mouse_down = 2;
-                                }
-                            }
-                            c->state = client_message;
-                            c->read = 0;
-                            c->needed = 1;
-                            break;
-                        case client_message_clientcuttext_0:
-                            c->extra = ntohl(*(uint32_t*)(&c->buffer[4]));
-                        // printf("Client %d plans to send us %u cut-text\n", c->fd, c->extra);
-
-                        // We don't actually care about the cut-text and just plan to read and discard it,
-                        // 20 bytes at a time.
-
-                        // fallthrough
-
-                        case client_message_clientcuttext_n:
-                            c->read = 0;
-                            if (c->extra == 0) {
-                                c->needed = 1;
-                                c->state = client_message;
-                            } else {
-                                c->needed = (c->extra < 20 ? c->extra : 20);
-                                c->extra -= c->needed;
-                                c->state = client_message_clientcuttext_n;
-                            }
-                            break;
-                        default:
-                            fprintf(stderr, "Ended up in unhandled state %d for client %d!\n", c->state, c->fd);
-                            DROP_CLIENT
-
-                        }
-                    }
+        // deadlines first - which also brings the wheel up to date before anything new is set on it
+        //  (the new process sets its own after a handoff)
+        if (successor_fd < 0) run_timers();
+
+        for (int i = 0; i < event_count; i ++) {
+            const struct net_event * e = &events[i];
+            struct client * c = e->ctx;
+
+            if (e->type == net_accept && e->fd == metrics_fd) {
+                // somebody come to scrape the metrics
+                if (! net_attach(&net, e->new_fd, &metrics_conn)) close(e->new_fd);
+                continue;
+            }
+
+            if (e->type == net_accept && e->fd == handoff_fd) {
+                // a new process, come to take over - once everything here has gone quiet
+                if (successor_fd >= 0) {
+                    close(e->new_fd);
+                    continue;
+                }
+                int flags = fcntl(e->new_fd, F_GETFL);
+                if (flags >= 0) fcntl(e->new_fd, F_SETFL, flags & ~O_NONBLOCK);
+                successor_fd = e->new_fd;
+                handoff_started = timer_now();
+                puts("* A new process is taking over: handing off...");
+                fflush(stdout);
+                continue;
+            }
+
+            if (e->type == net_accept && e->fd == cluster_fd) {
+                // a relay subscribing - which isn't one more viewer, but how a lot of them are
+                //  served, so it's let in however loaded we are
+                c = client_new(e->new_fd, connections, NULL, 0, 1);
+                connections ++;
+                if (c == NULL) continue;
+                client_link(&clients, c);
+                // its keyframe, right away
+                if (! client_update(c)) client_drop(c);
+                continue;
+            }
 
+            if (e->type == net_accept && governor.stage >= governor_refuse) {
+                // overloaded: turn them away before they cost anything
+                close(e->new_fd);
+                METRIC_ADD(metrics_local()->refused, 1);
+                continue;
+            }
+
+            if (e->type == net_accept) {
+                // handle new connections
+                c = client_new(e->new_fd, connections, record_dir, zerocopy, 0);
+                connections ++;
+                if (c != NULL) client_link(&clients, c);
+                continue;
+            }
+
+            if (e->fd == watch_fd) {
+                if (pack_changed(watch_fd, assets_file)) reload_pending = 1;
+                continue;
+            }
+
+            if (e->ctx == &upstream_conn) {
+                // (anything left from a connection that has already been given up on is ignored)
+                if (e->fd != upstream_fd) continue;
+                if (e->type == net_data) {
+                    // new frames from the authority: pass them on
+                    int frames = cluster_read(&upstream, e->data, e->len, &rooms[0].game);
+                    if (frames < 0) {
+                        fprintf(stderr, "Nonsense from the authority on socket %d\n", e->fd);
+                        upstream_lost();
+                    } else if (frames > 0 && successor_fd < 0) {
+                        held = push_updates(clients);
+                    }
+                } else if (e->type == net_closed || e->type == net_error) {
+                    upstream_lost();
                 }
-                // keep the max fd updated
-                if (c->fd > fd_max) fd_max = c->fd;
-                p = c;
+                continue;
+            }
 
-                c = c->next;
-            } // END handle data from client
-        } // END looping through file descriptors
+            if (e->ctx == &metrics_conn) {
+                if (e->type == net_data)
+                    metrics_serve(e->fd, e->data, e->len, clients, connections);
+                else if (e->type == net_closed || e->type == net_error)
+                    net_detach(&net, e->fd);
+                continue;
+            }
 
-        if (gamestate != waiting) {
+            // already dropped earlier in this batch
+            if (c == NULL || c->state == none) continue;
+
+            // zerocopy completions wake us up too - collect them first
+            if (c->zerocopy_min) outq_zerocopy_complete(&c->out, c->fd);
+
+            switch (e->type) {
+            case net_data:
+                // we got some data from a client
+                if (! client_input(c, e->data, e->len)) client_drop(c);
+                break;
+            case net_closed:
+                // connection closed
+                printf("- Socket %d hung up\n", c->fd);
+                client_drop(c);
+                break;
+            case net_error:
+                errno = e->error;
+                perror("recv");
+                client_drop(c);
+                break;
+            default:
+                break;
+            }
+        }
+
+        client_sweep();
+
+        if (reload_pending && successor_fd < 0) {
+            reload_pending = 0;
+            struct pack * fresh = pack_open(assets_file);
+            if (fresh != NULL) {
+                // redraw with the new sprites and send everyone the lot
+                for (unsigned int r = 0; r < room_count; r ++)
+                    game_set_assets(&rooms[r].game, pack_assets(fresh));
+                if (private_rooms) rebase_private(clients, pack_assets(fresh));
+                pack_close(pack);
+                pack = fresh;
+                printf("* Reloaded %s\n", assets_file);
+                held = push_updates(clients);
+                client_sweep();
+            } else {
+                fprintf(stderr, "Keeping the old assets\n");
+            }
+        }
+
+        if (successor_fd >= 0) {
+            handoff_step(clients, connections);
+        } else if (rooms_running || held || governor.stage != governor_normal) {
             // check clock and do any gamestate advancement
             gettimeofday(&tv_now, NULL);
 
             if (tv_now.tv_sec > tv_next.tv_sec ||
                     (tv_now.tv_sec == tv_next.tv_sec && tv_now.tv_usec > tv_next.tv_usec)) {
+                const uint64_t trace_tick_start = trace_begin();
+                const unsigned int busy = rooms_running;
+                struct metrics * m = metrics_local();
+                metric_observe(&m->tick_late, usec_between(&tv_next, &tv_now) * 1000);
+                const struct timeval tv_due = tv_next;
+
                 // set timer for next update
                 tv_next.tv_sec = tv_now.tv_sec;
                 tv_next.tv_usec = tv_now.tv_usec + INTERVAL;
@@ -1432,134 +3066,41 @@ foo:
                     tv_next.tv_usec -= 1000000;
                 }
 
-                // printf("State %d -> ", state);
-                // do game updates now
-                switch(gamestate) {
-                case coin:
-                    coin_y += 2;
-                    blit_simple(img_background, 388, 186, framebuffer, 388, 186, 29, 36);
-                    blit_special(img_coin, 0, 0, framebuffer, 388, 185 + coin_y, 29, (coin_y < 8 ? 29 : 36 - coin_y), 0xC7, 0);
-                    blit_special(img_coinslot, 0, 0, framebuffer, 388, 213, 29, 8, 0xFF, 0);
-                    if (coin_y >= 36) {
-                        plays ++;
-
-                        draw_number(framebuffer, img_digits, plays, 19, 293);
-                        draw_number(framebuffer, img_digits, profit - plays, 19, 353);
-                        handle_y = 0;
-                        gamestate = handle_down;
-                    }
-                    break;
-                case handle_down:
-                    handle_y += 10;
-                    draw_handle(framebuffer, img_background, img_handle, img_ball, handle_y);
-                    if (handle_y >= 100)
-                    {
-                        handle_y = 100;
-                        gamestate = handle_up;
-                    }
-                    break;
-                case handle_up:
-                    handle_y -= 20;
-                    draw_handle(framebuffer, img_background, img_handle, img_ball, handle_y);
-                    if (handle_y <= 0)
-                    {
-                        handle_y = 0;
-
-                        // determine three Amounts To Spin - i.e. find the three new Reel Stops
-                        //  do this by picking three random values from /dev/urandom...
-                        FILE * rng = fopen("/dev/urandom", "rb");
-                        if (! rng) {
-                            perror("Failed to open /dev/urandom");
-                            exit(EXIT_FAILURE);
-                        }
-                        int rand_result;
-                        do {
-                            unsigned char rngbuf[2];
-                            fread(rngbuf, 1, 2, rng);
-                            rand_result = (rngbuf[0] << 8) | rngbuf[1];
-                        } while (rand_result >= 64000);
-                        fclose(rng);
-
-                        // 960 is a full rotation: spin at least once and each subsequent spin must be longer than the previous
-                        unsigned short new_rp = rand_result % 20;
-                        rand_result /= 20;
-                        reel_left[0] = (reel_stop[0] - new_rp) * 48;
-                        while (reel_left[0] < 960) reel_left[0] += 960;
-                        reel_stop[0] = new_rp;
-                        new_rp = rand_result % 20;
-                        rand_result /= 20;
-                        reel_left[1] = (reel_stop[1] - new_rp) * 48;
-                        while (reel_left[1] <= reel_left[0]) reel_left[1] += 960;
-                        reel_stop[1] = new_rp;
-                        new_rp = rand_result % 20; // rand_result /= 20;
-                        reel_left[2] = (reel_stop[2] - new_rp) * 48;
-                        while (reel_left[2] <= reel_left[1]) reel_left[2] += 960;
-                        reel_stop[2] = new_rp;
-                        gamestate = spin;
+                // do game updates now in every room that's mid-pull (if none are, this tick is just
+                //  for the stragglers), and save a room's stats whenever its pull is complete
+                for (struct room * r = running, * next; r != NULL; r = next) {
+                    next = r->next_running;
+                    struct game * g = &r->game;
+                    const uint64_t trace_render_start = trace_begin();
+                    const char * tick_state = gamestate_name(g->state);
+                    struct timespec t0, t1;
+                    clock_gettime(CLOCK_MONOTONIC, &t0);
+                    int finished = game_tick(g);
+                    clock_gettime(CLOCK_MONOTONIC, &t1);
+                    TRACE_END(trace_render, trace_render_start, tick_state, g->version, r->id);
+                    metric_observe(&m->tick_render, (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec));
+                    // with encoder threads, they get on with this frame while the next room renders
+                    if (encode_threads() > 1 && r->id >= 0 && r->clients > 0)
+                        cache_prefetch(snapshot_take(&r->snapshot, g));
+                    if (finished) {
+                        if (r->id >= 0) room_save_stats(r->id);
+                        room_stop(r);
                     }
-                    break;
-                case spin:
-                    for (int i = 0; i < 3; i ++) {
-                        int amt = (reel_left[i] > 21 ? 21 : reel_left[i]);
-                        if (amt > 0) {
-                            reel_position[i] -= amt;
-                            reel_left[i] -= amt;
-                            if (reel_position[i] < 0) reel_position[i] += img_reels[i]->height;
-                            draw_reel(framebuffer, img_reels[i], reel_position[i], 222 + 50 * i, 67);
-                        }
-                    }
-
-                    if (reel_left[0] == 0 && reel_left[1] == 0 && reel_left[2] == 0)
-                    {
-                        // determine the payout amounts
-                        int r0 = reels[0][reel_stop[0]];
-                        int r1 = reels[1][reel_stop[1]];
-                        int r2 = reels[2][reel_stop[2]];
-                        if (r0 == bar && r1 == bar && r2 == bar) payout_left = 100;
-                        else if (r0 == bell && r1 == bell && (r2 == bell || r2 == bar)) payout_left = 18;
-                        else if (r0 == plum && r1 == plum && (r2 == plum || r2 == bar)) payout_left = 13;
-                        else if (r0 == orange && r1 == orange && (r2 == orange || r2 == bar)) payout_left = 11;
-                        else if (r0 == cherry && r1 == cherry && r2 == cherry) payout_left = 11;
-                        else if (r0 == cherry && r1 == cherry) payout_left = 5;
-                        else if (r0 == cherry) payout_left = 3;
-                        else payout_left = 0;
-
-                        //printf("SPIN: %s - %s - %s => %d\n", en2s(r0), en2s(r1), en2s(r2), payout_left);
-
-                        gamestate = payout;
-                    }
-
-                    break;
-                case payout:
-                    if (payout_left <= 0) {
-                        FILE * stats = fopen("stats.ini", "w");
-                        if (stats != NULL) {
-                            fprintf(stats, "%d %d\n", plays, profit);
-                            fclose(stats);
-                        } else perror("stats fopen");
-
-                        gamestate = waiting;
-                    } else {
-                        payout_left --;
-                        profit ++;
-                        draw_number(framebuffer, img_digits, profit, 19, 323);
-                        draw_number(framebuffer, img_digits, profit - plays, 19, 353);
-                    }
-                    break;
-                default:
-                    break;
-
                 }
 
-
                 // update any waiting clients
-                struct client *c = clients, *p = NULL;
-                while (c != NULL) {
-                    if (c->ready) {
-                        if (! update(c, 0, 0, 512, 384, 1)) DROP_CLIENT
-                        }
-                    c = c->next;
+                held = push_updates(clients);
+                client_sweep();
+
+                // how much of the budget that took, counting from when it was due
+                struct timeval tv_done;
+                gettimeofday(&tv_done, NULL);
+                if (governor_tick(&governor, usec_between(&tv_due, &tv_done), INTERVAL)) {
+                    selector_set_thrifty(governor.stage >= governor_cheap_encodings);
+                    printf("! Governor: %s (load %u%%)\n", governor_stage_name(governor.stage), governor.load / 10);
+                    fflush(stdout);
                 }
+                TRACE_END(trace_tick, trace_tick_start, NULL, busy);
             }
         }
     } // END for(;;)--and you thought it would never end!
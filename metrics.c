@@ -0,0 +1,202 @@
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char * const encoding_names[metric_encoding_count] = { "Raw", "RRE", "HexTile", "Cursor", "other" };
+
+// every thread's shard, newest first
+static struct metrics * shards;
+static __thread struct metrics * local;
+
+struct metrics * metrics_local(void)
+{
+    if (local == NULL) {
+        local = calloc(1, sizeof(struct metrics));
+        if (local == NULL) {
+            perror("calloc metrics");
+            exit(EXIT_FAILURE);
+        }
+        // push it onto the list without a lock
+        local->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+        while (! __atomic_compare_exchange_n(&shards, &local->next, local, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    return local;
+}
+
+enum metric_encoding metric_encoding_of(int32_t type)
+{
+    switch (type) {
+    case 0:
+        return metric_raw;
+    case 2:
+        return metric_rre;
+    case 5:
+        return metric_hextile;
+    case -239:
+        return metric_cursor;
+    default:
+        return metric_other;
+    }
+}
+
+void metric_observe(struct histogram * h, long ns)
+{
+    // bucket i holds up to 2^i us
+    unsigned long us = (ns > 0 ? (ns + 999) / 1000 : 0);
+    int i = (us > 1 ? 64 - __builtin_clzl(us - 1) : 0);
+    if (i > METRIC_BUCKETS) i = METRIC_BUCKETS;
+
+    METRIC_ADD(h->buckets[i], 1);
+    METRIC_ADD(h->count, 1);
+    METRIC_ADD(h->sum_ns, (unsigned long)(ns > 0 ? ns : 0));
+}
+
+void metric_encode_time(enum metric_encoding e, uint16_t x, uint16_t y, uint16_t w, uint16_t h, long ns)
+{
+    struct metrics * m = metrics_local();
+
+    unsigned int count = m->rect_count, i;
+    for (i = 0; i < count; i ++) {
+        const struct metric_rect * r = &m->rect[i];
+        if (r->x == x && r->y == y && r->w == w && r->h == h) break;
+    }
+    if (i == count) {
+        if (count < METRIC_RECTS) {
+            // fill it in before it's published
+            m->rect[i].x = x;
+            m->rect[i].y = y;
+            m->rect[i].w = w;
+            m->rect[i].h = h;
+            __atomic_store_n(&m->rect_count, count + 1, __ATOMIC_RELEASE);
+        } else {
+            i = METRIC_RECTS - 1;
+        }
+    }
+    metric_observe(&m->rect[i].encode[e], ns);
+}
+
+// /////////////////////////////////
+// Scraping
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static void merge_histogram(struct histogram * dst, const struct histogram * src)
+{
+    for (int i = 0; i <= METRIC_BUCKETS; i ++)
+        dst->buckets[i] += LOAD(src->buckets[i]);
+    dst->count += LOAD(src->count);
+    dst->sum_ns += LOAD(src->sum_ns);
+}
+
+static void write_histogram(FILE * fp, const char * name, const char * labels, const struct histogram * h)
+{
+    unsigned long total = 0;
+    for (int i = 0; i < METRIC_BUCKETS; i ++) {
+        total += h->buckets[i];
+        fprintf(fp, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, *labels ? "," : "", (1UL << i) / 1e6, total);
+    }
+    total += h->buckets[METRIC_BUCKETS];
+    fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, *labels ? "," : "", total);
+    if (*labels) {
+        fprintf(fp, "%s_sum{%s} %.9f\n", name, labels, h->sum_ns / 1e9);
+        fprintf(fp, "%s_count{%s} %lu\n", name, labels, h->count);
+    } else {
+        fprintf(fp, "%s_sum %.9f\n%s_count %lu\n", name, h->sum_ns / 1e9, name, h->count);
+    }
+}
+
+void metrics_write(FILE * fp)
+{
+    // the shards added together - rectangles matched up by position
+    static struct metrics sum;
+    memset(&sum, 0, sizeof(sum));
+    for (struct metrics * m = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); m != NULL; m = m->next) {
+        for (int e = 0; e < metric_encoding_count; e ++) {
+            sum.rect_bytes[e] += LOAD(m->rect_bytes[e]);
+            sum.rects[e] += LOAD(m->rects[e]);
+        }
+
+        unsigned int count = __atomic_load_n(&m->rect_count, __ATOMIC_ACQUIRE);
+        for (unsigned int i = 0; i < count; i ++) {
+            const struct metric_rect * r = &m->rect[i];
+            unsigned int k;
+            for (k = 0; k < sum.rect_count; k ++) {
+                if (sum.rect[k].x == r->x && sum.rect[k].y == r->y && sum.rect[k].w == r->w && sum.rect[k].h == r->h) break;
+            }
+            if (k == sum.rect_count) {
+                if (k == METRIC_RECTS) k --;
+                else {
+                    sum.rect[k].x = r->x;
+                    sum.rect[k].y = r->y;
+                    sum.rect[k].w = r->w;
+                    sum.rect[k].h = r->h;
+                    sum.rect_count ++;
+                }
+            }
+            for (int e = 0; e < metric_cursor; e ++)
+                merge_histogram(&sum.rect[k].encode[e], &r->encode[e]);
+        }
+
+        merge_histogram(&sum.tick_render, &m->tick_render);
+        merge_histogram(&sum.tick_late, &m->tick_late);
+        sum.send_stalls += LOAD(m->send_stalls);
+        sum.window_skips += LOAD(m->window_skips);
+        sum.pace_skips += LOAD(m->pace_skips);
+        sum.spectator_skips += LOAD(m->spectator_skips);
+        sum.refused += LOAD(m->refused);
+        sum.handshake_timeouts += LOAD(m->handshake_timeouts);
+        sum.idle_timeouts += LOAD(m->idle_timeouts);
+    }
+
+    fputs("# HELP vncslots_rectangle_bytes_total Bytes of rectangles sent, by encoding.\n"
+          "# TYPE vncslots_rectangle_bytes_total counter\n", fp);
+    for (int e = 0; e < metric_encoding_count; e ++)
+        fprintf(fp, "vncslots_rectangle_bytes_total{encoding=\"%s\"} %lu\n", encoding_names[e], sum.rect_bytes[e]);
+    fputs("# HELP vncslots_rectangles_total Rectangles sent, by encoding.\n"
+          "# TYPE vncslots_rectangles_total counter\n", fp);
+    for (int e = 0; e < metric_encoding_count; e ++)
+        fprintf(fp, "vncslots_rectangles_total{encoding=\"%s\"} %lu\n", encoding_names[e], sum.rects[e]);
+
+    fputs("# HELP vncslots_encode_seconds Time spent encoding, by encoder and rectangle.\n"
+          "# TYPE vncslots_encode_seconds histogram\n", fp);
+    for (unsigned int i = 0; i < sum.rect_count; i ++) {
+        const struct metric_rect * r = &sum.rect[i];
+        for (int e = 0; e < metric_cursor; e ++) {
+            if (r->encode[e].count == 0) continue;
+            char labels[80];
+            snprintf(labels, sizeof(labels), "encoder=\"%s\",rect=\"%u,%u %ux%u\"", encoding_names[e], r->x, r->y, r->w, r->h);
+            write_histogram(fp, "vncslots_encode_seconds", labels, &r->encode[e]);
+        }
+    }
+
+    fputs("# HELP vncslots_tick_render_seconds Time to advance and draw one animation frame.\n"
+          "# TYPE vncslots_tick_render_seconds histogram\n", fp);
+    write_histogram(fp, "vncslots_tick_render_seconds", "", &sum.tick_render);
+    fputs("# HELP vncslots_tick_lateness_seconds How far past its due time each tick started.\n"
+          "# TYPE vncslots_tick_lateness_seconds histogram\n", fp);
+    write_histogram(fp, "vncslots_tick_lateness_seconds", "", &sum.tick_late);
+
+    fprintf(fp, "# HELP vncslots_send_stalls_total Sends that blocked, or could not all go out at once.\n"
+            "# TYPE vncslots_send_stalls_total counter\n"
+            "vncslots_send_stalls_total %lu\n"
+            "# HELP vncslots_flight_window_skips_total Continuous updates held back by a full flight window.\n"
+            "# TYPE vncslots_flight_window_skips_total counter\n"
+            "vncslots_flight_window_skips_total %lu\n"
+            "# HELP vncslots_pace_skips_total Frames skipped by clients whose links were still draining.\n"
+            "# TYPE vncslots_pace_skips_total counter\n"
+            "vncslots_pace_skips_total %lu\n"
+            "# HELP vncslots_governor_spectator_skips_total Spectator frames skipped to shed load.\n"
+            "# TYPE vncslots_governor_spectator_skips_total counter\n"
+            "vncslots_governor_spectator_skips_total %lu\n"
+            "# HELP vncslots_governor_refused_total Connections refused to shed load.\n"
+            "# TYPE vncslots_governor_refused_total counter\n"
+            "vncslots_governor_refused_total %lu\n"
+            "# HELP vncslots_timeouts_total Clients dropped when a deadline passed.\n"
+            "# TYPE vncslots_timeouts_total counter\n"
+            "vncslots_timeouts_total{deadline=\"handshake\"} %lu\n"
+            "vncslots_timeouts_total{deadline=\"idle\"} %lu\n",
+            sum.send_stalls, sum.window_skips, sum.pace_skips, sum.spectator_skips, sum.refused,
+            sum.handshake_timeouts, sum.idle_timeouts);
+}
@@ -0,0 +1,82 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+// Performance counters, served in the Prometheus text format by --metrics.
+//  Each thread counts into a shard of its own with plain (relaxed) loads and stores - no
+//  locks, no atomic read-modify-writes - and the shards are only added up when somebody scrapes.
+
+#include <stdio.h>
+#include <stdint.h>
+
+// what a rectangle went out as
+enum metric_encoding {
+    metric_raw,
+    metric_rre,
+    metric_hextile,
+    metric_cursor,
+    metric_other,
+
+    metric_encoding_count
+};
+
+// histograms have power-of-two buckets from 1 us up to 2^(METRIC_BUCKETS - 1) us, plus +Inf
+#define METRIC_BUCKETS 16
+struct histogram {
+    unsigned long buckets[METRIC_BUCKETS + 1];
+    unsigned long count;
+    unsigned long sum_ns;
+};
+
+// a rectangle that has been encoded, with how long each encoder took on it
+#define METRIC_RECTS 32
+struct metric_rect {
+    uint16_t x, y, w, h;
+    struct histogram encode[metric_cursor];
+};
+
+struct metrics {
+    unsigned long rect_bytes[metric_encoding_count];
+    unsigned long rects[metric_encoding_count];
+
+    // encode time per encoder and rectangle - rectangles past the first METRIC_RECTS share the last one
+    struct metric_rect rect[METRIC_RECTS];
+    unsigned int rect_count;
+
+    // time to render a frame, and how late the tick started
+    struct histogram tick_render;
+    struct histogram tick_late;
+
+    // sends that couldn't go out at once, continuous updates held back by the flight window, and
+    //  frames sat out by clients whose links were still draining the last one
+    unsigned long send_stalls;
+    unsigned long window_skips;
+    unsigned long pace_skips;
+
+    // load shedding: spectator frames skipped, and connections refused, by the governor
+    unsigned long spectator_skips;
+    unsigned long refused;
+
+    // clients dropped for taking too long over the handshake, or for not answering when idle
+    unsigned long handshake_timeouts;
+    unsigned long idle_timeouts;
+
+    // the next shard, once registered
+    struct metrics * next;
+};
+
+// this thread's shard (set up on first use)
+struct metrics * metrics_local(void);
+
+// single writer per shard: a relaxed load and store, so a scrape never sees a torn value
+#define METRIC_ADD(field, n) __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+// the encoding type from a rectangle header
+enum metric_encoding metric_encoding_of(int32_t type);
+
+void metric_observe(struct histogram * h, long ns);
+void metric_encode_time(enum metric_encoding e, uint16_t x, uint16_t y, uint16_t w, uint16_t h, long ns);
+
+// add up every shard and write out the lot
+void metrics_write(FILE * fp);
+
+#endif
@@ -0,0 +1,105 @@
+// mkassets - build-time generator for builtin.c
+//  Reads the .bin images, builds the reel strips, palette and cursor exactly as the server
+//  used to at startup, and writes them all out as const C tables.
+
+#include "game.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+// the cursor shape - Windows "hand", 17x22, one bit per pixel with no row padding
+static const unsigned char cursor_colormap[47] = { 0x00, 0x00, 0x03, 0x00, 0x01, 0x80, 0x00, 0xc0, 0x00, 0x60, 0x00, 0x30, 0x00, 0x1b, 0x00, 0x0d, 0xb0, 0x06, 0xda, 0x03, 0x6d, 0x99, 0xfe, 0xce, 0xff, 0xe3, 0x7f, 0xf0, 0xbf, 0xf8, 0x7f, 0xfc, 0x1f, 0xfe, 0x0f, 0xfe, 0x03, 0xff, 0x01, 0xff, 0x80, 0x7f, 0x80, 0x3f, 0xc0, 0x00, 0x00 };
+// ... and its transparency, already in RFB's layout (rows padded to a byte)
+static const unsigned char cursor_tmap[66] = { 0x06, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x0f, 0xc0, 0x00, 0x0f, 0xf8, 0x00, 0x0f, 0xfe, 0x00, 0x0f, 0xff, 0x00, 0xef, 0xff, 0x80, 0xff, 0xff, 0x80, 0xff, 0xff, 0x80, 0x7f, 0xff, 0x80, 0x3f, 0xff, 0x80, 0x3f, 0xff, 0x80, 0x1f, 0xff, 0x80, 0x1f, 0xff, 0x00, 0x0f, 0xff, 0x00, 0x0f, 0xff, 0x00, 0x07, 0xfe, 0x00, 0x07, 0xfe, 0x00, 0x07, 0xfe, 0x00 };
+
+static void write_bytes(FILE * fp, const char * name, const unsigned char * data, size_t len)
+{
+    fprintf(fp, "const unsigned char %s[%zu] = {", name, len);
+    for (size_t i = 0; i < len; i ++)
+        fprintf(fp, "%s0x%02x,", (i % 32 ? " " : "\n    "), data[i]);
+    fputs("\n};\n\n", fp);
+}
+
+static void write_image(FILE * fp, const char * name, const struct image * img)
+{
+    char data_name[64];
+    snprintf(data_name, sizeof(data_name), "%s_data", name);
+    fputs("static ", fp);
+    write_bytes(fp, data_name, img->data, (size_t)img->width * img->height);
+    // the drawing code only ever reads sprites - the cast is just for struct image
+    fprintf(fp, "static const struct image %s = { %u, %u, %u, (unsigned char *)%s, NULL };\n\n", name, img->width, img->height, img->width, data_name);
+}
+
+int main(int argc, char * argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s builtin.c\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct assets a;
+    if (! load_assets(&a)) {
+        fputs("Failed to load images\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    FILE * fp = fopen(argv[1], "w");
+    if (fp == NULL) {
+        perror("fopen");
+        return EXIT_FAILURE;
+    }
+
+    fputs("// generated by mkassets - do not edit\n\n#include \"builtin.h\"\n\n", fp);
+
+    // BGR233 palette
+    fputs("const uint16_t bgr233_palette[3][256] = {", fp);
+    for (int c = 0; c < 3; c ++) {
+        fputs("\n    {", fp);
+        for (int i = 0; i < 256; i ++) {
+            int r = i & 7, g = (i >> 3) & 7, b = i >> 6;
+            uint16_t v;
+            if (c == 0)
+                v = (r << 13) | (r << 10) | (r << 7) | (r << 4) | (r << 1) | (r >> 2);
+            else if (c == 1)
+                v = (g << 13) | (g << 10) | (g << 7) | (g << 4) | (g << 1) | (g >> 2);
+            else
+                v = (b << 14) | (b << 12) | (b << 10) | (b << 8) | (b << 6) | (b << 4) | (b << 2) | b;
+            fprintf(fp, "%s0x%04x,", (i % 16 ? " " : "\n        "), v);
+        }
+        fputs("\n    },", fp);
+    }
+    fputs("\n};\n\n", fp);
+
+    // the cursor, one colour per pixel
+    unsigned char cursor[17 * 22];
+    for (int i = 0; i < 17 * 22; i ++)
+        cursor[i] = (cursor_colormap[i / 8] & (0x80 >> (i % 8)) ? 0xFF : 0);
+    write_bytes(fp, "cursor_pixels", cursor, sizeof(cursor));
+    write_bytes(fp, "cursor_mask", cursor_tmap, sizeof(cursor_tmap));
+
+    // sprites
+    write_image(fp, "img_background", a.background);
+    write_image(fp, "img_digits", a.digits);
+    write_image(fp, "img_ball", a.ball);
+    write_image(fp, "img_handle", a.handle);
+    write_image(fp, "img_coin", a.coin);
+    write_image(fp, "img_coinslot", a.coinslot);
+    for (int i = 0; i < 3; i ++) {
+        char name[16];
+        snprintf(name, sizeof(name), "img_reel%d", i);
+        write_image(fp, name, a.reels[i]);
+    }
+
+    fputs("const struct assets builtin_assets = {\n"
+          "    &img_background, &img_digits, &img_ball, &img_handle, &img_coin, &img_coinslot,\n"
+          "    { &img_reel0, &img_reel1, &img_reel2 }\n"
+          "};\n", fp);
+
+    if (fclose(fp) != 0) {
+        perror("fclose");
+        remove(argv[1]);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
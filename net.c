@@ -0,0 +1,373 @@
+// accept4()
+#define _GNU_SOURCE
+
+#include "net.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+
+// the most input read from one client per wait
+#define RECV_SIZE 1024
+
+int net_init(struct net * n, int use_uring)
+{
+    n->priv = NULL;
+#ifdef __linux__
+    if (use_uring) {
+        n->backend = &net_uring_backend;
+        if (n->backend->init(n)) return 1;
+        fputs("io_uring is not available, falling back to select()\n", stderr);
+    }
+#else
+    if (use_uring) fputs("io_uring is Linux-only, using select()\n", stderr);
+#endif
+    n->backend = &net_select_backend;
+    return n->backend->init(n);
+}
+
+void net_free(struct net * n)
+{
+    n->backend->free(n);
+}
+
+int net_listen(struct net * n, int fd)
+{
+    return n->backend->listen(n, fd);
+}
+
+int net_attach(struct net * n, int fd, void * ctx)
+{
+    return n->backend->attach(n, fd, ctx);
+}
+
+int net_watch(struct net * n, int fd, void * ctx)
+{
+    return n->backend->watch(n, fd, ctx);
+}
+
+void net_detach(struct net * n, int fd)
+{
+    n->backend->detach(n, fd);
+}
+
+int net_release(struct net * n, int fd)
+{
+    return n->backend->release(n, fd);
+}
+
+int net_send(struct net * n, int fd, struct outq * q, int flags, size_t zerocopy_min, net_sent_fn sent, void * ctx)
+{
+    return n->backend->send(n, fd, q, flags, zerocopy_min, sent, ctx);
+}
+
+int net_wait(struct net * n, const struct timeval * timeout, struct net_event * events, int max)
+{
+    return n->backend->wait(n, timeout, events, max);
+}
+
+size_t net_backlog(struct net * n, int fd)
+{
+    size_t backlog = n->backend->queued(n, fd);
+#ifdef SIOCOUTQ
+    int unacked;
+    if (ioctl(fd, SIOCOUTQ, &unacked) == 0 && unacked > 0) backlog += unacked;
+#endif
+    return backlog;
+}
+
+// /////////////////////////////////
+// select() backend: one accept or recv per ready socket per wait.  Sends go out right away, as
+//  much as the socket will take - the rest when select() says there's room.
+
+// a queue with bytes still to go, and how to send them
+struct select_pending {
+    struct outq * q;
+    int flags;
+    size_t zerocopy_min;
+    net_sent_fn sent;
+    void * ctx;
+};
+
+struct select_net {
+    fd_set master;
+    fd_set listeners;
+    fd_set watched;
+    fd_set writers;
+    // still here until their queues drain, but not to be read from
+    fd_set released;
+    int fd_max;
+    struct select_pending pending[FD_SETSIZE];
+    // the client behind each fd
+    void * ctx[FD_SETSIZE];
+    // input buffers handed out with net_data events
+    unsigned char * buffer;
+    int buffer_events;
+};
+
+static int select_init(struct net * n)
+{
+    struct select_net * s = calloc(1, sizeof(struct select_net));
+    if (s == NULL) {
+        perror("malloc select_net");
+        return 0;
+    }
+    FD_ZERO(&s->master);
+    FD_ZERO(&s->listeners);
+    FD_ZERO(&s->watched);
+    FD_ZERO(&s->writers);
+    FD_ZERO(&s->released);
+    s->fd_max = -1;
+    n->priv = s;
+    return 1;
+}
+
+static void select_free(struct net * n)
+{
+    struct select_net * s = n->priv;
+    free(s->buffer);
+    free(s);
+    n->priv = NULL;
+}
+
+static int select_add(struct select_net * s, int fd)
+{
+    if (fd >= FD_SETSIZE) {
+        fprintf(stderr, "Socket %d is too big for select()\n", fd);
+        return 0;
+    }
+    FD_SET(fd, &s->master);
+    if (fd > s->fd_max) s->fd_max = fd;
+    return 1;
+}
+
+// accept a connection, already non-blocking
+static int accept_nonblocking(int fd)
+{
+#ifdef SOCK_NONBLOCK
+    return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int new_fd = accept(fd, NULL, NULL);
+    if (new_fd >= 0) fcntl(new_fd, F_SETFL, O_NONBLOCK);
+    return new_fd;
+#endif
+}
+
+static int select_listen(struct net * n, int fd)
+{
+    struct select_net * s = n->priv;
+    if (! select_add(s, fd)) return 0;
+    FD_SET(fd, &s->listeners);
+    FD_CLR(fd, &s->released);
+    // accept until there's nobody left waiting
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    return 1;
+}
+
+static int select_attach(struct net * n, int fd, void * ctx)
+{
+    struct select_net * s = n->priv;
+    if (! select_add(s, fd)) return 0;
+    s->ctx[fd] = ctx;
+    FD_CLR(fd, &s->released);
+    // a slow client mustn't hold up everyone else: sends take what fits, and wait for room
+    //  (accepted sockets come that way already)
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && ! (flags & O_NONBLOCK)) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    return 1;
+}
+
+static int select_watch(struct net * n, int fd, void * ctx)
+{
+    struct select_net * s = n->priv;
+    if (! select_add(s, fd)) return 0;
+    s->ctx[fd] = ctx;
+    FD_SET(fd, &s->watched);
+    return 1;
+}
+
+static void select_detach(struct net * n, int fd)
+{
+    struct select_net * s = n->priv;
+    if (fd < FD_SETSIZE) {
+        FD_CLR(fd, &s->master);
+        FD_CLR(fd, &s->watched);
+        FD_CLR(fd, &s->writers);
+        FD_CLR(fd, &s->released);
+        s->ctx[fd] = NULL;
+        s->pending[fd].q = NULL;
+    }
+    close(fd);
+}
+
+static int select_release(struct net * n, int fd)
+{
+    struct select_net * s = n->priv;
+    if (fd >= FD_SETSIZE) return 1;
+    FD_SET(fd, &s->released);
+    if (FD_ISSET(fd, &s->writers)) return 0;
+    // nothing left to write either: forget it
+    FD_CLR(fd, &s->master);
+    FD_CLR(fd, &s->listeners);
+    FD_CLR(fd, &s->watched);
+    s->ctx[fd] = NULL;
+    return 1;
+}
+
+static int select_send(struct net * n, int fd, struct outq * q, int flags, size_t zerocopy_min, net_sent_fn sent, void * ctx)
+{
+    struct select_net * s = n->priv;
+    if (outq_flush(q, fd, flags, zerocopy_min, sent, ctx) < 0) {
+        perror("sendmsg");
+        return 0;
+    }
+
+    // the socket buffer is full: pick up the rest when it drains
+    if (q->count > 0) {
+        struct select_pending * p = &s->pending[fd];
+        p->q = q;
+        p->flags = flags & ~MSG_MORE;
+        p->zerocopy_min = zerocopy_min;
+        p->sent = sent;
+        p->ctx = ctx;
+        FD_SET(fd, &s->writers);
+    } else {
+        FD_CLR(fd, &s->writers);
+    }
+    return 1;
+}
+
+static size_t select_queued(struct net * n, int fd)
+{
+    // anything not yet sent is still in the caller's queue
+    (void)n;
+    (void)fd;
+    return 0;
+}
+
+static int select_wait(struct net * n, const struct timeval * timeout, struct net_event * events, int max)
+{
+    struct select_net * s = n->priv;
+
+    if (s->buffer_events < max) {
+        free(s->buffer);
+        s->buffer = malloc((size_t)max * RECV_SIZE);
+        if (s->buffer == NULL) {
+            perror("malloc select buffer");
+            exit(EXIT_FAILURE);
+        }
+        s->buffer_events = max;
+    }
+
+    // temp file descriptor list for select() - which also gets to scribble on the timeout
+    fd_set read_fds = s->master, write_fds = s->writers;
+    for (int fd = 0; fd <= s->fd_max; fd ++)
+        if (FD_ISSET(fd, &s->released)) FD_CLR(fd, &read_fds);
+    struct timeval tv, * tvp = NULL;
+    if (timeout != NULL) {
+        tv = *timeout;
+        tvp = &tv;
+    }
+
+    int ready_fds = select(s->fd_max + 1, &read_fds, &write_fds, NULL, tvp);
+    if (ready_fds < 0) return (errno == EINTR ? 0 : -1);
+
+    int count = 0;
+    int fd_max = -1;
+    for (int fd = 0; fd <= s->fd_max; fd ++) {
+        if (! FD_ISSET(fd, &s->master)) continue;
+        // keep the max fd updated
+        fd_max = fd;
+
+        // room for more of a waiting queue
+        if (FD_ISSET(fd, &write_fds) && FD_ISSET(fd, &s->writers) && count < max) {
+            struct select_pending * p = &s->pending[fd];
+            if (outq_flush(p->q, fd, p->flags, p->zerocopy_min, p->sent, p->ctx) < 0) {
+                struct net_event * e = &events[count ++];
+                e->type = net_error;
+                e->fd = fd;
+                e->ctx = s->ctx[fd];
+                e->error = errno;
+                FD_CLR(fd, &s->writers);
+                continue;
+            }
+            if (p->q->count == 0) FD_CLR(fd, &s->writers);
+        }
+
+        if (! FD_ISSET(fd, &read_fds) || count == max) continue;
+
+        if (FD_ISSET(fd, &s->listeners)) {
+            // handle new connections - every one that's waiting, or as many as there's room for
+            while (count < max) {
+                int new_fd = accept_nonblocking(fd);
+                if (new_fd == -1) {
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    // an error occurred trying to accept the new connection - maybe they disconnected in the meantime or something
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+                    break;
+                }
+                struct net_event * e = &events[count ++];
+                e->type = net_accept;
+                e->fd = fd;
+                e->ctx = s->ctx[fd];
+                e->new_fd = new_fd;
+            }
+            continue;
+        }
+
+        struct net_event * e = &events[count];
+        e->fd = fd;
+        e->ctx = s->ctx[fd];
+
+        if (FD_ISSET(fd, &s->watched)) {
+            e->type = net_wakeup;
+        } else {
+            // handle data from a client
+            unsigned char * buffer = s->buffer + (size_t)count * RECV_SIZE;
+            ssize_t nbytes = recv(fd, buffer, RECV_SIZE, MSG_DONTWAIT);
+            if (nbytes > 0) {
+                e->type = net_data;
+                e->data = buffer;
+                e->len = nbytes;
+            } else if (nbytes == 0) {
+                // connection closed
+                e->type = net_closed;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // readable with nothing to read: something on the error queue
+                e->type = net_wakeup;
+            } else {
+                e->type = net_error;
+                e->error = errno;
+            }
+        }
+        count ++;
+    }
+    s->fd_max = fd_max;
+
+    return count;
+}
+
+const struct net_backend net_select_backend = {
+    .name = "select",
+    .init = select_init,
+    .free = select_free,
+    .listen = select_listen,
+    .attach = select_attach,
+    .watch = select_watch,
+    .detach = select_detach,
+    .release = select_release,
+    .send = select_send,
+    .queued = select_queued,
+    .wait = select_wait
+};
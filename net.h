@@ -0,0 +1,99 @@
+#ifndef NET_H_
+#define NET_H_
+
+// The event loop: waits for connections, client input and the next tick, and carries output.
+//  Two backends sit behind it - plain select(), and io_uring on Linux kernels that have it,
+//  where a whole tick's worth of accepts, reads and sends costs one io_uring_enter().
+
+#include "outq.h"
+
+#include <stddef.h>
+#include <sys/time.h>
+
+enum net_event_type {
+    // a listener accepted new_fd
+    net_accept,
+    // input from a client: data / len, good until the next net_wait()
+    net_data,
+    // the client hung up
+    net_closed,
+    // a read or write on the client failed with error
+    net_error,
+    // the socket woke us without input (MSG_ZEROCOPY completions, say),
+    //  or a watched fd is readable
+    net_wakeup
+};
+
+struct net_event {
+    enum net_event_type type;
+    int fd;
+    void * ctx;
+
+    int new_fd;
+    const unsigned char * data;
+    size_t len;
+    int error;
+};
+
+// called for each run of bytes handed to the kernel
+typedef void (* net_sent_fn)(void * ctx, const unsigned char * data, size_t len);
+
+struct net;
+
+struct net_backend {
+    const char * name;
+    int (* init)(struct net * n);
+    void (* free)(struct net * n);
+    int (* listen)(struct net * n, int fd);
+    int (* attach)(struct net * n, int fd, void * ctx);
+    int (* watch)(struct net * n, int fd, void * ctx);
+    // stop watching a client, and close it
+    void (* detach)(struct net * n, int fd);
+    int (* release)(struct net * n, int fd);
+    int (* send)(struct net * n, int fd, struct outq * q, int flags, size_t zerocopy_min, net_sent_fn sent, void * ctx);
+    // bytes reported to sent() that haven't been handed to the kernel yet
+    size_t (* queued)(struct net * n, int fd);
+    int (* wait)(struct net * n, const struct timeval * timeout, struct net_event * events, int max);
+};
+
+struct net {
+    const struct net_backend * backend;
+    void * priv;
+};
+
+// set up the event loop - io_uring if asked for and the kernel allows it, otherwise select()
+int net_init(struct net * n, int use_uring);
+void net_free(struct net * n);
+
+int net_listen(struct net * n, int fd);
+int net_attach(struct net * n, int fd, void * ctx);
+// report a non-socket fd (an inotify instance, say) as net_wakeup whenever it's readable
+//  - reading it is up to the caller
+int net_watch(struct net * n, int fd, void * ctx);
+void net_detach(struct net * n, int fd);
+// stop reading (or accepting) on an fd without closing it, so it can go to another process -
+//  returns 1 once nothing more will come in on it and nothing is left to send, 0 if it's still
+//  winding down (ask again after the next wait).  net_attach() / net_listen() take it back.
+int net_release(struct net * n, int fd);
+
+// send (or, with io_uring, queue for the next net_wait) everything in q
+//  returns 0 if the connection has failed
+//  With select(), whatever the socket won't take right away stays in q and goes out as it drains
+//  - q must stay put until it's empty or the fd is detached.
+int net_send(struct net * n, int fd, struct outq * q, int flags, size_t zerocopy_min, net_sent_fn sent, void * ctx);
+
+// bytes already reported to sent() that haven't reached the other end: still waiting in the
+//  backend, or in the kernel's send queue unacknowledged
+size_t net_backlog(struct net * n, int fd);
+
+// wait for events, up to timeout (NULL for no limit) - returns how many, or -1 on error
+//  (0 could mean a signal interrupted the wait)
+int net_wait(struct net * n, const struct timeval * timeout, struct net_event * events, int max);
+
+// the backends
+extern const struct net_backend net_select_backend;
+#ifdef __linux__
+extern const struct net_backend net_uring_backend;
+#endif
+
+#endif
@@ -0,0 +1,251 @@
+#include "outq.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#ifdef SO_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+
+// most iovecs handed to one sendmsg() - an update is rarely more than a dozen pieces
+#define OUTQ_IOV 64
+
+struct segment * segment_new(size_t size)
+{
+    struct segment * s = malloc(sizeof(struct segment) + size);
+    if (s == NULL) {
+        perror("malloc segment");
+        exit(EXIT_FAILURE);
+    }
+    s->refs = 1;
+    s->len = size;
+    return s;
+}
+
+struct segment * segment_ref(struct segment * s)
+{
+    s->refs ++;
+    return s;
+}
+
+void segment_unref(struct segment * s)
+{
+    if (s != NULL && -- s->refs == 0) free(s);
+}
+
+struct segment * segment_shrink(struct segment * s)
+{
+    struct segment * smaller = realloc(s, sizeof(struct segment) + s->len);
+    return (smaller != NULL ? smaller : s);
+}
+
+void outq_init(struct outq * q)
+{
+    memset(q, 0, sizeof(struct outq));
+}
+
+void outq_free(struct outq * q)
+{
+    for (unsigned int i = 0; i < q->count; i ++)
+        segment_unref(q->entries[(q->head + i) % q->size].seg);
+    free(q->entries);
+
+    // the connection is going away, so nobody will see it if the kernel is still reading these
+    for (unsigned int i = 0; i < q->zerocopy_count; i ++) {
+        for (unsigned int k = 0; k < q->zerocopy[i].count; k ++)
+            segment_unref(q->zerocopy[i].segs[k]);
+        free(q->zerocopy[i].segs);
+    }
+    free(q->zerocopy);
+
+    outq_init(q);
+}
+
+void outq_push(struct outq * q, struct segment * s, size_t offset, size_t len)
+{
+    if (len == 0) return;
+
+    if (q->count == q->size) {
+        // grow the ring, straightening it out on the way
+        unsigned int size = (q->size ? q->size * 2 : 16);
+        struct outq_entry * entries = malloc(size * sizeof(struct outq_entry));
+        if (entries == NULL) {
+            perror("malloc outq");
+            exit(EXIT_FAILURE);
+        }
+        for (unsigned int i = 0; i < q->count; i ++)
+            entries[i] = q->entries[(q->head + i) % q->size];
+        free(q->entries);
+        q->entries = entries;
+        q->size = size;
+        q->head = 0;
+    }
+
+    struct outq_entry * e = &q->entries[(q->head + q->count) % q->size];
+    e->seg = segment_ref(s);
+    e->offset = offset;
+    e->len = len;
+    q->count ++;
+    q->bytes += len;
+}
+
+void outq_push_copy(struct outq * q, const void * data, size_t len)
+{
+    struct segment * s = segment_new(len);
+    memcpy(s->data, data, len);
+    outq_push(q, s, 0, len);
+    segment_unref(s);
+}
+
+int outq_pop(struct outq * q, struct outq_entry * e)
+{
+    if (q->count == 0) return 0;
+
+    *e = q->entries[q->head];
+    q->head = (q->head + 1) % q->size;
+    q->count --;
+    q->bytes -= e->len;
+    return 1;
+}
+
+#ifdef SO_ZEROCOPY
+// keep the segments behind a zerocopy send alive until its completion arrives
+static void zerocopy_hold(struct outq * q, unsigned int count)
+{
+    if (q->zerocopy_count == q->zerocopy_size) {
+        unsigned int size = (q->zerocopy_size ? q->zerocopy_size * 2 : 8);
+        struct zerocopy_send * zerocopy = realloc(q->zerocopy, size * sizeof(struct zerocopy_send));
+        if (zerocopy == NULL) {
+            perror("realloc zerocopy");
+            exit(EXIT_FAILURE);
+        }
+        q->zerocopy = zerocopy;
+        q->zerocopy_size = size;
+    }
+
+    struct zerocopy_send * z = &q->zerocopy[q->zerocopy_count ++];
+    z->id = q->zerocopy_next ++;
+    z->count = count;
+    z->segs = malloc(count * sizeof(struct segment *));
+    if (z->segs == NULL) {
+        perror("malloc zerocopy");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int i = 0; i < count; i ++)
+        z->segs[i] = segment_ref(q->entries[(q->head + i) % q->size].seg);
+    q->zerocopy_sends ++;
+}
+#endif
+
+long outq_flush(struct outq * q, int fd, int flags, size_t zerocopy_min,
+                void (* sent)(void * ctx, const unsigned char * data, size_t len), void * ctx)
+{
+    long total = 0;
+
+    while (q->count > 0) {
+        struct iovec iov[OUTQ_IOV];
+        unsigned int n = 0;
+        size_t len = 0;
+        for (; n < q->count && n < OUTQ_IOV; n ++) {
+            const struct outq_entry * e = &q->entries[(q->head + n) % q->size];
+            iov[n].iov_base = e->seg->data + e->offset;
+            iov[n].iov_len = e->len;
+            len += e->len;
+        }
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+        int f = flags;
+        // more of the queue still to come
+        if (n < q->count) f |= MSG_MORE;
+#ifdef SO_ZEROCOPY
+        const int zerocopy = (zerocopy_min && len >= zerocopy_min);
+        if (zerocopy) f |= MSG_ZEROCOPY;
+#else
+        (void)zerocopy_min;
+#endif
+
+        ssize_t r = sendmsg(fd, &msg, f);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+#ifdef SO_ZEROCOPY
+            // out of memory to pin pages with: just copy this one
+            if (zerocopy && errno == ENOBUFS) {
+                zerocopy_min = 0;
+                continue;
+            }
+#endif
+            return -1;
+        }
+
+#ifdef SO_ZEROCOPY
+        if (zerocopy) zerocopy_hold(q, n);
+#endif
+
+        // retire what went out - a signal can cut a blocking send short, so maybe not everything
+        size_t done = r;
+        while (done > 0) {
+            struct outq_entry * e = &q->entries[q->head];
+            size_t part = (done < e->len ? done : e->len);
+            if (sent) sent(ctx, e->seg->data + e->offset, part);
+            done -= part;
+            q->bytes -= part;
+            if (part < e->len) {
+                e->offset += part;
+                e->len -= part;
+            } else {
+                segment_unref(e->seg);
+                q->head = (q->head + 1) % q->size;
+                q->count --;
+            }
+        }
+        total += r;
+    }
+
+    return total;
+}
+
+void outq_zerocopy_complete(struct outq * q, int fd)
+{
+#ifdef SO_ZEROCOPY
+    for (;;) {
+        char control[128];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+
+        for (struct cmsghdr * cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (! ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                    (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            const struct sock_extended_err * err = (const struct sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+            // sends ee_info through ee_data are done with
+            uint32_t lo = err->ee_info, span = err->ee_data - err->ee_info;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) q->zerocopy_copied += span + 1;
+
+            unsigned int kept = 0;
+            for (unsigned int i = 0; i < q->zerocopy_count; i ++) {
+                struct zerocopy_send * z = &q->zerocopy[i];
+                if (z->id - lo <= span) {
+                    for (unsigned int k = 0; k < z->count; k ++)
+                        segment_unref(z->segs[k]);
+                    free(z->segs);
+                } else {
+                    q->zerocopy[kept ++] = *z;
+                }
+            }
+            q->zerocopy_count = kept;
+        }
+    }
+#else
+    (void)q;
+    (void)fd;
+#endif
+}
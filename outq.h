@@ -0,0 +1,72 @@
+#ifndef OUTQ_H_
+#define OUTQ_H_
+
+// Output queues: what's waiting to be sent to a client, as a list of references into shared,
+//  reference-counted segments.  An encoded rectangle is built once and queued for every client
+//  that wants it, then sent straight from the segment with sendmsg() - no per-client copy.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// an immutable (once queued) run of bytes, shared between queues
+struct segment {
+    unsigned int refs;
+    size_t len;
+    unsigned char data[];
+};
+
+// a new segment with room for size bytes, holding one reference
+struct segment * segment_new(size_t size);
+struct segment * segment_ref(struct segment * s);
+void segment_unref(struct segment * s);
+// give back unused space at the end of a segment nobody else has seen yet
+struct segment * segment_shrink(struct segment * s);
+
+struct outq_entry {
+    struct segment * seg;
+    size_t offset;
+    size_t len;
+};
+
+// segments sent with MSG_ZEROCOPY, held until the kernel says it's done with them
+struct zerocopy_send {
+    uint32_t id;
+    unsigned int count;
+    struct segment ** segs;
+};
+
+struct outq {
+    struct outq_entry * entries;
+    unsigned int head, count, size;
+    // total bytes waiting
+    size_t bytes;
+
+    // MSG_ZEROCOPY bookkeeping: the id of the next zerocopy send, and those not yet completed
+    uint32_t zerocopy_next;
+    struct zerocopy_send * zerocopy;
+    unsigned int zerocopy_count, zerocopy_size;
+    //  how many went out that way, and how many of those the kernel ended up copying anyway
+    unsigned long zerocopy_sends, zerocopy_copied;
+};
+
+void outq_init(struct outq * q);
+// drop everything queued, and any segments still held for zerocopy
+void outq_free(struct outq * q);
+
+// queue (a reference to) part of a segment
+void outq_push(struct outq * q, struct segment * s, size_t offset, size_t len);
+// queue a private copy of some bytes
+void outq_push_copy(struct outq * q, const void * data, size_t len);
+// take the entry at the front of the queue, reference and all - returns 0 if it's empty
+int outq_pop(struct outq * q, struct outq_entry * e);
+
+// send as much of the queue as the socket takes (all of it, for a blocking socket)
+//  calls sent() with each run of bytes that went out, and returns the bytes sent, or -1 on error
+//  if zerocopy_min is nonzero, sends at least that large go with MSG_ZEROCOPY
+long outq_flush(struct outq * q, int fd, int flags, size_t zerocopy_min,
+                void (* sent)(void * ctx, const unsigned char * data, size_t len), void * ctx);
+
+// collect MSG_ZEROCOPY completions from the socket error queue, releasing their segments
+void outq_zerocopy_complete(struct outq * q, int fd);
+
+#endif
@@ -0,0 +1,310 @@
+#include "pack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#define PACK_VERSION 1
+#define PACK_ALIGN 64
+#define PACK_NAME 16
+#define PACK_INDEX (PACK_NAME + 8)
+
+// what goes in a pack, in order
+enum pack_image {
+    pack_background,
+    pack_digits,
+    pack_ball,
+    pack_handle,
+    pack_coin,
+    pack_coinslot,
+    pack_reel0,
+    pack_reel1,
+    pack_reel2,
+
+    pack_image_count
+};
+
+static const char * const pack_names[pack_image_count] = {
+    "background", "digits", "ball", "handle", "coin", "coinslot", "reel0", "reel1", "reel2"
+};
+
+// the drawing code is written around these sizes, so a pack has to match them
+static const unsigned short pack_sizes[pack_image_count][2] = {
+    { 512, 384 }, { 6, 121 }, { 36, 36 }, { 24, 212 }, { 29, 29 }, { 29, 8 }, { 32, 960 }, { 32, 960 }, { 32, 960 }
+};
+
+struct pack {
+    void * map;
+    size_t size;
+    struct image images[pack_image_count];
+    struct assets assets;
+};
+
+static const struct image * asset_image(const struct assets * a, int i)
+{
+    switch (i) {
+    case pack_background:
+        return a->background;
+    case pack_digits:
+        return a->digits;
+    case pack_ball:
+        return a->ball;
+    case pack_handle:
+        return a->handle;
+    case pack_coin:
+        return a->coin;
+    case pack_coinslot:
+        return a->coinslot;
+    default:
+        return a->reels[i - pack_reel0];
+    }
+}
+
+static void put16(unsigned char * p, unsigned int v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(unsigned char * p, unsigned long v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static unsigned int get16(const unsigned char * p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static unsigned long get32(const unsigned char * p)
+{
+    return ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static size_t align(size_t n)
+{
+    return (n + PACK_ALIGN - 1) & ~(size_t)(PACK_ALIGN - 1);
+}
+
+int pack_write(const char * filename, const struct assets * a)
+{
+    // header and index
+    unsigned char header[12 + pack_image_count * PACK_INDEX];
+    memset(header, 0, sizeof(header));
+    memcpy(header, "VSPK", 4);
+    put32(&header[4], PACK_VERSION);
+    put32(&header[8], pack_image_count);
+
+    size_t offset = align(sizeof(header));
+    for (int i = 0; i < pack_image_count; i ++) {
+        const struct image * img = asset_image(a, i);
+        unsigned char * e = &header[12 + i * PACK_INDEX];
+        strncpy((char *)e, pack_names[i], PACK_NAME);
+        put16(&e[PACK_NAME], img->width);
+        put16(&e[PACK_NAME + 2], img->height);
+        put32(&e[PACK_NAME + 4], offset);
+        offset = align(offset + (size_t)img->width * img->height);
+    }
+
+    size_t len = strlen(filename);
+    char * tmp = malloc(len + 5);
+    if (tmp == NULL) {
+        perror("malloc pack name");
+        return 0;
+    }
+    memcpy(tmp, filename, len);
+    memcpy(tmp + len, ".tmp", 5);
+
+    FILE * fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen(%s): %d: %s\n", tmp, errno, strerror(errno));
+        free(tmp);
+        return 0;
+    }
+
+    static const unsigned char zero[PACK_ALIGN];
+    int ok = (fwrite(header, sizeof(header), 1, fp) == 1);
+    size_t pos = sizeof(header);
+    for (int i = 0; ok && i < pack_image_count; i ++) {
+        const struct image * img = asset_image(a, i);
+        size_t size = (size_t)img->width * img->height;
+        ok = (fwrite(zero, 1, align(pos) - pos, fp) == align(pos) - pos) &&
+             (fwrite(img->data, 1, size, fp) == size);
+        pos = align(pos) + size;
+    }
+    if (fclose(fp) != 0) ok = 0;
+
+    if (! ok || rename(tmp, filename) != 0) {
+        fprintf(stderr, "Failed to write %s: %d: %s\n", filename, errno, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return 0;
+    }
+
+    free(tmp);
+    return 1;
+}
+
+struct pack * pack_open(const char * filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open(%s): %d: %s\n", filename, errno, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "fstat(%s): %d: %s\n", filename, errno, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    const size_t size = st.st_size;
+    if (size < 12 + pack_image_count * PACK_INDEX) {
+        fprintf(stderr, "%s is too short for an asset pack\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    // the mapping keeps the file open for us
+    void * map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "mmap(%s): %d: %s\n", filename, errno, strerror(errno));
+        return NULL;
+    }
+
+    struct pack * p = malloc(sizeof(struct pack));
+    if (p == NULL) {
+        perror("malloc pack");
+        munmap(map, size);
+        return NULL;
+    }
+    p->map = map;
+    p->size = size;
+
+    const unsigned char * m = map;
+    if (memcmp(m, "VSPK", 4) != 0 || get32(&m[4]) != PACK_VERSION || get32(&m[8]) != pack_image_count) {
+        fprintf(stderr, "%s is not a version %d asset pack\n", filename, PACK_VERSION);
+        pack_close(p);
+        return NULL;
+    }
+
+    for (int i = 0; i < pack_image_count; i ++) {
+        const unsigned char * e = &m[12 + i * PACK_INDEX];
+        unsigned int width = get16(&e[PACK_NAME]), height = get16(&e[PACK_NAME + 2]);
+        unsigned long offset = get32(&e[PACK_NAME + 4]);
+        if (strncmp((const char *)e, pack_names[i], PACK_NAME) != 0 || offset > size ||
+                width != pack_sizes[i][0] || height != pack_sizes[i][1] ||
+                (size_t)width * height > size - offset) {
+            fprintf(stderr, "%s: bad index entry for %s\n", filename, pack_names[i]);
+            pack_close(p);
+            return NULL;
+        }
+        // the drawing code only ever reads sprites - the cast is just for struct image
+        p->images[i].width = width;
+        p->images[i].height = height;
+        p->images[i].stride = width;
+        p->images[i].data = (unsigned char *)&m[offset];
+        p->images[i].rows = NULL;
+    }
+
+    p->assets.background = &p->images[pack_background];
+    p->assets.digits = &p->images[pack_digits];
+    p->assets.ball = &p->images[pack_ball];
+    p->assets.handle = &p->images[pack_handle];
+    p->assets.coin = &p->images[pack_coin];
+    p->assets.coinslot = &p->images[pack_coinslot];
+    for (int i = 0; i < 3; i ++)
+        p->assets.reels[i] = &p->images[pack_reel0 + i];
+
+    return p;
+}
+
+const struct assets * pack_assets(const struct pack * p)
+{
+    return &p->assets;
+}
+
+void pack_close(struct pack * p)
+{
+    if (p == NULL) return;
+    munmap(p->map, p->size);
+    free(p);
+}
+
+// the name of a file within its directory
+static const char * pack_basename(const char * filename)
+{
+    const char * slash = strrchr(filename, '/');
+    return (slash ? slash + 1 : filename);
+}
+
+int pack_watch(const char * filename)
+{
+#ifdef __linux__
+    // watch the directory rather than the file: a new pack arrives as a new inode, renamed over
+    //  the old one - only ever that, since writing over the one that's mapped would pull the
+    //  pages out from under the drawing code (SIGBUS), so a pack written in place isn't taken up
+    const char * base = pack_basename(filename);
+    size_t dir_len = base - filename;
+    char * dir = malloc(dir_len + 2);
+    if (dir == NULL) {
+        perror("malloc pack dir");
+        return -1;
+    }
+    if (dir_len == 0) {
+        strcpy(dir, ".");
+    } else {
+        memcpy(dir, filename, dir_len);
+        dir[dir_len] = '\0';
+    }
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        perror("inotify_init1");
+    } else if (inotify_add_watch(fd, dir, IN_MOVED_TO) < 0) {
+        fprintf(stderr, "inotify_add_watch(%s): %d: %s\n", dir, errno, strerror(errno));
+        close(fd);
+        fd = -1;
+    }
+    free(dir);
+    return fd;
+#else
+    (void)filename;
+    return -1;
+#endif
+}
+
+int pack_changed(int fd, const char * filename)
+{
+    int changed = 0;
+#ifdef __linux__
+    const char * base = pack_basename(filename);
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (char * p = buffer; p < buffer + len; ) {
+            const struct inotify_event * e = (const struct inotify_event *)p;
+            if (e->len > 0 && strcmp(e->name, base) == 0) changed = 1;
+            p += sizeof(struct inotify_event) + e->len;
+        }
+    }
+#else
+    (void)fd;
+    (void)filename;
+#endif
+    return changed;
+}
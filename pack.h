@@ -0,0 +1,34 @@
+#ifndef PACK_H_
+#define PACK_H_
+
+// Asset packs: every sprite plus the prebuilt reel strips in one file, laid out so it can be
+//  mmap'd and used in place.  Starting from a pack reads nothing up front, and several servers
+//  on one host share its pages.
+//
+//  Layout (all numbers big-endian, like the .bin files):
+//   "VSPK", version (u32), image count (u32), then per image a 16 byte zero-padded name,
+//   width (u16), height (u16), offset (u32) - and the pixel data, each image starting on a
+//   64 byte boundary.
+
+#include "game.h"
+
+struct pack;
+
+// write the assets out as a pack - to a temporary file first, then renamed into place, so
+//  anybody with the old one mapped keeps it intact
+int pack_write(const char * filename, const struct assets * a);
+
+// map a pack, check it over (the sprites have to be the sizes the game draws with)
+//  and point a set of assets into it
+struct pack * pack_open(const char * filename);
+const struct assets * pack_assets(const struct pack * p);
+void pack_close(struct pack * p);
+
+// watch for a new pack being renamed into place (Linux only)
+//  never write over the pack a server has mapped: it would crash drawing from the pages cut off
+//  returns an fd that becomes readable when something happens, or -1
+int pack_watch(const char * filename);
+// after the watch fd wakes up: has the pack been replaced?
+int pack_changed(int fd, const char * filename);
+
+#endif
@@ -0,0 +1,145 @@
+#include "record.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+static const char fbs_header[12] = "FBS 001.000\n";
+
+static FILE * fbs_open(const char * dir, unsigned int id, const char * direction)
+{
+    char filename[PATH_MAX];
+    snprintf(filename, sizeof filename, "%s/%u-%s.fbs", dir, id, direction);
+
+    FILE * fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen(%s): %d: %s\n", filename, errno, strerror(errno));
+        return NULL;
+    }
+    fwrite(fbs_header, 1, 12, fp);
+    return fp;
+}
+
+static void put_u32(unsigned char * p, unsigned int value)
+{
+    p[0] = (value >> 24) & 0xFF;
+    p[1] = (value >> 16) & 0xFF;
+    p[2] = (value >> 8) & 0xFF;
+    p[3] = value & 0xFF;
+}
+
+static unsigned int get_u32(const unsigned char * p)
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void fbs_write_block(FILE * fp, const struct timeval * start, const void * data, size_t len)
+{
+    static const unsigned char padding[3] = { 0 };
+    unsigned char buffer[4];
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    unsigned int timestamp = (now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000;
+
+    put_u32(buffer, len);
+    fwrite(buffer, 1, 4, fp);
+    fwrite(data, 1, len, fp);
+    fwrite(padding, 1, (4 - (len & 3)) & 3, fp);
+    put_u32(buffer, timestamp);
+    fwrite(buffer, 1, 4, fp);
+}
+
+struct recorder * record_open(const char * dir, unsigned int id)
+{
+    struct recorder * r = malloc(sizeof(struct recorder));
+    if (r == NULL) {
+        perror("malloc recorder");
+        return NULL;
+    }
+
+    r->in = fbs_open(dir, id, "in");
+    r->out = fbs_open(dir, id, "out");
+    if (r->in == NULL || r->out == NULL) {
+        if (r->in) fclose(r->in);
+        if (r->out) fclose(r->out);
+        free(r);
+        return NULL;
+    }
+    gettimeofday(&r->start, NULL);
+
+    return r;
+}
+
+struct recorder * record_adopt(int in, int out, const struct timeval * start)
+{
+    struct recorder * r = malloc(sizeof(struct recorder));
+    if (r == NULL) {
+        perror("malloc recorder");
+        return NULL;
+    }
+
+    r->in = fdopen(in, "ab");
+    r->out = fdopen(out, "ab");
+    if (r->in == NULL || r->out == NULL) {
+        perror("fdopen recording");
+        if (r->in) fclose(r->in);
+        else close(in);
+        if (r->out) fclose(r->out);
+        else close(out);
+        free(r);
+        return NULL;
+    }
+    r->start = *start;
+
+    return r;
+}
+
+void record_close(struct recorder * r)
+{
+    fclose(r->in);
+    fclose(r->out);
+    free(r);
+}
+
+void record_in(struct recorder * r, const void * data, size_t len)
+{
+    fbs_write_block(r->in, &r->start, data, len);
+}
+
+void record_out(struct recorder * r, const void * data, size_t len)
+{
+    fbs_write_block(r->out, &r->start, data, len);
+}
+
+int fbs_read_header(FILE * fp)
+{
+    char buffer[12];
+    if (fread(buffer, 1, 12, fp) != 12 || memcmp(buffer, fbs_header, 8) != 0)
+        return 0;
+    return 1;
+}
+
+unsigned char * fbs_read_block(FILE * fp, size_t * len, unsigned int * timestamp)
+{
+    unsigned char buffer[4];
+    if (fread(buffer, 1, 4, fp) != 4) return NULL;
+    *len = get_u32(buffer);
+
+    // the data is padded out to a multiple of 4 bytes
+    size_t padded = (*len + 3) & ~3;
+    unsigned char * data = malloc(padded ? padded : 1);
+    if (data == NULL) {
+        perror("malloc fbs block");
+        return NULL;
+    }
+    if (fread(data, 1, padded, fp) != padded || fread(buffer, 1, 4, fp) != 4) {
+        free(data);
+        return NULL;
+    }
+    *timestamp = get_u32(buffer);
+
+    return data;
+}
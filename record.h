@@ -0,0 +1,35 @@
+#ifndef RECORD_H_
+#define RECORD_H_
+
+// session capture in the FBS (rfbproxy) format:
+//  a "FBS 001.000\n" header, then blocks of
+//   uint32 length, data padded to 4 bytes, uint32 milliseconds since the session began
+//  each client gets two files, one for each direction of the connection
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+struct recorder {
+    FILE * in;
+    FILE * out;
+    struct timeval start;
+};
+
+// creates <dir>/<id>-in.fbs and <dir>/<id>-out.fbs
+struct recorder * record_open(const char * dir, unsigned int id);
+void record_close(struct recorder * r);
+// carry on with files another process started (after a handoff), from their descriptors
+struct recorder * record_adopt(int in, int out, const struct timeval * start);
+
+// bytes received from the client
+void record_in(struct recorder * r, const void * data, size_t len);
+// bytes sent to the client
+void record_out(struct recorder * r, const void * data, size_t len);
+
+// read the next block from an FBS file: returns a malloc'd buffer, or NULL at end of file
+unsigned char * fbs_read_block(FILE * fp, size_t * len, unsigned int * timestamp);
+// check the FBS header of a file
+int fbs_read_header(FILE * fp);
+
+#endif
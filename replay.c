@@ -0,0 +1,620 @@
+/*
+** vncreplay - drive a VNCSlots server with recorded client traffic
+**
+** Reads a session captured with `vncslots --record DIR`, and plays the client side
+**  (<n>-in.fbs) back against a server from many parallel connections, either at the
+**  recorded pace or as fast as possible.  If the server side of the capture (<n>-out.fbs)
+**  is given too, every session's output is compared byte-for-byte against it, and the
+**  arrival time of each recorded block is compared against its original timestamp.
+**
+** With -c, it's a connection-rate benchmark instead: it keeps opening connections, sends
+**  the whole client side of the handshake in one go, and counts how many reach ServerInit.
+**
+** With -l, it holds sessions open for a while, asking for updates all the time and dropping
+**  a coin in every few seconds, and fails if the server loses any of them - for checking that
+**  a --takeover upgrade (see upgrade-test.sh) goes unnoticed.
+*/
+
+#include "record.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <time.h>
+
+// one block of the capture
+struct block {
+    unsigned char * data;
+    size_t len;
+    unsigned int timestamp;
+};
+
+// a whole capture file
+struct capture {
+    struct block * blocks;
+    unsigned int count;
+    // total of all block lengths
+    size_t bytes;
+};
+
+// one parallel replay
+struct session {
+    int fd;
+    // time this session connected, in ms
+    double start;
+    // next input block to send
+    unsigned int next;
+
+    // output from the server: how much arrived, and where it first differs from the capture
+    size_t received;
+    long mismatch;
+    // next output block whose arrival should be timed
+    unsigned int out_block;
+    size_t out_block_end;
+    double lateness_total;
+    double lateness_max;
+    unsigned int lateness_count;
+
+    double last_activity;
+    int done;
+};
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int load_capture(const char * filename, struct capture * cap)
+{
+    FILE * fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen(%s): %d: %s\n", filename, errno, strerror(errno));
+        return 0;
+    }
+    if (! fbs_read_header(fp)) {
+        fprintf(stderr, "%s is not an FBS file\n", filename);
+        fclose(fp);
+        return 0;
+    }
+
+    unsigned int allocated = 0;
+    cap->blocks = NULL;
+    cap->count = 0;
+    cap->bytes = 0;
+
+    struct block b;
+    while ((b.data = fbs_read_block(fp, &b.len, &b.timestamp)) != NULL) {
+        if (cap->count == allocated) {
+            allocated = allocated ? allocated * 2 : 256;
+            cap->blocks = realloc(cap->blocks, allocated * sizeof(struct block));
+            if (cap->blocks == NULL) {
+                perror("realloc blocks");
+                exit(EXIT_FAILURE);
+            }
+        }
+        cap->blocks[cap->count] = b;
+        cap->count ++;
+        cap->bytes += b.len;
+    }
+    fclose(fp);
+
+    return 1;
+}
+
+static int connect_to(const char * host, const char * port)
+{
+    static const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_protocol = IPPROTO_TCP
+    };
+
+    struct addrinfo *ai;
+    int rv = getaddrinfo(host, port, &hints, &ai);
+    if (rv != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo * p = ai; p != NULL; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+
+    if (fd < 0) perror("connect");
+    return fd;
+}
+
+// /////////////////////////////////
+// Connection-rate benchmark
+
+// one connection being set up
+struct attempt {
+    int fd;
+    // connect() still in progress
+    int connecting;
+    double start;
+    // the server's side of the handshake so far
+    unsigned char reply[64];
+    size_t received;
+};
+
+// how long the server's side of the handshake is - once enough of it has arrived to tell
+//  (ProtocolVersion, Security Types, SecurityResult, then ServerInit ending with the name)
+static size_t handshake_length(const unsigned char * reply, size_t len)
+{
+    if (len < 13) return 0;
+    size_t init = 12 + 1 + reply[12] + 4;
+    if (len < init + 24) return 0;
+    const unsigned char * l = &reply[init + 20];
+    return init + 24 + (((size_t)l[0] << 24) | (l[1] << 16) | (l[2] << 8) | l[3]);
+}
+
+static int start_attempt(struct attempt * a, const struct addrinfo * ai)
+{
+    a->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (a->fd < 0) {
+        perror("socket");
+        return 0;
+    }
+    fcntl(a->fd, F_SETFL, O_NONBLOCK);
+    a->start = now_ms();
+    a->received = 0;
+    a->connecting = 1;
+    if (connect(a->fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        a->connecting = 0;
+    } else if (errno != EINPROGRESS) {
+        perror("connect");
+        close(a->fd);
+        return 0;
+    }
+    return 1;
+}
+
+static int connection_benchmark(const char * host, const char * port, unsigned int parallel, double seconds)
+{
+    static const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_protocol = IPPROTO_TCP
+    };
+    struct addrinfo * ai;
+    int rv = getaddrinfo(host, port, &hints, &ai);
+    if (rv != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return EXIT_FAILURE;
+    }
+
+    struct attempt * attempts = calloc(parallel, sizeof(struct attempt));
+    struct pollfd * fds = calloc(parallel, sizeof(struct pollfd));
+    if (attempts == NULL || fds == NULL) {
+        perror("calloc attempts");
+        return EXIT_FAILURE;
+    }
+    printf("Opening connections to %s:%s, %u at a time, for %g s\n", host, port, parallel, seconds);
+
+    // ProtocolVersion, security type "None", and ClientInit (shared)
+    static const unsigned char client_side[] = { 'R', 'F', 'B', ' ', '0', '0', '3', '.', '0', '0', '8', '\n', 0x01, 0x01 };
+
+    unsigned long completed = 0, failed = 0;
+    double latency_total = 0, latency_max = 0;
+    const double begin = now_ms(), end = begin + seconds * 1000;
+    for (unsigned int i = 0; i < parallel; i ++) {
+        if (! start_attempt(&attempts[i], ai)) return EXIT_FAILURE;
+    }
+
+    while (now_ms() < end) {
+        for (unsigned int i = 0; i < parallel; i ++) {
+            fds[i].fd = attempts[i].fd;
+            fds[i].events = (attempts[i].connecting ? POLLOUT : POLLIN);
+        }
+        if (poll(fds, parallel, 100) < 0) {
+            perror("poll");
+            return EXIT_FAILURE;
+        }
+
+        for (unsigned int i = 0; i < parallel; i ++) {
+            struct attempt * a = &attempts[i];
+            if (! fds[i].revents) continue;
+
+            int ok = 1, done = 0;
+            if (a->connecting) {
+                // connected (or not): send our side of the handshake, all of it
+                int error = 0;
+                socklen_t len = sizeof(error);
+                getsockopt(a->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+                a->connecting = 0;
+                ok = (error == 0 && send(a->fd, client_side, sizeof(client_side), 0) == sizeof(client_side));
+            } else {
+                ssize_t n = recv(a->fd, a->reply + a->received, sizeof(a->reply) - a->received, 0);
+                if (n <= 0) {
+                    ok = 0;
+                } else {
+                    a->received += n;
+                    size_t needed = handshake_length(a->reply, a->received);
+                    if (needed && a->received >= needed) done = 1;
+                    else if (a->received == sizeof(a->reply)) ok = 0;
+                }
+            }
+
+            if (! ok || done) {
+                if (done) {
+                    double latency = now_ms() - a->start;
+                    latency_total += latency;
+                    if (latency > latency_max) latency_max = latency;
+                    completed ++;
+                } else {
+                    failed ++;
+                }
+                close(a->fd);
+                if (! start_attempt(a, ai)) return EXIT_FAILURE;
+            }
+        }
+    }
+    const double total = (now_ms() - begin) / 1000;
+
+    for (unsigned int i = 0; i < parallel; i ++) close(attempts[i].fd);
+    free(attempts);
+    free(fds);
+    freeaddrinfo(ai);
+
+    printf("%lu handshakes in %.3f s (%.0f per second), %lu failed\n", completed, total, completed / total, failed);
+    if (completed)
+        printf("connect to ServerInit took %.2f ms on average, %.2f ms at worst\n", latency_total / completed, latency_max);
+    return (completed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// /////////////////////////////////
+// Holding sessions open
+
+// how often every session asks for an update, and the first one drops a coin in
+#define HOLD_REQUEST_MS 40
+#define HOLD_PULL_MS 3000
+// a session that hears nothing for this long (the longest wait between pulls, and then some)
+//  has been lost
+#define HOLD_QUIET_MS 8000
+
+static int hold_sessions(const char * host, const char * port, unsigned int count, double seconds)
+{
+    int * socks = calloc(count, sizeof(int));
+    double * heard = calloc(count, sizeof(double));
+    struct pollfd * fds = calloc(count, sizeof(struct pollfd));
+    if (socks == NULL || heard == NULL || fds == NULL) {
+        perror("calloc sessions");
+        return EXIT_FAILURE;
+    }
+
+    // ProtocolVersion, security type "None", ClientInit (shared) - then, again and again, an
+    //  incremental FramebufferUpdateRequest for the lot, and a space bar press and release
+    static const unsigned char client_side[] = { 'R', 'F', 'B', ' ', '0', '0', '3', '.', '0', '0', '8', '\n', 0x01, 0x01 };
+    static const unsigned char request[] = { 3, 1, 0, 0, 0, 0, 0x20, 0x00, 0x20, 0x00 };
+    static const unsigned char pull[] = { 4, 1, 0, 0, 0, 0, 0, 32, 4, 0, 0, 0, 0, 0, 0, 32 };
+
+    printf("Holding %u sessions open against %s:%s for %g s\n", count, host, port, seconds);
+    const double begin = now_ms(), end = begin + seconds * 1000;
+    for (unsigned int i = 0; i < count; i ++) {
+        socks[i] = connect_to(host, port);
+        if (socks[i] < 0 || send(socks[i], client_side, sizeof(client_side), MSG_NOSIGNAL) != sizeof(client_side))
+            return EXIT_FAILURE;
+        heard[i] = begin;
+    }
+
+    unsigned int lost = 0;
+    size_t received = 0;
+    double next_request = begin, next_pull = begin;
+    static unsigned char buf[65536];
+    for (double now = begin; now < end; now = now_ms()) {
+        const int asking = (now >= next_request), pulling = (now >= next_pull);
+        if (asking) next_request = now + HOLD_REQUEST_MS;
+        if (pulling) next_pull = now + HOLD_PULL_MS;
+
+        for (unsigned int i = 0; i < count; i ++) {
+            int fd = socks[i];
+            fds[i].fd = fd;
+            fds[i].events = POLLIN;
+            if (fd < 0) continue;
+
+            const char * why = NULL;
+            if (now - heard[i] > HOLD_QUIET_MS) why = "went quiet";
+            else if (asking && send(fd, request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) why = "send failed";
+            else if (pulling && i == 0 && send(fd, pull, sizeof(pull), MSG_NOSIGNAL) != sizeof(pull)) why = "send failed";
+            if (why) {
+                printf("session %u %s after %.1f s\n", i, why, (now - begin) / 1000);
+                close(fd);
+                socks[i] = fds[i].fd = -1;
+                lost ++;
+            }
+        }
+
+        if (poll(fds, count, HOLD_REQUEST_MS) < 0) {
+            perror("poll");
+            return EXIT_FAILURE;
+        }
+
+        now = now_ms();
+        for (unsigned int i = 0; i < count; i ++) {
+            if (socks[i] < 0 || ! (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            ssize_t nbytes = recv(socks[i], buf, sizeof buf, 0);
+            if (nbytes <= 0) {
+                printf("session %u dropped after %.1f s\n", i, (now - begin) / 1000);
+                close(socks[i]);
+                socks[i] = -1;
+                lost ++;
+                continue;
+            }
+            received += nbytes;
+            heard[i] = now;
+        }
+    }
+
+    for (unsigned int i = 0; i < count; i ++)
+        if (socks[i] >= 0) close(socks[i]);
+    free(socks);
+    free(heard);
+    free(fds);
+
+    printf("%u sessions held for %g s, %zu bytes received: %u lost\n", count, seconds, received, lost);
+    return (lost ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+// compare newly arrived output against the capture
+static void check_output(struct session * s, const struct capture * out, const unsigned char * buf, size_t len, double now)
+{
+    size_t offset = s->received;
+    s->received += len;
+
+    if (out == NULL) return;
+
+    // find which recorded block each byte belongs to, for comparison and timing
+    size_t i = 0;
+    while (i < len && s->out_block < out->count) {
+        const struct block * b = &out->blocks[s->out_block];
+        size_t block_start = s->out_block_end - b->len;
+        size_t n = s->out_block_end - (offset + i);
+        if (n > len - i) n = len - i;
+
+        if (s->mismatch < 0 && memcmp(buf + i, b->data + (offset + i - block_start), n) != 0) {
+            for (size_t k = 0; k < n; k ++) {
+                if (buf[i + k] != b->data[offset + i - block_start + k]) {
+                    s->mismatch = offset + i + k;
+                    break;
+                }
+            }
+        }
+
+        i += n;
+        if (offset + i == s->out_block_end) {
+            // this block is complete: how late was it compared to the recording?
+            double lateness = (now - s->start) - b->timestamp;
+            s->lateness_total += lateness;
+            if (lateness > s->lateness_max) s->lateness_max = lateness;
+            s->lateness_count ++;
+
+            s->out_block ++;
+            if (s->out_block < out->count)
+                s->out_block_end += out->blocks[s->out_block].len;
+        }
+    }
+
+    // anything beyond the end of the capture is a difference too
+    if (s->mismatch < 0 && s->received > out->bytes)
+        s->mismatch = out->bytes;
+}
+
+static void usage(const char * name)
+{
+    fprintf(stderr, "Usage: %s [options] <n>-in.fbs [<n>-out.fbs]\n"
+            "       %s [options] -c seconds\n"
+            "       %s [options] -l seconds\n"
+            "  -H host      server to connect to (default localhost)\n"
+            "  -p port      port to connect to (default 5900)\n"
+            "  -n count     number of parallel sessions (default 1)\n"
+            "  -x speed     playback speed multiplier (default 1)\n"
+            "  -m           play back as fast as possible\n"
+            "  -i ms        idle time after the last input before a session is finished (default 2000)\n"
+            "  -c seconds   benchmark: open connections (-n at a time) and count completed handshakes\n"
+            "  -l seconds   hold -n sessions open, playing, and fail if the server drops any\n", name, name, name);
+}
+
+int main(int argc, char * argv[])
+{
+    const char * host = "localhost";
+    const char * port = "5900";
+    unsigned int count = 1;
+    double speed = 1;
+    double idle = 2000;
+    double benchmark = 0;
+    double hold = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:n:x:mi:c:l:")) != -1) {
+        switch (opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 'x':
+            speed = strtod(optarg, NULL);
+            break;
+        case 'm':
+            speed = 0;
+            break;
+        case 'i':
+            idle = strtod(optarg, NULL);
+            break;
+        case 'c':
+            benchmark = strtod(optarg, NULL);
+            break;
+        case 'l':
+            hold = strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (benchmark > 0 && count > 0) return connection_benchmark(host, port, count, benchmark);
+    if (hold > 0 && count > 0) return hold_sessions(host, port, count, hold);
+    if (optind >= argc || count == 0 || speed < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct capture in, out_capture, * out = NULL;
+    if (! load_capture(argv[optind], &in)) return EXIT_FAILURE;
+    if (optind + 1 < argc) {
+        if (! load_capture(argv[optind + 1], &out_capture)) return EXIT_FAILURE;
+        out = &out_capture;
+    }
+    printf("Loaded %u client blocks (%zu bytes)", in.count, in.bytes);
+    if (out) printf(", %u server blocks (%zu bytes)", out->count, out->bytes);
+    printf("\nReplaying %u sessions against %s:%s at ", count, host, port);
+    if (speed > 0) printf("x%g recorded pace\n", speed);
+    else printf("max speed\n");
+
+    struct session * sessions = calloc(count, sizeof(struct session));
+    struct pollfd * fds = calloc(count, sizeof(struct pollfd));
+    if (sessions == NULL || fds == NULL) {
+        perror("calloc sessions");
+        return EXIT_FAILURE;
+    }
+
+    double begin = now_ms();
+    for (unsigned int i = 0; i < count; i ++) {
+        struct session * s = &sessions[i];
+        s->fd = connect_to(host, port);
+        if (s->fd < 0) return EXIT_FAILURE;
+        s->start = s->last_activity = now_ms();
+        s->mismatch = -1;
+        s->out_block_end = (out && out->count ? out->blocks[0].len : 0);
+    }
+
+    unsigned int active = count;
+    static unsigned char buf[65536];
+    while (active > 0) {
+        double now = now_ms();
+
+        // send anything that is due, and work out how long until the next send
+        double wait = 100;
+        for (unsigned int i = 0; i < count; i ++) {
+            struct session * s = &sessions[i];
+            fds[i].fd = (s->done ? -1 : s->fd);
+            fds[i].events = POLLIN;
+            if (s->done) continue;
+
+            while (s->next < in.count) {
+                const struct block * b = &in.blocks[s->next];
+                double due = (speed > 0 ? s->start + b->timestamp / speed : now);
+                if (due > now) {
+                    if (due - now < wait) wait = due - now;
+                    break;
+                }
+                if (send(s->fd, b->data, b->len, 0) == -1) {
+                    perror("send");
+                    s->done = 1;
+                    break;
+                }
+                s->next ++;
+                s->last_activity = now;
+            }
+
+            // all input is sent: finish up once the output is all there, or has gone quiet
+            if (! s->done && s->next == in.count) {
+                if ((out && s->received >= out->bytes && speed > 0) || now - s->last_activity > idle) {
+                    s->done = 1;
+                } else if (idle - (now - s->last_activity) < wait) {
+                    wait = idle - (now - s->last_activity);
+                }
+            }
+            if (s->done) {
+                close(s->fd);
+                fds[i].fd = -1;
+                active --;
+            }
+        }
+
+        if (poll(fds, count, wait > 0 ? (int)wait + 1 : 0) < 0) {
+            perror("poll");
+            return EXIT_FAILURE;
+        }
+
+        now = now_ms();
+        for (unsigned int i = 0; i < count; i ++) {
+            struct session * s = &sessions[i];
+            if (s->done || ! (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+            ssize_t nbytes = recv(s->fd, buf, sizeof buf, 0);
+            if (nbytes <= 0) {
+                if (nbytes < 0) perror("recv");
+                close(s->fd);
+                s->done = 1;
+                active --;
+                continue;
+            }
+            check_output(s, out, buf, nbytes, now);
+            s->last_activity = now;
+        }
+    }
+    double total = (now_ms() - begin) / 1000;
+
+    // report
+    size_t received = 0;
+    unsigned int matched = 0;
+    double lateness_total = 0, lateness_max = 0;
+    unsigned int lateness_count = 0;
+    for (unsigned int i = 0; i < count; i ++) {
+        struct session * s = &sessions[i];
+        received += s->received;
+        if (out == NULL) continue;
+
+        if (s->mismatch < 0 && s->received == out->bytes) {
+            matched ++;
+        } else {
+            printf("session %u: %zu of %zu bytes, ", i, s->received, out->bytes);
+            if (s->mismatch >= 0) printf("first difference at byte %ld\n", s->mismatch);
+            else printf("output is short\n");
+        }
+        lateness_total += s->lateness_total;
+        lateness_count += s->lateness_count;
+        if (s->lateness_max > lateness_max) lateness_max = s->lateness_max;
+    }
+
+    printf("%u sessions, %zu bytes received in %.3f s (%.0f bytes/sec)\n", count, received, total, total > 0 ? received / total : 0);
+    if (out) {
+        printf("%u of %u sessions matched the capture exactly\n", matched, count);
+        if (lateness_count)
+            printf("server output was %.1f ms later than recorded on average, %.1f ms at worst\n", lateness_total / lateness_count, lateness_max);
+    }
+
+    int status = (out && matched != count ? EXIT_FAILURE : EXIT_SUCCESS);
+
+    free(sessions);
+    free(fds);
+    for (unsigned int i = 0; i < in.count; i ++) free(in.blocks[i].data);
+    free(in.blocks);
+    if (out) {
+        for (unsigned int i = 0; i < out->count; i ++) free(out->blocks[i].data);
+        free(out->blocks);
+    }
+
+    return status;
+}
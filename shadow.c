@@ -0,0 +1,59 @@
+#include "shadow.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void shadow_free(struct shadow * s)
+{
+    if (s == NULL) return;
+    free_image(s->image);
+    free(s);
+}
+
+const struct image * shadow_update(struct shadow ** shadow, const struct game * g, unsigned int factor)
+{
+    struct shadow * s = *shadow;
+    const struct image * fb = g->framebuffer;
+    const unsigned short width = fb->width / factor, height = fb->height / factor;
+    if (s != NULL && (s->image->width != width || s->image->height != height)) {
+        shadow_free(s);
+        s = NULL;
+    }
+    if (s == NULL) {
+        s = malloc(sizeof(struct shadow));
+        if (s == NULL || (s->image = make_image(width, height)) == NULL) {
+            perror("malloc shadow");
+            exit(EXIT_FAILURE);
+        }
+        s->source = NULL;
+        *shadow = s;
+    }
+    if (s->source == fb && s->version == g->version && s->epoch == g->epoch) return s->image;
+
+    // a new epoch (or framebuffer) has been drawn all over: shrink the lot
+    struct rect damage[GAME_DAMAGE_MAX];
+    unsigned int count;
+    if (s->source != fb || s->epoch != g->epoch) {
+        damage[0] = (struct rect) { 0, 0, fb->width, fb->height };
+        count = 1;
+    } else {
+        count = game_damage(g, &s->view, damage);
+    }
+    for (unsigned int i = 0; i < count; i ++) {
+        // every block the area touches (what's left over at the edges of a framebuffer that
+        //  doesn't divide evenly isn't shown)
+        const struct rect * d = &damage[i];
+        const unsigned int left = d->x / factor, top = d->y / factor;
+        unsigned int right = (d->x + d->w + factor - 1) / factor, bottom = (d->y + d->h + factor - 1) / factor;
+        if (right > width) right = width;
+        if (bottom > height) bottom = height;
+        if (left < right && top < bottom)
+            blit_downscale(fb, s->image, factor, left, top, right - left, bottom - top);
+    }
+
+    s->source = fb;
+    s->version = g->version;
+    s->epoch = g->epoch;
+    game_view(g, &s->view);
+    return s->image;
+}
@@ -0,0 +1,30 @@
+#ifndef SHADOW_H_
+#define SHADOW_H_
+
+// Shadows: a machine's framebuffer shrunk by a whole factor, for the clients that have asked for
+//  a smaller screen (scaled sessions - see SetDesktopSize in main.c).  A room keeps one per factor
+//  anyone is using, and only shrinks again what's been drawn on since it last caught up.
+//  Main thread only.
+
+#include "game.h"
+#include "image.h"
+
+// the most a screen can be shrunk by
+#define SHADOW_SCALE_MAX 4
+
+struct shadow {
+    // the framebuffer it was last brought up to date from, with the version and epoch it had then,
+    //  and what a viewer saw of the machine at that point
+    const struct image * source;
+    unsigned int version, epoch;
+    struct game_view view;
+    struct image * image;
+};
+
+// the shadow of g at 1/factor size, brought up to date: *shadow, or a new one in its place if
+//  there wasn't one yet (or it's for another size of framebuffer)
+const struct image * shadow_update(struct shadow ** shadow, const struct game * g, unsigned int factor);
+
+void shadow_free(struct shadow * s);
+
+#endif
@@ -0,0 +1,103 @@
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct strip {
+    unsigned int refs;
+    unsigned char data[];
+};
+
+static void strip_unref(struct strip * s)
+{
+    if (s != NULL && -- s->refs == 0) free(s);
+}
+
+struct snapshot * snapshot_ref(struct snapshot * s)
+{
+    s->refs ++;
+    return s;
+}
+
+void snapshot_unref(struct snapshot * s)
+{
+    if (s == NULL || -- s->refs > 0) return;
+    for (unsigned int i = 0; i < s->strip_count; i ++)
+        strip_unref(s->strips[i]);
+    free(s->strips);
+    free((void *)s->image.rows);
+    free(s);
+}
+
+// does any of the damage touch rows top to top + rows?
+static int drawn_on(const struct snapshot * s, unsigned int top, unsigned int rows)
+{
+    for (unsigned int i = 0; i < s->damage_count; i ++) {
+        const struct rect * r = &s->damage[i];
+        if (r->y < top + rows && r->y + r->h > top) return 1;
+    }
+    return 0;
+}
+
+struct snapshot * snapshot_take(struct snapshot ** latest, const struct game * g)
+{
+    struct snapshot * prev = *latest;
+    const struct image * fb = g->framebuffer;
+    if (prev != NULL && prev->source == fb && prev->version == g->version && prev->epoch == g->epoch)
+        return prev;
+
+    struct snapshot * s = malloc(sizeof(struct snapshot));
+    const unsigned char ** rows = malloc(fb->height * sizeof(unsigned char *));
+    const unsigned int strip_count = (fb->height + SNAPSHOT_STRIP - 1) / SNAPSHOT_STRIP;
+    struct strip ** strips = calloc(strip_count, sizeof(struct strip *));
+    if (s == NULL || rows == NULL || strips == NULL) {
+        perror("malloc snapshot");
+        exit(EXIT_FAILURE);
+    }
+
+    s->refs = 1;
+    s->source = fb;
+    s->version = g->version;
+    s->epoch = g->epoch;
+    game_view(g, &s->view);
+    s->image.width = fb->width;
+    s->image.height = fb->height;
+    s->image.data = NULL;
+    s->image.rows = rows;
+    s->strips = strips;
+    s->strip_count = strip_count;
+
+    // a new epoch (or a new framebuffer altogether) has been drawn all over
+    const int fresh = (prev == NULL || prev->source != fb || prev->epoch != g->epoch);
+    if (fresh) {
+        s->damage[0] = (struct rect) { 0, 0, fb->width, fb->height };
+        s->damage_count = 1;
+    } else {
+        s->damage_count = game_damage(g, &prev->view, s->damage);
+    }
+
+    for (unsigned int i = 0; i < strip_count; i ++) {
+        const unsigned int top = i * SNAPSHOT_STRIP;
+        const unsigned int height = (fb->height - top < SNAPSHOT_STRIP ? fb->height - top : SNAPSHOT_STRIP);
+        if (fresh || drawn_on(s, top, height)) {
+            strips[i] = malloc(sizeof(struct strip) + (size_t)fb->width * height);
+            if (strips[i] == NULL) {
+                perror("malloc strip");
+                exit(EXIT_FAILURE);
+            }
+            strips[i]->refs = 1;
+            for (unsigned int y = 0; y < height; y ++)
+                memcpy(&strips[i]->data[y * fb->width], image_row(fb, top + y), fb->width);
+        } else {
+            strips[i] = prev->strips[i];
+            strips[i]->refs ++;
+        }
+        for (unsigned int y = 0; y < height; y ++)
+            rows[top + y] = &strips[i]->data[y * fb->width];
+    }
+
+    snapshot_unref(prev);
+    *latest = s;
+    return s;
+}
@@ -0,0 +1,46 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+// Framebuffer snapshots: an unchanging copy of a machine's framebuffer as it was at one version,
+//  which the encoder threads can read while the machine goes on drawing the next frame.  A
+//  snapshot is cut into strips of SNAPSHOT_STRIP rows, and a new one only copies the strips that
+//  have been drawn on since the last - the rest it shares with that one.  Strips and snapshots
+//  are reference-counted and go as soon as nothing holds them, which is usually just the room
+//  (for its latest) and any encoding still working from an older one.
+//  Only the main thread takes or drops references: an encoder thread reads a snapshot that the
+//  main thread is holding on its behalf.
+
+#include "game.h"
+#include "image.h"
+
+// rows per strip: one row of HexTile tiles, and the grain of the encoder bands
+#define SNAPSHOT_STRIP 16
+
+struct strip;
+
+struct snapshot {
+    unsigned int refs;
+    // the framebuffer this is a copy of - which stands for the machine - with its version and
+    //  epoch at the time, and what a viewer saw of the machine then
+    const struct image * source;
+    unsigned int version, epoch;
+    struct game_view view;
+    // what's changed since the snapshot before (the whole screen, for the first of an epoch)
+    struct rect damage[GAME_DAMAGE_MAX];
+    unsigned int damage_count;
+
+    // the pixels, read through image.rows (image.data is NULL)
+    struct image image;
+    struct strip ** strips;
+    unsigned int strip_count;
+};
+
+// the latest snapshot of g: *latest, or - if g has been drawn on since that was taken - a new one
+//  in its place, copying only the strips drawn on and sharing the rest
+//  (*latest holds the reference: take another to keep the snapshot past the next call)
+struct snapshot * snapshot_take(struct snapshot ** latest, const struct game * g);
+
+struct snapshot * snapshot_ref(struct snapshot * s);
+void snapshot_unref(struct snapshot * s);
+
+#endif
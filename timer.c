@@ -0,0 +1,158 @@
+#include "timer.h"
+
+#include <stddef.h>
+#include <time.h>
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+// the furthest ahead the top level reaches
+#define TIMER_RANGE ((uint64_t)1 << (TIMER_LEVELS * TIMER_BITS))
+
+uint64_t timer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(struct timer_wheel * w, uint64_t now)
+{
+    w->base = now;
+    for (int level = 0; level < TIMER_LEVELS; level ++) {
+        for (int i = 0; i < TIMER_SLOTS; i ++) {
+            struct timer * head = &w->slots[level][i];
+            head->next = head->prev = head;
+        }
+        w->count[level] = 0;
+    }
+}
+
+void timer_init(struct timer * t, void * ctx, int kind)
+{
+    t->next = t->prev = NULL;
+    t->expires = 0;
+    t->level = 0;
+    t->ctx = ctx;
+    t->kind = kind;
+}
+
+int timer_pending(const struct timer * t)
+{
+    return t->prev != NULL;
+}
+
+static void unlink_timer(struct timer_wheel * w, struct timer * t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    w->count[t->level] --;
+}
+
+// put a timer in the finest level that reaches its deadline
+static void insert(struct timer_wheel * w, struct timer * t)
+{
+    if (t->expires < w->base) t->expires = w->base;
+    uint64_t delta = t->expires - w->base;
+    if (delta >= TIMER_RANGE) {
+        t->expires = w->base + TIMER_RANGE - 1;
+        delta = TIMER_RANGE - 1;
+    }
+
+    int level = 0;
+    while (delta >= ((uint64_t)1 << ((level + 1) * TIMER_BITS))) level ++;
+
+    struct timer * head = &w->slots[level][(t->expires >> (level * TIMER_BITS)) & TIMER_MASK];
+    t->level = level;
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+    w->count[level] ++;
+}
+
+void timer_set(struct timer_wheel * w, struct timer * t, uint64_t expires)
+{
+    if (timer_pending(t)) unlink_timer(w, t);
+    t->expires = expires;
+    insert(w, t);
+}
+
+void timer_cancel(struct timer_wheel * w, struct timer * t)
+{
+    if (timer_pending(t)) unlink_timer(w, t);
+}
+
+// the clock has come round to the start of this level's current slot: move its timers down
+//  (after the level above has done the same, as that may add to them)
+static void cascade(struct timer_wheel * w, int level)
+{
+    const unsigned int i = (w->base >> (level * TIMER_BITS)) & TIMER_MASK;
+    if (i == 0 && level + 1 < TIMER_LEVELS) cascade(w, level + 1);
+
+    struct timer * head = &w->slots[level][i];
+    while (head->next != head) {
+        struct timer * t = head->next;
+        unlink_timer(w, t);
+        insert(w, t);
+    }
+}
+
+struct timer * timer_advance(struct timer_wheel * w, uint64_t now)
+{
+    struct timer * expired = NULL, ** tail = &expired;
+
+    while (w->base <= now) {
+        const unsigned int i = w->base & TIMER_MASK;
+        if (i == 0) cascade(w, 1);
+
+        if (w->count[0] == 0) {
+            // nothing at the bottom: skip straight to where the next slot up comes down
+            unsigned int total = 0;
+            for (int level = 1; level < TIMER_LEVELS; level ++) total += w->count[level];
+            uint64_t next = (total ? (w->base | TIMER_MASK) + 1 : now + 1);
+            w->base = (next < now + 1 ? next : now + 1);
+            continue;
+        }
+
+        struct timer * head = &w->slots[0][i];
+        while (head->next != head) {
+            struct timer * t = head->next;
+            unlink_timer(w, t);
+            *tail = t;
+            tail = &t->next;
+        }
+        w->base ++;
+    }
+    *tail = NULL;
+    return expired;
+}
+
+long timer_next(const struct timer_wheel * w, uint64_t now)
+{
+    unsigned int total = 0;
+    for (int level = 0; level < TIMER_LEVELS; level ++) total += w->count[level];
+    if (total == 0) return -1;
+
+    uint64_t when = w->base;
+    if (w->count[0]) {
+        // the bottom level, up to the end of its lap
+        for (uint64_t t = w->base; ; t ++) {
+            const struct timer * head = &w->slots[0][t & TIMER_MASK];
+            if (head->next != head || (t & TIMER_MASK) == TIMER_MASK) {
+                when = (head->next != head ? t : t + 1);
+                break;
+            }
+        }
+    } else {
+        // the next slot of level 1 with anything in it, or the next time a level above that
+        //  comes down, whichever is sooner
+        const unsigned int above = total - w->count[1];
+        when = (w->base | TIMER_MASK) + 1;
+        for (int i = 0; i < TIMER_SLOTS; i ++, when += TIMER_SLOTS) {
+            const struct timer * head = &w->slots[1][(when >> TIMER_BITS) & TIMER_MASK];
+            if (head->next != head) break;
+            if (above && ((when >> TIMER_BITS) & TIMER_MASK) == 0) break;
+        }
+    }
+    return (when > now ? (long)(when - now) : 0);
+}
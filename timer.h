@@ -0,0 +1,55 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+
+// Timer wheel: per-client deadlines (handshake, idle, pacing), where setting, cancelling and
+//  expiring a timer each cost the same however many there are.  Four levels of 64 slots - a
+//  millisecond apart at the bottom, then 64 ms, 4 s and 4.4 minutes - and a timer sits in the
+//  finest level its deadline fits in.  Each time the clock comes round to an upper-level slot,
+//  its timers drop down to where they now fit, until they reach the bottom and expire.
+//  (Anything further out than the top level reaches, about 4.8 hours, expires at that point.)
+
+#include <stdint.h>
+
+#define TIMER_LEVELS 4
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+
+struct timer {
+    // in a slot's list while it's pending
+    struct timer * next, * prev;
+    // when it's due, in ms
+    uint64_t expires;
+    uint8_t level;
+    // what it's for - up to the owner
+    void * ctx;
+    int kind;
+};
+
+struct timer_wheel {
+    // the next millisecond to expire
+    uint64_t base;
+    // each slot is a circular list around a dummy head
+    struct timer slots[TIMER_LEVELS][TIMER_SLOTS];
+    // how many timers are in each level
+    unsigned int count[TIMER_LEVELS];
+};
+
+// the monotonic clock, in ms
+uint64_t timer_now(void);
+
+void timer_wheel_init(struct timer_wheel * w, uint64_t now);
+void timer_init(struct timer * t, void * ctx, int kind);
+
+// (re)arm a timer to expire at a time in ms - if that has passed already, with the next timer_advance()
+void timer_set(struct timer_wheel * w, struct timer * t, uint64_t expires);
+void timer_cancel(struct timer_wheel * w, struct timer * t);
+int timer_pending(const struct timer * t);
+
+// move the clock on to now, and return every timer that expired on the way, linked through next
+struct timer * timer_advance(struct timer_wheel * w, uint64_t now);
+
+// ms from now until the wheel next has something to do - a timer expiring, or the upper levels
+//  moving down - or -1 if there are no timers at all
+long timer_next(const struct timer_wheel * w, uint64_t now);
+
+#endif
@@ -0,0 +1,143 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// events kept per thread - the most recent ones win
+#define TRACE_EVENTS 65536
+
+struct trace_event {
+    uint64_t start, end;
+    const char * label;
+    int32_t args[TRACE_ARGS];
+    uint8_t kind;
+};
+
+struct trace_ring {
+    struct trace_event events[TRACE_EVENTS];
+    unsigned long head;
+    int tid;
+    struct trace_ring * next;
+};
+
+static const struct {
+    const char * name;
+    const char * category;
+    // what the label is, if there is one
+    const char * label;
+    const char * args[TRACE_ARGS];
+} kinds[trace_kind_count] = {
+    [trace_tick] = { "tick", "game", NULL, { "running" } },
+    [trace_render] = { "game_tick", "game", "state", { "version", "room" } },
+    [trace_draw_reel] = { "draw_reel", "game", NULL, { "reel", "position" } },
+    [trace_update] = { "update", "net", NULL, { "fd", "incremental", "rectangles", "bytes" } },
+    [trace_encode] = { "encode", "encode", "encoding", { "x", "y", "w", "h", "bytes", "probe" } },
+    [trace_send] = { "send", "net", NULL, { "fd", "bytes" } },
+    [trace_input] = { "input", "net", NULL, { "fd", "bytes" } },
+    [trace_state] = { "state", "client", "state", { "fd", "from", "to" } }
+};
+
+int trace_on;
+
+// every thread's ring, newest first
+static struct trace_ring * rings;
+static int ring_count;
+static __thread struct trace_ring * local;
+
+uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_record(enum trace_kind kind, uint64_t start, uint64_t end, const char * label, const int32_t * args)
+{
+    if (local == NULL) {
+        // the first event from this thread: give it a ring
+        local = malloc(sizeof(struct trace_ring));
+        if (local == NULL) {
+            perror("malloc trace ring");
+            exit(EXIT_FAILURE);
+        }
+        local->head = 0;
+        local->tid = __atomic_add_fetch(&ring_count, 1, __ATOMIC_RELAXED);
+        local->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (! __atomic_compare_exchange_n(&rings, &local->next, local, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    struct trace_event * e = &local->events[local->head % TRACE_EVENTS];
+    e->start = start;
+    e->end = end;
+    e->label = label;
+    memcpy(e->args, args, sizeof(e->args));
+    e->kind = kind;
+    __atomic_store_n(&local->head, local->head + 1, __ATOMIC_RELEASE);
+}
+
+static void write_event(FILE * fp, const struct trace_event * e, int tid, uint64_t origin)
+{
+    // state changes are instants, everything else a complete event with a duration
+    const int instant = (e->kind == trace_state);
+    fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,",
+            kinds[e->kind].name, kinds[e->kind].category, instant ? "i\",\"s\":\"t" : "X", (e->start - origin) / 1000.0);
+    if (! instant) fprintf(fp, "\"dur\":%.3f,", (e->end - e->start) / 1000.0);
+    fprintf(fp, "\"pid\":%d,\"tid\":%d,\"args\":{", (int)getpid(), tid);
+    int n = 0;
+    if (e->label && kinds[e->kind].label) {
+        fprintf(fp, "\"%s\":\"%s\"", kinds[e->kind].label, e->label);
+        n ++;
+    }
+    for (int i = 0; i < TRACE_ARGS && kinds[e->kind].args[i]; i ++)
+        fprintf(fp, "%s\"%s\":%d", n ++ ? "," : "", kinds[e->kind].args[i], e->args[i]);
+    fputs("}}", fp);
+}
+
+const char * trace_toggle(void)
+{
+    static unsigned int dumps;
+    static uint64_t origin;
+    static char filename[64];
+
+    if (! trace_on) {
+        // start afresh: whatever is still in the rings from last time is older than this
+        origin = trace_now();
+        __atomic_store_n(&trace_on, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    __atomic_store_n(&trace_on, 0, __ATOMIC_RELAXED);
+
+    snprintf(filename, sizeof(filename), "trace-%d-%u.json", (int)getpid(), dumps ++);
+    FILE * fp = fopen(filename, "w");
+    if (fp == NULL) {
+        perror("trace fopen");
+        return NULL;
+    }
+
+    // process name first, so every event after it can start with a comma
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"vncslots\"}}", (int)getpid());
+    for (struct trace_ring * r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                (int)getpid(), r->tid, r->tid == 1 ? "main" : "worker");
+
+        unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned long i = (head > TRACE_EVENTS ? head - TRACE_EVENTS : 0);
+        for (; i < head; i ++) {
+            const struct trace_event * e = &r->events[i % TRACE_EVENTS];
+            // anything from before this recording started was left over from the last one
+            if (e->start >= origin) write_event(fp, e, r->tid, origin);
+        }
+    }
+    fputs("\n]}\n", fp);
+
+    if (fclose(fp) != 0) {
+        perror("trace fclose");
+        return NULL;
+    }
+    return filename;
+}
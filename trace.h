@@ -0,0 +1,55 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+// A timeline of what the server spends its time on: ticks, drawing, encodes, sends, input and
+//  client state changes.  Each thread records into a ring buffer of its own; kill -USR2 starts
+//  recording, and a second -USR2 stops it and writes the lot out in Chrome's trace-event JSON
+//  (open it in Perfetto, or chrome://tracing).
+//  While it's off, a trace point costs one test of trace_on.
+
+#include <stdint.h>
+
+enum trace_kind {
+    trace_tick,
+    trace_render,
+    trace_draw_reel,
+    trace_update,
+    trace_encode,
+    trace_send,
+    trace_input,
+    trace_state,
+
+    trace_kind_count
+};
+
+// integer arguments per event - their names depend on the kind
+#define TRACE_ARGS 6
+
+extern int trace_on;
+
+uint64_t trace_now(void);
+void trace_record(enum trace_kind kind, uint64_t start, uint64_t end, const char * label, const int32_t * args);
+
+// start of a scope: 0 (and nothing recorded at the end) if tracing is off
+static inline uint64_t trace_begin(void)
+{
+    return (__atomic_load_n(&trace_on, __ATOMIC_RELAXED) ? trace_now() : 0);
+}
+
+// end of a scope begun with trace_begin(), with an optional label (a string that lives forever)
+#define TRACE_END(kind, start, label, ...) do { \
+        if (start) trace_record((kind), (start), trace_now(), (label), (const int32_t[TRACE_ARGS]) { __VA_ARGS__ }); \
+    } while (0)
+
+// something that happened at an instant
+#define TRACE_INSTANT(kind, label, ...) do { \
+        if (__atomic_load_n(&trace_on, __ATOMIC_RELAXED)) { \
+            uint64_t t_ = trace_now(); \
+            trace_record((kind), t_, t_, (label), (const int32_t[TRACE_ARGS]) { __VA_ARGS__ }); \
+        } \
+    } while (0)
+
+// start recording, or stop and write the trace out: returns the file name written, or NULL
+const char * trace_toggle(void);
+
+#endif
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Upgrade under load: hold sessions open against a server (vncreplay -l) while it's replaced
+#  twice with --takeover - the first time in the middle of a pull - and fail if a single one of
+#  them is dropped, or any server along the way doesn't exit cleanly.
+#  Run after `make`, from the source directory: ./upgrade-test.sh [sessions] [port]
+
+SESSIONS=${1:-16}
+PORT=${2:-5959}
+HERE=$(pwd)
+WORK=$(mktemp -d)
+SOCK="$WORK/handoff.sock"
+trap 'rm -rf "$WORK"' EXIT
+
+# each server in the work directory, so its stats.ini goes there
+server() {
+    (cd "$WORK" && exec "$HERE/vncslots" --port "$PORT" --handoff "$SOCK" "$@") > "$WORK/server-$N.log" 2>&1 &
+}
+
+N=0
+server
+first=$!
+sleep 1
+
+"$HERE/vncreplay" -p "$PORT" -n "$SESSIONS" -l 16 &
+replay=$!
+
+# the first session drops a coin in straight away: a second later the reels are spinning
+sleep 1
+N=1
+server --takeover "$SOCK"
+second=$!
+sleep 6
+N=2
+server --takeover "$SOCK"
+third=$!
+
+failed=0
+wait $replay || failed=1
+wait $first || { echo "first server exited $?"; failed=1; }
+wait $second || { echo "second server exited $?"; failed=1; }
+kill $third
+wait $third 2> /dev/null
+# (a sanitizer build reports its findings without necessarily failing)
+if grep -l "ERROR\|runtime error" "$WORK"/server-*.log; then failed=1; fi
+
+if [ $failed -ne 0 ]; then
+    for log in "$WORK"/server-*.log; do
+        echo "== $log"
+        tail -n 20 "$log"
+    done
+    echo "FAILED"
+    exit 1
+fi
+echo "OK"
@@ -0,0 +1,722 @@
+// io_uring backend for the event loop (net.h), on the raw system calls - no liburing needed.
+//  Listeners get a multishot accept and clients a multishot recv into a ring of provided buffers,
+//  so neither needs re-arming per event; sends are batched per client and go in with the next
+//  wait, so a tick costs one io_uring_enter() however many clients there are.
+
+#include "net.h"
+#include "metrics.h"
+
+#ifdef __linux__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 256
+
+// provided receive buffers (a power of two)
+#define BUFFER_COUNT 256
+#define BUFFER_SIZE 1024
+#define BUFFER_GROUP 0
+
+// the most iovecs in one sendmsg()
+#define BATCH_IOV 1024
+
+// user_data on each request: sends carry their (8-byte aligned) batch pointer, everything else
+//  a tag with the fd and its generation, so completions for a closed fd's old owner are ignored
+enum { tag_send = 0, tag_accept = 1, tag_recv = 2, tag_poll = 3, tag_cancel = 4 };
+#define USER_DATA(tag, fd, gen) (((uint64_t)(gen) << 32) | ((uint64_t)(fd) << 3) | (tag))
+
+// everything queued for one client since its last sendmsg() went in
+struct send_batch {
+    int fd;
+    uint32_t gen;
+    struct msghdr msg;
+    struct iovec * iov;
+    struct segment ** segs;
+    unsigned int count, size;
+    // the first iovec with bytes still to go
+    unsigned int first;
+};
+
+struct uring_slot {
+    uint32_t gen;
+    void * ctx;
+    uint8_t in_use;
+    uint8_t dirty;
+    // what's armed on it (tag_accept, tag_recv or tag_poll), and while it's being released,
+    //  whether that has finished yet
+    uint8_t tag;
+    uint8_t releasing, stopped;
+    // at most one sendmsg() in flight per socket, to keep the bytes in order
+    struct send_batch * inflight;
+    struct send_batch * pending;
+};
+
+struct uring_net {
+    int ring_fd;
+
+    void * sq_ptr, * cq_ptr;
+    size_t sq_size, cq_size;
+    unsigned int * sq_head, * sq_tail, * sq_array;
+    unsigned int sq_mask, sq_entries;
+    struct io_uring_sqe * sqes;
+    size_t sqes_size;
+    unsigned int * cq_head, * cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe * cqes;
+
+    // the provided buffer ring, and the buffers behind it
+    struct io_uring_buf_ring * br;
+    unsigned short br_tail;
+    unsigned char * buffers;
+    // buffers handed out with the last batch of events, to go back at the next wait
+    unsigned short lent[BUFFER_COUNT];
+    unsigned int lent_count;
+
+    // old kernels (before 6.0) can't do multishot recv: re-arm a plain one each time instead
+    uint8_t recv_multishot;
+
+    struct uring_slot * slots;
+    int slot_count;
+    // clients with a pending send batch
+    int * dirty;
+    int dirty_count, dirty_size;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params * p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void * arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void * arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned int sq_unsubmitted(const struct uring_net * u)
+{
+    return *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static struct io_uring_sqe * get_sqe(struct uring_net * u)
+{
+    if (sq_unsubmitted(u) == u->sq_entries) {
+        // full - push what's there in early
+        if (sys_io_uring_enter(u->ring_fd, u->sq_entries, 0, 0, NULL, 0) < 0 && errno != EINTR) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        if (sq_unsubmitted(u) == u->sq_entries) {
+            fputs("io_uring submission queue stuck full\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    unsigned int tail = *u->sq_tail;
+    unsigned int index = tail & u->sq_mask;
+    struct io_uring_sqe * sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->sq_array[index] = index;
+    // nothing reads the ring before the next io_uring_enter()
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static struct uring_slot * get_slot(struct uring_net * u, int fd)
+{
+    if (fd >= u->slot_count) {
+        int count = (u->slot_count ? u->slot_count : 64);
+        while (count <= fd) count *= 2;
+        struct uring_slot * slots = realloc(u->slots, count * sizeof(struct uring_slot));
+        if (slots == NULL) {
+            perror("realloc uring slots");
+            exit(EXIT_FAILURE);
+        }
+        memset(&slots[u->slot_count], 0, (count - u->slot_count) * sizeof(struct uring_slot));
+        u->slots = slots;
+        u->slot_count = count;
+    }
+    return &u->slots[fd];
+}
+
+static void free_batch(struct send_batch * b)
+{
+    if (b == NULL) return;
+    for (unsigned int i = 0; i < b->count; i ++)
+        segment_unref(b->segs[i]);
+    free(b->iov);
+    free(b->segs);
+    free(b);
+}
+
+static void give_buffer(struct uring_net * u, unsigned short bid)
+{
+    struct io_uring_buf * b = &u->br->bufs[u->br_tail & (BUFFER_COUNT - 1)];
+    b->addr = (uintptr_t)(u->buffers + (size_t)bid * BUFFER_SIZE);
+    b->len = BUFFER_SIZE;
+    b->bid = bid;
+    u->br_tail ++;
+}
+
+static void arm_accept(struct uring_net * u, int fd, uint32_t gen)
+{
+    struct io_uring_sqe * sqe = get_sqe(u);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = USER_DATA(tag_accept, fd, gen);
+}
+
+static void arm_recv(struct uring_net * u, int fd, uint32_t gen)
+{
+    struct io_uring_sqe * sqe = get_sqe(u);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    if (u->recv_multishot) sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = USER_DATA(tag_recv, fd, gen);
+}
+
+static void arm_poll(struct uring_net * u, int fd, uint32_t gen)
+{
+    struct io_uring_sqe * sqe = get_sqe(u);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = USER_DATA(tag_poll, fd, gen);
+}
+
+static void submit_batch(struct uring_net * u, struct send_batch * b)
+{
+    b->msg.msg_iov = &b->iov[b->first];
+    b->msg.msg_iovlen = b->count - b->first;
+    if (b->msg.msg_iovlen > BATCH_IOV) b->msg.msg_iovlen = BATCH_IOV;
+
+    struct io_uring_sqe * sqe = get_sqe(u);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = b->fd;
+    sqe->addr = (uintptr_t)&b->msg;
+    sqe->len = 1;
+    // a failure comes back as a completion - no need for SIGPIPE too
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)b;
+}
+
+static int uring_init(struct net * n)
+{
+    struct uring_net * u = calloc(1, sizeof(struct uring_net));
+    if (u == NULL) return 0;
+    u->ring_fd = -1;
+    u->recv_multishot = 1;
+    n->priv = u;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->ring_fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (u->ring_fd < 0) {
+        perror("io_uring_setup");
+        goto fail;
+    }
+    // the timeout on a wait needs EXT_ARG, and NODROP keeps completions from being lost to overflow
+    if (! (p.features & IORING_FEAT_EXT_ARG) || ! (p.features & IORING_FEAT_NODROP)) {
+        fputs("io_uring is too old\n", stderr);
+        goto fail;
+    }
+
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_size > u->sq_size) u->sq_size = u->cq_size;
+        u->cq_size = u->sq_size;
+    }
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+        u->sq_ptr = NULL;
+        perror("mmap io_uring");
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ptr = u->sq_ptr;
+    } else {
+        u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED) {
+            u->cq_ptr = NULL;
+            perror("mmap io_uring");
+            goto fail;
+        }
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        perror("mmap io_uring");
+        goto fail;
+    }
+
+    unsigned char * sq = u->sq_ptr, * cq = u->cq_ptr;
+    u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    u->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    u->sq_entries = *(unsigned int *)(sq + p.sq_off.ring_entries);
+    u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // make sure the operations we use are there
+    size_t probe_size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe * probe = calloc(1, probe_size);
+    if (probe == NULL) goto fail;
+    int supported = (sys_io_uring_register(u->ring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0);
+    static const int needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD };
+    for (unsigned int i = 0; supported && i < sizeof(needed) / sizeof(needed[0]); i ++)
+        supported = (needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED));
+    free(probe);
+    if (! supported) {
+        fputs("io_uring lacks accept / recv / sendmsg\n", stderr);
+        goto fail;
+    }
+
+    // the provided buffer ring (5.19 and up - which also brought multishot accept)
+    u->br = mmap(NULL, BUFFER_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        perror("mmap buffer ring");
+        goto fail;
+    }
+    struct io_uring_buf_reg reg = { .ring_addr = (uintptr_t)u->br, .ring_entries = BUFFER_COUNT, .bgid = BUFFER_GROUP };
+    if (sys_io_uring_register(u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring buffer ring");
+        goto fail;
+    }
+    u->buffers = malloc((size_t)BUFFER_COUNT * BUFFER_SIZE);
+    if (u->buffers == NULL) goto fail;
+    for (unsigned int i = 0; i < BUFFER_COUNT; i ++)
+        give_buffer(u, i);
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+
+    return 1;
+
+fail:
+    n->backend->free(n);
+    return 0;
+}
+
+static void uring_free(struct net * n)
+{
+    struct uring_net * u = n->priv;
+    if (u == NULL) return;
+
+    // closing the ring cancels whatever is in flight
+    if (u->ring_fd >= 0) close(u->ring_fd);
+    for (int i = 0; i < u->slot_count; i ++) {
+        free_batch(u->slots[i].inflight);
+        free_batch(u->slots[i].pending);
+    }
+    free(u->slots);
+    free(u->dirty);
+    free(u->buffers);
+    if (u->br) munmap(u->br, BUFFER_COUNT * sizeof(struct io_uring_buf));
+    if (u->sqes) munmap(u->sqes, u->sqes_size);
+    if (u->cq_ptr && u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_size);
+    if (u->sq_ptr) munmap(u->sq_ptr, u->sq_size);
+    free(u);
+    n->priv = NULL;
+}
+
+static int uring_listen(struct net * n, int fd)
+{
+    struct uring_net * u = n->priv;
+    struct uring_slot * s = get_slot(u, fd);
+    s->gen ++;
+    s->in_use = 1;
+    s->ctx = NULL;
+    s->tag = tag_accept;
+    s->releasing = s->stopped = 0;
+    arm_accept(u, fd, s->gen);
+    return 1;
+}
+
+static int uring_attach(struct net * n, int fd, void * ctx)
+{
+    struct uring_net * u = n->priv;
+    struct uring_slot * s = get_slot(u, fd);
+    s->gen ++;
+    s->in_use = 1;
+    s->ctx = ctx;
+    s->tag = tag_recv;
+    s->releasing = s->stopped = 0;
+    arm_recv(u, fd, s->gen);
+    return 1;
+}
+
+static int uring_watch(struct net * n, int fd, void * ctx)
+{
+    struct uring_net * u = n->priv;
+    struct uring_slot * s = get_slot(u, fd);
+    s->gen ++;
+    s->in_use = 1;
+    s->ctx = ctx;
+    s->tag = tag_poll;
+    s->releasing = s->stopped = 0;
+    arm_poll(u, fd, s->gen);
+    return 1;
+}
+
+static void uring_detach(struct net * n, int fd)
+{
+    struct uring_net * u = n->priv;
+    struct uring_slot * s = get_slot(u, fd);
+
+    // a new generation: anything still to complete for this fd is dropped when it does
+    //  (the in-flight batch is freed then, too - the kernel is still using it)
+    s->gen ++;
+    s->in_use = 0;
+    s->ctx = NULL;
+    s->dirty = 0;
+    s->inflight = NULL;
+    free_batch(s->pending);
+    s->pending = NULL;
+
+    // the multishot recv holds the socket open: shut it down so that ends now
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+}
+
+static int uring_release(struct net * n, int fd)
+{
+    struct uring_net * u = n->priv;
+    struct uring_slot * s = get_slot(u, fd);
+    if (! s->in_use) return 1;
+
+    if (! s->releasing) {
+        // cancel the multishot request: it ends with one last completion (any input that beat
+        //  the cancel still comes through as usual before it)
+        s->releasing = 1;
+        struct io_uring_sqe * sqe = get_sqe(u);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = USER_DATA(s->tag, fd, s->gen);
+        sqe->user_data = USER_DATA(tag_cancel, fd, s->gen);
+    }
+    if (! s->stopped || s->inflight || s->pending) return 0;
+
+    // done with it: anything still to complete for it is dropped, as after a detach
+    s->gen ++;
+    s->in_use = 0;
+    s->ctx = NULL;
+    s->dirty = 0;
+    return 1;
+}
+
+static int uring_send(struct net * n, int fd, struct outq * q, int flags, size_t zerocopy_min, net_sent_fn sent, void * ctx)
+{
+    // it all goes in one batch with the next wait anyway, so MSG_MORE is implied
+    //  (and MSG_ZEROCOPY notifications have no place to go)
+    (void)flags;
+    (void)zerocopy_min;
+
+    struct uring_net * u = n->priv;
+    struct uring_slot * s = get_slot(u, fd);
+
+    struct send_batch * b = s->pending;
+    if (b == NULL) {
+        b = calloc(1, sizeof(struct send_batch));
+        if (b == NULL) {
+            perror("malloc send batch");
+            exit(EXIT_FAILURE);
+        }
+        b->fd = fd;
+        b->gen = s->gen;
+        s->pending = b;
+    }
+
+    // take over the queue's references: the batch owns them until the send completes
+    struct outq_entry e;
+    while (outq_pop(q, &e)) {
+        if (b->count == b->size) {
+            unsigned int size = (b->size ? b->size * 2 : 16);
+            struct iovec * iov = realloc(b->iov, size * sizeof(struct iovec));
+            struct segment ** segs = realloc(b->segs, size * sizeof(struct segment *));
+            if (iov == NULL || segs == NULL) {
+                perror("realloc send batch");
+                exit(EXIT_FAILURE);
+            }
+            b->iov = iov;
+            b->segs = segs;
+            b->size = size;
+        }
+        b->iov[b->count].iov_base = e.seg->data + e.offset;
+        b->iov[b->count].iov_len = e.len;
+        b->segs[b->count] = e.seg;
+        b->count ++;
+        if (sent) sent(ctx, e.seg->data + e.offset, e.len);
+    }
+
+    if (! s->dirty) {
+        if (u->dirty_count == u->dirty_size) {
+            int size = (u->dirty_size ? u->dirty_size * 2 : 64);
+            int * dirty = realloc(u->dirty, size * sizeof(int));
+            if (dirty == NULL) {
+                perror("realloc dirty list");
+                exit(EXIT_FAILURE);
+            }
+            u->dirty = dirty;
+            u->dirty_size = size;
+        }
+        u->dirty[u->dirty_count ++] = fd;
+        s->dirty = 1;
+    }
+    return 1;
+}
+
+static size_t batch_bytes(const struct send_batch * b)
+{
+    size_t bytes = 0;
+    if (b != NULL) {
+        for (unsigned int i = b->first; i < b->count; i ++)
+            bytes += b->iov[i].iov_len;
+    }
+    return bytes;
+}
+
+static size_t uring_queued(struct net * n, int fd)
+{
+    // sent() has seen it all, but it only reaches the socket once the sendmsg()s get through
+    struct uring_net * u = n->priv;
+    if (fd >= u->slot_count) return 0;
+    const struct uring_slot * s = &u->slots[fd];
+    return batch_bytes(s->inflight) + batch_bytes(s->pending);
+}
+
+// a sendmsg() finished: move on to what's left of it, or to the next batch
+//  returns an error number to report, if any
+static int send_complete(struct uring_net * u, struct send_batch * b, int res)
+{
+    struct uring_slot * s = get_slot(u, b->fd);
+    if (! s->in_use || s->gen != b->gen) {
+        // the client has gone
+        free_batch(b);
+        return 0;
+    }
+
+    if (res < 0) {
+        s->inflight = NULL;
+        free_batch(b);
+        return -res;
+    }
+
+    size_t done = res;
+    while (done > 0 && b->first < b->count) {
+        struct iovec * v = &b->iov[b->first];
+        if (done < v->iov_len) {
+            v->iov_base = (unsigned char *)v->iov_base + done;
+            v->iov_len -= done;
+            done = 0;
+        } else {
+            done -= v->iov_len;
+            b->first ++;
+        }
+    }
+
+    if (b->first < b->count) {
+        // a short send: the socket buffer filled up
+        METRIC_ADD(metrics_local()->send_stalls, 1);
+        submit_batch(u, b);
+        return 0;
+    }
+
+    free_batch(b);
+    s->inflight = s->pending;
+    s->pending = NULL;
+    if (s->inflight) submit_batch(u, s->inflight);
+    return 0;
+}
+
+static int uring_wait(struct net * n, const struct timeval * timeout, struct net_event * events, int max)
+{
+    struct uring_net * u = n->priv;
+
+    // the input handed out last time has been dealt with
+    if (u->lent_count) {
+        for (unsigned int i = 0; i < u->lent_count; i ++)
+            give_buffer(u, u->lent[i]);
+        u->lent_count = 0;
+        __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+    }
+
+    // this tick's output, one sendmsg() per client
+    for (int i = 0; i < u->dirty_count; i ++) {
+        struct uring_slot * s = get_slot(u, u->dirty[i]);
+        if (! s->dirty) continue;
+        s->dirty = 0;
+        if (s->inflight == NULL && s->pending != NULL) {
+            s->inflight = s->pending;
+            s->pending = NULL;
+            submit_batch(u, s->inflight);
+        }
+    }
+    u->dirty_count = 0;
+
+    // submit it all, and wait for something to come back if nothing has yet
+    unsigned int cq_ready = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) - *u->cq_head;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = { .sigmask = 0, .sigmask_sz = _NSIG / 8, .ts = 0 };
+    if (timeout != NULL) {
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_usec * 1000LL;
+        arg.ts = (uintptr_t)&ts;
+    }
+    unsigned int to_submit = sq_unsubmitted(u);
+    if (cq_ready == 0 || to_submit > 0) {
+        int wait = (cq_ready == 0);
+        if (sys_io_uring_enter(u->ring_fd, to_submit, wait, (wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0),
+                               (wait ? &arg : NULL), (wait ? sizeof(arg) : 0)) < 0) {
+            if (errno != EINTR && errno != ETIME && errno != EBUSY) return -1;
+        }
+    }
+
+    // reap
+    int count = 0;
+    unsigned int head = *u->cq_head;
+    while (count < max && head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        const struct io_uring_cqe * cqe = &u->cqes[head & u->cq_mask];
+        head ++;
+
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned int flags = cqe->flags;
+
+        if ((user_data & 7) == tag_send) {
+            struct send_batch * b = (struct send_batch *)(uintptr_t)user_data;
+            int fd = b->fd;
+            int error = send_complete(u, b, res);
+            if (error) {
+                struct net_event * e = &events[count ++];
+                e->type = net_error;
+                e->fd = fd;
+                e->ctx = get_slot(u, fd)->ctx;
+                e->error = error;
+            }
+            continue;
+        }
+
+        int fd = (user_data >> 3) & 0x1FFFFFFF;
+        uint32_t gen = user_data >> 32;
+        struct uring_slot * s = get_slot(u, fd);
+        const int current = (s->in_use && s->gen == gen);
+
+        // any buffer that came with it is ours to give back
+        if (flags & IORING_CQE_F_BUFFER) {
+            unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            u->lent[u->lent_count ++] = bid;
+        }
+        if (! current || (user_data & 7) == tag_cancel) continue;
+
+        struct net_event * e = &events[count];
+        e->fd = fd;
+        e->ctx = s->ctx;
+
+        if (s->releasing && ! (flags & IORING_CQE_F_MORE)) {
+            // the last of it: nothing more is armed, and nothing will be
+            s->stopped = 1;
+            if (res == -ECANCELED || res == -ENOBUFS || res == -EINVAL) continue;
+            if ((user_data & 7) == tag_accept) {
+                if (res < 0) continue;
+                e->type = net_accept;
+                e->new_fd = res;
+            } else if ((user_data & 7) == tag_poll) {
+                continue;
+            } else if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+                e->type = net_data;
+                e->data = u->buffers + (size_t)(flags >> IORING_CQE_BUFFER_SHIFT) * BUFFER_SIZE;
+                e->len = res;
+            } else if (res == 0) {
+                e->type = net_closed;
+            } else {
+                e->type = net_error;
+                e->error = (res < 0 ? -res : EIO);
+            }
+            count ++;
+            continue;
+        }
+
+        if ((user_data & 7) == tag_poll) {
+            if (! (flags & IORING_CQE_F_MORE)) arm_poll(u, fd, gen);
+            if (res < 0) continue;
+            e->type = net_wakeup;
+            count ++;
+        } else if ((user_data & 7) == tag_accept) {
+            if (! (flags & IORING_CQE_F_MORE)) arm_accept(u, fd, gen);
+            if (res < 0) {
+                errno = -res;
+                perror("accept");
+                continue;
+            }
+            e->type = net_accept;
+            e->new_fd = res;
+            count ++;
+        } else {
+            if (res == -EINVAL && u->recv_multishot) {
+                // no multishot recv on this kernel: fall back to one at a time
+                u->recv_multishot = 0;
+                arm_recv(u, fd, gen);
+                continue;
+            }
+            if (res == -ENOBUFS) {
+                // out of buffers until the next wait gives them back
+                arm_recv(u, fd, gen);
+                continue;
+            }
+            if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+                e->type = net_data;
+                e->data = u->buffers + (size_t)(flags >> IORING_CQE_BUFFER_SHIFT) * BUFFER_SIZE;
+                e->len = res;
+                if (! (flags & IORING_CQE_F_MORE)) arm_recv(u, fd, gen);
+            } else if (res == 0) {
+                e->type = net_closed;
+            } else {
+                e->type = net_error;
+                e->error = (res < 0 ? -res : EIO);
+            }
+            count ++;
+        }
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    return count;
+}
+
+const struct net_backend net_uring_backend = {
+    .name = "io_uring",
+    .init = uring_init,
+    .free = uring_free,
+    .listen = uring_listen,
+    .attach = uring_attach,
+    .watch = uring_watch,
+    .detach = uring_detach,
+    .release = uring_release,
+    .send = uring_send,
+    .queued = uring_queued,
+    .wait = uring_wait
+};
+
+#endif